@@ -4,10 +4,13 @@
 
 FUNC_GenericCommand CmdListCpus;
 FUNC_GenericCommand CmdListThreads;
+FUNC_GenericCommand CmdDumpSwitchTrace;
+FUNC_GenericCommand CmdListLockStats;
 FUNC_GenericCommand CmdYield;
 FUNC_GenericCommand CmdRunTest;
 FUNC_GenericCommand CmdSendIpi;
 FUNC_GenericCommand CmdListCpuInterrupts;
+FUNC_GenericCommand CmdListDpcStats;
 FUNC_GenericCommand CmdTestTimer;
 FUNC_GenericCommand CmdCpuid;
 FUNC_GenericCommand CmdRdmsr;
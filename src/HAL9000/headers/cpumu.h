@@ -5,11 +5,75 @@
 #include "cpu.h"
 #include "list.h"
 #include "synch.h"
+#include "queued_lock.h"
 #include "cpu_structures.h"
+#include "thread.h"
+#include "rcu.h"
+#include "dpc.h"
+#include "ex_work_queue.h"
+#include "ex_timer.h"
+#include "lapic_system.h"
+#include "pmm.h"
 
 #define STACK_DEFAULT_SIZE          (8*PAGE_SIZE)
 #define STACK_GUARD_SIZE            (2*PAGE_SIZE)
 
+// Number of distinct thread priorities, all THREAD_PRIORITY values are
+// smaller than this
+#define THREAD_PRIORITY_LEVELS      32
+
+typedef struct _THREAD_READY_QUEUE
+{
+    // Bit i is set if and only if Lists[i] is not empty
+    DWORD               NonEmptyLevels;
+
+    // One FIFO list for each priority level
+    LIST_ENTRY          Lists[THREAD_PRIORITY_LEVELS];
+} THREAD_READY_QUEUE, *PTHREAD_READY_QUEUE;
+
+// Number of buckets of a latency histogram: bucket i counts the latencies in
+// [2^i, 2^(i+1)) TSC ticks, the last bucket also counts everything larger
+#define THREAD_LATENCY_BUCKETS      40
+
+typedef struct _THREAD_LATENCY_HISTOGRAM
+{
+    QWORD               Samples;
+    QWORD               MaxTicks;
+    DWORD               Buckets[THREAD_LATENCY_BUCKETS];
+} THREAD_LATENCY_HISTOGRAM, *PTHREAD_LATENCY_HISTOGRAM;
+
+typedef enum _THREAD_SWITCH_REASON
+{
+    // the thread gave up the CPU by calling ThreadYield
+    ThreadSwitchReasonYield,
+
+    // the thread waits for a resource
+    ThreadSwitchReasonBlock,
+
+    // the time slice of the thread expired
+    ThreadSwitchReasonPreempt,
+
+    // a more important thread became ready before the slice expired
+    ThreadSwitchReasonWakeup,
+
+    ThreadSwitchReasonExit,
+    ThreadSwitchReasonReserved = ThreadSwitchReasonExit + 1
+} THREAD_SWITCH_REASON;
+
+typedef struct _THREAD_SWITCH_TRACE_ENTRY
+{
+    QWORD               Tsc;
+    TID                 PreviousTid;
+    TID                 NextTid;
+    BYTE                Reason;
+
+    // Number of threads left in the CPU's ready queue after the switch
+    DWORD               ReadyThreads;
+} THREAD_SWITCH_TRACE_ENTRY, *PTHREAD_SWITCH_TRACE_ENTRY;
+
+// Must be a power of 2
+#define THREAD_SWITCH_TRACE_ENTRIES 256
+
 typedef struct _THREADING_DATA
 {
     DWORD               RunningThreadTicks;
@@ -17,10 +81,74 @@ typedef struct _THREADING_DATA
     struct _THREAD*     CurrentThread;
     struct _THREAD*     PreviousThread;
 
+    // Set when the time slice of the running thread expired, the thread is
+    // demoted by the MLFQ policy
     BOOLEAN             YieldOnInterruptReturn;
 
+    // Set when a thread more important than the running one may have become
+    // ready, the running thread keeps its MLFQ level and is the first of its
+    // priority to run again
+    BOOLEAN             PreemptOnInterruptReturn;
+
     QWORD               IdleTicks;
     QWORD               KernelTicks;
+
+    // TRUE while the periodic scheduler tick is stopped because the CPU has
+    // nothing to run (tickless idle)
+    BOOLEAN             TickStopped;
+
+    // System time up to which the idle time spent without a scheduler tick
+    // was accounted in IdleTicks
+    QWORD               TicklessIdleAccountedUs;
+
+    // Destroyed THREAD structures which still own their mapped kernel stack,
+    // they are reused by the next threads created on this CPU. The lock is
+    // taken by other CPUs only when the caches are trimmed.
+    LOCK                ThreadCacheLock;
+    LIST_ENTRY          ThreadCache;
+    DWORD               ThreadCacheSize;
+
+    // Each CPU has its own ready queues, a thread which becomes ready is
+    // inserted in the queues of the CPU it last ran on (or of the CPU which
+    // makes it ready) if its affinity allows it. An idle CPU will try to
+    // steal threads from the queues of the other CPUs.
+    HOT_LOCK            ReadyThreadsLock;
+
+    // Threads which may run on more than one CPU, the only queue other CPUs
+    // steal from, each thief takes only the threads allowed to run on it
+    _Guarded_by_(ReadyThreadsLock)
+    THREAD_READY_QUEUE  ReadyThreads;
+
+    // Threads bound to this CPU, they are never stolen
+    _Guarded_by_(ReadyThreadsLock)
+    THREAD_READY_QUEUE  PinnedReadyThreads;
+
+    // Modified only with ReadyThreadsLock held, they may be read without the
+    // lock by CPUs looking for threads to steal
+    volatile DWORD      NumberOfReadyThreads;
+    volatile DWORD      NumberOfStealableThreads;
+
+    // Effective priority of the thread running on this CPU, read without any
+    // lock by the CPUs which make threads ready to decide if it should be
+    // preempted
+    volatile DWORD      RunningThreadPriority;
+
+    // The thread whose extended (FPU/SSE) state was last loaded on this CPU.
+    // Its registers are still valid only if the thread's FpuCpu is also this
+    // CPU, else the state must be restored from the thread's XSAVE area.
+    struct _THREAD*     FpuOwner;
+
+    // Scheduling latencies of all the threads dispatched on this CPU, updated
+    // with ReadyThreadsLock held
+    THREAD_LATENCY_HISTOGRAM    WakeupLatency;
+    THREAD_LATENCY_HISTOGRAM    RunQueueLatency;
+
+    // Ring with the last context switches of this CPU, written only by this
+    // CPU with interrupts disabled. SwitchTraceCount is the number of switches
+    // ever recorded, it is incremented after the entry is written so readers
+    // can detect the entries overwritten while they were copied.
+    THREAD_SWITCH_TRACE_ENTRY   SwitchTrace[THREAD_SWITCH_TRACE_ENTRIES];
+    volatile QWORD              SwitchTraceCount;
 } THREADING_DATA, *PTHREADING_DATA;
 
 typedef struct _PCPU
@@ -44,8 +172,22 @@ typedef struct _PCPU
 
     BOOLEAN                     ApicInitialized;
 
+    LAPIC_TIMER_STATE           ApicTimer;
+
     THREADING_DATA              ThreadData;
 
+    RCU_CPU_DATA                RcuData;
+
+    DPC_CPU_DATA                DpcData;
+
+    EX_WORK_POOL                WorkPool;
+
+    // Timers started by the threads running on this CPU
+    EX_TIMER_WHEEL              TimerWheel;
+
+    // Free frames for the single frame reservations made on this CPU
+    PMM_FRAME_CACHE             FrameCache;
+
     // IPC data
     LIST_ENTRY                  EventList;
     LOCK                        EventListLock;
@@ -123,6 +265,34 @@ CpuMuActivateFpuFeatures(
     void
     );
 
+// Returns the XCR0 state components enabled by CpuMuActivateFpuFeatures
+QWORD
+CpuMuGetActiveFpuFeatures(
+    void
+    );
+
+// Returns the number of bytes an XSAVE area needs to hold all the state
+// components enabled in XCR0 (as reported by CPUID leaf 0xD)
+DWORD
+CpuMuGetXsaveAreaSize(
+    void
+    );
+
+BOOLEAN
+CpuMuIsXsaveoptSupported(
+    void
+    );
+
+BOOLEAN
+CpuMuIsInvariantTscSupported(
+    void
+    );
+
+BOOLEAN
+CpuMuIsTscDeadlineSupported(
+    void
+    );
+
 __forceinline
 IRQL
 CpuMuRaiseIrql(
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "list.h"
+
+// Deferred procedure calls. An interrupt routine which has more work to do
+// than acknowledging its device queues a DPC and returns. The DPCs queued on a
+// CPU run on the same CPU, in the order they were queued, at the IRQL of the
+// interrupted thread and with interrupts enabled:
+// - when the outermost interrupt returns, in batches bounded by
+//   DPC_BATCH_MAX_COUNT DPCs and by DPC_BATCH_BUDGET_US
+// - by the DPC thread of the CPU, which takes over whatever did not fit in the
+//   batch or was queued outside of an interrupt
+//
+// A DPC routine must not block: it may run on the stack of any thread.
+
+// Maximum number of DPCs run on an interrupt exit
+#define DPC_BATCH_MAX_COUNT             16
+
+// No DPC is started on an interrupt exit after this much time was spent
+// running DPCs
+#define DPC_BATCH_BUDGET_US             500
+
+typedef
+void
+(__cdecl FUNC_DpcRoutine)(
+    IN_OPT  PVOID                   Context
+    );
+
+typedef FUNC_DpcRoutine*        PFUNC_DpcRoutine;
+
+// Usually embedded in the device extension, initialized once with DpcInit
+typedef struct _DPC
+{
+    LIST_ENTRY              ListEntry;
+
+    PFUNC_DpcRoutine        Routine;
+    PVOID                   Context;
+
+    // TRUE from the moment the DPC is queued until its routine starts, a DPC
+    // which is already queued is not queued again
+    volatile BOOLEAN        Queued;
+} DPC, *PDPC;
+
+// Modified only by the CPU owning them with interrupts disabled
+typedef struct _DPC_STATS
+{
+    QWORD                   DpcsQueued;
+    QWORD                   DpcsExecuted;
+
+    // DPCs executed by the DPC thread instead of on an interrupt exit
+    QWORD                   DpcsDeferred;
+
+    // Interrupt exit batches and those which did not empty the queue
+    QWORD                   Batches;
+    QWORD                   BatchesOverBudget;
+
+    DWORD                   QueueDepth;
+    DWORD                   MaxQueueDepth;
+
+    // TSC ticks spent running DPC routines
+    QWORD                   TotalRunTicks;
+    QWORD                   MaxRunTicks;
+} DPC_STATS, *PDPC_STATS;
+
+// Per-CPU DPC state, embedded in the PCPU structure
+typedef struct _DPC_CPU_DATA
+{
+    // Accessed only by its CPU with interrupts disabled
+    LIST_ENTRY              Queue;
+
+    // Number of interrupt handlers in progress on the CPU
+    DWORD                   InterruptNesting;
+
+    // TRUE while an interrupt exit batch runs, the interrupts which arrive
+    // meanwhile leave their DPCs to it
+    BOOLEAN                 BatchInProgress;
+
+    struct _THREAD*         Thread;
+    BOOLEAN                 ThreadWaiting;
+
+    DPC_STATS               Stats;
+} DPC_CPU_DATA, *PDPC_CPU_DATA;
+
+_No_competing_thread_
+void
+DpcCpuInit(
+    OUT     PDPC_CPU_DATA           CpuData
+    );
+
+//******************************************************************************
+// Function:     DpcCpuStartThread
+// Description:  Creates the DPC thread of the current CPU.
+// Returns:      STATUS
+// NOTE:         Must be called after ThreadSystemInitIdleForCurrentCPU, until
+//               then the DPCs queued outside of interrupts wait for the next
+//               interrupt exit.
+//******************************************************************************
+STATUS
+DpcCpuStartThread(
+    void
+    );
+
+void
+DpcInit(
+    OUT     PDPC                    Dpc,
+    IN      PFUNC_DpcRoutine        Routine,
+    IN_OPT  PVOID                   Context
+    );
+
+//******************************************************************************
+// Function:     DpcQueue
+// Description:  Queues Dpc on the current CPU.
+// Returns:      BOOLEAN - FALSE if Dpc was already queued, its routine will
+//               run only once.
+// Parameter:    INOUT PDPC Dpc
+// NOTE:         May be called from any context, including interrupt routines.
+//******************************************************************************
+BOOLEAN
+DpcQueue(
+    INOUT   PDPC                    Dpc
+    );
+
+// Called by the interrupt dispatcher before and after the interrupt routine
+void
+DpcInterruptEnter(
+    void
+    );
+
+//******************************************************************************
+// Function:     DpcInterruptExit
+// Description:  Runs a batch of DPCs if the outermost interrupt is returning,
+//               the DPC thread is woken if the batch did not empty the queue.
+// Returns:      BOOLEAN - FALSE if the interrupt arrived while a batch was
+//               running, the interrupted thread must not yield the CPU then.
+// NOTE:         Must be called with interrupts disabled, after the interrupt
+//               was acknowledged and the IRQL was lowered.
+//******************************************************************************
+BOOLEAN
+DpcInterruptExit(
+    void
+    );
+
+//******************************************************************************
+// Function:     DpcIsInterruptContext
+// Description:  Checks if the current CPU is running an interrupt routine or
+//               the DPCs of an interrupt exit.
+// Returns:      BOOLEAN - TRUE if the running thread must not yield the CPU.
+// NOTE:         Must be called with interrupts disabled.
+//******************************************************************************
+BOOLEAN
+DpcIsInterruptContext(
+    void
+    );
+
+//******************************************************************************
+// Function:     DpcGetStats
+// Description:  Returns a copy of the DPC statistics of Cpu.
+// Returns:      void
+// Parameter:    IN struct _PCPU* Cpu
+// Parameter:    OUT PDPC_STATS Stats
+//******************************************************************************
+void
+DpcGetStats(
+    IN      struct _PCPU*           Cpu,
+    OUT     PDPC_STATS              Stats
+    );
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "list.h"
+#include "synch.h"
+
+typedef struct _EX_RWLOCK
+{
+    LOCK                Lock;
+
+    // Number of threads which currently hold the lock shared
+    _Guarded_by_(Lock)
+    DWORD               ActiveReaders;
+
+    // Thread which currently holds the lock exclusively, if any
+    _Guarded_by_(Lock)
+    struct _THREAD*     ExclusiveHolder;
+
+    // Blocked writers, ordered by priority (the highest priority writer is
+    // the first to receive the lock)
+    _Guarded_by_(Lock)
+    LIST_ENTRY          WaitingWriters;
+
+    _Guarded_by_(Lock)
+    DWORD               NumberOfWaitingWriters;
+
+    // Blocked readers, they all receive the lock at once when no writer holds
+    // it and no writer is waiting for it
+    _Guarded_by_(Lock)
+    LIST_ENTRY          WaitingReaders;
+} EX_RWLOCK, *PEX_RWLOCK;
+
+//******************************************************************************
+// Function:     ExRwLockInit
+// Description:  Initializes a sleeping reader-writer lock.
+// Returns:      void
+// Parameter:    OUT PEX_RWLOCK RwLock
+//******************************************************************************
+_No_competing_thread_
+void
+ExRwLockInit(
+    OUT         PEX_RWLOCK      RwLock
+    );
+
+//******************************************************************************
+// Function:     ExRwLockAcquireShared
+// Description:  Acquires the lock shared. If a thread holds the lock
+//               exclusively or if any writer is waiting for it the thread is
+//               blocked until the lock is handed to it.
+// Returns:      void
+// Parameter:    INOUT PEX_RWLOCK RwLock
+// NOTE:         Because writers take precedence over the new readers the lock
+//               must not be acquired shared recursively.
+//******************************************************************************
+ACQUIRES_SHARED_AND_NON_REENTRANT_LOCK(*RwLock)
+REQUIRES_NOT_HELD_LOCK(*RwLock)
+void
+ExRwLockAcquireShared(
+    INOUT       PEX_RWLOCK      RwLock
+    );
+
+//******************************************************************************
+// Function:     ExRwLockReleaseShared
+// Description:  Releases a shared acquisition of the lock. When the last reader
+//               leaves the lock is handed to the first waiting writer.
+// Returns:      void
+// Parameter:    INOUT PEX_RWLOCK RwLock
+//******************************************************************************
+RELEASES_SHARED_AND_NON_REENTRANT_LOCK(*RwLock)
+REQUIRES_SHARED_LOCK(*RwLock)
+void
+ExRwLockReleaseShared(
+    INOUT       PEX_RWLOCK      RwLock
+    );
+
+//******************************************************************************
+// Function:     ExRwLockAcquireExclusive
+// Description:  Acquires the lock exclusively. If the lock is held by anyone
+//               else the thread is blocked until the lock is handed to it.
+// Returns:      void
+// Parameter:    INOUT PEX_RWLOCK RwLock
+//******************************************************************************
+ACQUIRES_EXCL_AND_NON_REENTRANT_LOCK(*RwLock)
+REQUIRES_NOT_HELD_LOCK(*RwLock)
+void
+ExRwLockAcquireExclusive(
+    INOUT       PEX_RWLOCK      RwLock
+    );
+
+//******************************************************************************
+// Function:     ExRwLockReleaseExclusive
+// Description:  Releases the lock. If writers are waiting the lock is handed to
+//               the highest priority one, else all the waiting readers receive
+//               it at once.
+// Returns:      void
+// Parameter:    INOUT PEX_RWLOCK RwLock
+//******************************************************************************
+RELEASES_EXCL_AND_NON_REENTRANT_LOCK(*RwLock)
+REQUIRES_EXCL_LOCK(*RwLock)
+void
+ExRwLockReleaseExclusive(
+    INOUT       PEX_RWLOCK      RwLock
+    );
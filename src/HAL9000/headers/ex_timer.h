@@ -1,5 +1,66 @@
 #pragma once
 
+#include "list.h"
+#include "synch.h"
+
+// The started timers are kept in a hierarchical timing wheel owned by the CPU
+// which started them. A wheel tick lasts EX_TIMER_WHEEL_TICK_US, level N has
+// EX_TIMER_WHEEL_SLOTS slots, each covering EX_TIMER_WHEEL_SLOTS^N ticks. The
+// timers of a higher level slot are moved to the lower levels (cascaded) when
+// the wheel reaches the slot => arming, stopping and expiring a timer are O(1)
+//
+// The wheel is advanced on each scheduler tick and, if the LAPIC timer
+// supports it, on an interrupt programmed for the nearest timer of the CPU.
+#define EX_TIMER_WHEEL_SLOT_BITS        6
+#define EX_TIMER_WHEEL_SLOTS            (1 << EX_TIMER_WHEEL_SLOT_BITS)
+#define EX_TIMER_WHEEL_LEVELS           4
+#define EX_TIMER_WHEEL_TICK_US          (1 * MS_IN_US)
+
+typedef struct _EX_TIMER_WHEEL
+{
+    LOCK                Lock;
+
+    // All the timers which trigger before the wheel tick CurrentTick expired,
+    // those of CurrentTick expire as their time comes
+    _Guarded_by_(Lock)
+    QWORD               CurrentTick;
+
+    // FALSE until CurrentTick is first synchronized with the system time
+    _Guarded_by_(Lock)
+    BOOLEAN             Synchronized;
+
+    _Guarded_by_(Lock)
+    DWORD               NumberOfArmedTimers;
+
+    // System time for which the LAPIC timer of the CPU was last armed,
+    // MAX_QWORD if it was not
+    _Guarded_by_(Lock)
+    QWORD               ProgrammedDeadlineUs;
+
+    // TRUE if the LAPIC timer accepted the last deadline
+    _Guarded_by_(Lock)
+    BOOLEAN             HardwareDeadlines;
+
+    // Set by another CPU which armed a timer due before ProgrammedDeadlineUs,
+    // the reschedule IPI it sends then only asks us to reprogram the LAPIC
+    _Guarded_by_(Lock)
+    BOOLEAN             ReprogramRequested;
+
+    _Guarded_by_(Lock)
+    LIST_ENTRY          Slots[EX_TIMER_WHEEL_LEVELS][EX_TIMER_WHEEL_SLOTS];
+} EX_TIMER_WHEEL, *PEX_TIMER_WHEEL;
+
+// Called with the wheel lock held and interrupts disabled each time the timer
+// triggers. The routine may hand back a blocked thread, which is woken up
+// together with the threads waiting for the timer.
+typedef
+struct _THREAD*
+(__cdecl FUNC_ExTimerCallback)(
+    IN_OPT  PVOID                   Context
+    );
+
+typedef FUNC_ExTimerCallback*   PFUNC_ExTimerCallback;
+
 typedef enum _EX_TIMER_TYPE
 {
     ExTimerTypeAbsolute,
@@ -20,6 +81,26 @@ typedef struct _EX_TIMER
 
     volatile BOOLEAN    TimerStarted;
     BOOLEAN             TimerUninited;
+
+    // Wheel of the CPU which first started the timer, its lock protects all
+    // the fields below
+    PEX_TIMER_WHEEL     Wheel;
+
+    // Links the timer in a wheel slot while Armed is TRUE
+    LIST_ENTRY          WheelEntry;
+    BOOLEAN             Armed;
+
+    // Wheel tick during which the timer triggers
+    QWORD               ExpirationTick;
+
+    // Number of times the timer triggered
+    QWORD               TriggerCount;
+
+    // Threads blocked in ExTimerWait, linked through their ReadyList field
+    LIST_ENTRY          WaitingList;
+
+    PFUNC_ExTimerCallback   Callback;
+    PVOID                   CallbackContext;
 } EX_TIMER, *PEX_TIMER;
 
 //******************************************************************************
@@ -52,6 +133,26 @@ ExTimerInit(
     IN      QWORD           TimeUs
     );
 
+//******************************************************************************
+// Function:     ExTimerSetCallback
+// Description:  Sets a routine to be called each time the timer triggers. It
+//               lets a thread which blocks on another object use the timer as
+//               a timeout.
+// Returns:      void
+// Parameter:    INOUT PEX_TIMER Timer
+// Parameter:    IN PFUNC_ExTimerCallback Callback
+// Parameter:    IN_OPT PVOID Context
+// NOTE:         Must be called before ExTimerStart. The routine is not called
+//               when the timer is stopped. Once ExTimerStop returns the
+//               routine is no longer running.
+//******************************************************************************
+void
+ExTimerSetCallback(
+    INOUT   PEX_TIMER               Timer,
+    IN      PFUNC_ExTimerCallback   Callback,
+    IN_OPT  PVOID                   Context
+    );
+
 //******************************************************************************
 // Function:     ExTimerStart
 // Description:  Starts the timer countdown. If the time has already elapsed all
@@ -81,6 +182,8 @@ ExTimerStop(
 // Description:  Called by a thread to wait for the timer to trigger. If the
 //               timer already triggered and it's not periodic or if the timer
 //               is uninitialized this function must return instantly.
+//               The thread blocks until the timer triggers or is stopped, a
+//               periodic timer is re-armed each time it triggers.
 // Returns:      void
 // Parameter:    INOUT PEX_TIMER Timer
 //******************************************************************************
@@ -116,3 +219,50 @@ ExTimerCompareTimers(
     IN      PEX_TIMER     FirstElem,
     IN      PEX_TIMER     SecondElem
     );
+
+_No_competing_thread_
+void
+ExTimerCpuInit(
+    OUT     PEX_TIMER_WHEEL Wheel
+    );
+
+//******************************************************************************
+// Function:     ExTimerTick
+// Description:  Called on each scheduler tick, triggers the timers of the
+//               current CPU whose time elapsed and wakes up their waiters.
+//               Catches up with the ticks missed while the tick was stopped.
+// Returns:      void
+// NOTE:         Must be called with interrupts disabled.
+//******************************************************************************
+void
+ExTimerTick(
+    void
+    );
+
+//******************************************************************************
+// Function:     ExTimerReprogramDeadline
+// Description:  Arms the LAPIC timer of the current CPU for the nearest timer
+//               of its wheel if another CPU armed a timer on our wheel which
+//               triggers before the deadline we programmed. Called by the
+//               reschedule IPI handler.
+// Returns:      BOOLEAN - TRUE if another CPU requested the reprogramming,
+//               i.e. the IPI may have been sent only for it.
+// NOTE:         Must be called with interrupts disabled.
+//******************************************************************************
+BOOLEAN
+ExTimerReprogramDeadline(
+    void
+    );
+
+//******************************************************************************
+// Function:     ExTimerGetIdleTicks
+// Description:  Returns the number of scheduler ticks the current CPU may
+//               sleep without delaying any of its timers.
+// Returns:      DWORD - between 1 and MaxTicks
+// Parameter:    IN DWORD MaxTicks
+// NOTE:         Must be called with interrupts disabled.
+//******************************************************************************
+DWORD
+ExTimerGetIdleTicks(
+    IN      DWORD           MaxTicks
+    );
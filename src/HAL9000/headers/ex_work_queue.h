@@ -0,0 +1,136 @@
+#pragma once
+
+#include "list.h"
+#include "synch.h"
+
+// Executive work queues. Each CPU has a pool of worker threads which run the
+// work items submitted on that CPU, the items of higher priority first and
+// those of the same priority in submission order.
+//
+// Submitting an item takes no lock: the item is pushed on a lock-free stack
+// of its priority which the workers empty into their FIFO queues. A pool
+// starts with a single worker, when all the workers of a pool are blocked
+// inside work items while more items are waiting the work queue manager adds
+// workers, up to EX_WORK_QUEUE_MAX_WORKERS_PER_CPU.
+
+#define EX_WORK_QUEUE_MAX_WORKERS_PER_CPU       4
+
+// Interval at which the manager checks a pool whose items are not picked up
+#define EX_WORK_QUEUE_STALL_CHECK_US            (10 * MS_IN_US)
+
+typedef enum _EX_WORK_PRIORITY
+{
+    ExWorkPriorityHigh,
+    ExWorkPriorityNormal,
+    ExWorkPriorityLow,
+    ExWorkPriorityReserved = ExWorkPriorityLow + 1
+} EX_WORK_PRIORITY;
+
+typedef
+void
+(__cdecl FUNC_WorkRoutine)(
+    IN_OPT  PVOID                   Context
+    );
+
+typedef FUNC_WorkRoutine*       PFUNC_WorkRoutine;
+
+// Owned by the submitter, it is not accessed by the work queue once its
+// routine starts => the routine may free or submit it again
+typedef struct _EX_WORK_ITEM
+{
+    // Link in the lock-free submission stack
+    struct _EX_WORK_ITEM* volatile  Next;
+
+    // Link in the FIFO queue of the pool
+    LIST_ENTRY              ListEntry;
+
+    PFUNC_WorkRoutine       Routine;
+    PVOID                   Context;
+    EX_WORK_PRIORITY        Priority;
+
+    // TRUE from the moment the item is submitted until its routine starts
+    volatile BOOLEAN        Queued;
+} EX_WORK_ITEM, *PEX_WORK_ITEM;
+
+// Per-CPU pool of workers, embedded in the PCPU structure
+typedef struct _EX_WORK_POOL
+{
+    // Items submitted but not yet seen by a worker, in LIFO order
+    PEX_WORK_ITEM volatile  Submitted[ExWorkPriorityReserved];
+
+    // Number of workers waiting in IdleWorkers, read without the lock by the
+    // submitters to decide if a worker must be woken
+    volatile DWORD          NumberOfIdleWorkers;
+
+    // Set by the submitters which found no idle worker, cleared by the
+    // manager when it checks the pool
+    volatile BOOLEAN        ManagerNotified;
+
+    LOCK                    Lock;
+
+    _Guarded_by_(Lock)
+    LIST_ENTRY              Pending[ExWorkPriorityReserved];
+
+    // Threads of the idle workers, linked through their ReadyList
+    _Guarded_by_(Lock)
+    LIST_ENTRY              IdleWorkers;
+
+    _Guarded_by_(Lock)
+    LIST_ENTRY              Workers;
+
+    _Guarded_by_(Lock)
+    DWORD                   NumberOfWorkers;
+
+    volatile QWORD          ItemsSubmitted;
+    volatile QWORD          ItemsExecuted;
+} EX_WORK_POOL, *PEX_WORK_POOL;
+
+_No_competing_thread_
+void
+ExWorkPoolCpuInit(
+    OUT     PEX_WORK_POOL           Pool
+    );
+
+//******************************************************************************
+// Function:     ExWorkQueueSystemInit
+// Description:  Starts the work queue manager.
+// Returns:      STATUS
+//******************************************************************************
+STATUS
+ExWorkQueueSystemInit(
+    void
+    );
+
+//******************************************************************************
+// Function:     ExWorkQueueCpuStart
+// Description:  Creates the first worker of the current CPU's pool.
+// Returns:      STATUS
+// NOTE:         Must be called by each CPU after its idle thread is started,
+//               the items submitted on a CPU before it are run afterwards.
+//******************************************************************************
+STATUS
+ExWorkQueueCpuStart(
+    void
+    );
+
+void
+ExWorkItemInit(
+    OUT     PEX_WORK_ITEM           WorkItem,
+    IN      PFUNC_WorkRoutine       Routine,
+    IN_OPT  PVOID                   Context,
+    IN      EX_WORK_PRIORITY        Priority
+    );
+
+//******************************************************************************
+// Function:     ExWorkQueueSubmit
+// Description:  Queues WorkItem to the pool of the current CPU.
+// Returns:      BOOLEAN - FALSE if WorkItem was already queued, its routine
+//               will run only once.
+// Parameter:    INOUT PEX_WORK_ITEM WorkItem
+// NOTE:         May be called from any context, including DPCs and interrupt
+//               routines.
+//******************************************************************************
+BOOLEAN
+ExWorkQueueSubmit(
+    INOUT   PEX_WORK_ITEM           WorkItem
+    );
@@ -0,0 +1,53 @@
+#pragma once
+
+// Passing this value as the timeout of FutexWait makes the thread wait until
+// it is woken up by FutexWake
+#define FUTEX_WAIT_INFINITE         MAX_QWORD
+
+void
+FutexSystemPreinit(
+    void
+    );
+
+//******************************************************************************
+// Function:     FutexWait
+// Description:  Blocks the current thread while the DWORD at Address holds
+//               ExpectedValue, until another thread calls FutexWake on the
+//               same address or until the timeout expires. The value check and
+//               the insertion in the wait queue are done atomically with
+//               respect to FutexWake.
+// Returns:      STATUS - STATUS_SUCCESS if the thread was woken up by a
+//               FutexWake, STATUS_UNSUCCESSFUL if the value at Address was not
+//               ExpectedValue, STATUS_JOB_INTERRUPTED if the timeout expired
+//               or if the thread is being terminated.
+// Parameter:    IN PVOID Address - user-mode address of the futex, it must be
+//               aligned to 4 bytes.
+// Parameter:    IN DWORD ExpectedValue
+// Parameter:    IN QWORD TimeoutUs - maximum time to wait in microseconds or
+//               FUTEX_WAIT_INFINITE.
+// NOTE:         The wait queues are keyed by the physical address of the
+//               futex: threads of different processes which map the same
+//               memory synchronize with each other.
+//******************************************************************************
+STATUS
+FutexWait(
+    IN          PVOID           Address,
+    IN          DWORD           ExpectedValue,
+    IN          QWORD           TimeoutUs
+    );
+
+//******************************************************************************
+// Function:     FutexWake
+// Description:  Wakes up at most NumberOfThreads threads waiting on the futex
+//               at Address.
+// Returns:      STATUS
+// Parameter:    IN PVOID Address - user-mode address of the futex
+// Parameter:    IN DWORD NumberOfThreads
+// Parameter:    OUT_OPT DWORD* ThreadsWoken - number of threads woken up
+//******************************************************************************
+STATUS
+FutexWake(
+    IN          PVOID           Address,
+    IN          DWORD           NumberOfThreads,
+    OUT_OPT     DWORD*          ThreadsWoken
+    );
@@ -105,6 +105,18 @@ IomuGetSystemTimeUs(
     void
     );
 
+//******************************************************************************
+// Function:     IomuGetSystemTimeNs
+// Description:  Returns the time elapsed since boot in nanoseconds. If the
+//               TSC clocksource is reliable the time is read from the TSC,
+//               else its resolution is the timer interrupt period.
+// Returns:      QWORD
+//******************************************************************************
+QWORD
+IomuGetSystemTimeNs(
+    void
+    );
+
 QWORD
 IomuTickCountToUs(
     IN          QWORD                   TickCount
@@ -2,6 +2,34 @@
 
 #include "lapic.h"
 
+typedef enum _LAPIC_TIMER_MODE
+{
+    // The hardware periodic mode, only the scheduler tick is available
+    LapicTimerModePeriodic,
+
+    // The timer is armed for the nearest event, the periodic scheduler tick
+    // is emulated on top of it
+    LapicTimerModeOneShot,
+    LapicTimerModeTscDeadline
+} LAPIC_TIMER_MODE;
+
+// Per-CPU state of the LAPIC timer, accessed only by its CPU with interrupts
+// disabled. The times are TSC clock times in nanoseconds.
+typedef struct _LAPIC_TIMER_STATE
+{
+    BOOLEAN             ModeSelected;
+    LAPIC_TIMER_MODE    Mode;
+
+    // Period of the emulated periodic timer
+    QWORD               PeriodNs;
+
+    // MAX_QWORD if the periodic timer is stopped
+    QWORD               NextPeriodicNs;
+
+    // Set by LapicSystemSetTimerDeadline, MAX_QWORD if there is none
+    QWORD               DeadlineNs;
+} LAPIC_TIMER_STATE, *PLAPIC_TIMER_STATE;
+
 STATUS
 LapicSystemInit(
     void
@@ -32,15 +60,59 @@ LapicSystemSendEOI(
 // Function:     LapicSystemSetTimer
 // Description:  Enables the LAPIC timer on the current CPU to trigger every
 //               Microseconds ms. If the argument is 0 the timer is stopped.
+//               If the TSC clock is reliable the first call switches the timer
+//               to the TSC-deadline or to the one-shot mode and the period is
+//               emulated.
 // Parameter:    IN DWORD Microseconds - Trigger period in microseconds.
-// Parameter:    OUT_PTR PTHREAD * Thread
 // NOTE:         This only programs the LAPIC timer on the current CPU.
+// NOTE:         This is called on the scheduler paths (idle entry and exit), it
+//               must not log anything.
 //******************************************************************************
 void
 LapicSystemSetTimer(
     IN      DWORD                           Microseconds
     );
 
+//******************************************************************************
+// Function:     LapicSystemSetTimerDeadline
+// Description:  Requests a timer interrupt on the current CPU once the TSC
+//               clock reaches DeadlineNs, independently of the periodic timer.
+//               The deadline is cleared by the interrupt.
+// Returns:      BOOLEAN - FALSE if the LAPIC timer is in the periodic mode,
+//               the interrupts then arrive only on the periodic ticks.
+// Parameter:    IN QWORD DeadlineNs - MAX_QWORD clears the deadline
+// NOTE:         Must be called with interrupts disabled.
+//******************************************************************************
+BOOLEAN
+LapicSystemSetTimerDeadline(
+    IN      QWORD                           DeadlineNs
+    );
+
+//******************************************************************************
+// Function:     LapicSystemHasTimerDeadlines
+// Description:  Returns TRUE if the LAPIC timer of the current CPU accepts
+//               deadlines, i.e. it can be stopped and still wake the CPU for
+//               the next event.
+// Returns:      BOOLEAN
+// NOTE:         Must be called with interrupts disabled.
+//******************************************************************************
+BOOLEAN
+LapicSystemHasTimerDeadlines(
+    void
+    );
+
+//******************************************************************************
+// Function:     LapicSystemHandleTimerInterrupt
+// Description:  Called on each LAPIC timer interrupt, re-arms the timer for
+//               the next event.
+// Returns:      BOOLEAN - TRUE if the periodic tick is due, FALSE if the
+//               interrupt was generated only for a deadline.
+//******************************************************************************
+BOOLEAN
+LapicSystemHandleTimerInterrupt(
+    void
+    );
+
 void
 LapicSystemSendIpi(
     _When_(ApicDestinationShorthandNone == DeliveryMode, IN)
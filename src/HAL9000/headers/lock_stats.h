@@ -0,0 +1,110 @@
+#pragma once
+
+// Setting this to 1 makes QUEUED_LOCKs and MUTEXes collect contention
+// statistics, when it is 0 the instrumentation compiles to nothing. The
+// regular LOCK is implemented in the common library and is not profiled, a
+// lock must be declared as HOT_LOCK to appear in the statistics.
+#define LOCK_STATS_ENABLED              0
+
+// Maximum number of distinct lock initialization sites tracked, locks
+// initialized at other sites are not profiled
+#define LOCK_STATS_MAX_SITES            128
+
+// Statistics are collected per lock initialization site: all the locks
+// initialized by the same instruction (for example the per-CPU ready queue
+// locks or the locks of all the processes) are accounted together. This way
+// the statistics outlive the locks and need no unregistration.
+typedef struct _LOCK_STATS
+{
+    // Return address of the lock initialization call
+    PVOID volatile      CallSite;
+
+    // Optional name given with LOCK_STATS_SET_NAME
+    const char*         Name;
+
+    volatile QWORD      Acquisitions;
+
+    // Acquisitions which did not find the lock free
+    volatile QWORD      Contentions;
+
+    // TSC ticks spent spinning or blocked waiting for the lock
+    volatile QWORD      TotalWaitTicks;
+    volatile QWORD      MaxWaitTicks;
+
+    volatile QWORD      MaxHoldTicks;
+} LOCK_STATS, *PLOCK_STATS;
+
+// Embedded in each profiled lock
+typedef struct _LOCK_STATS_INSTANCE
+{
+    PLOCK_STATS         Stats;
+
+    // Valid only while the lock is held
+    QWORD               AcquireTsc;
+} LOCK_STATS_INSTANCE, *PLOCK_STATS_INSTANCE;
+
+// Describes one acquisition attempt, it lives on the stack of the acquirer
+typedef struct _LOCK_STATS_WAIT
+{
+    QWORD               StartTsc;
+    BOOLEAN             Contended;
+} LOCK_STATS_WAIT, *PLOCK_STATS_WAIT;
+
+void
+LockStatsInitInstance(
+    OUT         PLOCK_STATS_INSTANCE    Instance,
+    IN          PVOID                   CallSite
+    );
+
+void
+LockStatsSetName(
+    INOUT       PLOCK_STATS_INSTANCE    Instance,
+    IN_Z        const char*             Name
+    );
+
+void
+LockStatsAcquired(
+    INOUT       PLOCK_STATS_INSTANCE    Instance,
+    IN_OPT      PLOCK_STATS_WAIT        Wait
+    );
+
+void
+LockStatsReleased(
+    INOUT       PLOCK_STATS_INSTANCE    Instance
+    );
+
+//******************************************************************************
+// Function:     LockStatsGetMostContended
+// Description:  Copies the statistics of the most contended lock sites in
+//               decreasing order of their number of contentions.
+// Returns:      DWORD - Number of entries copied in Stats.
+// Parameter:    OUT_WRITES(MaxEntries) PLOCK_STATS Stats
+// Parameter:    IN DWORD MaxEntries
+// NOTE:         Returns 0 if LOCK_STATS_ENABLED is 0.
+//******************************************************************************
+DWORD
+LockStatsGetMostContended(
+    OUT_WRITES(MaxEntries)
+                PLOCK_STATS             Stats,
+    IN          DWORD                   MaxEntries
+    );
+
+#if LOCK_STATS_ENABLED
+#define LOCK_STATS_INIT(Inst)                   LockStatsInitInstance((Inst), _ReturnAddress())
+#define LOCK_STATS_SET_NAME(Inst,Name)          LockStatsSetName((Inst), (Name))
+#define LOCK_STATS_DECLARE_WAIT(Var)            LOCK_STATS_WAIT Var
+#define LOCK_STATS_WAIT_BEGIN(Var,Contended)    ((Var).StartTsc = __rdtsc(), (Var).Contended = (Contended))
+#define LOCK_STATS_WAIT_CONTENDED(Var)          ((Var).Contended = TRUE)
+#define LOCK_STATS_ACQUIRED(Inst,Var)           LockStatsAcquired((Inst), &(Var))
+#define LOCK_STATS_ACQUIRED_NO_WAIT(Inst)       LockStatsAcquired((Inst), NULL)
+#define LOCK_STATS_RELEASED(Inst)               LockStatsReleased((Inst))
+#else
+#define LOCK_STATS_INIT(Inst)
+#define LOCK_STATS_SET_NAME(Inst,Name)
+#define LOCK_STATS_DECLARE_WAIT(Var)
+#define LOCK_STATS_WAIT_BEGIN(Var,Contended)
+#define LOCK_STATS_WAIT_CONTENDED(Var)
+#define LOCK_STATS_ACQUIRED(Inst,Var)
+#define LOCK_STATS_ACQUIRED_NO_WAIT(Inst)
+#define LOCK_STATS_RELEASED(Inst)
+#endif
@@ -2,6 +2,7 @@
 
 #pragma pack(push,1)
 
+#define MULTIBOOT_FLAG_COMMAND_LINE_PRESENT         (1<<2)
 #define MULTIBOOT_FLAG_BOOT_MODULES_PRESENT         (1<<3)
 #define MULTIBOOT_FLAG_LOADER_NAME_PRESENT          (1<<9)
 
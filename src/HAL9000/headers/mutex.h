@@ -2,6 +2,19 @@
 
 #include "list.h"
 #include "synch.h"
+#include "lock_stats.h"
+
+typedef BYTE            MUTEX_FLAGS;
+
+// Before blocking, MutexAcquire spins for a bounded time while the holder is
+// running on another CPU: short critical sections do not cost two context
+// switches anymore
+#define MUTEX_FLAG_ADAPTIVE_SPIN        0x1
+
+// MutexRelease does not hand the mutex to the first waiter, it only wakes it
+// up to compete for it again: a running thread may take the mutex before it
+// (no lock convoys), at the expense of fairness
+#define MUTEX_FLAG_BARGING              0x2
 
 typedef struct _MUTEX
 {
@@ -10,9 +23,18 @@ typedef struct _MUTEX
     BYTE                CurrentRecursivityDepth;
     BYTE                MaxRecursivityDepth;
 
+    MUTEX_FLAGS         Flags;
+
     _Guarded_by_(MutexLock)
     LIST_ENTRY          WaitingList;
-    struct _THREAD*     Holder;
+
+    // Modified only with MutexLock held, it may be read without the lock by
+    // the threads spinning for the mutex
+    struct _THREAD* volatile    Holder;
+
+#if LOCK_STATS_ENABLED
+    LOCK_STATS_INSTANCE StatsInstance;
+#endif
 } MUTEX, *PMUTEX;
 
 //******************************************************************************
@@ -32,10 +54,29 @@ MutexInit(
     IN          BOOLEAN     Recursive
     );
 
+//******************************************************************************
+// Function:     MutexInitEx
+// Description:  Same as MutexInit except it also takes the MUTEX_FLAG_*
+//               options of the mutex.
+// Returns:      void
+// Parameter:    OUT PMUTEX Mutex
+// Parameter:    IN BOOLEAN Recursive
+// Parameter:    IN MUTEX_FLAGS Flags
+//******************************************************************************
+_No_competing_thread_
+void
+MutexInitEx(
+    OUT         PMUTEX      Mutex,
+    IN          BOOLEAN     Recursive,
+    IN          MUTEX_FLAGS Flags
+    );
+
 //******************************************************************************
 // Function:     MutexAcquire
 // Description:  Acquires a mutex. If the mutex is currently held the thread
-//               is placed in a waiting list and its execution is blocked.
+//               is placed in a waiting list and its execution is blocked. For
+//               adaptive mutexes the thread first spins while the holder is
+//               running.
 // Returns:      void
 // Parameter:    INOUT PMUTEX Mutex
 //******************************************************************************
@@ -50,7 +91,8 @@ MutexAcquire(
 // Function:     MutexRelease
 // Description:  Releases a mutex. If there is a thread on the waiting list it
 //               will be unblocked and placed as the lock's holder - this will
-//               ensure fairness.
+//               ensure fairness. For barging mutexes the first waiter is only
+//               unblocked, the mutex is free until someone acquires it.
 // Returns:      void
 // Parameter:    INOUT PMUTEX Mutex
 //******************************************************************************
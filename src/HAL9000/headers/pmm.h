@@ -4,6 +4,32 @@
 
 #define PmmReserveMemory(Frames)        PmmReserveMemoryEx((Frames), NULL )
 
+// Each CPU keeps a cache of free frames from which the single frame
+// reservations are satisfied and to which the single frames are released
+// without taking the PMM lock. The frames are moved between a cache and the
+// buddy allocator PMM_FRAME_CACHE_BATCH at a time.
+#define PMM_FRAME_CACHE_CAPACITY        64
+#define PMM_FRAME_CACHE_BATCH           (PMM_FRAME_CACHE_CAPACITY / 2)
+
+// The pool of zeroed frames is refilled up to PMM_ZEROED_POOL_TARGET frames by
+// the zero worker, which is woken once the pool drops below
+// PMM_ZEROED_POOL_LOW frames. The zeroed frames released while the pool holds
+// PMM_ZEROED_POOL_MAX_FRAMES go back to the buddy allocator.
+#define PMM_ZEROED_POOL_TARGET          256
+#define PMM_ZEROED_POOL_LOW             (PMM_ZEROED_POOL_TARGET / 2)
+#define PMM_ZEROED_POOL_MAX_FRAMES      (4 * PMM_ZEROED_POOL_TARGET)
+
+// Embedded in the PCPU structure, accessed without any lock only by its CPU
+// with interrupts disabled. The other CPUs ask it through an IPI to empty the
+// cache when the buddy allocator runs out of frames.
+typedef struct _PMM_FRAME_CACHE
+{
+    DWORD                   NumberOfFrames;
+
+    // The frames released last are at the end and are reused first
+    PHYSICAL_ADDRESS        Frames[PMM_FRAME_CACHE_CAPACITY];
+} PMM_FRAME_CACHE, *PPMM_FRAME_CACHE;
+
 _No_competing_thread_
 void
 PmmPreinitSystem(
@@ -19,13 +45,34 @@ PmmInitSystem(
     OUT         DWORD*                  SizeReserved
     );
 
+_No_competing_thread_
+void
+PmmFrameCacheCpuInit(
+    OUT         PPMM_FRAME_CACHE        Cache
+    );
+
 //******************************************************************************
 // Function:     PmmRequestMemoryEx
-// Description:  Reserves the first free frames available after MinPhysAddr.
+// Description:  Reserves NoOfFrames contiguous frames from the buddy
+//               allocator. If MinPhysAddr is given and the frames starting at
+//               it are free they are the ones reserved, else the frames
+//               following it if they lie in a free block, else a block above
+//               it among the first blocks of each free list, else the lowest
+//               free frames above it.
 // Returns:      PHYSICAL_ADDRESS - start address of physical address reserved
 // Parameter:    IN DWORD NoOfFrames - frames to reserved.
 // Parameter:    IN_OPT PHYSICAL_ADDRESS MinPhysAddr - physical address from
 //               which to start searching for free frames.
+// NOTE:         Without MinPhysAddr the reservation takes O(log n), the
+//               address returned is aligned to the power of two greater than
+//               or equal to NoOfFrames. A single frame is taken from the cache
+//               of the current CPU.
+//               With MinPhysAddr the reservation usually takes O(log n) as
+//               well, it walks all the free blocks only if the free lists
+//               are too fragmented for the first blocks to fit.
+//               Once the buddy allocator runs out of frames the caches of all
+//               the CPUs and the pool of zeroed frames are emptied into it and
+//               the reservation is retried.
 //******************************************************************************
 PTR_SUCCESS
 PHYSICAL_ADDRESS
@@ -36,7 +83,8 @@ PmmReserveMemoryEx(
 
 //******************************************************************************
 // Function:     PmmReleaseMemory
-// Description:  Releases previously reserved memory
+// Description:  Releases previously reserved memory, a single frame goes to
+//               the cache of the current CPU.
 // Returns:      void
 // Parameter:    IN PHYSICAL_ADDRESS PhysicalAddr
 // Parameter:    IN DWORD NoOfFrames
@@ -47,6 +95,53 @@ PmmReleaseMemory(
     IN          DWORD                   NoOfFrames
     );
 
+//******************************************************************************
+// Function:     PmmReserveZeroedMemory
+// Description:  Reserves a frame from the pool of zeroed frames, if the pool is
+//               empty a frame with unknown contents is reserved instead.
+// Returns:      PHYSICAL_ADDRESS - address of the frame reserved
+// Parameter:    OUT BOOLEAN* Zeroed - TRUE if the frame is known to be zero,
+//               else the caller must clear it.
+//******************************************************************************
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+PmmReserveZeroedMemory(
+    OUT         BOOLEAN*                Zeroed
+    );
+
+//******************************************************************************
+// Function:     PmmReleaseZeroedMemory
+// Description:  Releases frames whose contents are zero to the pool of zeroed
+//               frames.
+// Returns:      void
+// Parameter:    IN PHYSICAL_ADDRESS PhysicalAddr
+// Parameter:    IN DWORD NoOfFrames
+//******************************************************************************
+void
+PmmReleaseZeroedMemory(
+    IN          PHYSICAL_ADDRESS        PhysicalAddr,
+    IN          DWORD                   NoOfFrames
+    );
+
+// Returns the number of frames missing from the pool of zeroed frames to reach
+// PMM_ZEROED_POOL_TARGET
+DWORD
+PmmGetZeroedFramesNeeded(
+    void
+    );
+
+//******************************************************************************
+// Function:     PmmSetZeroedPoolLowEvent
+// Description:  Sets the event signaled when the pool of zeroed frames drops
+//               below PMM_ZEROED_POOL_LOW frames.
+// Returns:      void
+// Parameter:    IN struct _EX_EVENT* Event
+//******************************************************************************
+void
+PmmSetZeroedPoolLowEvent(
+    IN          struct _EX_EVENT*       Event
+    );
+
 //******************************************************************************
 // Function:     PmmGetTotalSystemMemory
 // Description:
@@ -5,6 +5,7 @@
 #include "process.h"
 #include "synch.h"
 #include "ex_event.h"
+#include "rcu.h"
 
 #define PROCESS_MAX_PHYSICAL_FRAMES     16
 #define PROCESS_MAX_OPEN_FILES          16
@@ -47,8 +48,10 @@ typedef struct _PROCESS
     _Interlocked_
     volatile DWORD                  ActiveThreads;
 
-    // Links all the processes in the global process list
+    // Links all the processes in the global process list, the list is walked
+    // under RCU protection => the structure is freed only after a grace period
     LIST_ENTRY                      NextProcess;
+    RCU_HEAD                        RcuHead;
 
     // Pointer to the process' paging structures
     struct _PAGING_LOCK_DATA*       PagingData;
@@ -136,11 +139,15 @@ ProcessRemoveThreadFromList(
 
 //******************************************************************************
 // Function:     ProcessExecuteForEachProcessEntry
-// Description:  Iterates over the all threads list and invokes Function on each
-//               entry passing an additional optional Context parameter.
+// Description:  Iterates over the all processes list and invokes Function on
+//               each entry passing an additional optional Context parameter.
 // Returns:      STATUS
 // Parameter:    IN PFUNC_ListFunction Function
 // Parameter:    IN_OPT PVOID Context
+// NOTE:         The list is walked inside an RCU read-side section, i.e. with
+//               interrupts disabled: Function must not block, sleep or take a
+//               mutex or an executive lock, it may only take spinlocks (as
+//               the logging and the dump functions do).
 //******************************************************************************
 STATUS
 ProcessExecuteForEachProcessEntry(
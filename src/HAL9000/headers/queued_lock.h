@@ -0,0 +1,112 @@
+#pragma once
+
+#include "synch.h"
+#include "lock_stats.h"
+
+// A FIFO ticket spinlock: each CPU takes a ticket and waits until it is
+// served. Acquisition is fair and, because a waiter knows how many CPUs are
+// in front of it, it polls the lock proportionally less often, instead of
+// all the waiters hammering the same cache line.
+typedef struct _QUEUED_LOCK
+{
+    volatile DWORD      NextTicket;
+    volatile DWORD      NowServing;
+
+    // CPU which holds the lock (CpuGetCurrent() value), valid only while the
+    // lock is held
+    PVOID volatile      Holder;
+
+#if LOCK_STATS_ENABLED
+    LOCK_STATS_INSTANCE StatsInstance;
+#endif
+} QUEUED_LOCK, *PQUEUED_LOCK;
+
+//******************************************************************************
+// Function:     QueuedLockInit
+// Description:  Initializes a queued lock.
+// Returns:      void
+// Parameter:    OUT PQUEUED_LOCK Lock
+//******************************************************************************
+_No_competing_thread_
+void
+QueuedLockInit(
+    OUT         PQUEUED_LOCK    Lock
+    );
+
+//******************************************************************************
+// Function:     QueuedLockAcquire
+// Description:  Disables interrupts and acquires the lock, the CPUs receive the
+//               lock in the order in which they tried to acquire it.
+// Returns:      void
+// Parameter:    INOUT PQUEUED_LOCK Lock
+// Parameter:    OUT INTR_STATE* IntrState - interrupt state before the call,
+//               it must be passed to QueuedLockRelease.
+//******************************************************************************
+ACQUIRES_EXCL_AND_NON_REENTRANT_LOCK(*Lock)
+REQUIRES_NOT_HELD_LOCK(*Lock)
+void
+QueuedLockAcquire(
+    INOUT       PQUEUED_LOCK    Lock,
+    OUT         INTR_STATE*     IntrState
+    );
+
+//******************************************************************************
+// Function:     QueuedLockTryAcquire
+// Description:  Acquires the lock only if it is free and no CPU waits for it.
+// Returns:      BOOLEAN - TRUE if the lock was acquired, in this case
+//               interrupts are disabled and IntrState is valid.
+// Parameter:    INOUT PQUEUED_LOCK Lock
+// Parameter:    OUT INTR_STATE* IntrState
+//******************************************************************************
+_When_(return, _Acquires_exclusive_lock_(*Lock))
+BOOLEAN
+QueuedLockTryAcquire(
+    INOUT       PQUEUED_LOCK    Lock,
+    OUT         INTR_STATE*     IntrState
+    );
+
+//******************************************************************************
+// Function:     QueuedLockRelease
+// Description:  Releases the lock to the next waiting CPU and restores the
+//               interrupt state.
+// Returns:      void
+// Parameter:    INOUT PQUEUED_LOCK Lock
+// Parameter:    IN INTR_STATE OldIntrState
+//******************************************************************************
+RELEASES_EXCL_AND_NON_REENTRANT_LOCK(*Lock)
+REQUIRES_EXCL_LOCK(*Lock)
+void
+QueuedLockRelease(
+    INOUT       PQUEUED_LOCK    Lock,
+    IN          INTR_STATE      OldIntrState
+    );
+
+BOOLEAN
+QueuedLockIsOwner(
+    IN          PQUEUED_LOCK    Lock
+    );
+
+// The most contended global locks (the ready queue locks, the PMM allocation
+// lock, the heap locks and the log lock) are declared as HOT_LOCK. Setting
+// this to 0 turns them back into regular LOCKs.
+#define HOT_LOCKS_ARE_QUEUED        1
+
+#if HOT_LOCKS_ARE_QUEUED
+typedef QUEUED_LOCK                 HOT_LOCK;
+
+#define HotLockInit                 QueuedLockInit
+#define HotLockAcquire              QueuedLockAcquire
+#define HotLockTryAcquire           QueuedLockTryAcquire
+#define HotLockRelease              QueuedLockRelease
+#define HotLockIsOwner              QueuedLockIsOwner
+#define HotLockSetName(Lock,Name)   LOCK_STATS_SET_NAME(&(Lock)->StatsInstance, (Name))
+#else
+typedef LOCK                        HOT_LOCK;
+
+#define HotLockInit                 LockInit
+#define HotLockAcquire              LockAcquire
+#define HotLockTryAcquire           LockTryAcquire
+#define HotLockRelease              LockRelease
+#define HotLockIsOwner              LockIsOwner
+#define HotLockSetName(Lock,Name)
+#endif
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "list.h"
+
+// Epoch based read-copy-update. Readers walk the protected lists without
+// taking any lock, writers still serialize among themselves with the list's
+// lock, but an element removed from a list may only be freed once all the
+// readers which could have seen it are done: the memory is handed to RcuCall
+// and the callback runs after a grace period.
+//
+// A read-side section disables interrupts => no context switch can happen
+// while a CPU is inside one and the callbacks run from the scheduler, at the
+// point where a CPU switches threads (a quiescent point).
+
+struct _RCU_HEAD;
+
+typedef
+void
+(__cdecl FUNC_RcuCallback)(
+    IN      struct _RCU_HEAD*       Head
+    );
+
+typedef FUNC_RcuCallback*       PFUNC_RcuCallback;
+
+// Embedded in each structure whose freeing is deferred
+typedef struct _RCU_HEAD
+{
+    LIST_ENTRY              ListEntry;
+
+    // Global epoch when RcuCall was issued, the callback may run once the
+    // global epoch advanced twice more
+    QWORD                   Epoch;
+
+    PFUNC_RcuCallback       Callback;
+} RCU_HEAD, *PRCU_HEAD;
+
+// Per-CPU RCU state, embedded in the PCPU structure
+typedef struct _RCU_CPU_DATA
+{
+    // Global epoch observed by the CPU when it entered its current read-side
+    // section, valid only while Active is TRUE
+    volatile QWORD          Epoch;
+    volatile BOOLEAN        Active;
+
+    DWORD                   Nesting;
+
+    // RCU_HEADs queued by this CPU, ordered by epoch, accessed only by this
+    // CPU with interrupts disabled
+    LIST_ENTRY              Callbacks;
+} RCU_CPU_DATA, *PRCU_CPU_DATA;
+
+_No_competing_thread_
+void
+RcuSystemPreinit(
+    void
+    );
+
+_No_competing_thread_
+void
+RcuCpuInit(
+    OUT     PRCU_CPU_DATA           CpuData
+    );
+
+//******************************************************************************
+// Function:     RcuReadLock
+// Description:  Enters a read-side section. The elements reached through the
+//               RCU protected lists remain valid until RcuReadUnlock.
+// Returns:      INTR_STATE - must be passed to RcuReadUnlock.
+// NOTE:         Read-side sections may be nested but they must not block.
+//******************************************************************************
+INTR_STATE
+RcuReadLock(
+    void
+    );
+
+void
+RcuReadUnlock(
+    IN      INTR_STATE              OldIntrState
+    );
+
+//******************************************************************************
+// Function:     RcuCall
+// Description:  Queues Callback to be called with Head after all the
+//               read-side sections which are currently in progress end.
+// Returns:      void
+// Parameter:    INOUT PRCU_HEAD Head
+// Parameter:    IN PFUNC_RcuCallback Callback
+// NOTE:         The callback runs on the current CPU, from the scheduler with
+//               interrupts disabled, it must not block.
+//******************************************************************************
+void
+RcuCall(
+    INOUT   PRCU_HEAD               Head,
+    IN      PFUNC_RcuCallback       Callback
+    );
+
+//******************************************************************************
+// Function:     RcuSynchronize
+// Description:  Waits until all the read-side sections which are currently in
+//               progress end.
+// Returns:      void
+//******************************************************************************
+void
+RcuSynchronize(
+    void
+    );
+
+//******************************************************************************
+// Function:     RcuQuiescentState
+// Description:  Called by the scheduler on every pass, tries to advance the
+//               global epoch and runs the callbacks of the current CPU whose
+//               grace period ended.
+// Returns:      void
+// NOTE:         Must be called with interrupts disabled and with no scheduler
+//               lock held.
+//******************************************************************************
+void
+RcuQuiescentState(
+    void
+    );
+
+// Publishes Entry at the tail of ListHead, the writer must hold the list's
+// lock. A reader walking the list forward sees either the old or the new tail,
+// never a partially linked entry.
+void
+RcuInsertTailList(
+    INOUT   PLIST_ENTRY             ListHead,
+    INOUT   PLIST_ENTRY             Entry
+    );
+
+// Unlinks Entry without modifying it, readers currently positioned on it can
+// continue their walk. Entry may be freed only after a grace period.
+void
+RcuRemoveEntryList(
+    INOUT   PLIST_ENTRY             Entry
+    );
@@ -5,6 +5,9 @@
 
 typedef BYTE CPU_AFFINITY;
 
+// Each bit corresponds to the logical APIC ID of a CPU (PCPU.LogicalApicId)
+#define CPU_AFFINITY_ALL            ((CPU_AFFINITY)MAX_BYTE)
+
 typedef union _SMP_DESTINATION
 {
     struct
@@ -120,6 +123,20 @@ SmpSendGenericIpiEx(
             SMP_DESTINATION         Destination
     );
 
+//******************************************************************************
+// Function:     SmpSendRescheduleIpi
+// Description:  Sends a single IPI to all the CPUs in Cpus to make them look
+//               for new threads to run. Unlike SmpSendGenericIpiEx it does not
+//               allocate anything and may be called with locks held.
+// Returns:      void
+// Parameter:    IN CPU_AFFINITY Cpus - logical APIC IDs of the target CPUs,
+//               nothing is sent if it is 0.
+//******************************************************************************
+void
+SmpSendRescheduleIpi(
+    IN      CPU_AFFINITY            Cpus
+    );
+
 STATUS
 SmpCpuInit(
     void
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "dpc.h"
+
+void
+TestDpcFunctions(
+    void
+    );
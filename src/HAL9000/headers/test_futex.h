@@ -0,0 +1,8 @@
+#pragma once
+
+#include "futex.h"
+
+void
+TestFutexFunctions(
+    void
+    );
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "mutex.h"
+#include "ex_rwlock.h"
+
+void
+TestSynchFunctions(
+    void
+    );
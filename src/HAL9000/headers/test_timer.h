@@ -6,6 +6,10 @@
 #define TIMER_TEST_SLEEP_INCREMENT      (10 * MS_IN_US)
 #define TIMER_TEST_NO_OF_ITERATIONS     10
 
+// Below a wheel tick: the wakeup relies on the LAPIC deadline of the nearest
+// timer, not on the scheduler tick
+#define TIMER_TEST_SHORT_SLEEP_TIME_IN_US   500
+
 #define SLEEP_TIME_BIT_OFFSET           0x10
 #define TIMER_TYPE_BIT_OFFSET           (SLEEP_TIME_BIT_OFFSET + 0x20)
 
@@ -20,9 +24,12 @@
 #define TEST_TIMER_PERIODIC_ZERO        DEFINE_TEST(ExTimerTypeRelativePeriodic, 0, 1)
 #define TEST_TIMER_RELATIVE             DEFINE_TEST(ExTimerTypeRelativeOnce, TIMER_TEST_SLEEP_TIME_IN_US, 1)
 #define TEST_TIMER_RELATIVE_ZERO        DEFINE_TEST(ExTimerTypeRelativeOnce, 0, 1)
+#define TEST_TIMER_RELATIVE_SHORT       DEFINE_TEST(ExTimerTypeRelativeOnce, TIMER_TEST_SHORT_SLEEP_TIME_IN_US, 1)
 
 FUNC_ThreadStart                        TestThreadTimerSleep;
 FUNC_ThreadStart                        TestThreadTimerMultiple;
+FUNC_ThreadStart                        TestThreadTimerWakeupLatency;
+FUNC_ThreadStart                        TestThreadTimerRemoteWheel;
 
 FUNC_ThreadPrepareTest                  TestThreadTimerPrepare;
 FUNC_ThreadPostFinish                   TestThreadTimerMultipleTimersPostFinish;
@@ -4,6 +4,9 @@
 #include "ref_cnt.h"
 #include "ex_event.h"
 #include "thread.h"
+#include "smp.h"
+#include "cpumu.h"
+#include "rcu.h"
 
 typedef enum _THREAD_STATE
 {
@@ -26,6 +29,23 @@ typedef enum _THREAD_STATE
     ThreadStateReserved = ThreadStateDying + 1
 } THREAD_STATE;
 
+typedef enum _THREAD_SCHEDULING_POLICY
+{
+    // all threads have the same time slice, the priority of a thread never
+    // changes unless requested
+    ThreadSchedulingPolicyRoundRobin,
+
+    // multi-level feedback queue: threads which use their whole time slice
+    // are moved to lower levels (lower priority, longer time slice), threads
+    // which block or yield before the end of their slice move to upper levels
+    ThreadSchedulingPolicyMlfq,
+
+    ThreadSchedulingPolicyReserved = ThreadSchedulingPolicyMlfq + 1
+} THREAD_SCHEDULING_POLICY;
+
+// Number of MLFQ levels, the time slice doubles with each level
+#define THREAD_MLFQ_LEVELS                          4
+
 typedef DWORD           THREAD_FLAGS;
 
 #define THREAD_FLAG_FORCE_TERMINATE_PENDING         0x1
@@ -40,10 +60,24 @@ typedef struct _THREAD
     TID                     Id;
     char*                   Name;
 
-    // Currently the thread priority is not used for anything
+    // The scheduler always picks the ready thread with the highest priority,
+    // threads with the same priority are scheduled in a round-robin fashion
     THREAD_PRIORITY         Priority;
     THREAD_STATE            State;
 
+    // The CPUs on which the thread is allowed to run, by default a thread
+    // inherits the affinity of the thread which created it
+    CPU_AFFINITY            Affinity;
+
+    // The last CPU on which the thread ran, when the thread becomes ready it
+    // will be preferably placed in the ready queue of this CPU (if it is
+    // allowed by the affinity) to benefit from a cache which is still warm
+    struct _PCPU*           LastCpu;
+
+    // Set when the thread must be moved to another CPU because its affinity
+    // no longer allows it to run on the current one
+    BOOLEAN                 MigrationPending;
+
     // valid only if State == ThreadStateTerminated
     STATUS                  ExitStatus;
     EX_EVENT                TerminationEvt;
@@ -54,12 +88,21 @@ typedef struct _THREAD
     // blocks and a thread on another CPU which wants to unblock it
     LOCK                    BlockLock;
 
-    // List of all the threads in the system (including those blocked or dying)
+    // List of all the threads in the system (including those blocked or dying),
+    // it is walked under RCU protection => the structure is freed only after
+    // a grace period
     LIST_ENTRY              AllList;
+    RCU_HEAD                RcuHead;
 
-    // List of the threads ready to run
+    // List of the threads ready to run (each CPU has its own list)
     LIST_ENTRY              ReadyList;
 
+    // Where the thread waits while it is ready, set and cleared with the
+    // ready lock of ReadyCpu held
+    struct _PCPU*           ReadyCpu;
+    struct _THREAD_READY_QUEUE* ReadyQueue;
+    THREAD_PRIORITY         ReadyPriority;
+
     // List of the threads in the same process
     LIST_ENTRY              ProcessList;
 
@@ -76,6 +119,23 @@ typedef struct _THREAD
     // ticks, i.e. by yielding or by blocking
     QWORD                   TickCountEarly;
 
+    // TSC values taken when the thread was last unblocked and when it was last
+    // inserted in a ready queue, they are consumed (zeroed) when the thread is
+    // dispatched
+    QWORD                   UnblockTsc;
+    QWORD                   EnqueueTsc;
+
+    // Time from ThreadUnblock until the thread runs
+    THREAD_LATENCY_HISTOGRAM    WakeupLatency;
+
+    // Time spent in a ready queue (after an unblock or a yield) until the
+    // thread runs
+    THREAD_LATENCY_HISTOGRAM    RunQueueLatency;
+
+    // Used only by the MLFQ policy: 0 is the level with the shortest time
+    // slice and the smallest priority penalty
+    DWORD                   MlfqLevel;
+
     // The highest valid address for the kernel stack (its initial value)
     PVOID                   InitialStackBase;
 
@@ -86,6 +146,21 @@ typedef struct _THREAD
     // its used when resuming thread execution)
     PVOID                   Stack;
 
+    // TRUE if the kernel stack was allocated by the thread module (it is not
+    // the stack of a CPU's main thread), such a thread may be cached together
+    // with its stack when it is destroyed
+    BOOLEAN                 OwnsKernelStack;
+
+    // Holds the extended processor state (x87, SSE) while the thread does not
+    // own the FPU of a CPU. The state is switched lazily: a thread is given the
+    // FPU only when it first uses it after being scheduled (#NM trap), threads
+    // which never use it never have their state saved or restored.
+    PVOID                   XsaveArea;
+
+    // The CPU on which the extended state was last loaded, if the thread is
+    // still the FpuOwner of that CPU its registers need not be restored
+    struct _PCPU*           FpuCpu;
+
     // MUST be non-NULL for all threads which belong to user-mode processes
     PVOID                   UserStack;
 
@@ -94,9 +169,9 @@ typedef struct _THREAD
 
 //******************************************************************************
 // Function:     ThreadSystemPreinit
-// Description:  Basic global initialization. Initializes the all threads list,
-//               the ready list and all the locks protecting the global
-//               structures.
+// Description:  Basic global initialization. Initializes the all threads list
+//               and the lock protecting it. The ready lists are per-CPU and
+//               are initialized in ThreadSystemInitMainForCurrentCPU.
 // Returns:      void
 // Parameter:    void
 //******************************************************************************
@@ -106,6 +181,30 @@ ThreadSystemPreinit(
     void
     );
 
+//******************************************************************************
+// Function:     ThreadSystemSetSchedulingPolicy
+// Description:  Selects the scheduling policy. Must be called at boot, before
+//               any thread other than the main thread of the BSP is created.
+// Returns:      void
+// Parameter:    IN THREAD_SCHEDULING_POLICY Policy
+//******************************************************************************
+void
+_No_competing_thread_
+ThreadSystemSetSchedulingPolicy(
+    IN      THREAD_SCHEDULING_POLICY    Policy
+    );
+
+//******************************************************************************
+// Function:     ThreadSystemGetSchedulingPolicy
+// Description:  Returns the scheduling policy selected at boot.
+// Returns:      THREAD_SCHEDULING_POLICY
+// Parameter:    void
+//******************************************************************************
+THREAD_SCHEDULING_POLICY
+ThreadSystemGetSchedulingPolicy(
+    void
+    );
+
 //******************************************************************************
 // Function:     ThreadSystemInitMainForCurrentCPU
 // Description:  Call by each CPU to initialize the main execution thread. Has a
@@ -187,7 +286,10 @@ ThreadBlock(
 // Description:  Transitions thread, which must be in the blocked state, to the
 //               ready state, allowing it to resume running. This is called when
 //               the resource on which the thread is waiting for becomes
-//               available.
+//               available. If the thread should preempt the thread running on
+//               the CPU which received it (or if that CPU is idle) a
+//               reschedule IPI is sent to it, if it must wait in the ready
+//               queue an idle CPU which may steal it is woken instead.
 // Returns:      void
 // Parameter:    IN PTHREAD Thread
 //******************************************************************************
@@ -196,10 +298,25 @@ ThreadUnblock(
     IN      PTHREAD              Thread
     );
 
+//******************************************************************************
+// Function:     ThreadUnblockList
+// Description:  Same as calling ThreadUnblock for each thread in ThreadList,
+//               which are linked through their ReadyList field. Each ready
+//               queue receiving threads is locked only once and the idle CPUs
+//               which received threads are woken with a single IPI.
+// Returns:      void
+// Parameter:    INOUT PLIST_ENTRY ThreadList - empty on return
+//******************************************************************************
+void
+ThreadUnblockList(
+    INOUT   PLIST_ENTRY         ThreadList
+    );
+
 //******************************************************************************
 // Function:     ThreadYieldOnInterrupt
 // Description:  Returns TRUE if the thread must yield the CPU at the end of
-//               this interrupt. FALSE otherwise.
+//               this interrupt, either because its slice expired or because
+//               it is preempted. FALSE otherwise.
 // Returns:      BOOLEAN
 // Parameter:    void
 //******************************************************************************
@@ -208,6 +325,51 @@ ThreadYieldOnInterrupt(
     void
     );
 
+//******************************************************************************
+// Function:     ThreadRequestYieldOnInterrupt
+// Description:  Makes the running thread yield the CPU at the end of the
+//               current interrupt because its time slice expired. The MLFQ
+//               policy moves it to the next level.
+// Returns:      void
+// Parameter:    void
+// NOTE:         Must be called from an interrupt handler.
+//******************************************************************************
+void
+ThreadRequestYieldOnInterrupt(
+    void
+    );
+
+//******************************************************************************
+// Function:     ThreadRequestPreemptOnInterrupt
+// Description:  Makes the running thread yield the CPU at the end of the
+//               current interrupt because a more important thread may have
+//               become ready: it is placed first among the ready threads of
+//               its priority and keeps its MLFQ level. Used by the reschedule
+//               IPI, by the timers and by the DPCs which wake threads.
+// Returns:      void
+// Parameter:    void
+// NOTE:         Must be called with interrupts disabled, the running thread
+//               yields when the interrupts are enabled again.
+//******************************************************************************
+void
+ThreadRequestPreemptOnInterrupt(
+    void
+    );
+
+//******************************************************************************
+// Function:     ThreadRequestPreemptIfNeeded
+// Description:  Same as ThreadRequestPreemptOnInterrupt, but only if the CPU
+//               is idle or a thread more important than the running one waits
+//               in its ready queues.
+// Returns:      void
+// Parameter:    void
+// NOTE:         Must be called with interrupts disabled.
+//******************************************************************************
+void
+ThreadRequestPreemptIfNeeded(
+    void
+    );
+
 //******************************************************************************
 // Function:     ThreadTerminate
 // Description:  Signals a thread to terminate.
@@ -224,6 +386,20 @@ ThreadTerminate(
     INOUT   PTHREAD             Thread
     );
 
+//******************************************************************************
+// Function:     ThreadIsTerminatePending
+// Description:  Checks if ThreadTerminate was called for the executing thread.
+// Returns:      BOOLEAN - TRUE if the thread will exit the next time it blocks
+//               or yields the CPU.
+// Parameter:    void
+// NOTE:         While the executing thread holds its block lock the result
+//               does not change until it calls ThreadBlock.
+//******************************************************************************
+BOOLEAN
+ThreadIsTerminatePending(
+    void
+    );
+
 //******************************************************************************
 // Function:     ThreadTakeBlockLock
 // Description:  Takes the block lock for the executing thread. This is required
@@ -238,6 +414,21 @@ ThreadTakeBlockLock(
     void
     );
 
+//******************************************************************************
+// Function:     ThreadHandleDeviceNotAvailable
+// Description:  Handles the #NM raised when the running thread first uses the
+//               FPU/SSE after being scheduled (CR0.TS is set). Gives the FPU of
+//               the current CPU to the running thread and loads its extended
+//               state if the registers do not already hold it.
+// Returns:      BOOLEAN - TRUE if the exception was solved
+// Parameter:    void
+// NOTE:         Called with interrupts disabled.
+//******************************************************************************
+BOOLEAN
+ThreadHandleDeviceNotAvailable(
+    void
+    );
+
 //******************************************************************************
 // Function:     ThreadExecuteForEachThreadEntry
 // Description:  Iterates over the all threads list and invokes Function on each
@@ -253,6 +444,38 @@ ThreadExecuteForEachThreadEntry(
     );
 
 
+//******************************************************************************
+// Function:     ThreadLatencyGetPercentileUs
+// Description:  Returns an upper bound of the Percentile-th percentile of the
+//               latencies recorded in Histogram, in microseconds. The bound is
+//               never larger than the maximum latency recorded.
+// Returns:      QWORD - 0 if there are no samples
+// Parameter:    IN PTHREAD_LATENCY_HISTOGRAM Histogram
+// Parameter:    IN DWORD Percentile - between 1 and 100
+//******************************************************************************
+QWORD
+ThreadLatencyGetPercentileUs(
+    IN      PTHREAD_LATENCY_HISTOGRAM   Histogram,
+    IN      DWORD                       Percentile
+    );
+
+//******************************************************************************
+// Function:     ThreadGetSwitchTrace
+// Description:  Copies the most recent context switches recorded by Cpu, from
+//               the oldest to the newest. The ring is not locked: the entries
+//               overwritten by Cpu while they were being copied are dropped.
+// Returns:      DWORD - number of entries copied
+// Parameter:    IN PPCPU Cpu
+// Parameter:    OUT_WRITES(MaxEntries) PTHREAD_SWITCH_TRACE_ENTRY Entries
+// Parameter:    IN DWORD MaxEntries
+//******************************************************************************
+DWORD
+ThreadGetSwitchTrace(
+    IN                      PPCPU                       Cpu,
+    OUT_WRITES(MaxEntries)  PTHREAD_SWITCH_TRACE_ENTRY  Entries,
+    IN                      DWORD                       MaxEntries
+    );
+
 //******************************************************************************O
 // Function:     GetCurrentThread
 // Description:  Returns the running thread.
@@ -271,6 +494,22 @@ SetCurrentThread(
     IN      PTHREAD     Thread
     );
 
+//******************************************************************************
+// Function:     ThreadCacheTrim
+// Description:  Frees the destroyed threads kept for reuse in the caches of
+//               all the CPUs, together with their kernel stacks.
+// Returns:      void
+// Parameter:    void
+// NOTE:         Called by the PMM and by the heap before failing an
+//               allocation and at shutdown.
+// NOTE:         Must be called with interrupts enabled, the kernel stacks are
+//               unmapped.
+//******************************************************************************
+void
+ThreadCacheTrim(
+    void
+    );
+
 //******************************************************************************
 // Function:     ThreadSetPriority
 // Description:  Sets the thread's priority to new priority. If the
@@ -282,3 +521,36 @@ void
 ThreadSetPriority(
     IN      THREAD_PRIORITY     NewPriority
     );
+
+//******************************************************************************
+// Function:     ThreadSetAffinity
+// Description:  Restricts Thread to the CPUs set in Affinity. If Thread is
+//               the running thread and the current CPU is not one of them the
+//               thread is moved to an allowed CPU before this function
+//               returns. Another thread waiting in a ready queue is moved to
+//               an allowed CPU right away, a thread running on a CPU which is
+//               no longer allowed moves at its next scheduling point.
+// Returns:      STATUS - STATUS_INVALID_PARAMETER2 if none of the CPUs
+//               in Affinity is active.
+// Parameter:    IN_OPT PTHREAD Thread - if NULL the running thread.
+// Parameter:    IN CPU_AFFINITY Affinity
+// NOTE:         A thread bound to a single CPU is never stolen, the others
+//               may be stolen by the idle CPUs in their affinity.
+//******************************************************************************
+STATUS
+ThreadSetAffinity(
+    IN_OPT  PTHREAD             Thread,
+    IN      CPU_AFFINITY        Affinity
+    );
+
+//******************************************************************************
+// Function:     ThreadGetAffinity
+// Description:  Returns the mask of CPUs on which the thread may run. If
+//               Thread is NULL returns the affinity of the running thread.
+// Returns:      CPU_AFFINITY
+// Parameter:    IN_OPT PTHREAD Thread
+//******************************************************************************
+CPU_AFFINITY
+ThreadGetAffinity(
+    IN_OPT  PTHREAD             Thread
+    );
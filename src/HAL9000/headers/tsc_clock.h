@@ -0,0 +1,71 @@
+#pragma once
+
+#ifndef US_IN_NS
+#define US_IN_NS                        1000ULL
+#endif
+
+#ifndef SEC_IN_NS
+#define SEC_IN_NS                       (SEC_IN_US * US_IN_NS)
+#endif
+
+// Clocksource based on the invariant TSC. The TSC frequency is calibrated
+// against the RTC at boot, the time is read without taking any lock and
+// without depending on any interrupt. The TSC is used only if it is invariant
+// and if no CPU was found to be out of sync with the others, else the system
+// time falls back to the time counted by the timer interrupts.
+
+//******************************************************************************
+// Function:     TscClockInit
+// Description:  Starts the clocksource, the time it returns is counted from
+//               this moment.
+// Returns:      void
+// Parameter:    IN QWORD TscFrequency - number of TSC ticks in a second
+// Parameter:    IN BOOLEAN Invariant - TRUE if the TSC ticks at a constant
+//               rate regardless of the P-, C- and T-states of the CPU
+//******************************************************************************
+_No_competing_thread_
+void
+TscClockInit(
+    IN      QWORD                   TscFrequency,
+    IN      BOOLEAN                 Invariant
+    );
+
+//******************************************************************************
+// Function:     TscClockCheckCpu
+// Description:  Checks the TSC of the current CPU against the values read by
+//               the other CPUs, it must be called by each CPU when it starts.
+//               If the TSC is seen going backwards between CPUs the
+//               clocksource is marked as unreliable.
+// Returns:      void
+//******************************************************************************
+void
+TscClockCheckCpu(
+    void
+    );
+
+BOOLEAN
+TscClockIsReliable(
+    void
+    );
+
+//******************************************************************************
+// Function:     TscClockGetTimeNs
+// Description:  Returns the number of nanoseconds elapsed since TscClockInit.
+// Returns:      QWORD
+// NOTE:         May be called from any context, including with interrupts
+//               disabled.
+//******************************************************************************
+QWORD
+TscClockGetTimeNs(
+    void
+    );
+
+QWORD
+TscClockTicksToNs(
+    IN      QWORD                   TscTicks
+    );
+
+QWORD
+TscClockNsToTicks(
+    IN      QWORD                   Nanoseconds
+    );
@@ -11,14 +11,47 @@
 #include "pci_system.h"
 #include "pit.h"
 #include "iomu.h"
+#include "ex_work_queue.h"
+#include "ex_event.h"
+
+// Function deferred by AcpiOsExecute
+typedef struct _ACPI_OS_EXECUTE_ITEM
+{
+    EX_WORK_ITEM            WorkItem;
+
+    ACPI_OSD_EXEC_CALLBACK  Function;
+    void*                   Context;
+} ACPI_OS_EXECUTE_ITEM, *PACPI_OS_EXECUTE_ITEM;
+
+// Number of functions queued by AcpiOsExecute which did not finish yet,
+// protected by m_acpiPendingLock
+static DWORD m_acpiPendingExecutions = 0;
+static LOCK m_acpiPendingLock;
+
+// Notification event signaled while no function queued by AcpiOsExecute is
+// pending
+static EX_EVENT m_acpiExecutionsCompleteEvt;
+
+static FUNC_WorkRoutine     _AcpiOsExecuteWorkRoutine;
 
 #ifndef ACPI_USE_ALTERNATE_PROTOTYPE_AcpiOsInitialize
 ACPI_STATUS
 AcpiOsInitialize (
     void)
 {
+    STATUS status;
+
     LOG_FUNC_START;
 
+    LockInit(&m_acpiPendingLock);
+
+    status = ExEventInit(&m_acpiExecutionsCompleteEvt, ExEventTypeNotification, TRUE);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ExEventInit", status);
+        return AE_ERROR;
+    }
+
     LOG_FUNC_END;
 
     return AE_OK;
@@ -673,18 +706,75 @@ AcpiOsExecute (
     ACPI_OSD_EXEC_CALLBACK  Function,
     void                    *Context)
 {
-    UNREFERENCED_PARAMETER(Type);
-    UNREFERENCED_PARAMETER(Function);
-    UNREFERENCED_PARAMETER(Context);
+    PACPI_OS_EXECUTE_ITEM pItem;
+    INTR_STATE oldState;
 
     LOG_FUNC_START;
 
-    NOT_REACHED;
+    if (NULL == Function)
+    {
+        LOG_FUNC_END;
+        return AE_BAD_PARAMETER;
+    }
+
+    pItem = ExAllocatePoolWithTag(PoolAllocateZeroMemory, sizeof(ACPI_OS_EXECUTE_ITEM), HEAP_ACPICA_TAG, 0);
+    if (NULL == pItem)
+    {
+        LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", sizeof(ACPI_OS_EXECUTE_ITEM));
+        LOG_FUNC_END;
+        return AE_NO_MEMORY;
+    }
+
+    pItem->Function = Function;
+    pItem->Context = Context;
+
+    // the notify and GPE handlers are run ahead of the other deferred work
+    ExWorkItemInit(&pItem->WorkItem,
+                   _AcpiOsExecuteWorkRoutine,
+                   pItem,
+                   (OSL_NOTIFY_HANDLER == Type || OSL_GPE_HANDLER == Type) ? ExWorkPriorityHigh : ExWorkPriorityNormal);
+
+    // the count and the event state change together, else a function
+    // finishing meanwhile could leave the event cleared with nothing pending
+    LockAcquire(&m_acpiPendingLock, &oldState);
+    if (0 == m_acpiPendingExecutions++)
+    {
+        ExEventClearSignal(&m_acpiExecutionsCompleteEvt);
+    }
+    LockRelease(&m_acpiPendingLock, oldState);
+
+    ExWorkQueueSubmit(&pItem->WorkItem);
 
     LOG_FUNC_END;
 
     return AE_OK;
 }
+
+static
+void
+(__cdecl _AcpiOsExecuteWorkRoutine)(
+    IN_OPT  PVOID                   Context
+    )
+{
+    PACPI_OS_EXECUTE_ITEM pItem;
+    INTR_STATE oldState;
+
+    ASSERT(NULL != Context);
+
+    pItem = (PACPI_OS_EXECUTE_ITEM) Context;
+
+    pItem->Function(pItem->Context);
+
+    ExFreePoolWithTag(pItem, HEAP_ACPICA_TAG);
+
+    LockAcquire(&m_acpiPendingLock, &oldState);
+    ASSERT(0 != m_acpiPendingExecutions);
+    if (0 == --m_acpiPendingExecutions)
+    {
+        ExEventSignal(&m_acpiExecutionsCompleteEvt);
+    }
+    LockRelease(&m_acpiPendingLock, oldState);
+}
 #endif
 
 #ifndef ACPI_USE_ALTERNATE_PROTOTYPE_AcpiOsWaitEventsComplete
@@ -694,7 +784,7 @@ AcpiOsWaitEventsComplete (
 {
     LOG_FUNC_START;
 
-    NOT_REACHED;
+    ExEventWaitForSignal(&m_acpiExecutionsCompleteEvt);
 
     LOG_FUNC_END;
 
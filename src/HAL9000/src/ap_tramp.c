@@ -6,6 +6,8 @@
 #include "gdtmu.h"
 #include "idt.h"
 #include "thread_internal.h"
+#include "dpc.h"
+#include "ex_work_queue.h"
 
 #define LOW_MEMORY_CONFIG_START         0x1000
 #define LOW_MEMORY_CONFIG_SIZE          0x1000
@@ -288,6 +290,20 @@ ApInitCpu(
             __leave;
     }
 
+    status = DpcCpuStartThread();
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("DpcCpuStartThread", status);
+            __leave;
+    }
+
+    status = ExWorkQueueCpuStart();
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ExWorkQueueCpuStart", status);
+            __leave;
+    }
+
     // exit main thread
     ThreadExit(STATUS_SUCCESS);
     }
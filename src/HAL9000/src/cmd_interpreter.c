@@ -63,11 +63,15 @@ static const COMMAND_DEFINITION COMMANDS[] =
 
     { "cpu", "Displays CPU related information", CmdListCpus, 0, 0},
     { "int", "List interrupts received", CmdListCpuInterrupts, 0, 0},
+    { "dpcstat", "Displays the DPC queue statistics of each CPU", CmdListDpcStats, 0, 0},
     { "yield", "Yields processor", CmdYield, 0, 0},
     { "timer", "$MODE [$TIME_IN_US] [$TIMES]\n\tSee EX_TIMER_TYPE for timer types\n\t$TIME_IN_US time in uS until timer fires"
                 "\n\t$TIMES - number of times to wait for timer, valid only if periodic", CmdTestTimer, 1, 3},
 
     { "threads", "Displays all threads", CmdListThreads, 0, 0},
+    { "swtrace", "[0x$APIC_ID] - displays the last context switches of a CPU\n\tIf no CPU is specified displays them for all CPUs",
+                  CmdDumpSwitchTrace, 0, 1},
+    { "lockstat", "[$N] - displays the N most contended locks (10 by default)", CmdListLockStats, 0, 1},
     { "run", "$TEST [$NO_OF_THREADS]\n\tRuns the $TEST specified"
              "\n\t$NO_OF_THREADS the number of threads for running the test,"
              "if the number is not specified then it will run on 2 * NumberOfProcessors",
@@ -16,6 +16,8 @@
 #include "ex_timer.h"
 #include "vmm.h"
 #include "pit.h"
+#include "lock_stats.h"
+#include "dpc.h"
 
 
 #pragma warning(push)
@@ -26,6 +28,9 @@
 // warning C4029: declared formal parameter list different from definition
 #pragma warning(disable:4029)
 
+#define CMD_LOCK_STATS_DEFAULT_ENTRIES      10
+#define CMD_LOCK_STATS_MAX_ENTRIES          32
+
 static FUNC_IpcProcessEvent _CmdIpiCmd;
 
 #define CPU_BOUND_CPU_USAGE         (100 * MS_IN_US)
@@ -72,6 +77,20 @@ _CmdReadAndDumpCpuid(
     );
 
 static FUNC_ListFunction _CmdThreadPrint;
+static FUNC_ListFunction _CmdThreadPrintLatency;
+
+static
+void
+_CmdPrintLatencyHeader(
+    IN      BOOLEAN             Log
+    );
+
+static
+void
+_CmdPrintLatency(
+    IN      PTHREAD_LATENCY_HISTOGRAM   Histogram,
+    IN      BOOLEAN                     Log
+    );
 
 void
 (__cdecl CmdListCpus)(
@@ -118,6 +137,24 @@ void
         printf("%6U%c", pCpu->PageFaults, '|' );
         printf("%14s%c", pCpu->ThreadData.CurrentThread->Name, '|');
     }
+
+    printf("\nScheduling latency (us): Wk = unblock to run, Q = ready queue wait\n");
+
+    printColor(MAGENTA_COLOR, "%8s", "Apic ID|");
+    _CmdPrintLatencyHeader(FALSE);
+    printf("\n");
+
+    for (pCurEntry = pCpuListHead->Flink;
+         pCurEntry != pCpuListHead;
+         pCurEntry = pCurEntry->Flink)
+    {
+        PPCPU pCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+
+        printf("%7x%c", pCpu->ApicId, '|');
+        _CmdPrintLatency(&pCpu->ThreadData.WakeupLatency, FALSE);
+        _CmdPrintLatency(&pCpu->ThreadData.RunQueueLatency, FALSE);
+        printf("\n");
+    }
 }
 
 void
@@ -129,6 +166,9 @@ void
 
     ASSERT(NumberOfParameters == 0);
 
+    LOG("Scheduling policy: %s\n",
+        ThreadSchedulingPolicyMlfq == ThreadSystemGetSchedulingPolicy() ? "MLFQ" : "Round-robin");
+
     LOG("%7s", "TID|");
     LOG("%20s", "Name|");
     LOG("%5s", "Prio|");
@@ -141,6 +181,16 @@ void
 
     status = ThreadExecuteForEachThreadEntry(_CmdThreadPrint, NULL );
     ASSERT( SUCCEEDED(status));
+
+    LOG("\nScheduling latency (us): Wk = unblock to run, Q = ready queue wait\n");
+
+    LOG("%7s", "TID|");
+    LOG("%20s", "Name|");
+    _CmdPrintLatencyHeader(TRUE);
+    LOG("\n");
+
+    status = ThreadExecuteForEachThreadEntry(_CmdThreadPrintLatency, NULL);
+    ASSERT(SUCCEEDED(status));
 }
 
 void
@@ -295,6 +345,57 @@ void
     LOG("%12u [TOTAL]\n", total );
 }
 
+void
+(__cdecl CmdListDpcStats)(
+    IN          QWORD       NumberOfParameters
+    )
+{
+    PLIST_ENTRY pCpuListHead;
+    PLIST_ENTRY pCurEntry;
+
+    ASSERT(NumberOfParameters == 0);
+
+    pCpuListHead = NULL;
+
+    SmpGetCpuList(&pCpuListHead);
+
+    LOG("%6s", "CPU|");
+    LOG("%12s", "Queued|");
+    LOG("%12s", "Executed|");
+    LOG("%12s", "Deferred|");
+    LOG("%12s", "Batches|");
+    LOG("%12s", "Over budget|");
+    LOG("%8s", "Depth|");
+    LOG("%10s", "Max depth|");
+    LOG("%12s", "Run avg|");
+    LOG("%12s", "Run max|");
+    LOG("\n");
+
+    for (pCurEntry = pCpuListHead->Flink;
+         pCurEntry != pCpuListHead;
+         pCurEntry = pCurEntry->Flink)
+    {
+        PPCPU pCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+        DPC_STATS stats;
+
+        DpcGetStats(pCpu, &stats);
+
+        LOG("%5x%c", pCpu->ApicId, '|');
+        LOG("%11U%c", stats.DpcsQueued, '|');
+        LOG("%11U%c", stats.DpcsExecuted, '|');
+        LOG("%11U%c", stats.DpcsDeferred, '|');
+        LOG("%11U%c", stats.Batches, '|');
+        LOG("%11U%c", stats.BatchesOverBudget, '|');
+        LOG("%7u%c", stats.QueueDepth, '|');
+        LOG("%9u%c", stats.MaxQueueDepth, '|');
+        LOG("%11U%c", 0 != stats.DpcsExecuted ? IomuTickCountToUs(stats.TotalRunTicks / stats.DpcsExecuted) : 0, '|');
+        LOG("%11U%c", IomuTickCountToUs(stats.MaxRunTicks), '|');
+        LOG("\n");
+    }
+
+    LOG("Times are in microseconds\n");
+}
+
 void
 (__cdecl CmdTestTimer)(
     IN          QWORD               NumberOfParameters,
@@ -671,6 +772,154 @@ _CmdHelperPrintThreadFunctions(
     }
 }
 
+void
+(__cdecl CmdDumpSwitchTrace)(
+    IN          QWORD               NumberOfParameters,
+    IN_Z        char*               ApicIdString
+    )
+{
+    static const char __reasonNames[ThreadSwitchReasonReserved][8] = { "Yield", "Block", "Preempt", "Wakeup", "Exit" };
+
+    PTHREAD_SWITCH_TRACE_ENTRY pEntries;
+    PLIST_ENTRY pCpuListHead;
+    PLIST_ENTRY pCurEntry;
+    DWORD apicId;
+    BOOLEAN bCpuFound;
+
+    ASSERT(NumberOfParameters <= 1);
+
+    apicId = 0;
+    bCpuFound = FALSE;
+    pCpuListHead = NULL;
+
+    if (NumberOfParameters >= 1)
+    {
+        atoi32(&apicId, ApicIdString, BASE_HEXA);
+    }
+
+    // the copy is too large for the stack
+    pEntries = ExAllocatePoolWithTag(0,
+                                     sizeof(THREAD_SWITCH_TRACE_ENTRY) * THREAD_SWITCH_TRACE_ENTRIES,
+                                     HEAP_TEMP_TAG,
+                                     0);
+    if (NULL == pEntries)
+    {
+        LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", sizeof(THREAD_SWITCH_TRACE_ENTRY) * THREAD_SWITCH_TRACE_ENTRIES);
+        return;
+    }
+
+    SmpGetCpuList(&pCpuListHead);
+
+    for (pCurEntry = pCpuListHead->Flink;
+         pCurEntry != pCpuListHead;
+         pCurEntry = pCurEntry->Flink)
+    {
+        PPCPU pCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+        DWORD noOfEntries;
+        QWORD newestTsc;
+
+        if (NumberOfParameters >= 1 && pCpu->ApicId != apicId)
+        {
+            continue;
+        }
+        bCpuFound = TRUE;
+
+        noOfEntries = ThreadGetSwitchTrace(pCpu, pEntries, THREAD_SWITCH_TRACE_ENTRIES);
+
+        LOG("CPU 0x%x: last %u context switches of %U\n", pCpu->ApicId, noOfEntries, pCpu->ThreadData.SwitchTraceCount);
+        if (0 == noOfEntries)
+        {
+            continue;
+        }
+
+        LOG("%14s", "Time (us)|");
+        LOG("%10s", "Prev TID|");
+        LOG("%10s", "Next TID|");
+        LOG("%9s", "Reason|");
+        LOG("%7s", "Ready|");
+        LOG("\n");
+
+        // times are relative to the newest switch
+        newestTsc = pEntries[noOfEntries - 1].Tsc;
+
+        for (DWORD i = 0; i < noOfEntries; ++i)
+        {
+            PTHREAD_SWITCH_TRACE_ENTRY pEntry = &pEntries[i];
+
+            LOG("-%12U%c", newestTsc > pEntry->Tsc ? IomuTickCountToUs(newestTsc - pEntry->Tsc) : 0, '|');
+            LOG("%9x%c", pEntry->PreviousTid, '|');
+            LOG("%9x%c", pEntry->NextTid, '|');
+            LOG("%8s%c", pEntry->Reason < ThreadSwitchReasonReserved ? __reasonNames[pEntry->Reason] : "?", '|');
+            LOG("%6u%c", pEntry->ReadyThreads, '|');
+            LOG("\n");
+        }
+    }
+
+    if (!bCpuFound)
+    {
+        LOG("There is no CPU with APIC ID 0x%x\n", apicId);
+    }
+
+    ExFreePoolWithTag(pEntries, HEAP_TEMP_TAG);
+}
+
+void
+(__cdecl CmdListLockStats)(
+    IN          QWORD               NumberOfParameters,
+    IN_Z        char*               NumberOfEntriesString
+    )
+{
+    LOCK_STATS stats[CMD_LOCK_STATS_MAX_ENTRIES];
+    DWORD noOfEntries;
+
+    ASSERT(NumberOfParameters <= 1);
+
+    noOfEntries = CMD_LOCK_STATS_DEFAULT_ENTRIES;
+    if (NumberOfParameters >= 1)
+    {
+        atoi32(&noOfEntries, NumberOfEntriesString, BASE_TEN);
+    }
+    noOfEntries = min(noOfEntries, CMD_LOCK_STATS_MAX_ENTRIES);
+
+    noOfEntries = LockStatsGetMostContended(stats, noOfEntries);
+    if (0 == noOfEntries)
+    {
+        LOG("No lock statistics available, they are collected only if LOCK_STATS_ENABLED is set\n");
+        return;
+    }
+
+    LOG("%20s", "Lock|");
+    LOG("%12s", "Acquired|");
+    LOG("%12s", "Contended|");
+    LOG("%12s", "Wait avg|");
+    LOG("%12s", "Wait max|");
+    LOG("%12s", "Hold max|");
+    LOG("\n");
+
+    for (DWORD i = 0; i < noOfEntries; ++i)
+    {
+        PLOCK_STATS pStats = &stats[i];
+
+        if (NULL != pStats->Name)
+        {
+            LOG("%19s%c", pStats->Name, '|');
+        }
+        else
+        {
+            // locks without a name are identified by their initialization site
+            LOG("%19X%c", pStats->CallSite, '|');
+        }
+        LOG("%11U%c", pStats->Acquisitions, '|');
+        LOG("%11U%c", pStats->Contentions, '|');
+        LOG("%11U%c", 0 != pStats->Contentions ? IomuTickCountToUs(pStats->TotalWaitTicks / pStats->Contentions) : 0, '|');
+        LOG("%11U%c", IomuTickCountToUs(pStats->MaxWaitTicks), '|');
+        LOG("%11U%c", IomuTickCountToUs(pStats->MaxHoldTicks), '|');
+        LOG("\n");
+    }
+
+    LOG("Times are in microseconds\n");
+}
+
 static
 STATUS
 (__cdecl _CmdThreadPrint) (
@@ -698,6 +947,79 @@ STATUS
     return STATUS_SUCCESS;
 }
 
+static
+STATUS
+(__cdecl _CmdThreadPrintLatency) (
+    IN      PLIST_ENTRY     ListEntry,
+    IN_OPT  PVOID           FunctionContext
+    )
+{
+    PTHREAD pThread;
+
+    ASSERT(NULL != ListEntry);
+    ASSERT(NULL == FunctionContext);
+
+    pThread = CONTAINING_RECORD(ListEntry, THREAD, AllList);
+
+    LOG("%6x%c", pThread->Id, '|');
+    LOG("%19s%c", pThread->Name, '|');
+    _CmdPrintLatency(&pThread->WakeupLatency, TRUE);
+    _CmdPrintLatency(&pThread->RunQueueLatency, TRUE);
+    LOG("\n");
+
+    return STATUS_SUCCESS;
+}
+
+static
+void
+_CmdPrintLatencyHeader(
+    IN      BOOLEAN             Log
+    )
+{
+    static const char __columnNames[][8] = { "Wk p50|", "Wk p99|", "Wk max|",
+                                             "Q p50|", "Q p99|", "Q max|" };
+
+    for (DWORD i = 0; i < ARRAYSIZE(__columnNames); ++i)
+    {
+        if (Log)
+        {
+            LOG("%8s", __columnNames[i]);
+        }
+        else
+        {
+            printColor(MAGENTA_COLOR, "%8s", __columnNames[i]);
+        }
+    }
+}
+
+static
+void
+_CmdPrintLatency(
+    IN      PTHREAD_LATENCY_HISTOGRAM   Histogram,
+    IN      BOOLEAN                     Log
+    )
+{
+    QWORD values[3];
+
+    ASSERT(NULL != Histogram);
+
+    values[0] = ThreadLatencyGetPercentileUs(Histogram, 50);
+    values[1] = ThreadLatencyGetPercentileUs(Histogram, 99);
+    values[2] = ThreadLatencyGetPercentileUs(Histogram, 100);
+
+    for (DWORD i = 0; i < ARRAYSIZE(values); ++i)
+    {
+        if (Log)
+        {
+            LOG("%7U%c", values[i], '|');
+        }
+        else
+        {
+            printf("%7U%c", values[i], '|');
+        }
+    }
+}
+
 static
 void
 _CmdReadAndDumpCpuid(
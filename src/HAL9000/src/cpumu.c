@@ -7,6 +7,7 @@
 #include "vmm.h"
 #include "gs_utils.h"
 #include "syscall.h"
+#include "tsc_clock.h"
 
 #define STACK_MINIMUM_SIZE          PAGE_SIZE
 #define STACK_MAXIMUM_SIZE          (16*PAGE_SIZE)
@@ -17,6 +18,17 @@
 
 #define HAL9000_USED_XCR0_FEATURES           (XCR0_SAVED_STATE_x87_MMX | XCR0_SAVED_STATE_SSE)
 
+// CPUID.(EAX=0DH,ECX=1):EAX[0]
+#define CPUID_EXTENDED_STATE_XSAVEOPT_SUPPORTED     (1<<0)
+
+#define CPUID_IDX_ADVANCED_POWER_MANAGEMENT         0x80000007
+
+// CPUID.01H:ECX[24]
+#define CPUID_FEATURE_INFORMATION_TSC_DEADLINE          (1<<24)
+
+// CPUID.80000007H:EDX[8]
+#define CPUID_ADVANCED_POWER_MANAGEMENT_INVARIANT_TSC   (1<<8)
+
 typedef struct _CPUMU_DATA
 {
     CPUID_BASIC_INFORMATION                         BasicInformation;
@@ -26,6 +38,17 @@ typedef struct _CPUMU_DATA
     CPUID_EXTENDED_CPUID_INFORMATION                ExtendedCpuidInformation;
     CPUID_EXTENDED_FEATURE_INFORMATION              ExtendedFeatureInformation;
     CPUID_EXTENDED_STATE_ENUMERATION_MAIN_LEAF      ExtendedStateMainLeaf;
+
+    // Size of the XSAVE area required for the features enabled in XCR0,
+    // valid only after CpuMuActivateFpuFeatures
+    DWORD                                           XsaveAreaSize;
+    BOOLEAN                                         XsaveoptSupported;
+
+    // The TSC runs at a constant rate in all ACPI P-, C- and T-states
+    BOOLEAN                                         InvariantTsc;
+
+    // The LAPIC timer can be armed with an absolute TSC value
+    BOOLEAN                                         TscDeadline;
 } CPUMU_DATA, *PCPMU_DATA;
 
 static CPUMU_DATA m_cpuMuData;
@@ -75,7 +98,12 @@ _CpuMuCollectBasicInformation(
 
     if (m_cpuMuData.BasicInformation.MaxValueForBasicInfo >= CpuidIdxFeatureInformation)
     {
+        CPUID_INFO cpuId;
+
         __cpuid((int*)&m_cpuMuData.FeatureInformation, CpuidIdxFeatureInformation);
+
+        __cpuid(cpuId.values, CpuidIdxFeatureInformation);
+        m_cpuMuData.TscDeadline = IsBooleanFlagOn(cpuId.values[2], CPUID_FEATURE_INFORMATION_TSC_DEADLINE);
     }
 
     if (m_cpuMuData.BasicInformation.MaxValueForBasicInfo >= CpuidIdxMonitorLeaf)
@@ -107,6 +135,14 @@ _CpuMuCollectExtendedInformation(
     {
         __cpuid((int*) &m_cpuMuData.ExtendedFeatureInformation, CpuidIdxExtendedFeatureInformation);
     }
+
+    if (m_cpuMuData.ExtendedCpuidInformation.MaxValueForExtendedInfo >= CPUID_IDX_ADVANCED_POWER_MANAGEMENT)
+    {
+        CPUID_INFO cpuId;
+
+        __cpuid(cpuId.values, CPUID_IDX_ADVANCED_POWER_MANAGEMENT);
+        m_cpuMuData.InvariantTsc = IsBooleanFlagOn(cpuId.values[3], CPUID_ADVANCED_POWER_MANAGEMENT_INVARIANT_TSC);
+    }
 }
 
 // this has nothing to do with the thread system, it is a `hack` used to
@@ -316,6 +352,16 @@ CpuMuAllocCpu(
     LockInit(&pPcpu->EventListLock);
     pPcpu->NoOfEventsInList = 0;
 
+    RcuCpuInit(&pPcpu->RcuData);
+
+    DpcCpuInit(&pPcpu->DpcData);
+
+    ExWorkPoolCpuInit(&pPcpu->WorkPool);
+
+    ExTimerCpuInit(&pPcpu->TimerWheel);
+
+    PmmFrameCacheCpuInit(&pPcpu->FrameCache);
+
     *PhysicalCpu = pPcpu;
 
     LOG_FUNC_END;
@@ -371,6 +417,12 @@ CpuMuInitCpu(
         return status;
     }
 
+    // the BSP checks its TSC after all the APs started
+    if (!PhysicalCpu->BspProcessor)
+    {
+        TscClockCheckCpu();
+    }
+
     // notify SMP module that the CPU has woken up
     SmpNotifyCpuWakeup();
 
@@ -414,7 +466,64 @@ CpuMuActivateFpuFeatures(
     void
     )
 {
-    return HalSetActiveFpuFeatures(HAL9000_USED_XCR0_FEATURES);
+    STATUS status;
+    CPUID_INFO cpuidInfo;
+
+    status = HalSetActiveFpuFeatures(HAL9000_USED_XCR0_FEATURES);
+    if (!SUCCEEDED(status))
+    {
+        return status;
+    }
+
+    // EBX of the main leaf reports the size needed for the features currently
+    // enabled in XCR0 => it must be read after they were activated
+    __cpuidex(cpuidInfo.values, CpuidIdxExtendedStateEnumerationMainLeaf, 0x0);
+    m_cpuMuData.XsaveAreaSize = cpuidInfo.ebx;
+
+    __cpuidex(cpuidInfo.values, CpuidIdxExtendedStateEnumerationMainLeaf, 0x1);
+    m_cpuMuData.XsaveoptSupported = IsBooleanFlagOn(cpuidInfo.eax, CPUID_EXTENDED_STATE_XSAVEOPT_SUPPORTED);
+
+    return STATUS_SUCCESS;
+}
+
+QWORD
+CpuMuGetActiveFpuFeatures(
+    void
+    )
+{
+    return HAL9000_USED_XCR0_FEATURES;
+}
+
+DWORD
+CpuMuGetXsaveAreaSize(
+    void
+    )
+{
+    return m_cpuMuData.XsaveAreaSize;
+}
+
+BOOLEAN
+CpuMuIsXsaveoptSupported(
+    void
+    )
+{
+    return m_cpuMuData.XsaveoptSupported;
+}
+
+BOOLEAN
+CpuMuIsInvariantTscSupported(
+    void
+    )
+{
+    return m_cpuMuData.InvariantTsc;
+}
+
+BOOLEAN
+CpuMuIsTscDeadlineSupported(
+    void
+    )
+{
+    return m_cpuMuData.TscDeadline;
 }
 
 static
@@ -0,0 +1,417 @@
+#include "HAL9000.h"
+#include "dpc.h"
+#include "cpumu.h"
+#include "iomu.h"
+#include "thread_internal.h"
+
+static FUNC_ThreadStart     _DpcThread;
+
+static
+PDPC
+_DpcRemoveHead(
+    INOUT   PDPC_CPU_DATA           CpuData
+    );
+
+static
+void
+_DpcRun(
+    INOUT   PDPC_CPU_DATA           CpuData,
+    INOUT   PDPC                    Dpc,
+    IN      BOOLEAN                 Deferred
+    );
+
+static
+BOOLEAN
+_DpcWakeThread(
+    INOUT   PDPC_CPU_DATA           CpuData
+    );
+
+_No_competing_thread_
+void
+DpcCpuInit(
+    OUT     PDPC_CPU_DATA           CpuData
+    )
+{
+    ASSERT(NULL != CpuData);
+
+    memzero(CpuData, sizeof(DPC_CPU_DATA));
+
+    InitializeListHead(&CpuData->Queue);
+}
+
+STATUS
+DpcCpuStartThread(
+    void
+    )
+{
+    STATUS status;
+    PPCPU pCpu;
+    PTHREAD pThread;
+    INTR_STATE oldState;
+    char threadName[MAX_PATH];
+
+    oldState = CpuIntrDisable();
+    pCpu = GetCurrentPcpu();
+    CpuIntrSetState(oldState);
+
+    ASSERT(NULL != pCpu);
+
+    snprintf(threadName, MAX_PATH, "%s-%02x", "dpc", pCpu->ApicId);
+
+    status = ThreadCreate(threadName,
+                          ThreadPriorityMaximum,
+                          _DpcThread,
+                          pCpu,
+                          &pThread
+                          );
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadCreate", status);
+        return status;
+    }
+
+    // the handle is kept for the lifetime of the system
+    oldState = CpuIntrDisable();
+    pCpu->DpcData.Thread = pThread;
+    CpuIntrSetState(oldState);
+
+    return status;
+}
+
+void
+DpcInit(
+    OUT     PDPC                    Dpc,
+    IN      PFUNC_DpcRoutine        Routine,
+    IN_OPT  PVOID                   Context
+    )
+{
+    ASSERT(NULL != Dpc);
+    ASSERT(NULL != Routine);
+
+    memzero(Dpc, sizeof(DPC));
+
+    Dpc->Routine = Routine;
+    Dpc->Context = Context;
+}
+
+BOOLEAN
+DpcQueue(
+    INOUT   PDPC                    Dpc
+    )
+{
+    INTR_STATE oldState;
+    PDPC_CPU_DATA pCpuData;
+    BOOLEAN bThreadWoken;
+
+    ASSERT(NULL != Dpc);
+
+    if (_InterlockedCompareExchange8((volatile char*) &Dpc->Queued, TRUE, FALSE))
+    {
+        return FALSE;
+    }
+
+    bThreadWoken = FALSE;
+
+    oldState = CpuIntrDisable();
+
+    pCpuData = &GetCurrentPcpu()->DpcData;
+
+    InsertTailList(&pCpuData->Queue, &Dpc->ListEntry);
+
+    pCpuData->Stats.DpcsQueued++;
+    pCpuData->Stats.QueueDepth++;
+    pCpuData->Stats.MaxQueueDepth = max(pCpuData->Stats.MaxQueueDepth, pCpuData->Stats.QueueDepth);
+
+    // no interrupt exit is pending which would run the DPC
+    if (0 == pCpuData->InterruptNesting && !pCpuData->BatchInProgress)
+    {
+        bThreadWoken = _DpcWakeThread(pCpuData);
+    }
+
+    CpuIntrSetState(oldState);
+
+    if (bThreadWoken && INTR_ON == oldState)
+    {
+        ThreadYield();
+    }
+
+    return TRUE;
+}
+
+void
+DpcInterruptEnter(
+    void
+    )
+{
+    PPCPU pCpu;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pCpu = GetCurrentPcpu();
+    if (NULL != pCpu)
+    {
+        // in the early stages the PCPU may have not been yet set
+        pCpu->DpcData.InterruptNesting++;
+    }
+}
+
+BOOLEAN
+DpcIsInterruptContext(
+    void
+    )
+{
+    PPCPU pCpu;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pCpu = GetCurrentPcpu();
+    if (NULL == pCpu)
+    {
+        return TRUE;
+    }
+
+    return 0 != pCpu->DpcData.InterruptNesting || pCpu->DpcData.BatchInProgress;
+}
+
+BOOLEAN
+DpcInterruptExit(
+    void
+    )
+{
+    PPCPU pCpu;
+    PDPC_CPU_DATA pCpuData;
+    QWORD startTsc;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pCpu = GetCurrentPcpu();
+    if (NULL == pCpu)
+    {
+        return TRUE;
+    }
+
+    pCpuData = &pCpu->DpcData;
+
+    ASSERT(pCpuData->InterruptNesting > 0);
+    pCpuData->InterruptNesting--;
+
+    if (pCpuData->BatchInProgress)
+    {
+        // the interrupted batch runs our DPCs, the thread running it must not
+        // be switched out from under it
+        return FALSE;
+    }
+
+    ASSERT(0 == pCpuData->InterruptNesting);
+
+    if (IsListEmpty(&pCpuData->Queue))
+    {
+        return TRUE;
+    }
+
+    pCpuData->BatchInProgress = TRUE;
+    pCpuData->Stats.Batches++;
+
+    startTsc = __rdtsc();
+    for (DWORD i = 0; i < DPC_BATCH_MAX_COUNT; ++i)
+    {
+        PDPC pDpc;
+
+        if (IomuTickCountToUs(__rdtsc() - startTsc) >= DPC_BATCH_BUDGET_US)
+        {
+            break;
+        }
+
+        pDpc = _DpcRemoveHead(pCpuData);
+        if (NULL == pDpc)
+        {
+            break;
+        }
+
+        _DpcRun(pCpuData, pDpc, FALSE);
+    }
+
+    pCpuData->BatchInProgress = FALSE;
+
+    if (!IsListEmpty(&pCpuData->Queue))
+    {
+        pCpuData->Stats.BatchesOverBudget++;
+
+        if (_DpcWakeThread(pCpuData))
+        {
+            // the DPC thread has the maximum priority, it replaces the
+            // interrupted thread as soon as we return, which keeps its MLFQ
+            // level
+            ThreadRequestPreemptOnInterrupt();
+        }
+    }
+
+    return TRUE;
+}
+
+void
+DpcGetStats(
+    IN      struct _PCPU*           Cpu,
+    OUT     PDPC_STATS              Stats
+    )
+{
+    ASSERT(NULL != Cpu);
+    ASSERT(NULL != Stats);
+
+    // the statistics of another CPU change while they are copied, they are
+    // only informative
+    memcpy(Stats, &Cpu->DpcData.Stats, sizeof(DPC_STATS));
+}
+
+static
+STATUS
+(__cdecl _DpcThread)(
+    IN_OPT      PVOID       Context
+    )
+{
+    STATUS status;
+    PPCPU pCpu;
+
+    ASSERT(NULL != Context);
+
+    pCpu = (PPCPU) Context;
+
+    // the thread serves only the queue of its CPU
+    status = ThreadSetAffinity(NULL, pCpu->LogicalApicId);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadSetAffinity", status);
+        return status;
+    }
+
+    // warning C4127: conditional expression is constant
+#pragma warning(suppress:4127)
+    while (TRUE)
+    {
+        PDPC_CPU_DATA pCpuData;
+        INTR_STATE oldState;
+
+        oldState = CpuIntrDisable();
+
+        ASSERT(GetCurrentPcpu() == pCpu);
+        pCpuData = &pCpu->DpcData;
+
+        for (DWORD i = 0; i < DPC_BATCH_MAX_COUNT; ++i)
+        {
+            PDPC pDpc = _DpcRemoveHead(pCpuData);
+            if (NULL == pDpc)
+            {
+                break;
+            }
+
+            _DpcRun(pCpuData, pDpc, TRUE);
+        }
+
+        if (IsListEmpty(&pCpuData->Queue))
+        {
+            // no interrupt can queue a DPC before we block, interrupts are
+            // disabled on our CPU
+            pCpuData->ThreadWaiting = TRUE;
+
+            ThreadTakeBlockLock();
+            ThreadBlock();
+
+            CpuIntrSetState(oldState);
+        }
+        else
+        {
+            CpuIntrSetState(oldState);
+
+            // the other threads of maximum priority get a chance to run
+            ThreadYield();
+        }
+    }
+
+    NOT_REACHED;
+}
+
+static
+PDPC
+_DpcRemoveHead(
+    INOUT   PDPC_CPU_DATA           CpuData
+    )
+{
+    PLIST_ENTRY pEntry;
+    PDPC pDpc;
+
+    ASSERT(NULL != CpuData);
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    if (IsListEmpty(&CpuData->Queue))
+    {
+        return NULL;
+    }
+
+    pEntry = RemoveHeadList(&CpuData->Queue);
+    pDpc = CONTAINING_RECORD(pEntry, DPC, ListEntry);
+
+    ASSERT(CpuData->Stats.QueueDepth > 0);
+    CpuData->Stats.QueueDepth--;
+
+    return pDpc;
+}
+
+static
+void
+_DpcRun(
+    INOUT   PDPC_CPU_DATA           CpuData,
+    INOUT   PDPC                    Dpc,
+    IN      BOOLEAN                 Deferred
+    )
+{
+    PFUNC_DpcRoutine pRoutine;
+    PVOID pContext;
+    QWORD startTsc;
+    QWORD runTicks;
+
+    ASSERT(NULL != CpuData);
+    ASSERT(NULL != Dpc);
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pRoutine = Dpc->Routine;
+    pContext = Dpc->Context;
+
+    // from now on the DPC may be queued again, even by its own routine
+    _InterlockedExchange8((volatile char*) &Dpc->Queued, FALSE);
+
+    CpuIntrEnable();
+
+    startTsc = __rdtsc();
+    pRoutine(pContext);
+    runTicks = __rdtsc() - startTsc;
+
+    CpuIntrDisable();
+
+    CpuData->Stats.DpcsExecuted++;
+    if (Deferred)
+    {
+        CpuData->Stats.DpcsDeferred++;
+    }
+    CpuData->Stats.TotalRunTicks += runTicks;
+    CpuData->Stats.MaxRunTicks = max(CpuData->Stats.MaxRunTicks, runTicks);
+}
+
+static
+BOOLEAN
+_DpcWakeThread(
+    INOUT   PDPC_CPU_DATA           CpuData
+    )
+{
+    ASSERT(NULL != CpuData);
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    if (NULL == CpuData->Thread || !CpuData->ThreadWaiting)
+    {
+        return FALSE;
+    }
+
+    CpuData->ThreadWaiting = FALSE;
+    ThreadUnblock(CpuData->Thread);
+
+    return TRUE;
+}
@@ -37,6 +37,7 @@ ExEventSignal(
 {
     INTR_STATE oldState;
     PLIST_ENTRY pEntry;
+    LIST_ENTRY threadsToWake;
 
     ASSERT(NULL != Event);
 
@@ -44,25 +45,39 @@ ExEventSignal(
 
     LockAcquire(&Event->EventLock, &oldState);
     _InterlockedExchange8(&Event->Signaled, TRUE);
-    
-    for(pEntry = RemoveHeadList(&Event->WaitingList);
-        pEntry != &Event->WaitingList;
-        pEntry = RemoveHeadList(&Event->WaitingList)
-            )
-    {
-        PTHREAD pThreadToSignal = CONTAINING_RECORD(pEntry, THREAD, ReadyList);
-        ThreadUnblock(pThreadToSignal);
 
-        if (ExEventTypeSynchronization == Event->EventType)
+    if (ExEventTypeSynchronization == Event->EventType)
+    {
+        pEntry = RemoveHeadList(&Event->WaitingList);
+        if (pEntry != &Event->WaitingList)
         {
             // sorry, we only wake one thread
             // we must not clear the signal here, because the first thread which will
             // wake up will claar it :)
-            break;
+            ThreadUnblock(CONTAINING_RECORD(pEntry, THREAD, ReadyList));
         }
+
+        LockRelease(&Event->EventLock, oldState);
+        return;
+    }
+
+    // all the waiters are woken up at once, the waiting list is moved on the
+    // stack so the ready queues are not accessed with the event lock held
+    InitializeListHead(&threadsToWake);
+    for(pEntry = RemoveHeadList(&Event->WaitingList);
+        pEntry != &Event->WaitingList;
+        pEntry = RemoveHeadList(&Event->WaitingList)
+            )
+    {
+        InsertTailList(&threadsToWake, pEntry);
     }
 
     LockRelease(&Event->EventLock, oldState);
+
+    if (!IsListEmpty(&threadsToWake))
+    {
+        ThreadUnblockList(&threadsToWake);
+    }
 }
 
 void
@@ -0,0 +1,224 @@
+#include "HAL9000.h"
+#include "ex_rwlock.h"
+#include "thread_internal.h"
+
+static FUNC_CompareFunction     _ExRwLockWriterCompareFunction;
+
+_No_competing_thread_
+void
+ExRwLockInit(
+    OUT         PEX_RWLOCK      RwLock
+    )
+{
+    ASSERT(NULL != RwLock);
+
+    memzero(RwLock, sizeof(EX_RWLOCK));
+
+    LockInit(&RwLock->Lock);
+
+    InitializeListHead(&RwLock->WaitingWriters);
+    InitializeListHead(&RwLock->WaitingReaders);
+}
+
+ACQUIRES_SHARED_AND_NON_REENTRANT_LOCK(*RwLock)
+REQUIRES_NOT_HELD_LOCK(*RwLock)
+void
+ExRwLockAcquireShared(
+    INOUT       PEX_RWLOCK      RwLock
+    )
+{
+    INTR_STATE dummyState;
+    INTR_STATE oldState;
+    PTHREAD pCurrentThread = GetCurrentThread();
+
+    ASSERT(NULL != RwLock);
+    ASSERT(NULL != pCurrentThread);
+    ASSERT(pCurrentThread != RwLock->ExclusiveHolder);
+
+    oldState = CpuIntrDisable();
+
+    LockAcquire(&RwLock->Lock, &dummyState);
+
+    // writer preference: new readers queue behind the waiting writers
+    if (NULL == RwLock->ExclusiveHolder && 0 == RwLock->NumberOfWaitingWriters)
+    {
+        RwLock->ActiveReaders++;
+        LockRelease(&RwLock->Lock, dummyState);
+    }
+    else
+    {
+        // the lock is handed to us before we are unblocked, ActiveReaders
+        // is already incremented on our behalf
+        InsertTailList(&RwLock->WaitingReaders, &pCurrentThread->ReadyList);
+        ThreadTakeBlockLock();
+        LockRelease(&RwLock->Lock, dummyState);
+        ThreadBlock();
+    }
+
+    _Analysis_assume_lock_acquired_(*RwLock);
+
+    CpuIntrSetState(oldState);
+}
+
+RELEASES_SHARED_AND_NON_REENTRANT_LOCK(*RwLock)
+REQUIRES_SHARED_LOCK(*RwLock)
+void
+ExRwLockReleaseShared(
+    INOUT       PEX_RWLOCK      RwLock
+    )
+{
+    INTR_STATE oldState;
+    PLIST_ENTRY pEntry;
+
+    ASSERT(NULL != RwLock);
+
+    LockAcquire(&RwLock->Lock, &oldState);
+
+    ASSERT(RwLock->ActiveReaders > 0);
+    ASSERT(NULL == RwLock->ExclusiveHolder);
+
+    RwLock->ActiveReaders--;
+    if (0 == RwLock->ActiveReaders)
+    {
+        pEntry = RemoveHeadList(&RwLock->WaitingWriters);
+        if (pEntry != &RwLock->WaitingWriters)
+        {
+            PTHREAD pThread = CONTAINING_RECORD(pEntry, THREAD, ReadyList);
+
+            RwLock->NumberOfWaitingWriters--;
+            RwLock->ExclusiveHolder = pThread;
+            ThreadUnblock(pThread);
+        }
+    }
+
+    _Analysis_assume_lock_released_(*RwLock);
+
+    LockRelease(&RwLock->Lock, oldState);
+}
+
+ACQUIRES_EXCL_AND_NON_REENTRANT_LOCK(*RwLock)
+REQUIRES_NOT_HELD_LOCK(*RwLock)
+void
+ExRwLockAcquireExclusive(
+    INOUT       PEX_RWLOCK      RwLock
+    )
+{
+    INTR_STATE dummyState;
+    INTR_STATE oldState;
+    PTHREAD pCurrentThread = GetCurrentThread();
+
+    ASSERT(NULL != RwLock);
+    ASSERT(NULL != pCurrentThread);
+    ASSERT(pCurrentThread != RwLock->ExclusiveHolder);
+
+    oldState = CpuIntrDisable();
+
+    LockAcquire(&RwLock->Lock, &dummyState);
+
+    if (NULL == RwLock->ExclusiveHolder && 0 == RwLock->ActiveReaders)
+    {
+        ASSERT(0 == RwLock->NumberOfWaitingWriters);
+
+        RwLock->ExclusiveHolder = pCurrentThread;
+    }
+    else
+    {
+        // the writers are served in priority order, this makes the lock behave
+        // towards high priority threads the same way the ready queues do
+        InsertOrderedList(&RwLock->WaitingWriters, &pCurrentThread->ReadyList, _ExRwLockWriterCompareFunction, NULL);
+        RwLock->NumberOfWaitingWriters++;
+
+        while (RwLock->ExclusiveHolder != pCurrentThread)
+        {
+            ThreadTakeBlockLock();
+            LockRelease(&RwLock->Lock, dummyState);
+            ThreadBlock();
+            LockAcquire(&RwLock->Lock, &dummyState);
+        }
+    }
+
+    _Analysis_assume_lock_acquired_(*RwLock);
+
+    LockRelease(&RwLock->Lock, dummyState);
+
+    CpuIntrSetState(oldState);
+}
+
+RELEASES_EXCL_AND_NON_REENTRANT_LOCK(*RwLock)
+REQUIRES_EXCL_LOCK(*RwLock)
+void
+ExRwLockReleaseExclusive(
+    INOUT       PEX_RWLOCK      RwLock
+    )
+{
+    INTR_STATE oldState;
+    PLIST_ENTRY pEntry;
+    LIST_ENTRY readersToWake;
+
+    ASSERT(NULL != RwLock);
+    ASSERT(GetCurrentThread() == RwLock->ExclusiveHolder);
+
+    InitializeListHead(&readersToWake);
+
+    LockAcquire(&RwLock->Lock, &oldState);
+
+    ASSERT(0 == RwLock->ActiveReaders);
+
+    pEntry = RemoveHeadList(&RwLock->WaitingWriters);
+    if (pEntry != &RwLock->WaitingWriters)
+    {
+        PTHREAD pThread = CONTAINING_RECORD(pEntry, THREAD, ReadyList);
+
+        RwLock->NumberOfWaitingWriters--;
+        RwLock->ExclusiveHolder = pThread;
+        ThreadUnblock(pThread);
+
+        _Analysis_assume_lock_released_(*RwLock);
+
+        LockRelease(&RwLock->Lock, oldState);
+        return;
+    }
+
+    RwLock->ExclusiveHolder = NULL;
+
+    // no writer is waiting => all the readers receive the lock, they are
+    // woken up after the lock is released, the same way ExEventSignal does
+    for (pEntry = RemoveHeadList(&RwLock->WaitingReaders);
+         pEntry != &RwLock->WaitingReaders;
+         pEntry = RemoveHeadList(&RwLock->WaitingReaders))
+    {
+        RwLock->ActiveReaders++;
+        InsertTailList(&readersToWake, pEntry);
+    }
+
+    _Analysis_assume_lock_released_(*RwLock);
+
+    LockRelease(&RwLock->Lock, oldState);
+
+    if (!IsListEmpty(&readersToWake))
+    {
+        ThreadUnblockList(&readersToWake);
+    }
+}
+
+static
+INT64
+(__cdecl _ExRwLockWriterCompareFunction) (
+    IN      PLIST_ENTRY     FirstElem,
+    IN      PLIST_ENTRY     SecondElem,
+    IN_OPT  PVOID           Context
+    )
+{
+    PTHREAD pFirstThread;
+    PTHREAD pSecondThread;
+
+    ASSERT(NULL != FirstElem);
+    ASSERT(NULL != SecondElem);
+    ASSERT(Context == NULL);
+
+    pFirstThread = CONTAINING_RECORD(FirstElem, THREAD, ReadyList);
+    pSecondThread = CONTAINING_RECORD(SecondElem, THREAD, ReadyList);
+
+    // higher priorities first
+    return (INT64) ThreadGetPriority(pSecondThread) - (INT64) ThreadGetPriority(pFirstThread);
+}
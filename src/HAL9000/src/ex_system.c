@@ -1,6 +1,7 @@
 #include "HAL9000.h"
 #include "ex_system.h"
 #include "thread_internal.h"
+#include "ex_timer.h"
 
 void
 ExSystemTimerTick(
@@ -8,4 +9,6 @@ ExSystemTimerTick(
     )
 {
     ThreadTick();
+
+    ExTimerTick();
 }
\ No newline at end of file
@@ -2,6 +2,83 @@
 #include "ex_timer.h"
 #include "iomu.h"
 #include "thread_internal.h"
+#include "cpumu.h"
+#include "tsc_clock.h"
+#include "smp.h"
+
+#define EX_TIMER_WHEEL_SLOT_MASK        (EX_TIMER_WHEEL_SLOTS - 1)
+
+// Number of wheel ticks covered by the first Level levels of the wheel
+#define EX_TIMER_WHEEL_RANGE(Level)     (1ULL << (EX_TIMER_WHEEL_SLOT_BITS * (Level)))
+
+#define EX_TIMER_US_TO_WHEEL_TICK(Us)   ((Us) / EX_TIMER_WHEEL_TICK_US)
+
+static
+void
+_ExTimerWheelSynchronize(
+    INOUT   PEX_TIMER_WHEEL Wheel
+    );
+
+static
+void
+_ExTimerWheelInsert(
+    INOUT   PEX_TIMER_WHEEL Wheel,
+    INOUT   PEX_TIMER       Timer
+    );
+
+static
+void
+_ExTimerWheelRemove(
+    INOUT   PEX_TIMER_WHEEL Wheel,
+    INOUT   PEX_TIMER       Timer
+    );
+
+static
+void
+_ExTimerWheelCascade(
+    INOUT   PEX_TIMER_WHEEL Wheel,
+    IN      DWORD           Level
+    );
+
+static
+void
+_ExTimerWheelAdvance(
+    INOUT   PEX_TIMER_WHEEL Wheel
+    );
+
+static
+void
+_ExTimerWheelExpireCurrentSlot(
+    INOUT   PEX_TIMER_WHEEL Wheel,
+    IN      QWORD           NowUs,
+    INOUT   PLIST_ENTRY     ThreadsToWake
+    );
+
+static
+QWORD
+_ExTimerWheelGetNextEventUs(
+    IN      PEX_TIMER_WHEEL Wheel
+    );
+
+static
+void
+_ExTimerWheelProgramDeadline(
+    INOUT   PEX_TIMER_WHEEL Wheel
+    );
+
+static
+void
+_ExTimerMoveWaiters(
+    INOUT   PEX_TIMER       Timer,
+    INOUT   PLIST_ENTRY     ThreadsToWake
+    );
+
+static
+void
+_ExTimerTrigger(
+    INOUT   PEX_TIMER       Timer,
+    INOUT   PLIST_ENTRY     ThreadsToWake
+    );
 
 STATUS
 ExTimerInit(
@@ -26,6 +103,8 @@ ExTimerInit(
 
     memzero(Timer, sizeof(EX_TIMER));
 
+    InitializeListHead(&Timer->WaitingList);
+
     Timer->Type = Type;
     if (Timer->Type != ExTimerTypeAbsolute)
     {
@@ -45,11 +124,30 @@ ExTimerInit(
     return status;
 }
 
+void
+ExTimerSetCallback(
+    INOUT   PEX_TIMER               Timer,
+    IN      PFUNC_ExTimerCallback   Callback,
+    IN_OPT  PVOID                   Context
+    )
+{
+    ASSERT(Timer != NULL);
+    ASSERT(Callback != NULL);
+    ASSERT(!Timer->TimerStarted);
+
+    Timer->Callback = Callback;
+    Timer->CallbackContext = Context;
+}
+
 void
 ExTimerStart(
     IN      PEX_TIMER       Timer
     )
 {
+    PEX_TIMER_WHEEL pWheel;
+    INTR_STATE oldState;
+    LIST_ENTRY threadsToWake;
+
     ASSERT(Timer != NULL);
 
     if (Timer->TimerUninited)
@@ -57,7 +155,63 @@ ExTimerStart(
         return;
     }
 
-    Timer->TimerStarted = TRUE;
+    // the timer stays on the wheel of the CPU which first started it, this
+    // is usually the CPU of the thread which will wait for it
+    oldState = CpuIntrDisable();
+    _InterlockedCompareExchangePointer((PVOID volatile*) &Timer->Wheel, &GetCurrentPcpu()->TimerWheel, NULL);
+    CpuIntrSetState(oldState);
+
+    pWheel = Timer->Wheel;
+
+    InitializeListHead(&threadsToWake);
+
+    LockAcquire(&pWheel->Lock, &oldState);
+
+    if (!Timer->TimerStarted)
+    {
+        Timer->TimerStarted = TRUE;
+
+        _ExTimerWheelSynchronize(pWheel);
+
+        if (ExTimerTypeRelativePeriodic == Timer->Type && 0 == Timer->ReloadTimeUs)
+        {
+            // the timer would trigger continuously, it is never armed so
+            // ExTimerWait returns instantly
+        }
+        else if (ExTimerTypeRelativePeriodic != Timer->Type && IomuGetSystemTimeUs() >= Timer->TriggerTimeUs)
+        {
+            _ExTimerTrigger(Timer, &threadsToWake);
+        }
+        else
+        {
+            Timer->ExpirationTick = EX_TIMER_US_TO_WHEEL_TICK(Timer->TriggerTimeUs);
+            _ExTimerWheelInsert(pWheel, Timer);
+
+            if (Timer->TriggerTimeUs < pWheel->ProgrammedDeadlineUs)
+            {
+                if (pWheel == &GetCurrentPcpu()->TimerWheel)
+                {
+                    _ExTimerWheelProgramDeadline(pWheel);
+                }
+                else
+                {
+                    // the LAPIC timer of another CPU cannot be armed from
+                    // here, the CPU owning the wheel reprograms it when it
+                    // receives the IPI (it may also be idle with its
+                    // scheduler tick stopped)
+                    pWheel->ReprogramRequested = TRUE;
+                    SmpSendRescheduleIpi(CONTAINING_RECORD(pWheel, PCPU, TimerWheel)->LogicalApicId);
+                }
+            }
+        }
+    }
+
+    LockRelease(&pWheel->Lock, oldState);
+
+    if (!IsListEmpty(&threadsToWake))
+    {
+        ThreadUnblockList(&threadsToWake);
+    }
 }
 
 void
@@ -65,6 +219,10 @@ ExTimerStop(
     IN      PEX_TIMER       Timer
     )
 {
+    PEX_TIMER_WHEEL pWheel;
+    INTR_STATE oldState;
+    LIST_ENTRY threadsToWake;
+
     ASSERT(Timer != NULL);
 
     if (Timer->TimerUninited)
@@ -72,7 +230,27 @@ ExTimerStop(
         return;
     }
 
+    pWheel = Timer->Wheel;
+    if (NULL == pWheel)
+    {
+        // never started
+        return;
+    }
+
+    InitializeListHead(&threadsToWake);
+
+    LockAcquire(&pWheel->Lock, &oldState);
+
     Timer->TimerStarted = FALSE;
+    _ExTimerWheelRemove(pWheel, Timer);
+    _ExTimerMoveWaiters(Timer, &threadsToWake);
+
+    LockRelease(&pWheel->Lock, oldState);
+
+    if (!IsListEmpty(&threadsToWake))
+    {
+        ThreadUnblockList(&threadsToWake);
+    }
 }
 
 void
@@ -80,6 +258,10 @@ ExTimerWait(
     INOUT   PEX_TIMER       Timer
     )
 {
+    PEX_TIMER_WHEEL pWheel;
+    INTR_STATE dummyState;
+    INTR_STATE oldState;
+
     ASSERT(Timer != NULL);
 
     if (Timer->TimerUninited)
@@ -87,10 +269,31 @@ ExTimerWait(
         return;
     }
 
-    while (IomuGetSystemTimeUs() < Timer->TriggerTimeUs && Timer->TimerStarted)
+    pWheel = Timer->Wheel;
+    if (NULL == pWheel)
+    {
+        // never started
+        return;
+    }
+
+    oldState = CpuIntrDisable();
+    LockAcquire(&pWheel->Lock, &dummyState);
+
+    // only an armed timer will trigger: a stopped timer, a one-shot timer
+    // which already triggered or a periodic timer without a period are not
+    if (Timer->Armed)
+    {
+        InsertTailList(&Timer->WaitingList, &GetCurrentThread()->ReadyList);
+        ThreadTakeBlockLock();
+        LockRelease(&pWheel->Lock, dummyState);
+        ThreadBlock();
+    }
+    else
     {
-        ThreadYield();
+        LockRelease(&pWheel->Lock, dummyState);
     }
+
+    CpuIntrSetState(oldState);
 }
 
 void
@@ -112,4 +315,449 @@ ExTimerCompareTimers(
 )
 {
     return FirstElem->TriggerTimeUs - SecondElem->TriggerTimeUs;
-}
\ No newline at end of file
+}
+
+_No_competing_thread_
+void
+ExTimerCpuInit(
+    OUT     PEX_TIMER_WHEEL Wheel
+    )
+{
+    ASSERT(NULL != Wheel);
+
+    memzero(Wheel, sizeof(EX_TIMER_WHEEL));
+
+    LockInit(&Wheel->Lock);
+
+    Wheel->ProgrammedDeadlineUs = MAX_QWORD;
+
+    for (DWORD level = 0; level < EX_TIMER_WHEEL_LEVELS; ++level)
+    {
+        for (DWORD slot = 0; slot < EX_TIMER_WHEEL_SLOTS; ++slot)
+        {
+            InitializeListHead(&Wheel->Slots[level][slot]);
+        }
+    }
+}
+
+void
+ExTimerTick(
+    void
+    )
+{
+    PEX_TIMER_WHEEL pWheel;
+    INTR_STATE dummyState;
+    QWORD nowUs;
+    LIST_ENTRY threadsToWake;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pWheel = &GetCurrentPcpu()->TimerWheel;
+    nowUs = IomuGetSystemTimeUs();
+
+    InitializeListHead(&threadsToWake);
+
+    LockAcquire(&pWheel->Lock, &dummyState);
+
+    _ExTimerWheelSynchronize(pWheel);
+
+    // the wheel ticks which ended since the last call are emptied, there is no
+    // reason to walk the slots of an empty wheel
+    while (0 != pWheel->NumberOfArmedTimers)
+    {
+        _ExTimerWheelExpireCurrentSlot(pWheel, nowUs, &threadsToWake);
+
+        if (pWheel->CurrentTick >= EX_TIMER_US_TO_WHEEL_TICK(nowUs))
+        {
+            break;
+        }
+
+        _ExTimerWheelAdvance(pWheel);
+    }
+
+    if (0 == pWheel->NumberOfArmedTimers)
+    {
+        pWheel->CurrentTick = max(pWheel->CurrentTick, EX_TIMER_US_TO_WHEEL_TICK(nowUs));
+    }
+
+    _ExTimerWheelProgramDeadline(pWheel);
+
+    LockRelease(&pWheel->Lock, dummyState);
+
+    if (!IsListEmpty(&threadsToWake))
+    {
+        ThreadUnblockList(&threadsToWake);
+
+        // we are on an interrupt, the woken threads may be more important
+        // than the one running on this CPU
+        ThreadRequestPreemptOnInterrupt();
+    }
+}
+
+BOOLEAN
+ExTimerReprogramDeadline(
+    void
+    )
+{
+    PEX_TIMER_WHEEL pWheel;
+    INTR_STATE dummyState;
+    BOOLEAN bRequested;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pWheel = &GetCurrentPcpu()->TimerWheel;
+
+    LockAcquire(&pWheel->Lock, &dummyState);
+    bRequested = pWheel->ReprogramRequested;
+    if (bRequested)
+    {
+        pWheel->ReprogramRequested = FALSE;
+        _ExTimerWheelProgramDeadline(pWheel);
+    }
+    LockRelease(&pWheel->Lock, dummyState);
+
+    return bRequested;
+}
+
+DWORD
+ExTimerGetIdleTicks(
+    IN      DWORD           MaxTicks
+    )
+{
+    PEX_TIMER_WHEEL pWheel;
+    INTR_STATE dummyState;
+    DWORD idleTicks;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+    ASSERT(MaxTicks > 0);
+
+    pWheel = &GetCurrentPcpu()->TimerWheel;
+    idleTicks = MaxTicks;
+
+    LockAcquire(&pWheel->Lock, &dummyState);
+
+    // if the LAPIC timer is armed for the next event it wakes the CPU anyway
+    if (!pWheel->HardwareDeadlines && 0 != pWheel->NumberOfArmedTimers)
+    {
+        QWORD nextEventUs = _ExTimerWheelGetNextEventUs(pWheel);
+        QWORD nowUs = IomuGetSystemTimeUs();
+        DWORD tickUs = IomuGetTimerInterrupTimeUs();
+
+        idleTicks = (nextEventUs > nowUs)
+            ? (DWORD) min((nextEventUs - nowUs + tickUs - 1) / tickUs, MaxTicks)
+            : 1;
+    }
+
+    LockRelease(&pWheel->Lock, dummyState);
+
+    return idleTicks;
+}
+
+static
+void
+_ExTimerWheelSynchronize(
+    INOUT   PEX_TIMER_WHEEL Wheel
+    )
+{
+    ASSERT(NULL != Wheel);
+    ASSERT(LockIsOwner(&Wheel->Lock));
+
+    if (!Wheel->Synchronized)
+    {
+        Wheel->CurrentTick = EX_TIMER_US_TO_WHEEL_TICK(IomuGetSystemTimeUs());
+        Wheel->Synchronized = TRUE;
+    }
+}
+
+static
+void
+_ExTimerWheelInsert(
+    INOUT   PEX_TIMER_WHEEL Wheel,
+    INOUT   PEX_TIMER       Timer
+    )
+{
+    QWORD slotTick;
+    QWORD delta;
+    DWORD level;
+
+    ASSERT(NULL != Wheel);
+    ASSERT(NULL != Timer);
+    ASSERT(LockIsOwner(&Wheel->Lock));
+    ASSERT(!Timer->Armed);
+
+    // a timer whose time has already passed is placed in the current slot
+    slotTick = max(Timer->ExpirationTick, Wheel->CurrentTick);
+    delta = slotTick - Wheel->CurrentTick;
+
+    for (level = 0; level < EX_TIMER_WHEEL_LEVELS - 1; ++level)
+    {
+        if (delta < EX_TIMER_WHEEL_RANGE(level + 1))
+        {
+            break;
+        }
+    }
+
+    if (delta >= EX_TIMER_WHEEL_RANGE(EX_TIMER_WHEEL_LEVELS))
+    {
+        // beyond the range of the wheel: the timer waits in the farthest slot
+        // and it is placed again each time the slot is cascaded
+        slotTick = Wheel->CurrentTick + EX_TIMER_WHEEL_RANGE(EX_TIMER_WHEEL_LEVELS) - 1;
+    }
+
+    InsertTailList(&Wheel->Slots[level][(slotTick >> (EX_TIMER_WHEEL_SLOT_BITS * level)) & EX_TIMER_WHEEL_SLOT_MASK],
+                   &Timer->WheelEntry);
+    Timer->Armed = TRUE;
+    Wheel->NumberOfArmedTimers++;
+}
+
+static
+void
+_ExTimerWheelRemove(
+    INOUT   PEX_TIMER_WHEEL Wheel,
+    INOUT   PEX_TIMER       Timer
+    )
+{
+    ASSERT(NULL != Wheel);
+    ASSERT(NULL != Timer);
+    ASSERT(LockIsOwner(&Wheel->Lock));
+
+    if (Timer->Armed)
+    {
+        RemoveEntryList(&Timer->WheelEntry);
+        Timer->Armed = FALSE;
+
+        ASSERT(Wheel->NumberOfArmedTimers > 0);
+        Wheel->NumberOfArmedTimers--;
+    }
+}
+
+static
+void
+_ExTimerWheelCascade(
+    INOUT   PEX_TIMER_WHEEL Wheel,
+    IN      DWORD           Level
+    )
+{
+    PLIST_ENTRY pSlot;
+    PLIST_ENTRY pEntry;
+    LIST_ENTRY timers;
+
+    ASSERT(NULL != Wheel);
+    ASSERT(0 < Level && Level < EX_TIMER_WHEEL_LEVELS);
+
+    pSlot = &Wheel->Slots[Level][(Wheel->CurrentTick >> (EX_TIMER_WHEEL_SLOT_BITS * Level)) & EX_TIMER_WHEEL_SLOT_MASK];
+
+    InitializeListHead(&timers);
+    for (pEntry = RemoveHeadList(pSlot);
+         pEntry != pSlot;
+         pEntry = RemoveHeadList(pSlot))
+    {
+        InsertTailList(&timers, pEntry);
+    }
+
+    for (pEntry = RemoveHeadList(&timers);
+         pEntry != &timers;
+         pEntry = RemoveHeadList(&timers))
+    {
+        PEX_TIMER pTimer = CONTAINING_RECORD(pEntry, EX_TIMER, WheelEntry);
+
+        // the timer is now close enough to be placed in a lower level
+        pTimer->Armed = FALSE;
+        Wheel->NumberOfArmedTimers--;
+        _ExTimerWheelInsert(Wheel, pTimer);
+    }
+}
+
+static
+void
+_ExTimerWheelAdvance(
+    INOUT   PEX_TIMER_WHEEL Wheel
+    )
+{
+    ASSERT(NULL != Wheel);
+
+    Wheel->CurrentTick++;
+
+    // each time a level wraps around the next slot of the level above is
+    // distributed over it
+    for (DWORD level = 1; level < EX_TIMER_WHEEL_LEVELS; ++level)
+    {
+        if (0 != ((Wheel->CurrentTick >> (EX_TIMER_WHEEL_SLOT_BITS * (level - 1))) & EX_TIMER_WHEEL_SLOT_MASK))
+        {
+            break;
+        }
+
+        _ExTimerWheelCascade(Wheel, level);
+    }
+}
+
+static
+void
+_ExTimerWheelExpireCurrentSlot(
+    INOUT   PEX_TIMER_WHEEL Wheel,
+    IN      QWORD           NowUs,
+    INOUT   PLIST_ENTRY     ThreadsToWake
+    )
+{
+    PLIST_ENTRY pSlot;
+    PLIST_ENTRY pEntry;
+    LIST_ENTRY timers;
+
+    ASSERT(NULL != Wheel);
+    ASSERT(NULL != ThreadsToWake);
+
+    pSlot = &Wheel->Slots[0][Wheel->CurrentTick & EX_TIMER_WHEEL_SLOT_MASK];
+
+    // the periodic timers may be re-armed in the same slot
+    InitializeListHead(&timers);
+    for (pEntry = RemoveHeadList(pSlot);
+         pEntry != pSlot;
+         pEntry = RemoveHeadList(pSlot))
+    {
+        InsertTailList(&timers, pEntry);
+    }
+
+    for (pEntry = RemoveHeadList(&timers);
+         pEntry != &timers;
+         pEntry = RemoveHeadList(&timers))
+    {
+        PEX_TIMER pTimer = CONTAINING_RECORD(pEntry, EX_TIMER, WheelEntry);
+
+        if (pTimer->TriggerTimeUs > NowUs)
+        {
+            // only possible for the wheel tick which is still in progress
+            InsertTailList(pSlot, pEntry);
+            continue;
+        }
+
+        pTimer->Armed = FALSE;
+        Wheel->NumberOfArmedTimers--;
+
+        _ExTimerTrigger(pTimer, ThreadsToWake);
+
+        if (ExTimerTypeRelativePeriodic == pTimer->Type)
+        {
+            pTimer->TriggerTimeUs += pTimer->ReloadTimeUs;
+            if (pTimer->TriggerTimeUs <= NowUs)
+            {
+                // the periods which were missed are skipped
+                pTimer->TriggerTimeUs += ((NowUs - pTimer->TriggerTimeUs) / pTimer->ReloadTimeUs + 1) * pTimer->ReloadTimeUs;
+            }
+
+            pTimer->ExpirationTick = EX_TIMER_US_TO_WHEEL_TICK(pTimer->TriggerTimeUs);
+            _ExTimerWheelInsert(Wheel, pTimer);
+        }
+    }
+}
+
+static
+QWORD
+_ExTimerWheelGetNextEventUs(
+    IN      PEX_TIMER_WHEEL Wheel
+    )
+{
+    ASSERT(NULL != Wheel);
+    ASSERT(LockIsOwner(&Wheel->Lock));
+
+    if (0 == Wheel->NumberOfArmedTimers)
+    {
+        return MAX_QWORD;
+    }
+
+    // the first level covers the next EX_TIMER_WHEEL_SLOTS wheel ticks, the
+    // search stops at the first slot which holds timers or at the first slot
+    // in which timers of the upper levels are cascaded
+    for (DWORD i = 0; i < EX_TIMER_WHEEL_SLOTS; ++i)
+    {
+        QWORD tick = Wheel->CurrentTick + i;
+        PLIST_ENTRY pSlot = &Wheel->Slots[0][tick & EX_TIMER_WHEEL_SLOT_MASK];
+        QWORD nextEventUs;
+
+        if (0 != i && 0 == (tick & EX_TIMER_WHEEL_SLOT_MASK))
+        {
+            return tick * EX_TIMER_WHEEL_TICK_US;
+        }
+
+        nextEventUs = MAX_QWORD;
+        for (PLIST_ENTRY pEntry = pSlot->Flink; pEntry != pSlot; pEntry = pEntry->Flink)
+        {
+            PEX_TIMER pTimer = CONTAINING_RECORD(pEntry, EX_TIMER, WheelEntry);
+
+            nextEventUs = min(nextEventUs, pTimer->TriggerTimeUs);
+        }
+
+        if (MAX_QWORD != nextEventUs)
+        {
+            return nextEventUs;
+        }
+    }
+
+    return (Wheel->CurrentTick + EX_TIMER_WHEEL_SLOTS) * EX_TIMER_WHEEL_TICK_US;
+}
+
+static
+void
+_ExTimerWheelProgramDeadline(
+    INOUT   PEX_TIMER_WHEEL Wheel
+    )
+{
+    QWORD deadlineUs;
+
+    ASSERT(NULL != Wheel);
+    ASSERT(LockIsOwner(&Wheel->Lock));
+    ASSERT(Wheel == &GetCurrentPcpu()->TimerWheel);
+
+    // the LAPIC deadlines are given in TSC time, if it is not the system time
+    // the interrupt could come before the system time reaches the deadline
+    deadlineUs = TscClockIsReliable() ? _ExTimerWheelGetNextEventUs(Wheel) : MAX_QWORD;
+
+    Wheel->HardwareDeadlines = LapicSystemSetTimerDeadline(MAX_QWORD != deadlineUs ? deadlineUs * US_IN_NS : MAX_QWORD)
+                               && MAX_QWORD != deadlineUs;
+    Wheel->ProgrammedDeadlineUs = Wheel->HardwareDeadlines ? deadlineUs : MAX_QWORD;
+}
+
+static
+void
+_ExTimerMoveWaiters(
+    INOUT   PEX_TIMER       Timer,
+    INOUT   PLIST_ENTRY     ThreadsToWake
+    )
+{
+    PLIST_ENTRY pEntry;
+
+    ASSERT(NULL != Timer);
+    ASSERT(NULL != ThreadsToWake);
+
+    // the threads are woken up after the wheel lock is released so the ready
+    // queues are not accessed with it held
+    for (pEntry = RemoveHeadList(&Timer->WaitingList);
+         pEntry != &Timer->WaitingList;
+         pEntry = RemoveHeadList(&Timer->WaitingList))
+    {
+        InsertTailList(ThreadsToWake, pEntry);
+    }
+}
+
+static
+void
+_ExTimerTrigger(
+    INOUT   PEX_TIMER       Timer,
+    INOUT   PLIST_ENTRY     ThreadsToWake
+    )
+{
+    ASSERT(NULL != Timer);
+    ASSERT(NULL != ThreadsToWake);
+
+    Timer->TriggerCount++;
+    _ExTimerMoveWaiters(Timer, ThreadsToWake);
+
+    if (NULL != Timer->Callback)
+    {
+        PTHREAD pThread = Timer->Callback(Timer->CallbackContext);
+
+        if (NULL != pThread)
+        {
+            InsertTailList(ThreadsToWake, &pThread->ReadyList);
+        }
+    }
+}
@@ -0,0 +1,544 @@
+#include "HAL9000.h"
+#include "ex_work_queue.h"
+#include "ex_timer.h"
+#include "cpumu.h"
+#include "smp.h"
+#include "thread_internal.h"
+
+typedef struct _EX_WORKER
+{
+    // Link in the Workers list of the pool
+    LIST_ENTRY              ListEntry;
+
+    PPCPU                   Cpu;
+    PTHREAD                 Thread;
+
+    // TRUE while the worker runs a work item
+    volatile BOOLEAN        Busy;
+} EX_WORKER, *PEX_WORKER;
+
+typedef struct _EX_WORK_QUEUE_DATA
+{
+    // Signaled by the submitters which found no idle worker
+    EX_EVENT                ManagerEvent;
+    volatile BOOLEAN        ManagerStarted;
+} EX_WORK_QUEUE_DATA, *PEX_WORK_QUEUE_DATA;
+
+static EX_WORK_QUEUE_DATA m_exWorkQueueData;
+
+static const THREAD_PRIORITY WORK_PRIORITY_TO_THREAD_PRIORITY[ExWorkPriorityReserved] = { ThreadPriorityMaximum,
+                                                                                          ThreadPriorityDefault,
+                                                                                          ThreadPriorityLowest };
+
+static FUNC_ThreadStart     _ExWorkerThread;
+static FUNC_ThreadStart     _ExWorkQueueManagerThread;
+
+static
+STATUS
+_ExWorkQueueCreateWorker(
+    INOUT   PPCPU                   Cpu
+    );
+
+static
+PEX_WORK_ITEM
+_ExWorkPoolWaitForItem(
+    INOUT   PEX_WORK_POOL           Pool
+    );
+
+static
+BOOLEAN
+_ExWorkPoolHasSubmittedItems(
+    IN      PEX_WORK_POOL           Pool
+    );
+
+static
+void
+_ExWorkPoolWakeWorker(
+    INOUT   PEX_WORK_POOL           Pool
+    );
+
+static
+BOOLEAN
+_ExWorkQueueCheckPool(
+    INOUT   PPCPU                   Cpu
+    );
+
+_No_competing_thread_
+void
+ExWorkPoolCpuInit(
+    OUT     PEX_WORK_POOL           Pool
+    )
+{
+    ASSERT(NULL != Pool);
+
+    memzero(Pool, sizeof(EX_WORK_POOL));
+
+    LockInit(&Pool->Lock);
+
+    for (DWORD i = 0; i < ExWorkPriorityReserved; ++i)
+    {
+        InitializeListHead(&Pool->Pending[i]);
+    }
+    InitializeListHead(&Pool->IdleWorkers);
+    InitializeListHead(&Pool->Workers);
+}
+
+STATUS
+ExWorkQueueSystemInit(
+    void
+    )
+{
+    STATUS status;
+    PTHREAD pThread;
+
+    status = ExEventInit(&m_exWorkQueueData.ManagerEvent, ExEventTypeSynchronization, FALSE);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ExEventInit", status);
+        return status;
+    }
+
+    status = ThreadCreate("workq-manager",
+                          ThreadPriorityMaximum,
+                          _ExWorkQueueManagerThread,
+                          NULL,
+                          &pThread
+                          );
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadCreate", status);
+        return status;
+    }
+
+    ThreadCloseHandle(pThread);
+    pThread = NULL;
+
+    // the event may be signaled only after it was initialized
+    _WriteBarrier();
+    m_exWorkQueueData.ManagerStarted = TRUE;
+
+    return status;
+}
+
+STATUS
+ExWorkQueueCpuStart(
+    void
+    )
+{
+    PPCPU pCpu;
+    INTR_STATE oldState;
+
+    oldState = CpuIntrDisable();
+    pCpu = GetCurrentPcpu();
+    CpuIntrSetState(oldState);
+
+    ASSERT(NULL != pCpu);
+
+    return _ExWorkQueueCreateWorker(pCpu);
+}
+
+void
+ExWorkItemInit(
+    OUT     PEX_WORK_ITEM           WorkItem,
+    IN      PFUNC_WorkRoutine       Routine,
+    IN_OPT  PVOID                   Context,
+    IN      EX_WORK_PRIORITY        Priority
+    )
+{
+    ASSERT(NULL != WorkItem);
+    ASSERT(NULL != Routine);
+    ASSERT(Priority < ExWorkPriorityReserved);
+
+    memzero(WorkItem, sizeof(EX_WORK_ITEM));
+
+    WorkItem->Routine = Routine;
+    WorkItem->Context = Context;
+    WorkItem->Priority = Priority;
+}
+
+BOOLEAN
+ExWorkQueueSubmit(
+    INOUT   PEX_WORK_ITEM           WorkItem
+    )
+{
+    PEX_WORK_POOL pPool;
+    PEX_WORK_ITEM pHead;
+    INTR_STATE oldState;
+
+    ASSERT(NULL != WorkItem);
+    ASSERT(WorkItem->Priority < ExWorkPriorityReserved);
+
+    if (_InterlockedCompareExchange8((volatile char*) &WorkItem->Queued, TRUE, FALSE))
+    {
+        return FALSE;
+    }
+
+    // if we are moved to another CPU after this point the item simply runs
+    // on the CPU where we were
+    oldState = CpuIntrDisable();
+    pPool = &GetCurrentPcpu()->WorkPool;
+    CpuIntrSetState(oldState);
+
+    // the workers detach the whole stack at once => no ABA problem
+    do
+    {
+        pHead = pPool->Submitted[WorkItem->Priority];
+        WorkItem->Next = pHead;
+    } while (_InterlockedCompareExchangePointer((PVOID volatile*) &pPool->Submitted[WorkItem->Priority],
+                                                WorkItem,
+                                                pHead) != pHead);
+
+    _InterlockedIncrement64((volatile __int64*) &pPool->ItemsSubmitted);
+
+    // the exchange above is a full barrier, a worker which goes idle after we
+    // read the counter will see the item
+    if (0 != pPool->NumberOfIdleWorkers)
+    {
+        _ExWorkPoolWakeWorker(pPool);
+    }
+    else if (m_exWorkQueueData.ManagerStarted &&
+             !_InterlockedExchange8((volatile char*) &pPool->ManagerNotified, TRUE))
+    {
+        // all the workers are busy, some of them may be blocked
+        ExEventSignal(&m_exWorkQueueData.ManagerEvent);
+    }
+
+    return TRUE;
+}
+
+static
+STATUS
+_ExWorkQueueCreateWorker(
+    INOUT   PPCPU                   Cpu
+    )
+{
+    STATUS status;
+    PEX_WORKER pWorker;
+    INTR_STATE oldState;
+    char threadName[MAX_PATH];
+
+    ASSERT(NULL != Cpu);
+
+    pWorker = ExAllocatePoolWithTag(PoolAllocateZeroMemory, sizeof(EX_WORKER), HEAP_THREAD_TAG, 0);
+    if (NULL == pWorker)
+    {
+        LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", sizeof(EX_WORKER));
+        return STATUS_HEAP_NO_MORE_MEMORY;
+    }
+
+    pWorker->Cpu = Cpu;
+
+    snprintf(threadName, MAX_PATH, "worker-%02x-%u", Cpu->ApicId, Cpu->WorkPool.NumberOfWorkers);
+
+    status = ThreadCreate(threadName,
+                          ThreadPriorityDefault,
+                          _ExWorkerThread,
+                          pWorker,
+                          &pWorker->Thread
+                          );
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadCreate", status);
+        ExFreePoolWithTag(pWorker, HEAP_THREAD_TAG);
+        return status;
+    }
+
+    // the reference to the thread is kept for the lifetime of the system
+    LockAcquire(&Cpu->WorkPool.Lock, &oldState);
+    InsertTailList(&Cpu->WorkPool.Workers, &pWorker->ListEntry);
+    Cpu->WorkPool.NumberOfWorkers++;
+    LockRelease(&Cpu->WorkPool.Lock, oldState);
+
+    LOG_TRACE_THREAD("Created worker %u for CPU 0x%02x\n", Cpu->WorkPool.NumberOfWorkers, Cpu->ApicId);
+
+    return status;
+}
+
+static
+STATUS
+(__cdecl _ExWorkerThread)(
+    IN_OPT      PVOID       Context
+    )
+{
+    STATUS status;
+    PEX_WORKER pWorker;
+    PEX_WORK_POOL pPool;
+
+    ASSERT(NULL != Context);
+
+    pWorker = (PEX_WORKER) Context;
+    pPool = &pWorker->Cpu->WorkPool;
+
+    // the workers serve only the pool of their CPU
+    status = ThreadSetAffinity(NULL, pWorker->Cpu->LogicalApicId);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadSetAffinity", status);
+        return status;
+    }
+
+    // warning C4127: conditional expression is constant
+#pragma warning(suppress:4127)
+    while (TRUE)
+    {
+        PEX_WORK_ITEM pItem;
+        PFUNC_WorkRoutine pRoutine;
+        PVOID pContext;
+
+        pItem = _ExWorkPoolWaitForItem(pPool);
+
+        pRoutine = pItem->Routine;
+        pContext = pItem->Context;
+
+        ThreadSetPriority(WORK_PRIORITY_TO_THREAD_PRIORITY[pItem->Priority]);
+
+        pWorker->Busy = TRUE;
+
+        // from now on the item may be freed or submitted again
+        _InterlockedExchange8((volatile char*) &pItem->Queued, FALSE);
+        pItem = NULL;
+
+        pRoutine(pContext);
+
+        pWorker->Busy = FALSE;
+
+        _InterlockedIncrement64((volatile __int64*) &pPool->ItemsExecuted);
+    }
+
+    NOT_REACHED;
+}
+
+static
+PEX_WORK_ITEM
+_ExWorkPoolWaitForItem(
+    INOUT   PEX_WORK_POOL           Pool
+    )
+{
+    INTR_STATE oldState;
+    INTR_STATE dummyState;
+
+    ASSERT(NULL != Pool);
+
+    // warning C4127: conditional expression is constant
+#pragma warning(suppress:4127)
+    while (TRUE)
+    {
+        oldState = CpuIntrDisable();
+        LockAcquire(&Pool->Lock, &dummyState);
+
+        for (DWORD i = 0; i < ExWorkPriorityReserved; ++i)
+        {
+            PEX_WORK_ITEM pStack;
+            PLIST_ENTRY pLastPending;
+
+            pStack = _InterlockedExchangePointer((PVOID volatile*) &Pool->Submitted[i], NULL);
+
+            // the stack holds the newest item first, inserting each of them
+            // after the same entry restores the submission order
+            pLastPending = Pool->Pending[i].Blink;
+            for (PEX_WORK_ITEM pItem = pStack; NULL != pItem; pItem = pItem->Next)
+            {
+                InsertHeadList(pLastPending, &pItem->ListEntry);
+            }
+
+            if (!IsListEmpty(&Pool->Pending[i]))
+            {
+                PLIST_ENTRY pEntry = RemoveHeadList(&Pool->Pending[i]);
+
+                LockRelease(&Pool->Lock, dummyState);
+                CpuIntrSetState(oldState);
+
+                return CONTAINING_RECORD(pEntry, EX_WORK_ITEM, ListEntry);
+            }
+        }
+
+        // the exchange is a full barrier, a submitter which pushes an item
+        // after we checked the stacks will see us idle and wake us
+        _InterlockedIncrement((volatile long*) &Pool->NumberOfIdleWorkers);
+        if (_ExWorkPoolHasSubmittedItems(Pool))
+        {
+            _InterlockedDecrement((volatile long*) &Pool->NumberOfIdleWorkers);
+
+            LockRelease(&Pool->Lock, dummyState);
+            CpuIntrSetState(oldState);
+            continue;
+        }
+
+        InsertTailList(&Pool->IdleWorkers, &GetCurrentThread()->ReadyList);
+        ThreadTakeBlockLock();
+        LockRelease(&Pool->Lock, dummyState);
+        ThreadBlock();
+
+        CpuIntrSetState(oldState);
+    }
+
+    NOT_REACHED;
+}
+
+static
+BOOLEAN
+_ExWorkPoolHasSubmittedItems(
+    IN      PEX_WORK_POOL           Pool
+    )
+{
+    ASSERT(NULL != Pool);
+
+    for (DWORD i = 0; i < ExWorkPriorityReserved; ++i)
+    {
+        if (NULL != Pool->Submitted[i])
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static
+void
+_ExWorkPoolWakeWorker(
+    INOUT   PEX_WORK_POOL           Pool
+    )
+{
+    INTR_STATE oldState;
+    PTHREAD pThread;
+
+    ASSERT(NULL != Pool);
+
+    pThread = NULL;
+
+    LockAcquire(&Pool->Lock, &oldState);
+    if (!IsListEmpty(&Pool->IdleWorkers))
+    {
+        pThread = CONTAINING_RECORD(RemoveHeadList(&Pool->IdleWorkers), THREAD, ReadyList);
+        _InterlockedDecrement((volatile long*) &Pool->NumberOfIdleWorkers);
+    }
+    LockRelease(&Pool->Lock, oldState);
+
+    if (NULL != pThread)
+    {
+        ThreadUnblock(pThread);
+    }
+}
+
+static
+STATUS
+(__cdecl _ExWorkQueueManagerThread)(
+    IN_OPT      PVOID       Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    // warning C4127: conditional expression is constant
+#pragma warning(suppress:4127)
+    while (TRUE)
+    {
+        PLIST_ENTRY pCpuListHead;
+        PLIST_ENTRY pCurEntry;
+        BOOLEAN bCheckAgain;
+
+        bCheckAgain = FALSE;
+        pCpuListHead = NULL;
+
+        SmpGetCpuList(&pCpuListHead);
+
+        for (pCurEntry = pCpuListHead->Flink;
+             pCurEntry != pCpuListHead;
+             pCurEntry = pCurEntry->Flink)
+        {
+            PPCPU pCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+
+            bCheckAgain = _ExWorkQueueCheckPool(pCpu) || bCheckAgain;
+        }
+
+        if (bCheckAgain)
+        {
+            EX_TIMER timer;
+            STATUS status;
+
+            // the busy workers may still block, the pools are watched until
+            // they have an idle worker again
+            status = ExTimerInit(&timer, ExTimerTypeRelativeOnce, EX_WORK_QUEUE_STALL_CHECK_US);
+            if (!SUCCEEDED(status))
+            {
+                LOG_FUNC_ERROR("ExTimerInit", status);
+                continue;
+            }
+
+            ExTimerStart(&timer);
+            ExTimerWait(&timer);
+            ExTimerUninit(&timer);
+        }
+        else
+        {
+            ExEventWaitForSignal(&m_exWorkQueueData.ManagerEvent);
+        }
+    }
+
+    NOT_REACHED;
+}
+
+static
+BOOLEAN
+_ExWorkQueueCheckPool(
+    INOUT   PPCPU                   Cpu
+    )
+{
+    PEX_WORK_POOL pPool;
+    INTR_STATE oldState;
+    BOOLEAN bStalled;
+
+    ASSERT(NULL != Cpu);
+
+    pPool = &Cpu->WorkPool;
+
+    // the submitters which come after this point notify us again
+    _InterlockedExchange8((volatile char*) &pPool->ManagerNotified, FALSE);
+
+    LockAcquire(&pPool->Lock, &oldState);
+
+    // a CPU which was not yet started has no workers
+    if (0 == pPool->NumberOfWorkers || 0 != pPool->NumberOfIdleWorkers)
+    {
+        LockRelease(&pPool->Lock, oldState);
+        return FALSE;
+    }
+
+    bStalled = _ExWorkPoolHasSubmittedItems(pPool);
+    for (DWORD i = 0; i < ExWorkPriorityReserved; ++i)
+    {
+        bStalled = bStalled || !IsListEmpty(&pPool->Pending[i]);
+    }
+
+    if (!bStalled)
+    {
+        LockRelease(&pPool->Lock, oldState);
+        return FALSE;
+    }
+
+    // a worker which is running, ready or just started will pick up the
+    // items, the states are only a hint: they change as we read them
+    for (PLIST_ENTRY pEntry = pPool->Workers.Flink;
+         pEntry != &pPool->Workers;
+         pEntry = pEntry->Flink)
+    {
+        PEX_WORKER pWorker = CONTAINING_RECORD(pEntry, EX_WORKER, ListEntry);
+
+        if (!pWorker->Busy || ThreadStateBlocked != pWorker->Thread->State)
+        {
+            bStalled = FALSE;
+            break;
+        }
+    }
+
+    bStalled = bStalled && pPool->NumberOfWorkers < EX_WORK_QUEUE_MAX_WORKERS_PER_CPU;
+
+    LockRelease(&pPool->Lock, oldState);
+
+    if (bStalled)
+    {
+        _ExWorkQueueCreateWorker(Cpu);
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,370 @@
+#include "HAL9000.h"
+#include "futex.h"
+#include "thread_internal.h"
+#include "process_internal.h"
+#include "mmu.h"
+#include "iomu.h"
+#include "ex_timer.h"
+
+// Must be a power of 2
+#define FUTEX_HASH_BUCKETS          64
+
+typedef struct _FUTEX_BUCKET
+{
+    LOCK                Lock;
+
+    _Guarded_by_(Lock)
+    LIST_ENTRY          Waiters;
+} FUTEX_BUCKET, *PFUTEX_BUCKET;
+
+typedef struct _FUTEX_WAITER
+{
+    LIST_ENTRY          ListEntry;
+
+    // Physical address of the futex the thread waits on
+    PHYSICAL_ADDRESS    Key;
+
+    PTHREAD             Thread;
+
+    PFUTEX_BUCKET       Bucket;
+
+    // The fields below are protected by the bucket lock
+
+    // TRUE while the waiter is linked in the bucket
+    BOOLEAN             Queued;
+
+    BOOLEAN             Woken;
+    BOOLEAN             TimedOut;
+} FUTEX_WAITER, *PFUTEX_WAITER;
+
+typedef struct _FUTEX_DATA
+{
+    FUTEX_BUCKET        Buckets[FUTEX_HASH_BUCKETS];
+} FUTEX_DATA, *PFUTEX_DATA;
+
+static FUTEX_DATA m_futexData;
+
+static
+STATUS
+_FutexGetKey(
+    IN          PVOID               Address,
+    OUT         PHYSICAL_ADDRESS*   Key
+    );
+
+static FUNC_ExTimerCallback     _FutexWaitTimedOut;
+
+__forceinline
+static
+PFUTEX_BUCKET
+_FutexGetBucket(
+    IN          PHYSICAL_ADDRESS    Key
+    )
+{
+    QWORD key = (QWORD) Key;
+
+    // futexes are DWORD aligned and usually placed at the same page offsets
+    return &m_futexData.Buckets[((key >> 2) ^ (key / PAGE_SIZE)) & (FUTEX_HASH_BUCKETS - 1)];
+}
+
+void
+FutexSystemPreinit(
+    void
+    )
+{
+    DWORD i;
+
+    memzero(&m_futexData, sizeof(FUTEX_DATA));
+
+    for (i = 0; i < FUTEX_HASH_BUCKETS; ++i)
+    {
+        LockInit(&m_futexData.Buckets[i].Lock);
+        InitializeListHead(&m_futexData.Buckets[i].Waiters);
+    }
+}
+
+STATUS
+FutexWait(
+    IN          PVOID           Address,
+    IN          DWORD           ExpectedValue,
+    IN          QWORD           TimeoutUs
+    )
+{
+    STATUS status;
+    PHYSICAL_ADDRESS key;
+    PFUTEX_BUCKET pBucket;
+    FUTEX_WAITER waiter;
+    EX_TIMER timer;
+    BOOLEAN bTimed;
+    INTR_STATE dummyState;
+    INTR_STATE oldState;
+    volatile DWORD* pValue;
+
+    status = _FutexGetKey(Address, &key);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("_FutexGetKey", status);
+        return status;
+    }
+
+    // the value is read through a kernel mapping of the frame: the user
+    // mapping could fault while we hold the bucket lock with interrupts
+    // disabled
+    status = MmuGetSystemVirtualAddressForUserBuffer(Address,
+                                                     sizeof(DWORD),
+                                                     PAGE_RIGHTS_READ,
+                                                     GetCurrentProcess(),
+                                                     (PVOID*) &pValue);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("MmuGetSystemVirtualAddressForUserBuffer", status);
+        return status;
+    }
+
+    pBucket = _FutexGetBucket(key);
+
+    memzero(&waiter, sizeof(FUTEX_WAITER));
+    waiter.Key = key;
+    waiter.Thread = GetCurrentThread();
+    waiter.Bucket = pBucket;
+
+    bTimed = FALSE;
+
+    __try
+    {
+        // no need to take the lock if the value already changed
+        if (*pValue != ExpectedValue)
+        {
+            status = STATUS_UNSUCCESSFUL;
+            __leave;
+        }
+
+        if (0 == TimeoutUs)
+        {
+            status = STATUS_JOB_INTERRUPTED;
+            __leave;
+        }
+
+        if (FUTEX_WAIT_INFINITE != TimeoutUs)
+        {
+            // the timer is started before we take the bucket lock: if it
+            // triggers before we are queued the waiter is only marked as timed
+            // out and we do not block at all
+            status = ExTimerInit(&timer, ExTimerTypeRelativeOnce, TimeoutUs);
+            if (!SUCCEEDED(status))
+            {
+                LOG_FUNC_ERROR("ExTimerInit", status);
+                __leave;
+            }
+            bTimed = TRUE;
+
+            ExTimerSetCallback(&timer, _FutexWaitTimedOut, &waiter);
+            ExTimerStart(&timer);
+        }
+
+        oldState = CpuIntrDisable();
+
+        LockAcquire(&pBucket->Lock, &dummyState);
+
+        // the value is checked again with the bucket lock held, a FutexWake
+        // issued after the value was changed will find us in the wait queue
+        if (*pValue != ExpectedValue)
+        {
+            LockRelease(&pBucket->Lock, dummyState);
+            CpuIntrSetState(oldState);
+
+            status = STATUS_UNSUCCESSFUL;
+            __leave;
+        }
+
+        ThreadTakeBlockLock();
+
+        // a thread which is terminated exits from ThreadBlock, it would
+        // leave the waiter on its stack in the wait queue
+        if (waiter.TimedOut || ThreadIsTerminatePending())
+        {
+            LockRelease(&waiter.Thread->BlockLock, INTR_OFF);
+            LockRelease(&pBucket->Lock, dummyState);
+            CpuIntrSetState(oldState);
+
+            status = STATUS_JOB_INTERRUPTED;
+            __leave;
+        }
+
+        InsertTailList(&pBucket->Waiters, &waiter.ListEntry);
+        waiter.Queued = TRUE;
+
+        LockRelease(&pBucket->Lock, dummyState);
+
+        // we are unblocked either by FutexWake or by the timer, both remove
+        // the waiter from the bucket before waking us
+        ThreadBlock();
+
+        CpuIntrSetState(oldState);
+
+        ASSERT(!waiter.Queued);
+        ASSERT(waiter.Woken != waiter.TimedOut);
+
+        status = waiter.Woken ? STATUS_SUCCESS : STATUS_JOB_INTERRUPTED;
+    }
+    __finally
+    {
+        if (bTimed)
+        {
+            // waits for the timer routine if it is still running on another
+            // CPU, the waiter must stay valid until then
+            ExTimerUninit(&timer);
+        }
+
+        MmuFreeSystemVirtualAddressForUserBuffer((PVOID) pValue);
+    }
+
+    return status;
+}
+
+STATUS
+FutexWake(
+    IN          PVOID           Address,
+    IN          DWORD           NumberOfThreads,
+    OUT_OPT     DWORD*          ThreadsWoken
+    )
+{
+    STATUS status;
+    PHYSICAL_ADDRESS key;
+    PFUTEX_BUCKET pBucket;
+    INTR_STATE oldState;
+    PLIST_ENTRY pEntry;
+    PLIST_ENTRY pNextEntry;
+    LIST_ENTRY threadsToWake;
+    DWORD threadsWoken;
+
+    status = _FutexGetKey(Address, &key);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("_FutexGetKey", status);
+        return status;
+    }
+
+    pBucket = _FutexGetBucket(key);
+    threadsWoken = 0;
+
+    InitializeListHead(&threadsToWake);
+
+    LockAcquire(&pBucket->Lock, &oldState);
+
+    for (pEntry = pBucket->Waiters.Flink;
+         pEntry != &pBucket->Waiters && threadsWoken < NumberOfThreads;
+         pEntry = pNextEntry)
+    {
+        PFUTEX_WAITER pWaiter = CONTAINING_RECORD(pEntry, FUTEX_WAITER, ListEntry);
+
+        pNextEntry = pEntry->Flink;
+
+        if (pWaiter->Key != key)
+        {
+            continue;
+        }
+
+        RemoveEntryList(&pWaiter->ListEntry);
+        pWaiter->Queued = FALSE;
+        pWaiter->Woken = TRUE;
+
+        // the waiter structure lives on the stack of the thread, it must not
+        // be accessed once the thread is unblocked
+        InsertTailList(&threadsToWake, &pWaiter->Thread->ReadyList);
+        threadsWoken++;
+    }
+
+    LockRelease(&pBucket->Lock, oldState);
+
+    if (!IsListEmpty(&threadsToWake))
+    {
+        ThreadUnblockList(&threadsToWake);
+    }
+
+    if (NULL != ThreadsWoken)
+    {
+        *ThreadsWoken = threadsWoken;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_FutexGetKey(
+    IN          PVOID               Address,
+    OUT         PHYSICAL_ADDRESS*   Key
+    )
+{
+    STATUS status;
+    PPROCESS pProcess;
+    PHYSICAL_ADDRESS pa;
+
+    ASSERT(NULL != Key);
+
+    if (!IsAddressAligned(Address, sizeof(DWORD)))
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    pProcess = GetCurrentProcess();
+
+    status = MmuIsBufferValid(Address, sizeof(DWORD), PAGE_RIGHTS_READ, pProcess);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("MmuIsBufferValid", status);
+        return status;
+    }
+
+    // the page may not be mapped yet, touch it so it has a frame we can use
+    // as the key
+    (void) *((volatile DWORD*) Address);
+
+    pa = MmuGetPhysicalAddressEx(Address, pProcess->PagingData, NULL);
+    if (NULL == pa)
+    {
+        return STATUS_MEMORY_CANNOT_BE_MAPPED;
+    }
+
+    *Key = pa;
+
+    return STATUS_SUCCESS;
+}
+
+static
+PTHREAD
+(__cdecl _FutexWaitTimedOut)(
+    IN_OPT      PVOID       Context
+    )
+{
+    PFUTEX_WAITER pWaiter;
+    PTHREAD pThreadToWake;
+    INTR_STATE dummyState;
+
+    ASSERT(NULL != Context);
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pWaiter = (PFUTEX_WAITER) Context;
+    pThreadToWake = NULL;
+
+    LockAcquire(&pWaiter->Bucket->Lock, &dummyState);
+
+    // FutexWake may have been faster, else the waiter is unlinked here so
+    // no node of a returned FutexWait is left in the bucket
+    if (!pWaiter->Woken)
+    {
+        pWaiter->TimedOut = TRUE;
+
+        if (pWaiter->Queued)
+        {
+            RemoveEntryList(&pWaiter->ListEntry);
+            pWaiter->Queued = FALSE;
+
+            pThreadToWake = pWaiter->Thread;
+        }
+    }
+
+    LockRelease(&pWaiter->Bucket->Lock, dummyState);
+
+    return pThreadToWake;
+}
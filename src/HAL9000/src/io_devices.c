@@ -88,7 +88,9 @@ IoCreateDevice(
 
         pDevice->StackSize = 1;
 
-        MutexInit(&pDevice->DeviceLock, FALSE);
+        // every dispatch takes the device lock for a short time => spinning
+        // is cheaper than blocking and barging prevents lock convoys
+        MutexInitEx(&pDevice->DeviceLock, FALSE, MUTEX_FLAG_ADAPTIVE_SPIN | MUTEX_FLAG_BARGING);
 
         // insert device into list
         /// TODO: need to lock
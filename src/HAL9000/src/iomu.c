@@ -18,12 +18,15 @@
 #include "os_info.h"
 #include "eth_82574L.h"
 #include "system_driver.h"
+#include "ex_rwlock.h"
+#include "rcu.h"
 #include "ioapic_system.h"
 #include "bitmap.h"
 #include "pit.h"
 #include "smp.h"
-#include "ex_system.h"
 #include "lock_common.h"
+#include "tsc_clock.h"
+#include "cpumu.h"
 
 #define PIC_MASTER_OFFSET                   0x20
 #define PIC_SLAVE_OFFSET                    0x28
@@ -73,6 +76,10 @@ typedef struct _IOMU_DATA
 
     LIST_ENTRY                  DriverList;
 
+    // The VPB list is read on every path lookup and seldom modified
+    EX_RWLOCK                   VpbLock;
+
+    _Guarded_by_(VpbLock)
     LIST_ENTRY                  VpbList;
 
     UPTIME                      SystemUptime;
@@ -82,7 +89,6 @@ typedef struct _IOMU_DATA
     PFILE_OBJECT                SwapFile;
 
     DWORD                       TimerInterruptTimeUs;
-    DWORD                       TimeUpdatePerCpuUs;
     WORD                        PitInitialTickCount;
 
     char                        SystemDrive[4];
@@ -149,7 +155,7 @@ _IomuUpdateSystemTime(
     void
     )
 {
-    _InterlockedExchangeAdd( &m_iomuData.SystemUptime.UptimeMicroseconds, m_iomuData.TimeUpdatePerCpuUs );
+    _InterlockedExchangeAdd( &m_iomuData.SystemUptime.UptimeMicroseconds, m_iomuData.TimerInterruptTimeUs );
 }
 
 static
@@ -221,12 +227,12 @@ IomuPreinitSystem(
     memzero(&m_iomuData, sizeof(IOMU_DATA));
 
     m_iomuData.TimerInterruptTimeUs = SCHEDULER_TIMER_INTERRUPT_TIME_US;
-    m_iomuData.TimeUpdatePerCpuUs = SCHEDULER_TIMER_INTERRUPT_TIME_US;
 
     InitializeListHead(&m_iomuData.PciDeviceList);
     InitializeListHead(&m_iomuData.PciBridgeList);
     InitializeListHead(&m_iomuData.DriverList);
     InitializeListHead(&m_iomuData.VpbList);
+    ExRwLockInit(&m_iomuData.VpbLock);
 
     for (i = 0; i < NO_OF_USABLE_INTERRUPTS; ++i)
     {
@@ -312,6 +318,8 @@ IomuInitSystem(
 
     LOGL("TSC frequency: 0x%X\n", m_iomuData.TscFrequency );
 
+    TscClockInit(m_iomuData.TscFrequency, CpuMuIsInvariantTscSupported());
+
     status = _IomuSetupPit(m_iomuData.TimerInterruptTimeUs,
                            &m_iomuData.PitInitialTickCount);
     if (!SUCCEEDED(status))
@@ -339,15 +347,10 @@ IomuInitSystemAfterApWakeup(
     void
     )
 {
-    DWORD noOfActiveCpus;
     STATUS status;
 
-    noOfActiveCpus = SmpGetNumberOfActiveCpus();
     status = STATUS_SUCCESS;
 
-    m_iomuData.TimeUpdatePerCpuUs = m_iomuData.TimerInterruptTimeUs / noOfActiveCpus;
-    LOGL("CPU interrupt time %u/%u us\n", m_iomuData.TimeUpdatePerCpuUs, m_iomuData.TimerInterruptTimeUs);
-
     status = IoApicLateSystemInit();
     if (!SUCCEEDED(status))
     {
@@ -433,7 +436,11 @@ _IomuSetupPit(
     ioInterrupt.Irql = IrqlClockLevel;
     ioInterrupt.ServiceRoutine = _IomuSystemTickInterrupt;
     ioInterrupt.Exclusive = TRUE;
-    ioInterrupt.BroadcastInterrupt = TRUE;
+
+    // The PIT is only used to keep the system time, it is enough for it to be
+    // delivered to a single CPU. The scheduler tick is given by the LAPIC timer
+    // of each CPU which can be stopped while the CPU is idle.
+    ioInterrupt.BroadcastInterrupt = FALSE;
     ioInterrupt.Legacy.Irq = IrqPitTimer;
 
     status = IoRegisterInterrupt(&ioInterrupt, NULL);
@@ -698,7 +705,9 @@ IomuNewVpbCreated(
 
     Vpb->VolumeLetter = _IomuGetNextVolumeLetter();
 
+    ExRwLockAcquireExclusive(&m_iomuData.VpbLock);
     InsertOrderedList(&m_iomuData.VpbList, &Vpb->NextVpb, _VpbCompareFunction, NULL);
+    ExRwLockReleaseExclusive(&m_iomuData.VpbLock);
 }
 
 void
@@ -710,11 +719,25 @@ IomuExecuteForEachVpb(
 {
     ASSERT(NULL != Function);
 
-    UNREFERENCED_PARAMETER(Exclusive);
+    if (Exclusive)
+    {
+        ExRwLockAcquireExclusive(&m_iomuData.VpbLock);
+    }
+    else
+    {
+        ExRwLockAcquireShared(&m_iomuData.VpbLock);
+    }
 
-    // take lock
     ForEachElementExecute(&m_iomuData.VpbList, Function, Context, FALSE);
-    // release lock
+
+    if (Exclusive)
+    {
+        ExRwLockReleaseExclusive(&m_iomuData.VpbLock);
+    }
+    else
+    {
+        ExRwLockReleaseShared(&m_iomuData.VpbLock);
+    }
 }
 
 PTR_SUCCESS
@@ -731,7 +754,11 @@ IomuSearchForVpb(
     // take volume letter
     vpbToSearchFor.VolumeLetter = DriveLetter;
 
+    // VPBs are never removed from the list, the pointer remains valid after
+    // the lock is released
+    ExRwLockAcquireShared(&m_iomuData.VpbLock);
     pCorrespondingVpb = ListSearchForElement(&m_iomuData.VpbList, &vpbToSearchFor.NextVpb, TRUE, _VpbCompareFunction, NULL);
+    ExRwLockReleaseShared(&m_iomuData.VpbLock);
     if (NULL == pCorrespondingVpb)
     {
         return NULL;
@@ -923,7 +950,7 @@ IomuRegisterInterrupt(
         // because new interrupts are added to the tail of the list =>
         // if we have an exclusive ISR at the beginning it thinks it is the
         // only one being executed
-        InsertTailList(&m_iomuData.RegisteredInterrupts[interruptIndex].List, &pNewEntry->ListEntry);
+        RcuInsertTailList(&m_iomuData.RegisteredInterrupts[interruptIndex].List, &pNewEntry->ListEntry);
 
         RwSpinlockReleaseExclusive(&m_iomuData.RegisteredInterrupts[interruptIndex].Lock, INTR_OFF);
         bAcquiredListLock = FALSE;
@@ -1010,16 +1037,30 @@ QWORD
 IomuGetSystemTimeUs(
     void
     )
+{
+    return IomuGetSystemTimeNs() / US_IN_NS;
+}
+
+QWORD
+IomuGetSystemTimeNs(
+    void
+    )
 {
     UPTIME uptime;
     QWORD systemTime;
 
+    if (TscClockIsReliable())
+    {
+        return TscClockGetTimeNs();
+    }
+
+    // the uptime advances only on the timer interrupts
     uptime.Raw = m_iomuData.SystemUptime.Raw;
 
     systemTime = (QWORD) uptime.UptimeSeconds * SEC_IN_US +
                  ( uptime.UptimeMicroseconds >= SEC_IN_US ? SEC_IN_US : uptime.UptimeMicroseconds );
 
-    return systemTime;
+    return systemTime * US_IN_NS;
 }
 
 QWORD
@@ -1027,7 +1068,7 @@ IomuTickCountToUs(
     IN          QWORD                   TickCount
     )
 {
-    return ( TickCount * 1000 ) / ( m_iomuData.TscFrequency / 1000 );
+    return TscClockTicksToNs(TickCount) / US_IN_NS;
 }
 
 void
@@ -1105,7 +1146,9 @@ BOOLEAN
 
     ASSERT( interrupt < NO_OF_USABLE_INTERRUPTS );
 
-    RwSpinlockAcquireShared(&m_iomuData.RegisteredInterrupts[interrupt].Lock, &dummyState);
+    // the lock only serializes the registrations, the entries are published
+    // with RCU and are never removed
+    dummyState = RcuReadLock();
     for (PLIST_ENTRY pListEntry = m_iomuData.RegisteredInterrupts[interrupt].List.Flink;
          pListEntry != &m_iomuData.RegisteredInterrupts[interrupt].List;
          pListEntry = pListEntry->Flink
@@ -1119,7 +1162,7 @@ BOOLEAN
             break;
         }
     }
-    RwSpinlockReleaseShared(&m_iomuData.RegisteredInterrupts[interrupt].Lock, dummyState);
+    RcuReadUnlock(dummyState);
 
     return bHandledInterrupt;
 }
@@ -1135,8 +1178,6 @@ BOOLEAN
     _IomuUpdateSystemTime();
     //LOGP("%U us\n", IomuGetSystemTimeUs());
 
-    ExSystemTimerTick();
-
     return TRUE;
 }
 
@@ -8,6 +8,7 @@
 #include "cpumu.h"
 #include "dmp_cpu.h"
 #include "process.h"
+#include "dpc.h"
 
 #define UNDEFINED_INTERRUPT_TEXT                "UNKNOWN INTERRUPT"
 #define STACK_BYTES_TO_DUMP_ON_EXCEPTION        0x100
@@ -138,6 +139,10 @@ _IsrExceptionHandler(
             }
         }
     }
+    else if (ExceptionDeviceNotAvailable == InterruptIndex)
+    {
+        exceptionHandled = ThreadHandleDeviceNotAvailable();
+    }
     else if (ExceptionGeneralProtection == InterruptIndex)
     {
         LOG_TRACE_EXCEPTION("RSP[0]: 0x%X\n", *((QWORD*)StackPointer->Registers.Rsp));
@@ -196,6 +201,8 @@ _IsrInterruptHandler(
     // unexpected performance implications.
     prevIrql = CpuMuRaiseIrql(VECTOR_TO_IRQL(InterruptIndex));
 
+    DpcInterruptEnter();
+
     // call registered interrupt
     if (NULL != m_isrRoutines[indexInHandlers])
     {
@@ -227,7 +234,9 @@ _IsrInterruptHandler(
     // if the thread terminates
     CpuMuLowerIrql(prevIrql);
 
-    if (ThreadYieldOnInterrupt())
+    // the work deferred by the interrupt routines is done before the
+    // interrupted thread may be preempted
+    if (DpcInterruptExit() && ThreadYieldOnInterrupt())
     {
         ThreadYield();
     }
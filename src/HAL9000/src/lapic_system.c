@@ -2,9 +2,28 @@
 #include "lapic_system.h"
 #include "io.h"
 #include "cpumu.h"
+#include "tsc_clock.h"
 
 #define APIC_TIMER_DIVIDE_VALUE                 64
 
+// Intel SDM 10.5.4 APIC Timer
+#define APIC_LVT_TIMER_REGISTER_OFFSET          0x320
+
+#define APIC_LVT_TIMER_MODE_MASK                (0x3UL << 17)
+#define APIC_LVT_TIMER_MODE_ONE_SHOT            (0x0UL << 17)
+#define APIC_LVT_TIMER_MODE_TSC_DEADLINE        (0x2UL << 17)
+
+#ifndef IA32_TSC_DEADLINE
+#define IA32_TSC_DEADLINE                       0x6E0
+#endif
+
+// An event which is this close is considered due, else the interrupt would
+// be followed by another one only a few microseconds later
+#define APIC_TIMER_SLACK_NS                     (10 * US_IN_NS)
+
+// Longer one-shot intervals are split, the count would overflow
+#define APIC_TIMER_MAX_ONE_SHOT_NS              (60 * SEC_IN_NS)
+
 typedef struct _APIC_DATA
 {
     PVOID                   LocalApicAddress;
@@ -36,6 +55,18 @@ _LapicInstallInterruptRoutines(
     void
     );
 
+static
+void
+_LapicSystemSelectTimerMode(
+    INOUT   PLAPIC_TIMER_STATE              Timer
+    );
+
+static
+void
+_LapicSystemProgramTimer(
+    IN      PLAPIC_TIMER_STATE              Timer
+    );
+
 static FUNC_InterruptFunction               _ApicSpuriousIsr;
 static FUNC_InterruptFunction               _ApicErrorIsr;
 
@@ -179,9 +210,32 @@ LapicSystemSetTimer(
     )
 {
     DWORD timerCount;
+    PLAPIC_TIMER_STATE pTimer;
+    INTR_STATE oldState;
 
     ASSERT( NULL != m_apicData.LocalApicAddress );
 
+    oldState = CpuIntrDisable();
+
+    pTimer = &GetCurrentPcpu()->ApicTimer;
+    if (!pTimer->ModeSelected)
+    {
+        _LapicSystemSelectTimerMode(pTimer);
+    }
+
+    if (LapicTimerModePeriodic != pTimer->Mode)
+    {
+        pTimer->PeriodNs = (QWORD) Microseconds * US_IN_NS;
+        pTimer->NextPeriodicNs = (0 != Microseconds) ? TscClockGetTimeNs() + pTimer->PeriodNs : MAX_QWORD;
+
+        _LapicSystemProgramTimer(pTimer);
+
+        CpuIntrSetState(oldState);
+        return;
+    }
+
+    CpuIntrSetState(oldState);
+
     timerCount = 0;
 
     if (Microseconds != 0)
@@ -190,14 +244,89 @@ LapicSystemSetTimer(
         timerCount = ((QWORD)m_apicData.DividedBusFrequency * Microseconds) / SEC_IN_US;
 
         m_apicData.InitialTimerCount = timerCount;
-
-        LOGL("DividedBusFrequency: 0x%x\n", m_apicData.DividedBusFrequency);
-        LOGL("timerCount: 0x%x\n", timerCount);
     }
 
     LapicSetTimerInterval(m_apicData.LocalApicAddress, timerCount);
 }
 
+BOOLEAN
+LapicSystemSetTimerDeadline(
+    IN      QWORD                           DeadlineNs
+    )
+{
+    PLAPIC_TIMER_STATE pTimer;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pTimer = &GetCurrentPcpu()->ApicTimer;
+    if (!pTimer->ModeSelected || LapicTimerModePeriodic == pTimer->Mode)
+    {
+        return FALSE;
+    }
+
+    pTimer->DeadlineNs = DeadlineNs;
+    _LapicSystemProgramTimer(pTimer);
+
+    return TRUE;
+}
+
+BOOLEAN
+LapicSystemHasTimerDeadlines(
+    void
+    )
+{
+    PLAPIC_TIMER_STATE pTimer;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pTimer = &GetCurrentPcpu()->ApicTimer;
+
+    return pTimer->ModeSelected && LapicTimerModePeriodic != pTimer->Mode;
+}
+
+BOOLEAN
+LapicSystemHandleTimerInterrupt(
+    void
+    )
+{
+    PLAPIC_TIMER_STATE pTimer;
+    QWORD nowNs;
+    BOOLEAN bPeriodicTick;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pTimer = &GetCurrentPcpu()->ApicTimer;
+    if (!pTimer->ModeSelected || LapicTimerModePeriodic == pTimer->Mode)
+    {
+        return TRUE;
+    }
+
+    nowNs = TscClockGetTimeNs() + APIC_TIMER_SLACK_NS;
+    bPeriodicTick = FALSE;
+
+    if (nowNs >= pTimer->NextPeriodicNs)
+    {
+        bPeriodicTick = TRUE;
+
+        // the ticks which were missed are not replayed
+        pTimer->NextPeriodicNs += pTimer->PeriodNs;
+        if (pTimer->NextPeriodicNs <= nowNs)
+        {
+            pTimer->NextPeriodicNs = nowNs + pTimer->PeriodNs;
+        }
+    }
+
+    if (nowNs >= pTimer->DeadlineNs)
+    {
+        // the owner of the deadline sets the next one
+        pTimer->DeadlineNs = MAX_QWORD;
+    }
+
+    _LapicSystemProgramTimer(pTimer);
+
+    return bPeriodicTick;
+}
+
 void
 LapicSystemSendIpi(
     _When_(ApicDestinationShorthandNone == DeliveryMode, IN)
@@ -325,6 +454,90 @@ _LapicInstallInterruptRoutines(
     return status;
 }
 
+static
+void
+_LapicSystemSelectTimerMode(
+    INOUT   PLAPIC_TIMER_STATE              Timer
+    )
+{
+    volatile DWORD* pLvtTimer;
+
+    ASSERT(NULL != Timer);
+    ASSERT(!Timer->ModeSelected);
+
+    Timer->ModeSelected = TRUE;
+    Timer->NextPeriodicNs = MAX_QWORD;
+    Timer->DeadlineNs = MAX_QWORD;
+
+    // the emulation compares TSC values read by the same CPU, the deadlines
+    // are given in system time => the TSC must be the system clocksource
+    if (!TscClockIsReliable())
+    {
+        Timer->Mode = LapicTimerModePeriodic;
+        return;
+    }
+
+    Timer->Mode = CpuMuIsTscDeadlineSupported() ? LapicTimerModeTscDeadline : LapicTimerModeOneShot;
+
+    // the vector and the mask configured by LapicConfigureTimer are kept
+    pLvtTimer = (volatile DWORD*) PtrOffset(m_apicData.LocalApicAddress, APIC_LVT_TIMER_REGISTER_OFFSET);
+    *pLvtTimer = (*pLvtTimer & ~APIC_LVT_TIMER_MODE_MASK) |
+                 (LapicTimerModeTscDeadline == Timer->Mode ? APIC_LVT_TIMER_MODE_TSC_DEADLINE : APIC_LVT_TIMER_MODE_ONE_SHOT);
+
+    // in TSC-deadline mode the write to the MSR must be ordered after the
+    // write to the LVT register (Intel SDM 10.5.4.1)
+    _mm_mfence();
+}
+
+static
+void
+_LapicSystemProgramTimer(
+    IN      PLAPIC_TIMER_STATE              Timer
+    )
+{
+    QWORD nextEventNs;
+    QWORD nowNs;
+    QWORD deltaNs;
+
+    ASSERT(NULL != Timer);
+    ASSERT(LapicTimerModePeriodic != Timer->Mode);
+
+    nextEventNs = min(Timer->NextPeriodicNs, Timer->DeadlineNs);
+
+    if (MAX_QWORD == nextEventNs)
+    {
+        // writing 0 disarms the timer in both modes
+        if (LapicTimerModeTscDeadline == Timer->Mode)
+        {
+            __writemsr(IA32_TSC_DEADLINE, 0);
+        }
+        else
+        {
+            LapicSetTimerInterval(m_apicData.LocalApicAddress, 0);
+        }
+        return;
+    }
+
+    nowNs = TscClockGetTimeNs();
+    deltaNs = (nextEventNs > nowNs) ? nextEventNs - nowNs : 0;
+
+    if (LapicTimerModeTscDeadline == Timer->Mode)
+    {
+        // a deadline which already passed triggers immediately
+        __writemsr(IA32_TSC_DEADLINE, __rdtsc() + TscClockNsToTicks(deltaNs) + 1);
+    }
+    else
+    {
+        QWORD timerCount;
+
+        deltaNs = min(deltaNs, APIC_TIMER_MAX_ONE_SHOT_NS);
+        timerCount = ((QWORD) m_apicData.DividedBusFrequency * deltaNs) / SEC_IN_NS;
+
+        // a count of 0 would stop the timer
+        LapicSetTimerInterval(m_apicData.LocalApicAddress, (DWORD) max(timerCount, 1));
+    }
+}
+
 static
 BOOLEAN
 (__cdecl _ApicSpuriousIsr)(
@@ -0,0 +1,193 @@
+#include "HAL9000.h"
+#include "lock_stats.h"
+
+#if LOCK_STATS_ENABLED
+
+typedef struct _LOCK_STATS_DATA
+{
+    // Slots are claimed by writing their CallSite, they are never released
+    LOCK_STATS          Sites[LOCK_STATS_MAX_SITES];
+} LOCK_STATS_DATA, *PLOCK_STATS_DATA;
+
+static LOCK_STATS_DATA m_lockStatsData;
+
+static
+void
+_LockStatsUpdateMax(
+    INOUT       volatile QWORD*         Max,
+    IN          QWORD                   Value
+    );
+
+void
+LockStatsInitInstance(
+    OUT         PLOCK_STATS_INSTANCE    Instance,
+    IN          PVOID                   CallSite
+    )
+{
+    DWORD i;
+    DWORD index;
+
+    ASSERT(NULL != Instance);
+    ASSERT(NULL != CallSite);
+
+    Instance->Stats = NULL;
+    Instance->AcquireTsc = 0;
+
+    // open addressing on the call site, locks are initialized rarely enough
+    // for the linear probing not to matter
+    index = (DWORD) (((QWORD) CallSite >> 4) % LOCK_STATS_MAX_SITES);
+    for (i = 0; i < LOCK_STATS_MAX_SITES; ++i)
+    {
+        PLOCK_STATS pStats = &m_lockStatsData.Sites[(index + i) % LOCK_STATS_MAX_SITES];
+        PVOID pPrevSite;
+
+        pPrevSite = _InterlockedCompareExchangePointer(&pStats->CallSite, CallSite, NULL);
+        if (NULL == pPrevSite || CallSite == pPrevSite)
+        {
+            Instance->Stats = pStats;
+            return;
+        }
+    }
+}
+
+void
+LockStatsSetName(
+    INOUT       PLOCK_STATS_INSTANCE    Instance,
+    IN_Z        const char*             Name
+    )
+{
+    ASSERT(NULL != Instance);
+    ASSERT(NULL != Name);
+
+    if (NULL != Instance->Stats)
+    {
+        Instance->Stats->Name = Name;
+    }
+}
+
+void
+LockStatsAcquired(
+    INOUT       PLOCK_STATS_INSTANCE    Instance,
+    IN_OPT      PLOCK_STATS_WAIT        Wait
+    )
+{
+    PLOCK_STATS pStats;
+    QWORD waitTicks;
+
+    ASSERT(NULL != Instance);
+
+    pStats = Instance->Stats;
+    if (NULL == pStats)
+    {
+        return;
+    }
+
+    Instance->AcquireTsc = __rdtsc();
+
+    _InterlockedIncrement64((volatile __int64*) &pStats->Acquisitions);
+
+    if (NULL == Wait || !Wait->Contended)
+    {
+        return;
+    }
+
+    waitTicks = Instance->AcquireTsc - Wait->StartTsc;
+
+    _InterlockedIncrement64((volatile __int64*) &pStats->Contentions);
+    _InterlockedExchangeAdd64((volatile __int64*) &pStats->TotalWaitTicks, waitTicks);
+    _LockStatsUpdateMax(&pStats->MaxWaitTicks, waitTicks);
+}
+
+void
+LockStatsReleased(
+    INOUT       PLOCK_STATS_INSTANCE    Instance
+    )
+{
+    ASSERT(NULL != Instance);
+
+    if (NULL == Instance->Stats)
+    {
+        return;
+    }
+
+    _LockStatsUpdateMax(&Instance->Stats->MaxHoldTicks, __rdtsc() - Instance->AcquireTsc);
+}
+
+DWORD
+LockStatsGetMostContended(
+    OUT_WRITES(MaxEntries)
+                PLOCK_STATS             Stats,
+    IN          DWORD                   MaxEntries
+    )
+{
+    DWORD noOfEntries;
+
+    ASSERT(NULL != Stats);
+
+    noOfEntries = 0;
+
+    // insertion sort of the snapshots, the table is small
+    for (DWORD i = 0; i < LOCK_STATS_MAX_SITES; ++i)
+    {
+        LOCK_STATS snapshot = m_lockStatsData.Sites[i];
+        DWORD pos;
+
+        if (NULL == snapshot.CallSite || 0 == snapshot.Acquisitions)
+        {
+            continue;
+        }
+
+        for (pos = noOfEntries; pos > 0 && Stats[pos - 1].Contentions < snapshot.Contentions; --pos)
+        {
+            if (pos < MaxEntries)
+            {
+                Stats[pos] = Stats[pos - 1];
+            }
+        }
+
+        if (pos < MaxEntries)
+        {
+            Stats[pos] = snapshot;
+            noOfEntries = min(noOfEntries + 1, MaxEntries);
+        }
+    }
+
+    return noOfEntries;
+}
+
+static
+void
+_LockStatsUpdateMax(
+    INOUT       volatile QWORD*         Max,
+    IN          QWORD                   Value
+    )
+{
+    QWORD currentMax;
+
+    ASSERT(NULL != Max);
+
+    for (currentMax = *Max; Value > currentMax; currentMax = *Max)
+    {
+        if (currentMax == (QWORD) _InterlockedCompareExchange64((volatile __int64*) Max, Value, currentMax))
+        {
+            break;
+        }
+    }
+}
+
+#else
+
+DWORD
+LockStatsGetMostContended(
+    OUT_WRITES(MaxEntries)
+                PLOCK_STATS             Stats,
+    IN          DWORD                   MaxEntries
+    )
+{
+    UNREFERENCED_PARAMETER(Stats);
+    UNREFERENCED_PARAMETER(MaxEntries);
+
+    return 0;
+}
+
+#endif // LOCK_STATS_ENABLED
@@ -3,6 +3,7 @@
 #include "log.h"
 #include "serial_comm.h"
 #include "synch.h"
+#include "queued_lock.h"
 
 #define INFO_LEVEL_MODIFIER         ""
 #define WARNING_LEVEL_MODIFIER      "[WARNING]"
@@ -12,7 +13,7 @@
 
 typedef struct _LOG_DATA
 {
-    LOCK                        Lock;
+    HOT_LOCK                    Lock;
 
     _Interlocked_
     volatile BOOLEAN            Enabled;
@@ -41,7 +42,8 @@ LogSystemPreinit(
 {
     memzero(&m_logData, sizeof(LOG_DATA));
 
-    LockInit(&m_logData.Lock);
+    HotLockInit(&m_logData.Lock);
+    HotLockSetName(&m_logData.Lock, "LogLock");
 }
 
 _No_competing_thread_
@@ -187,12 +189,12 @@ _LogBufferInternal(
 
     ASSERT(NULL != Buffer);
 
-    LockAcquire(&m_logData.Lock, &oldState);
+    HotLockAcquire(&m_logData.Lock, &oldState);
 
     PrintFunction(Buffer);
 
     // also write through the serial port
     SerialCommWriteBuffer(Buffer);
 
-    LockRelease(&m_logData.Lock, oldState);
+    HotLockRelease(&m_logData.Lock, oldState);
 }
@@ -6,6 +6,7 @@
 #include "pte.h"
 #include "display.h"
 #include "synch.h"
+#include "queued_lock.h"
 #include "cl_heap.h"
 #include "cpumu.h"
 #include "thread.h"
@@ -67,6 +68,10 @@ STATIC_ASSERT( sizeof(PAGE_FAULT_ERR_CODE) == sizeof(DWORD));
 
 #pragma pack(pop)
 
+// Maximum number of frames the zero worker takes from the PMM at once to
+// refill the pool of zeroed frames
+#define MMU_ZERO_WORKER_BATCH_FRAMES    16
+
 typedef struct _MMU_ZERO_WORKER_ITEM
 {
     LIST_ENTRY                      ListEntry;
@@ -96,7 +101,7 @@ typedef struct _MMU_HEAP_DATA
 {
     _Guarded_by_(HeapLock)
     PHEAP_HEADER                    Heap;
-    LOCK                            HeapLock;
+    HOT_LOCK                        HeapLock;
 } MMU_HEAP_DATA, *PMMU_HEAP_DATA;
 
 typedef enum _MMU_HEAP_INDEX
@@ -222,6 +227,12 @@ _MmuDestroyPagingTables(
 
 static FUNC_ThreadStart                 _MmuZeroWorkerThreadFunction;
 
+static
+BOOLEAN
+_MmuZeroFreeFrames(
+    IN      DWORD                   NoOfFrames
+    );
+
 __forceinline
 static
 DWORD
@@ -534,6 +545,9 @@ MmuInitThreadingSystem(
 
         pCtx = NULL;
         m_mmuData.ZeroThreadData.WorkerThread = pThread;
+
+        // the worker also refills the pool of zeroed frames when it runs low
+        PmmSetZeroedPoolLowEvent(&m_mmuData.ZeroThreadData.NewPagesEvent);
     }
     __finally
     {
@@ -1910,7 +1924,8 @@ _MmuInitializeHeap(
 
     LOG("ClHeapInit suceeded\n");
 
-    LockInit(&Heap->HeapLock);
+    HotLockInit(&Heap->HeapLock);
+    HotLockSetName(&Heap->HeapLock, "HeapLock");
 
     return status;
 }
@@ -1933,14 +1948,34 @@ _MmuAllocateFromPoolWithTag(
     ASSERT( Heap < MmuHeapIndexReserved );
     ASSERT( NULL != m_mmuData.Heaps[Heap].Heap );
 
-    LockAcquire(&m_mmuData.Heaps[Heap].HeapLock, &oldState );
-    pResult = ClHeapAllocatePoolWithTag(m_mmuData.Heaps[Heap].Heap,
-                                      Flags,
-                                      AllocationSize,
-                                      Tag,
-                                      AllocationAlignment
-                                      );
-    LockRelease(&m_mmuData.Heaps[Heap].HeapLock, oldState );
+    for (DWORD attempt = 0; attempt < 2; ++attempt)
+    {
+        if (0 != attempt)
+        {
+            // the destroyed threads kept for reuse are allocated from the
+            // heap, they cannot be freed while the caller holds a spinlock
+            if (INTR_ON != CpuIntrGetState())
+            {
+                break;
+            }
+
+            ThreadCacheTrim();
+        }
+
+        HotLockAcquire(&m_mmuData.Heaps[Heap].HeapLock, &oldState );
+        pResult = ClHeapAllocatePoolWithTag(m_mmuData.Heaps[Heap].Heap,
+                                          Flags,
+                                          AllocationSize,
+                                          Tag,
+                                          AllocationAlignment
+                                          );
+        HotLockRelease(&m_mmuData.Heaps[Heap].HeapLock, oldState );
+
+        if (NULL != pResult)
+        {
+            break;
+        }
+    }
 
     return pResult;
 }
@@ -1959,12 +1994,12 @@ _MmuFreeFromPoolWithTag(
     ASSERT(Heap < MmuHeapIndexReserved);
     ASSERT( NULL != m_mmuData.Heaps[Heap].Heap );
 
-    LockAcquire(&m_mmuData.Heaps[Heap].HeapLock, &oldState);
+    HotLockAcquire(&m_mmuData.Heaps[Heap].HeapLock, &oldState);
     ClHeapFreePoolWithTag(m_mmuData.Heaps[Heap].Heap,
                         MemoryAddress,
                         Tag
                         );
-    LockRelease(&m_mmuData.Heaps[Heap].HeapLock, oldState);
+    HotLockRelease(&m_mmuData.Heaps[Heap].HeapLock, oldState);
 }
 
 static
@@ -1999,6 +2034,7 @@ _MmuZeroWorkerThreadFunction(
     PEX_EVENT pEvent;
     PLIST_ENTRY pCurrentEntry;
     PLOCK pLock;
+    BOOLEAN bOutOfFrames;
 
     LOG_FUNC_START;
 
@@ -2020,6 +2056,8 @@ _MmuZeroWorkerThreadFunction(
     ExFreePoolWithTag(pCtx, HEAP_MMU_TAG);
     pCtx = NULL;
 
+    bOutOfFrames = FALSE;
+
     // warning C4127: conditional expression is constant
 #pragma warning(suppress:4127)
     while (TRUE)
@@ -2028,14 +2066,13 @@ _MmuZeroWorkerThreadFunction(
         INTR_STATE oldState;
         DWORD noOfBytes;
         PVOID pAddr;
+        DWORD noOfFramesNeeded;
+        BOOLEAN bListEmpty;
 
         pItem = NULL;
         noOfBytes = 0;
         pAddr = NULL;
 
-        // may use executive timer in the future
-        ExEventWaitForSignal(pEvent);
-
         LockAcquire(pLock, &oldState);
         pCurrentEntry = RemoveHeadList(pListHead);
         LockRelease(pLock, oldState);
@@ -2043,9 +2080,38 @@ _MmuZeroWorkerThreadFunction(
         if (pCurrentEntry == pListHead)
         {
             // list is empty :(
+
+            // we have the lowest priority => we only get here when the CPU
+            // would otherwise be idle, the time is used to refill the pool of
+            // zeroed frames
+            noOfFramesNeeded = PmmGetZeroedFramesNeeded();
+            if (!bOutOfFrames && 0 != noOfFramesNeeded)
+            {
+                if (_MmuZeroFreeFrames(min(noOfFramesNeeded, MMU_ZERO_WORKER_BATCH_FRAMES)))
+                {
+                    continue;
+                }
+
+                // there is no free frame left, try again once some are released
+                bOutOfFrames = TRUE;
+            }
+
             ExEventClearSignal(pEvent);
 
-            // wait for another signal
+            // the pages released or the zeroed frames reserved before the
+            // signal was cleared must not be missed
+            LockAcquire(pLock, &oldState);
+            bListEmpty = IsListEmpty(pListHead);
+            LockRelease(pLock, oldState);
+
+            if (bListEmpty && (bOutOfFrames || 0 == PmmGetZeroedFramesNeeded()))
+            {
+                // wait for another signal, frames may have been released by
+                // the time we are woken
+                ExEventWaitForSignal(pEvent);
+                bOutOfFrames = FALSE;
+            }
+
             continue;
         }
 
@@ -2064,8 +2130,9 @@ _MmuZeroWorkerThreadFunction(
         // zero the memory, that's our job :)
         memzero(pAddr, noOfBytes);
 
-        // truly release physical addresses
-        PmmReleaseMemory(pItem->PhysicalAddress, pItem->NumberOfFrames );
+        // truly release physical addresses, the PMM keeps them as zeroed
+        PmmReleaseZeroedMemory(pItem->PhysicalAddress, pItem->NumberOfFrames );
+        bOutOfFrames = FALSE;
 
         // it's ok, this does not release memory => no oo loop
         MmuUnmapSystemMemory(pAddr, noOfBytes);
@@ -2079,4 +2146,45 @@ _MmuZeroWorkerThreadFunction(
     NOT_REACHED;
 
     return status;
-}
\ No newline at end of file
+}
+
+static
+BOOLEAN
+_MmuZeroFreeFrames(
+    IN      DWORD                   NoOfFrames
+    )
+{
+    PHYSICAL_ADDRESS pa;
+    DWORD noOfFrames;
+    DWORD noOfBytes;
+    PVOID pAddr;
+
+    ASSERT( 0 != NoOfFrames );
+
+    noOfFrames = NoOfFrames;
+
+    pa = PmmReserveMemory(noOfFrames);
+    if (NULL == pa && 1 != noOfFrames)
+    {
+        // there may still be single frames left
+        noOfFrames = 1;
+        pa = PmmReserveMemory(noOfFrames);
+    }
+
+    if (NULL == pa)
+    {
+        return FALSE;
+    }
+
+    noOfBytes = noOfFrames * PAGE_SIZE;
+    pAddr = MmuMapSystemMemory(pa, noOfBytes);
+    ASSERT( NULL != pAddr );
+
+    memzero(pAddr, noOfBytes);
+
+    MmuUnmapSystemMemory(pAddr, noOfBytes);
+
+    PmmReleaseZeroedMemory(pa, noOfFrames);
+
+    return TRUE;
+}
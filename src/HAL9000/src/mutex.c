@@ -1,9 +1,30 @@
 #include "HAL9000.h"
 #include "thread_internal.h"
 #include "mutex.h"
+#include "iomu.h"
+#include "rcu.h"
 
 #define MUTEX_MAX_RECURSIVITY_DEPTH         MAX_BYTE
 
+// Maximum time an adaptive mutex spins before the thread blocks, it should be
+// comparable to the cost of blocking and being woken up
+#define MUTEX_ADAPTIVE_SPIN_MAX_US          20
+
+static
+void
+_MutexInitInternal(
+    OUT         PMUTEX      Mutex,
+    IN          BOOLEAN     Recursive,
+    IN          MUTEX_FLAGS Flags
+    );
+
+static
+BOOLEAN
+_MutexSpinAcquire(
+    INOUT       PMUTEX      Mutex,
+    IN          PTHREAD     Thread
+    );
+
 _No_competing_thread_
 void
 MutexInit(
@@ -11,15 +32,24 @@ MutexInit(
     IN          BOOLEAN     Recursive
     )
 {
-    ASSERT( NULL != Mutex );
-
-    memzero(Mutex, sizeof(MUTEX));
+    _MutexInitInternal(Mutex, Recursive, 0);
 
-    LockInit(&Mutex->MutexLock);
+    // the statistics are initialized here and not in MutexInitEx so the
+    // mutex is accounted to our caller, not to MutexInit
+    LOCK_STATS_INIT(&Mutex->StatsInstance);
+}
 
-    InitializeListHead(&Mutex->WaitingList);
+_No_competing_thread_
+void
+MutexInitEx(
+    OUT         PMUTEX      Mutex,
+    IN          BOOLEAN     Recursive,
+    IN          MUTEX_FLAGS Flags
+    )
+{
+    _MutexInitInternal(Mutex, Recursive, Flags);
 
-    Mutex->MaxRecursivityDepth = Recursive ? MUTEX_MAX_RECURSIVITY_DEPTH : 1;
+    LOCK_STATS_INIT(&Mutex->StatsInstance);
 }
 
 ACQUIRES_EXCL_AND_REENTRANT_LOCK(*Mutex)
@@ -32,6 +62,8 @@ MutexAcquire(
     INTR_STATE dummyState;
     INTR_STATE oldState;
     PTHREAD pCurrentThread = GetCurrentThread();
+    BOOLEAN bWokenUp;
+    LOCK_STATS_DECLARE_WAIT(wait);
 
     ASSERT( NULL != Mutex);
     ASSERT( NULL != pCurrentThread );
@@ -44,24 +76,55 @@ MutexAcquire(
         return;
     }
 
-    oldState = CpuIntrDisable();
+    LOCK_STATS_WAIT_BEGIN(wait, NULL != Mutex->Holder);
 
-    LockAcquire(&Mutex->MutexLock, &dummyState );
-    if (NULL == Mutex->Holder)
+    if (IsBooleanFlagOn(Mutex->Flags, MUTEX_FLAG_ADAPTIVE_SPIN)
+        && _MutexSpinAcquire(Mutex, pCurrentThread))
     {
-        Mutex->Holder = pCurrentThread;
-        Mutex->CurrentRecursivityDepth = 1;
+        LOCK_STATS_ACQUIRED(&Mutex->StatsInstance, wait);
+
+        _Analysis_assume_lock_acquired_(*Mutex);
+        return;
     }
 
+    bWokenUp = FALSE;
+
+    oldState = CpuIntrDisable();
+
+    LockAcquire(&Mutex->MutexLock, &dummyState );
+
     while (Mutex->Holder != pCurrentThread)
     {
-        InsertTailList(&Mutex->WaitingList, &pCurrentThread->ReadyList);
+        // the mutex is free only if no thread is waiting for it or if it was
+        // released by a barging MutexRelease
+        if (NULL == Mutex->Holder)
+        {
+            Mutex->Holder = pCurrentThread;
+            Mutex->CurrentRecursivityDepth = 1;
+            break;
+        }
+
+        // if we were woken up by a barging release and someone else took the
+        // mutex we keep our place at the front of the queue
+        if (bWokenUp)
+        {
+            InsertHeadList(&Mutex->WaitingList, &pCurrentThread->ReadyList);
+        }
+        else
+        {
+            InsertTailList(&Mutex->WaitingList, &pCurrentThread->ReadyList);
+        }
         ThreadTakeBlockLock();
         LockRelease(&Mutex->MutexLock, dummyState);
         ThreadBlock();
         LockAcquire(&Mutex->MutexLock, &dummyState );
+
+        bWokenUp = TRUE;
+        LOCK_STATS_WAIT_CONTENDED(wait);
     }
 
+    LOCK_STATS_ACQUIRED(&Mutex->StatsInstance, wait);
+
     _Analysis_assume_lock_acquired_(*Mutex);
 
     LockRelease(&Mutex->MutexLock, dummyState);
@@ -90,6 +153,8 @@ MutexRelease(
 
     pEntry = NULL;
 
+    LOCK_STATS_RELEASED(&Mutex->StatsInstance);
+
     LockAcquire(&Mutex->MutexLock, &oldState);
 
     pEntry = RemoveHeadList(&Mutex->WaitingList);
@@ -97,9 +162,17 @@ MutexRelease(
     {
         PTHREAD pThread = CONTAINING_RECORD(pEntry, THREAD, ReadyList);
 
-        // wakeup first thread
-        Mutex->Holder = pThread;
-        Mutex->CurrentRecursivityDepth = 1;
+        if (IsBooleanFlagOn(Mutex->Flags, MUTEX_FLAG_BARGING))
+        {
+            // the first waiter will compete for the mutex when it runs
+            Mutex->Holder = NULL;
+        }
+        else
+        {
+            // wakeup first thread
+            Mutex->Holder = pThread;
+            Mutex->CurrentRecursivityDepth = 1;
+        }
         ThreadUnblock(pThread);
     }
     else
@@ -110,4 +183,86 @@ MutexRelease(
     _Analysis_assume_lock_released_(*Mutex);
 
     LockRelease(&Mutex->MutexLock, oldState);
-}
\ No newline at end of file
+}
+
+static
+BOOLEAN
+_MutexSpinAcquire(
+    INOUT       PMUTEX      Mutex,
+    IN          PTHREAD     Thread
+    )
+{
+    INTR_STATE oldState;
+    INTR_STATE rcuState;
+    PTHREAD pHolder;
+    QWORD tickFrequency;
+    QWORD spinDeadline;
+    BOOLEAN bAcquired;
+    BOOLEAN bHolderRunning;
+
+    ASSERT(NULL != Mutex);
+    ASSERT(NULL != Thread);
+
+    bAcquired = FALSE;
+
+    spinDeadline = IomuGetSystemTicks(&tickFrequency);
+    spinDeadline += (tickFrequency * MUTEX_ADAPTIVE_SPIN_MAX_US) / SEC_IN_US;
+
+    while (!bAcquired)
+    {
+        // the THREAD structures are freed through RcuCall => the holder we
+        // read cannot be freed before we are done looking at its state, even
+        // if it releases the mutex and exits meanwhile
+        rcuState = RcuReadLock();
+        pHolder = Mutex->Holder;
+        bHolderRunning = (NULL != pHolder) && (ThreadStateRunning == pHolder->State);
+        RcuReadUnlock(rcuState);
+
+        if (NULL == pHolder)
+        {
+            LockAcquire(&Mutex->MutexLock, &oldState);
+            if (NULL == Mutex->Holder)
+            {
+                Mutex->Holder = Thread;
+                Mutex->CurrentRecursivityDepth = 1;
+                bAcquired = TRUE;
+            }
+            LockRelease(&Mutex->MutexLock, oldState);
+
+            continue;
+        }
+
+        // it is worth spinning only while the holder makes progress on another
+        // CPU, the holder may change or release the mutex while we look at its
+        // state, in the worst case we block or spin a bit more than needed
+        if (!bHolderRunning
+            || IomuGetSystemTicks(NULL) >= spinDeadline)
+        {
+            break;
+        }
+
+        _mm_pause();
+    }
+
+    return bAcquired;
+}
+
+static
+void
+_MutexInitInternal(
+    OUT         PMUTEX      Mutex,
+    IN          BOOLEAN     Recursive,
+    IN          MUTEX_FLAGS Flags
+    )
+{
+    ASSERT( NULL != Mutex );
+
+    memzero(Mutex, sizeof(MUTEX));
+
+    LockInit(&Mutex->MutexLock);
+
+    InitializeListHead(&Mutex->WaitingList);
+
+    Mutex->MaxRecursivityDepth = Recursive ? MUTEX_MAX_RECURSIVITY_DEPTH : 1;
+    Mutex->Flags = Flags;
+}
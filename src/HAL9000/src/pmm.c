@@ -1,8 +1,12 @@
 #include "HAL9000.h"
 #include "pmm.h"
 #include "int15.h"
-#include "bitmap.h"
 #include "synch.h"
+#include "queued_lock.h"
+#include "cpumu.h"
+#include "ex_event.h"
+#include "smp.h"
+#include "thread_internal.h"
 
 typedef struct _MEMORY_REGION_LIST
 {
@@ -10,6 +14,47 @@ typedef struct _MEMORY_REGION_LIST
     DWORD               NumberOfEntries;
 } MEMORY_REGION_LIST, *PMEMORY_REGION_LIST;
 
+// The free frames are kept in blocks of 2^Order frames, aligned to their size
+#define PMM_BUDDY_MAX_ORDER         31
+
+#define PMM_BUDDY_NO_ORDER          ((BYTE)0xFF)
+#define PMM_BUDDY_NO_FRAME          MAX_DWORD
+
+#define PMM_BUDDY_BLOCK_FRAMES(Order)   ((QWORD)1 << (Order))
+
+// Maximum number of blocks looked at in the free list of each order by the
+// reservations above a minimum address
+#define PMM_BUDDY_ABOVE_SCAN_BLOCKS     64
+
+// A failed reservation is retried after draining the frame caches of the
+// CPUs and then after freeing the cached threads
+#define PMM_RESERVE_ATTEMPTS            3
+
+typedef struct _PMM_FRAME_LINK
+{
+    DWORD               Next;
+    DWORD               Prev;
+} PMM_FRAME_LINK, *PPMM_FRAME_LINK;
+
+// Binary buddy allocator, the metadata is indexed by the frame number and is
+// valid only for the first frame of each free block
+typedef struct _PMM_BUDDY_ALLOCATOR
+{
+    DWORD               NumberOfFrames;
+
+    // Links of the free block in the free list of its order
+    PPMM_FRAME_LINK     FrameLinks;
+
+    // Order of the free block starting at the frame, PMM_BUDDY_NO_ORDER if no
+    // free block starts there
+    PBYTE               FreeOrder;
+
+    DWORD               FreeListHead[PMM_BUDDY_MAX_ORDER + 1];
+    DWORD               NumberOfFreeBlocks[PMM_BUDDY_MAX_ORDER + 1];
+
+    QWORD               NumberOfFreeFrames;
+} PMM_BUDDY_ALLOCATOR, *PPMM_BUDDY_ALLOCATOR;
+
 typedef struct _PMM_DATA
 {
     // Both of the highest physical address values are setup on initialization and
@@ -32,10 +77,20 @@ typedef struct _PMM_DATA
 
     MEMORY_REGION_LIST  MemoryRegionList[MemoryMapTypeMax];
 
-    LOCK                AllocationLock;
+    HOT_LOCK            AllocationLock;
+
+    _Guarded_by_(AllocationLock)
+    PMM_BUDDY_ALLOCATOR Buddy;
+
+    // The zeroed frames are not part of the buddy allocator, they are linked
+    // through the Next field of their FrameLinks entry
+    _Guarded_by_(AllocationLock)
+    DWORD               ZeroedListHead;
 
     _Guarded_by_(AllocationLock)
-    BITMAP              AllocationBitmap;
+    DWORD               NumberOfZeroedFrames;
+
+    struct _EX_EVENT*   ZeroedPoolLowEvent;
 } PMM_DATA, *PPMM_DATA;
 
 static PMM_DATA m_pmmData;
@@ -53,15 +108,143 @@ _PmmDetermineMemoryLimits(
 
 static
 void
-_PmmInitializeAllocationBitmap(
+_PmmInitializeBuddyAllocator(
     IN                          PVOID                       CurrentVirtualAddress,
     IN                          QWORD                       HighestMemoryAddress,
     IN                          PINT15_MEMORY_MAP_ENTRY     MemoryEntries,
     IN                          DWORD                       NumberOfMemoryEntries,
-    OUT                         PBITMAP                     Bitmap,
+    OUT                         PPMM_BUDDY_ALLOCATOR        Buddy,
     OUT                         DWORD*                      SizeReserved
     );
 
+static
+void
+_PmmBuddyInsertBlock(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame,
+    IN          BYTE                    Order
+    );
+
+static
+void
+_PmmBuddyRemoveBlock(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame
+    );
+
+static
+DWORD
+_PmmBuddyFindFreeBlock(
+    IN          PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame
+    );
+
+static
+void
+_PmmBuddyFreeBlock(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame,
+    IN          BYTE                    Order
+    );
+
+static
+void
+_PmmBuddyFreeFrames(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame,
+    IN          DWORD                   NoOfFrames
+    );
+
+static
+BOOLEAN
+_PmmBuddyIsRangeFree(
+    IN          PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame,
+    IN          DWORD                   NoOfFrames
+    );
+
+static
+BOOLEAN
+_PmmBuddyReserveFrames(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame,
+    IN          DWORD                   NoOfFrames
+    );
+
+static
+DWORD
+_PmmBuddyAllocate(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   NoOfFrames
+    );
+
+static
+DWORD
+_PmmBuddyAllocateAbove(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   NoOfFrames,
+    IN          DWORD                   MinFrame
+    );
+
+static
+QWORD
+_PmmBuddyFindFreeRangeAbove(
+    IN          PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   NoOfFrames,
+    IN          DWORD                   MinFrame
+    );
+
+static
+BOOLEAN
+_PmmFrameCacheReserveFrame(
+    OUT         PHYSICAL_ADDRESS*       Frame
+    );
+
+static
+BOOLEAN
+_PmmFrameCacheReleaseFrame(
+    IN          PHYSICAL_ADDRESS        Frame
+    );
+
+static
+void
+_PmmFrameCacheFlushCurrent(
+    void
+    );
+
+static
+void
+_PmmFrameCacheRefill(
+    INOUT       PPMM_FRAME_CACHE        Cache
+    );
+
+static
+void
+_PmmFrameCacheDrain(
+    INOUT       PPMM_FRAME_CACHE        Cache,
+    IN          DWORD                   NoOfFrames
+    );
+
+static
+void
+_PmmFrameCacheDrainAll(
+    void
+    );
+
+static FUNC_IpcProcessEvent _PmmFrameCacheFlushIpi;
+
+static
+PHYSICAL_ADDRESS
+_PmmZeroedPoolReserveFrame(
+    void
+    );
+
+static
+void
+_PmmZeroedPoolDrain(
+    void
+    );
+
 _No_competing_thread_
 void
 PmmPreinitSystem(
@@ -77,7 +260,10 @@ PmmPreinitSystem(
         m_pmmData.MemoryRegionList[i].Type = i;
     }
 
-    LockInit(&m_pmmData.AllocationLock);
+    HotLockInit(&m_pmmData.AllocationLock);
+    HotLockSetName(&m_pmmData.AllocationLock, "PmmAllocationLock");
+
+    m_pmmData.ZeroedListHead = PMM_BUDDY_NO_FRAME;
 }
 
 _No_competing_thread_
@@ -127,21 +313,32 @@ PmmInitSystem(
     LOG("Highest Physical address present: 0x%X\n", m_pmmData.HighestPhysicalAddressPresent);
     LOG("Highest Physical address available: 0x%X\n", m_pmmData.HighestPhysicalAddressAvailable);
 
-    _PmmInitializeAllocationBitmap(BaseAddress,
-                                   (QWORD) m_pmmData.HighestPhysicalAddressPresent,
-                                   MemoryEntries,
-                                   NumberOfMemoryEntries,
-                                   &m_pmmData.AllocationBitmap,
-                                   &sizeReserved
-                                   );
+    _PmmInitializeBuddyAllocator(BaseAddress,
+                                 (QWORD) m_pmmData.HighestPhysicalAddressPresent,
+                                 MemoryEntries,
+                                 NumberOfMemoryEntries,
+                                 &m_pmmData.Buddy,
+                                 &sizeReserved
+                                 );
 
-    LOG("_PmmInitializeAllocationBitmap completed successfully\n");
+    LOG("_PmmInitializeBuddyAllocator completed successfully\n");
 
     *SizeReserved = AlignAddressUpper( sizeReserved, PAGE_SIZE );
 
     return STATUS_SUCCESS;
 }
 
+_No_competing_thread_
+void
+PmmFrameCacheCpuInit(
+    OUT         PPMM_FRAME_CACHE        Cache
+    )
+{
+    ASSERT(NULL != Cache);
+
+    memzero(Cache, sizeof(PMM_FRAME_CACHE));
+}
+
 PTR_SUCCESS
 PHYSICAL_ADDRESS
 PmmReserveMemoryEx(
@@ -170,15 +367,61 @@ PmmReserveMemoryEx(
         return NULL;
     }
 
-    LockAcquire( &m_pmmData.AllocationLock, &oldState);
-    idx = BitmapScanFromAndFlip(&m_pmmData.AllocationBitmap, (DWORD) startIdx, NoOfFrames, FALSE );
-    if (MAX_DWORD == idx)
+    if (0 == startIdx)
     {
-        LockRelease( &m_pmmData.AllocationLock, oldState);
-        return NULL;
+        PHYSICAL_ADDRESS pa;
+
+        if (1 == NoOfFrames && _PmmFrameCacheReserveFrame(&pa) && NULL != pa)
+        {
+            return pa;
+        }
+    }
+    else
+    {
+        // the frames cached by this CPU may be the ones the caller expects
+        _PmmFrameCacheFlushCurrent();
+    }
+
+    for (DWORD attempt = 0; attempt < PMM_RESERVE_ATTEMPTS; ++attempt)
+    {
+        if (PMM_RESERVE_ATTEMPTS - 1 == attempt)
+        {
+            // the kernel stacks of the destroyed threads kept for reuse are
+            // unmapped by the trim, which cannot be done while the caller
+            // holds a spinlock
+            if (INTR_ON != CpuIntrGetState())
+            {
+                break;
+            }
+
+            ThreadCacheTrim();
+        }
+
+        if (0 != attempt)
+        {
+            // the frames kept in the caches of the CPUs and in the pool of
+            // zeroed frames may be the missing ones, e.g. the buddies of the
+            // blocks left free
+            _PmmFrameCacheDrainAll();
+            _PmmZeroedPoolDrain();
+        }
+
+        HotLockAcquire( &m_pmmData.AllocationLock, &oldState);
+        idx = (0 == startIdx)
+            ? _PmmBuddyAllocate(&m_pmmData.Buddy, NoOfFrames)
+            : _PmmBuddyAllocateAbove(&m_pmmData.Buddy, NoOfFrames, (DWORD) startIdx);
+        HotLockRelease( &m_pmmData.AllocationLock, oldState);
+
+        if (PMM_BUDDY_NO_FRAME != idx)
+        {
+            break;
+        }
     }
 
-    LockRelease( &m_pmmData.AllocationLock, oldState);
+    if (PMM_BUDDY_NO_FRAME == idx)
+    {
+        return NULL;
+    }
 
     return (PHYSICAL_ADDRESS) ( (QWORD) idx * PAGE_SIZE );
 }
@@ -196,11 +439,98 @@ PmmReleaseMemory(
 
     index = (QWORD) PhysicalAddr / PAGE_SIZE;
 
-    ASSERT( index <= MAX_DWORD);
+    ASSERT( index + NoOfFrames <= m_pmmData.Buddy.NumberOfFrames);
+
+    if (1 == NoOfFrames && _PmmFrameCacheReleaseFrame(PhysicalAddr))
+    {
+        return;
+    }
+
+    HotLockAcquire( &m_pmmData.AllocationLock, &oldState);
+    _PmmBuddyFreeFrames(&m_pmmData.Buddy, (DWORD) index, NoOfFrames);
+    HotLockRelease( &m_pmmData.AllocationLock, oldState);
+}
+
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+PmmReserveZeroedMemory(
+    OUT         BOOLEAN*                Zeroed
+    )
+{
+    PHYSICAL_ADDRESS pa;
+
+    ASSERT(NULL != Zeroed);
+
+    pa = _PmmZeroedPoolReserveFrame();
+    if (NULL != pa)
+    {
+        *Zeroed = TRUE;
+        return pa;
+    }
+
+    *Zeroed = FALSE;
+
+    return PmmReserveMemory(1);
+}
+
+void
+PmmReleaseZeroedMemory(
+    IN          PHYSICAL_ADDRESS        PhysicalAddr,
+    IN          DWORD                   NoOfFrames
+    )
+{
+    QWORD index;
+    INTR_STATE oldState;
+
+    ASSERT( IsAddressAligned(PhysicalAddr, PAGE_SIZE));
+
+    index = (QWORD) PhysicalAddr / PAGE_SIZE;
+
+    ASSERT( index + NoOfFrames <= m_pmmData.Buddy.NumberOfFrames);
+
+    HotLockAcquire( &m_pmmData.AllocationLock, &oldState);
+    for (DWORD i = 0; i < NoOfFrames; ++i)
+    {
+        DWORD frame = (DWORD) index + i;
+
+        if (m_pmmData.NumberOfZeroedFrames >= PMM_ZEROED_POOL_MAX_FRAMES)
+        {
+            // the pool is full, the rest of the frames are no longer known
+            // to be zero
+            _PmmBuddyFreeFrames(&m_pmmData.Buddy, frame, NoOfFrames - i);
+            break;
+        }
+
+        ASSERT(PMM_BUDDY_NO_FRAME == _PmmBuddyFindFreeBlock(&m_pmmData.Buddy, frame));
 
-    LockAcquire( &m_pmmData.AllocationLock, &oldState);
-    BitmapClearBits(&m_pmmData.AllocationBitmap, (DWORD) index, NoOfFrames);
-    LockRelease( &m_pmmData.AllocationLock, oldState);
+        m_pmmData.Buddy.FrameLinks[frame].Next = m_pmmData.ZeroedListHead;
+        m_pmmData.ZeroedListHead = frame;
+        m_pmmData.NumberOfZeroedFrames++;
+    }
+    HotLockRelease( &m_pmmData.AllocationLock, oldState);
+}
+
+DWORD
+PmmGetZeroedFramesNeeded(
+    void
+    )
+{
+    DWORD noOfZeroedFrames;
+
+    // a snapshot is enough, the pool changes as soon as the lock is released
+    noOfZeroedFrames = m_pmmData.NumberOfZeroedFrames;
+
+    return (noOfZeroedFrames < PMM_ZEROED_POOL_TARGET) ? PMM_ZEROED_POOL_TARGET - noOfZeroedFrames : 0;
+}
+
+void
+PmmSetZeroedPoolLowEvent(
+    IN          struct _EX_EVENT*       Event
+    )
+{
+    ASSERT(NULL != Event);
+
+    m_pmmData.ZeroedPoolLowEvent = Event;
 }
 
 QWORD
@@ -293,17 +623,17 @@ _PmmDetermineMemoryLimits(
 
 static
 void
-_PmmInitializeAllocationBitmap(
+_PmmInitializeBuddyAllocator(
     IN                          PVOID                       CurrentVirtualAddress,
     IN                          QWORD                       HighestMemoryAddress,
     IN                          PINT15_MEMORY_MAP_ENTRY     MemoryEntries,
     IN                          DWORD                       NumberOfMemoryEntries,
-    OUT                         PBITMAP                     Bitmap,
+    OUT                         PPMM_BUDDY_ALLOCATOR        Buddy,
     OUT                         DWORD*                      SizeReserved
     )
 {
-    DWORD bitmapSize;
     QWORD noOfPhysicalFrames;
+    QWORD metadataSize;
     DWORD i;
     DWORD memoryType;
 
@@ -311,25 +641,35 @@ _PmmInitializeAllocationBitmap(
 
     ASSERT(NULL != CurrentVirtualAddress);
     ASSERT( 0 != HighestMemoryAddress );
-    ASSERT( NULL != Bitmap );
+    ASSERT( NULL != Buddy );
     ASSERT( NULL != SizeReserved );
 
     noOfPhysicalFrames = HighestMemoryAddress / PAGE_SIZE;
-    ASSERT( noOfPhysicalFrames <= MAX_DWORD);
+    ASSERT( noOfPhysicalFrames < MAX_DWORD);
+
+    metadataSize = noOfPhysicalFrames * (sizeof(PMM_FRAME_LINK) + sizeof(BYTE));
+    ASSERT( metadataSize <= MAX_DWORD );
+
+    Buddy->NumberOfFrames = (DWORD) noOfPhysicalFrames;
+    Buddy->FrameLinks = (PPMM_FRAME_LINK) CurrentVirtualAddress;
+    Buddy->FreeOrder = (PBYTE) PtrOffset(CurrentVirtualAddress, noOfPhysicalFrames * sizeof(PMM_FRAME_LINK));
+    Buddy->NumberOfFreeFrames = 0;
 
-    bitmapSize = BitmapPreinit(Bitmap, (DWORD) noOfPhysicalFrames);
-    BitmapInit(Bitmap, CurrentVirtualAddress );
+    for (i = 0; i <= PMM_BUDDY_MAX_ORDER; ++i)
+    {
+        Buddy->FreeListHead[i] = PMM_BUDDY_NO_FRAME;
+        Buddy->NumberOfFreeBlocks[i] = 0;
+    }
 
-    LOG("Bitmap size: %u B\n", bitmapSize );
+    LOG("Buddy allocator metadata size: %U B\n", metadataSize );
 
-    *SizeReserved = bitmapSize;
+    *SizeReserved = (DWORD) metadataSize;
 
-    // The idea here is to reserve all possible physical memory
+    // The idea here is to consider all possible physical memory reserved
     // PA 0 ----> HighestMemoryAddress
-    // and then mark as free only only usable RAM memory over 1MB
+    // and then free only usable RAM memory over 1MB
     // This means in-existent and reserved system memory will never be used
-
-    PmmReserveMemory(BitmapGetMaxElementCount(Bitmap));
+    memset(Buddy->FreeOrder, PMM_BUDDY_NO_ORDER, (DWORD) noOfPhysicalFrames);
 
     LOG("All memory is now reserved\n");
 
@@ -355,16 +695,751 @@ _PmmInitializeAllocationBitmap(
             continue;
         }
 
-        PHYSICAL_ADDRESS physAddr = (PHYSICAL_ADDRESS) AlignAddressUpper(MemoryEntries[i].BaseAddress, PAGE_SIZE);
-        QWORD noOfFrames = MemoryEntries[i].Length / PAGE_SIZE;
+        QWORD startFrame = AlignAddressUpper(MemoryEntries[i].BaseAddress, PAGE_SIZE) / PAGE_SIZE;
+        QWORD endFrame = AlignAddressLower(MemoryEntries[i].BaseAddress + MemoryEntries[i].Length, PAGE_SIZE) / PAGE_SIZE;
+
+        if (endFrame <= startFrame)
+        {
+            continue;
+        }
 
-        ASSERT( noOfFrames <= MAX_DWORD);
+        ASSERT( endFrame <= noOfPhysicalFrames);
 
-        // here it is necessary to use PmmReleaseMemory
-        PmmReleaseMemory(physAddr, (DWORD) noOfFrames );
+        // the frames are gathered in the largest blocks possible
+        _PmmBuddyFreeFrames(Buddy, (DWORD) startFrame, (DWORD) (endFrame - startFrame));
 
-        LOG("Releasing %d frames of memory starting from PA 0x%X\n", noOfFrames, physAddr );
+        LOG("Releasing %U frames of memory starting from PA 0x%X\n", endFrame - startFrame, startFrame * PAGE_SIZE );
     }
 
+    LOG("%U frames are free\n", Buddy->NumberOfFreeFrames );
+
     LOG_FUNC_END;
-}
\ No newline at end of file
+}
+
+static
+void
+_PmmBuddyInsertBlock(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame,
+    IN          BYTE                    Order
+    )
+{
+    DWORD head;
+
+    ASSERT(NULL != Buddy);
+    ASSERT(Order <= PMM_BUDDY_MAX_ORDER);
+    ASSERT(IsAddressAligned(Frame, PMM_BUDDY_BLOCK_FRAMES(Order)));
+    ASSERT((QWORD) Frame + PMM_BUDDY_BLOCK_FRAMES(Order) <= Buddy->NumberOfFrames);
+
+    // the block is placed at the head of its list, the block released last is
+    // the first to be reused
+    head = Buddy->FreeListHead[Order];
+
+    Buddy->FrameLinks[Frame].Next = head;
+    Buddy->FrameLinks[Frame].Prev = PMM_BUDDY_NO_FRAME;
+
+    if (PMM_BUDDY_NO_FRAME != head)
+    {
+        Buddy->FrameLinks[head].Prev = Frame;
+    }
+
+    Buddy->FreeListHead[Order] = Frame;
+    Buddy->FreeOrder[Frame] = Order;
+
+    Buddy->NumberOfFreeBlocks[Order]++;
+    Buddy->NumberOfFreeFrames += PMM_BUDDY_BLOCK_FRAMES(Order);
+}
+
+static
+void
+_PmmBuddyRemoveBlock(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame
+    )
+{
+    BYTE order;
+    DWORD next;
+    DWORD prev;
+
+    ASSERT(NULL != Buddy);
+
+    order = Buddy->FreeOrder[Frame];
+    ASSERT(order <= PMM_BUDDY_MAX_ORDER);
+
+    next = Buddy->FrameLinks[Frame].Next;
+    prev = Buddy->FrameLinks[Frame].Prev;
+
+    if (PMM_BUDDY_NO_FRAME != prev)
+    {
+        Buddy->FrameLinks[prev].Next = next;
+    }
+    else
+    {
+        ASSERT(Buddy->FreeListHead[order] == Frame);
+        Buddy->FreeListHead[order] = next;
+    }
+
+    if (PMM_BUDDY_NO_FRAME != next)
+    {
+        Buddy->FrameLinks[next].Prev = prev;
+    }
+
+    Buddy->FreeOrder[Frame] = PMM_BUDDY_NO_ORDER;
+
+    ASSERT(Buddy->NumberOfFreeBlocks[order] > 0);
+    Buddy->NumberOfFreeBlocks[order]--;
+    Buddy->NumberOfFreeFrames -= PMM_BUDDY_BLOCK_FRAMES(order);
+}
+
+// Returns the first frame of the free block containing Frame or
+// PMM_BUDDY_NO_FRAME if Frame is reserved
+static
+DWORD
+_PmmBuddyFindFreeBlock(
+    IN          PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame
+    )
+{
+    BYTE order;
+
+    ASSERT(NULL != Buddy);
+    ASSERT(Frame < Buddy->NumberOfFrames);
+
+    for (order = 0; order <= PMM_BUDDY_MAX_ORDER; ++order)
+    {
+        DWORD blockStart = (DWORD) AlignAddressLower(Frame, PMM_BUDDY_BLOCK_FRAMES(order));
+
+        if (Buddy->FreeOrder[blockStart] == order)
+        {
+            return blockStart;
+        }
+    }
+
+    return PMM_BUDDY_NO_FRAME;
+}
+
+static
+void
+_PmmBuddyFreeBlock(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame,
+    IN          BYTE                    Order
+    )
+{
+    DWORD frame;
+    BYTE order;
+
+    ASSERT(NULL != Buddy);
+    ASSERT(PMM_BUDDY_NO_FRAME == _PmmBuddyFindFreeBlock(Buddy, Frame));
+
+    frame = Frame;
+
+    // merge with the buddy as long as it is free as a whole
+    for (order = Order; order < PMM_BUDDY_MAX_ORDER; ++order)
+    {
+        QWORD buddyFrame = (QWORD) frame ^ PMM_BUDDY_BLOCK_FRAMES(order);
+
+        if (buddyFrame + PMM_BUDDY_BLOCK_FRAMES(order) > Buddy->NumberOfFrames)
+        {
+            break;
+        }
+
+        if (Buddy->FreeOrder[buddyFrame] != order)
+        {
+            break;
+        }
+
+        _PmmBuddyRemoveBlock(Buddy, (DWORD) buddyFrame);
+
+        frame = (DWORD) min(frame, buddyFrame);
+    }
+
+    _PmmBuddyInsertBlock(Buddy, frame, order);
+}
+
+static
+void
+_PmmBuddyFreeFrames(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame,
+    IN          DWORD                   NoOfFrames
+    )
+{
+    DWORD frame;
+    DWORD framesLeft;
+
+    ASSERT(NULL != Buddy);
+    ASSERT((QWORD) Frame + NoOfFrames <= Buddy->NumberOfFrames);
+
+    frame = Frame;
+    framesLeft = NoOfFrames;
+
+    // the range is split in the largest aligned blocks it contains
+    while (framesLeft > 0)
+    {
+        DWORD order;
+        DWORD alignment;
+
+        _BitScanReverse(&order, framesLeft);
+        if (_BitScanForward(&alignment, frame))
+        {
+            order = min(order, alignment);
+        }
+
+        _PmmBuddyFreeBlock(Buddy, frame, (BYTE) order);
+
+        frame = frame + (DWORD) PMM_BUDDY_BLOCK_FRAMES(order);
+        framesLeft = framesLeft - (DWORD) PMM_BUDDY_BLOCK_FRAMES(order);
+    }
+}
+
+static
+BOOLEAN
+_PmmBuddyIsRangeFree(
+    IN          PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame,
+    IN          DWORD                   NoOfFrames
+    )
+{
+    QWORD endFrame;
+    QWORD frame;
+
+    ASSERT(NULL != Buddy);
+    ASSERT(0 != NoOfFrames);
+
+    endFrame = (QWORD) Frame + NoOfFrames;
+    if (endFrame > Buddy->NumberOfFrames)
+    {
+        return FALSE;
+    }
+
+    // the range is covered by free blocks only if walking from block to block
+    // reaches its end
+    for (frame = Frame; frame < endFrame; )
+    {
+        DWORD blockStart = _PmmBuddyFindFreeBlock(Buddy, (DWORD) frame);
+        if (PMM_BUDDY_NO_FRAME == blockStart)
+        {
+            return FALSE;
+        }
+
+        frame = blockStart + PMM_BUDDY_BLOCK_FRAMES(Buddy->FreeOrder[blockStart]);
+    }
+
+    return TRUE;
+}
+
+// Reserves exactly the frames [Frame, Frame + NoOfFrames), returns FALSE if
+// any of them is already reserved
+static
+BOOLEAN
+_PmmBuddyReserveFrames(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   Frame,
+    IN          DWORD                   NoOfFrames
+    )
+{
+    QWORD endFrame;
+    QWORD frame;
+
+    if (!_PmmBuddyIsRangeFree(Buddy, Frame, NoOfFrames))
+    {
+        return FALSE;
+    }
+
+    endFrame = (QWORD) Frame + NoOfFrames;
+
+    for (frame = Frame; frame < endFrame; )
+    {
+        DWORD blockStart = _PmmBuddyFindFreeBlock(Buddy, (DWORD) frame);
+        QWORD blockEnd;
+
+        ASSERT(PMM_BUDDY_NO_FRAME != blockStart);
+
+        blockEnd = blockStart + PMM_BUDDY_BLOCK_FRAMES(Buddy->FreeOrder[blockStart]);
+
+        _PmmBuddyRemoveBlock(Buddy, blockStart);
+
+        // only the first and the last block may stick out of the range, their
+        // parts outside of it are given back
+        if (blockStart < frame)
+        {
+            _PmmBuddyFreeFrames(Buddy, blockStart, (DWORD) (frame - blockStart));
+        }
+
+        if (blockEnd > endFrame)
+        {
+            _PmmBuddyFreeFrames(Buddy, (DWORD) endFrame, (DWORD) (blockEnd - endFrame));
+        }
+
+        frame = blockEnd;
+    }
+
+    return TRUE;
+}
+
+static
+DWORD
+_PmmBuddyAllocate(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   NoOfFrames
+    )
+{
+    DWORD requiredOrder;
+    DWORD order;
+
+    ASSERT(NULL != Buddy);
+    ASSERT(0 != NoOfFrames);
+
+    _BitScanReverse(&requiredOrder, NoOfFrames);
+    if (PMM_BUDDY_BLOCK_FRAMES(requiredOrder) != NoOfFrames)
+    {
+        requiredOrder++;
+    }
+
+    for (order = requiredOrder; order <= PMM_BUDDY_MAX_ORDER; ++order)
+    {
+        DWORD blockStart = Buddy->FreeListHead[order];
+
+        if (PMM_BUDDY_NO_FRAME == blockStart)
+        {
+            continue;
+        }
+
+        _PmmBuddyRemoveBlock(Buddy, blockStart);
+
+        // the frames past the request are split into the blocks of lower
+        // orders they are made of
+        if (PMM_BUDDY_BLOCK_FRAMES(order) > NoOfFrames)
+        {
+            _PmmBuddyFreeFrames(Buddy,
+                                blockStart + NoOfFrames,
+                                (DWORD) (PMM_BUDDY_BLOCK_FRAMES(order) - NoOfFrames));
+        }
+
+        return blockStart;
+    }
+
+    return PMM_BUDDY_NO_FRAME;
+}
+
+static
+DWORD
+_PmmBuddyAllocateAbove(
+    INOUT       PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   NoOfFrames,
+    IN          DWORD                   MinFrame
+    )
+{
+    DWORD requiredOrder;
+    DWORD order;
+    DWORD blockStart;
+    QWORD alignedMinFrame;
+    QWORD bestFrame;
+
+    ASSERT(NULL != Buddy);
+    ASSERT(0 != NoOfFrames);
+
+    // the callers asking for a minimum address usually want exactly that
+    // address, e.g. the MMU reserving the frames already used by the kernel
+    if (_PmmBuddyReserveFrames(Buddy, MinFrame, NoOfFrames))
+    {
+        return MinFrame;
+    }
+
+    _BitScanReverse(&requiredOrder, NoOfFrames);
+    if (PMM_BUDDY_BLOCK_FRAMES(requiredOrder) != NoOfFrames)
+    {
+        requiredOrder++;
+    }
+
+    if (requiredOrder > PMM_BUDDY_MAX_ORDER
+        || (QWORD) MinFrame + NoOfFrames > Buddy->NumberOfFrames)
+    {
+        return PMM_BUDDY_NO_FRAME;
+    }
+
+    bestFrame = MAX_QWORD;
+
+    // an aligned block may not fit below the end of memory while an unaligned
+    // range still does, it is found by the full search below
+    alignedMinFrame = AlignAddressUpper(MinFrame, PMM_BUDDY_BLOCK_FRAMES(requiredOrder));
+    if (alignedMinFrame + PMM_BUDDY_BLOCK_FRAMES(requiredOrder) <= Buddy->NumberOfFrames)
+    {
+        // a free block large enough containing the aligned minimum frame gives
+        // the lowest address possible
+        blockStart = _PmmBuddyFindFreeBlock(Buddy, (DWORD) alignedMinFrame);
+        if (PMM_BUDDY_NO_FRAME != blockStart && Buddy->FreeOrder[blockStart] >= requiredOrder)
+        {
+            bestFrame = alignedMinFrame;
+        }
+        else
+        {
+            // else any block large enough starting above the minimum frame
+            // fits, the lists are not sorted by address so only their first
+            // blocks are looked at and the lowest of those is taken
+            for (order = requiredOrder; order <= PMM_BUDDY_MAX_ORDER; ++order)
+            {
+                DWORD blocksLeft = PMM_BUDDY_ABOVE_SCAN_BLOCKS;
+
+                for (blockStart = Buddy->FreeListHead[order];
+                     PMM_BUDDY_NO_FRAME != blockStart && blocksLeft > 0;
+                     blockStart = Buddy->FrameLinks[blockStart].Next, --blocksLeft)
+                {
+                    if (blockStart >= alignedMinFrame && blockStart < bestFrame)
+                    {
+                        bestFrame = blockStart;
+                    }
+                }
+            }
+        }
+    }
+
+    if (MAX_QWORD == bestFrame)
+    {
+        // the fitting blocks may all be past the ones looked at or the frames
+        // may only be free as a run of smaller blocks, we must not report an
+        // out of memory before looking at all of them
+        bestFrame = _PmmBuddyFindFreeRangeAbove(Buddy, NoOfFrames, MinFrame);
+        if (MAX_QWORD == bestFrame)
+        {
+            return PMM_BUDDY_NO_FRAME;
+        }
+    }
+
+    if (!_PmmBuddyReserveFrames(Buddy, (DWORD) bestFrame, NoOfFrames))
+    {
+        // the candidate was found in a free block
+        NOT_REACHED;
+    }
+
+    return (DWORD) bestFrame;
+}
+
+// Returns the lowest frame above MinFrame starting NoOfFrames free frames or
+// MAX_QWORD. Such a range starts either at MinFrame or at the first frame of
+// a free block => all the free blocks are looked at.
+static
+QWORD
+_PmmBuddyFindFreeRangeAbove(
+    IN          PPMM_BUDDY_ALLOCATOR    Buddy,
+    IN          DWORD                   NoOfFrames,
+    IN          DWORD                   MinFrame
+    )
+{
+    QWORD bestFrame;
+    DWORD order;
+    DWORD blockStart;
+
+    ASSERT(NULL != Buddy);
+    ASSERT(0 != NoOfFrames);
+
+    bestFrame = MAX_QWORD;
+
+    for (order = 0; order <= PMM_BUDDY_MAX_ORDER; ++order)
+    {
+        for (blockStart = Buddy->FreeListHead[order];
+             PMM_BUDDY_NO_FRAME != blockStart;
+             blockStart = Buddy->FrameLinks[blockStart].Next)
+        {
+            QWORD candidate;
+
+            if (blockStart + PMM_BUDDY_BLOCK_FRAMES(order) <= MinFrame)
+            {
+                continue;
+            }
+
+            candidate = max(blockStart, MinFrame);
+            if (candidate < bestFrame && _PmmBuddyIsRangeFree(Buddy, (DWORD) candidate, NoOfFrames))
+            {
+                bestFrame = candidate;
+            }
+        }
+    }
+
+    return bestFrame;
+}
+
+// Returns FALSE if the current CPU has no cache yet, else Frame is NULL if
+// neither the cache nor the buddy allocator have a free frame left
+static
+BOOLEAN
+_PmmFrameCacheReserveFrame(
+    OUT         PHYSICAL_ADDRESS*       Frame
+    )
+{
+    INTR_STATE oldState;
+    PPCPU pCpu;
+    PPMM_FRAME_CACHE pCache;
+
+    ASSERT(NULL != Frame);
+
+    oldState = CpuIntrDisable();
+
+    pCpu = GetCurrentPcpu();
+    if (NULL == pCpu)
+    {
+        // in the early stages the PCPU may have not been yet set
+        CpuIntrSetState(oldState);
+        return FALSE;
+    }
+
+    pCache = &pCpu->FrameCache;
+
+    if (0 == pCache->NumberOfFrames)
+    {
+        _PmmFrameCacheRefill(pCache);
+    }
+
+    *Frame = (0 != pCache->NumberOfFrames) ? pCache->Frames[--pCache->NumberOfFrames] : NULL;
+
+    CpuIntrSetState(oldState);
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+_PmmFrameCacheReleaseFrame(
+    IN          PHYSICAL_ADDRESS        Frame
+    )
+{
+    INTR_STATE oldState;
+    PPCPU pCpu;
+    PPMM_FRAME_CACHE pCache;
+
+    oldState = CpuIntrDisable();
+
+    pCpu = GetCurrentPcpu();
+    if (NULL == pCpu)
+    {
+        CpuIntrSetState(oldState);
+        return FALSE;
+    }
+
+    pCache = &pCpu->FrameCache;
+
+    if (PMM_FRAME_CACHE_CAPACITY == pCache->NumberOfFrames)
+    {
+        _PmmFrameCacheDrain(pCache, PMM_FRAME_CACHE_BATCH);
+    }
+
+    pCache->Frames[pCache->NumberOfFrames++] = Frame;
+
+    CpuIntrSetState(oldState);
+
+    return TRUE;
+}
+
+static
+void
+_PmmFrameCacheFlushCurrent(
+    void
+    )
+{
+    INTR_STATE oldState;
+    PPCPU pCpu;
+
+    oldState = CpuIntrDisable();
+
+    pCpu = GetCurrentPcpu();
+    if (NULL != pCpu)
+    {
+        _PmmFrameCacheDrain(&pCpu->FrameCache, pCpu->FrameCache.NumberOfFrames);
+    }
+
+    CpuIntrSetState(oldState);
+}
+
+static
+void
+_PmmFrameCacheRefill(
+    INOUT       PPMM_FRAME_CACHE        Cache
+    )
+{
+    INTR_STATE dummyState;
+
+    ASSERT(NULL != Cache);
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    HotLockAcquire(&m_pmmData.AllocationLock, &dummyState);
+    while (Cache->NumberOfFrames < PMM_FRAME_CACHE_BATCH)
+    {
+        DWORD idx = _PmmBuddyAllocate(&m_pmmData.Buddy, 1);
+        if (PMM_BUDDY_NO_FRAME == idx)
+        {
+            break;
+        }
+
+        Cache->Frames[Cache->NumberOfFrames++] = (PHYSICAL_ADDRESS) ((QWORD) idx * PAGE_SIZE);
+    }
+    HotLockRelease(&m_pmmData.AllocationLock, dummyState);
+}
+
+// Gives the NoOfFrames frames released first back to the buddy allocator, the
+// ones released last are kept as they are more likely to be in the caches
+static
+void
+_PmmFrameCacheDrain(
+    INOUT       PPMM_FRAME_CACHE        Cache,
+    IN          DWORD                   NoOfFrames
+    )
+{
+    INTR_STATE dummyState;
+    DWORD i;
+
+    ASSERT(NULL != Cache);
+    ASSERT(NoOfFrames <= Cache->NumberOfFrames);
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    if (0 == NoOfFrames)
+    {
+        return;
+    }
+
+    HotLockAcquire(&m_pmmData.AllocationLock, &dummyState);
+    for (i = 0; i < NoOfFrames; ++i)
+    {
+        _PmmBuddyFreeFrames(&m_pmmData.Buddy, (DWORD) ((QWORD) Cache->Frames[i] / PAGE_SIZE), 1);
+    }
+    HotLockRelease(&m_pmmData.AllocationLock, dummyState);
+
+    for (i = NoOfFrames; i < Cache->NumberOfFrames; ++i)
+    {
+        Cache->Frames[i - NoOfFrames] = Cache->Frames[i];
+    }
+
+    Cache->NumberOfFrames = Cache->NumberOfFrames - NoOfFrames;
+}
+
+// Gives all the frames cached by the CPUs back to the buddy allocator, called
+// once the buddy allocator runs out of frames. A cache is emptied only by its
+// own CPU, the other CPUs are asked to do it through an IPI.
+static
+void
+_PmmFrameCacheDrainAll(
+    void
+    )
+{
+    PLIST_ENTRY pCpuListHead;
+    PLIST_ENTRY pCurEntry;
+    BOOLEAN bRemoteFrames;
+    STATUS status;
+
+    _PmmFrameCacheFlushCurrent();
+
+    // the list is empty until the SMP module is initialized, only the cache
+    // of the current CPU may exist then
+    SmpGetCpuList(&pCpuListHead);
+
+    bRemoteFrames = FALSE;
+    for (pCurEntry = pCpuListHead->Flink;
+         pCurEntry != pCpuListHead;
+         pCurEntry = pCurEntry->Flink)
+    {
+        // a glance is enough, a frame cached meanwhile is found on the next
+        // attempt
+        if (0 != CONTAINING_RECORD(pCurEntry, PCPU, ListEntry)->FrameCache.NumberOfFrames)
+        {
+            bRemoteFrames = TRUE;
+            break;
+        }
+    }
+
+    // waiting for the other CPUs to handle the IPI with interrupts disabled
+    // could deadlock with one of them doing the same, their caches are left
+    // alone then
+    if (!bRemoteFrames || INTR_ON != CpuIntrGetState())
+    {
+        return;
+    }
+
+    status = SmpSendGenericIpi(_PmmFrameCacheFlushIpi, NULL, NULL, NULL, TRUE);
+    if (!SUCCEEDED(status) && STATUS_CPU_NO_MATCHES != status)
+    {
+        LOG_FUNC_ERROR("SmpSendGenericIpi", status);
+    }
+}
+
+static
+STATUS
+(__cdecl _PmmFrameCacheFlushIpi)(
+    IN_OPT      PVOID                   Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    _PmmFrameCacheFlushCurrent();
+
+    return STATUS_SUCCESS;
+}
+
+static
+PHYSICAL_ADDRESS
+_PmmZeroedPoolReserveFrame(
+    void
+    )
+{
+    INTR_STATE oldState;
+    DWORD frame;
+    BOOLEAN bPoolLow;
+
+    // the page faults must not contend on the PMM lock once the pool is
+    // empty, a frame missed because of a stale count only has to be zeroed
+    // by the caller
+    if (0 == *((volatile DWORD*) &m_pmmData.NumberOfZeroedFrames))
+    {
+        return NULL;
+    }
+
+    bPoolLow = FALSE;
+
+    HotLockAcquire(&m_pmmData.AllocationLock, &oldState);
+    frame = m_pmmData.ZeroedListHead;
+    if (PMM_BUDDY_NO_FRAME != frame)
+    {
+        m_pmmData.ZeroedListHead = m_pmmData.Buddy.FrameLinks[frame].Next;
+        m_pmmData.NumberOfZeroedFrames--;
+
+        // the worker is woken only once each time the pool drops below the
+        // threshold, it refills the pool up to the target on its own
+        bPoolLow = (PMM_ZEROED_POOL_LOW - 1 == m_pmmData.NumberOfZeroedFrames);
+    }
+    HotLockRelease(&m_pmmData.AllocationLock, oldState);
+
+    if (bPoolLow && NULL != m_pmmData.ZeroedPoolLowEvent)
+    {
+        ExEventSignal(m_pmmData.ZeroedPoolLowEvent);
+    }
+
+    return (PMM_BUDDY_NO_FRAME != frame) ? (PHYSICAL_ADDRESS) ((QWORD) frame * PAGE_SIZE) : NULL;
+}
+
+// Gives all the zeroed frames back to the buddy allocator, called once it runs
+// out of frames: the pool is refilled by the zero worker later on
+static
+void
+_PmmZeroedPoolDrain(
+    void
+    )
+{
+    INTR_STATE oldState;
+
+    if (0 == *((volatile DWORD*) &m_pmmData.NumberOfZeroedFrames))
+    {
+        return;
+    }
+
+    HotLockAcquire(&m_pmmData.AllocationLock, &oldState);
+    while (PMM_BUDDY_NO_FRAME != m_pmmData.ZeroedListHead)
+    {
+        DWORD frame = m_pmmData.ZeroedListHead;
+
+        m_pmmData.ZeroedListHead = m_pmmData.Buddy.FrameLinks[frame].Next;
+        m_pmmData.NumberOfZeroedFrames--;
+
+        _PmmBuddyFreeFrames(&m_pmmData.Buddy, frame, 1);
+    }
+    ASSERT(0 == m_pmmData.NumberOfZeroedFrames);
+    HotLockRelease(&m_pmmData.AllocationLock, oldState);
+}
@@ -101,6 +101,9 @@ _ProcessParseCommandLine(
 // Called when the reference count reaches zero
 static FUNC_FreeFunction            _ProcessDestroy;
 
+// Called after the RCU grace period which follows _ProcessDestroy
+static FUNC_RcuCallback             _ProcessFree;
+
 _No_competing_thread_
 void
 ProcessSystemPreinit(
@@ -168,6 +171,7 @@ ProcessExecuteForEachProcessEntry(
     )
 {
     STATUS status;
+    INTR_STATE oldState;
 
     if (NULL == Function)
     {
@@ -176,13 +180,15 @@ ProcessExecuteForEachProcessEntry(
 
     status = STATUS_SUCCESS;
 
-    MutexAcquire(&m_processData.ProcessListLock);
+    // ProcessListLock only serializes the writers, the processes removed from
+    // the list are freed after an RCU grace period
+    oldState = RcuReadLock();
     status = ForEachElementExecute(&m_processData.ProcessList,
                                    Function,
                                    Context,
                                    FALSE
                                    );
-    MutexRelease(&m_processData.ProcessListLock);
+    RcuReadUnlock(oldState);
 
     return status;
 }
@@ -513,7 +519,7 @@ _ProcessInit(
         pProcess->Id = _ProcessSystemRetrieveNextPid();
 
         MutexAcquire(&m_processData.ProcessListLock);
-        InsertTailList(&m_processData.ProcessList, &pProcess->NextProcess);
+        RcuInsertTailList(&m_processData.ProcessList, &pProcess->NextProcess);
         MutexRelease(&m_processData.ProcessListLock);
 
         LOG_TRACE_PROCESS("Process with PID 0x%X created\n", pProcess->Id);
@@ -727,9 +733,36 @@ _ProcessDestroy(
     // InitializeListHead => the RemoveEntryList has no problem with an empty list as long as it
     // is initialized :)
     MutexAcquire(&m_processData.ProcessListLock);
-    RemoveEntryList(&Process->NextProcess);
+    RcuRemoveEntryList(&Process->NextProcess);
     MutexRelease(&m_processData.ProcessListLock);
 
+    // Because the system process will never be destroyed it is ok to free
+    // these memory addresses unconditionally
+    MmuDestroyAddressSpaceForProcess(Process);
+
+    if (Process->Id != 0)
+    {
+        // This should be done only after MmuDestroyVirtualSpaceForProcess, that
+        // function is also responsible for destroying all cached translations for
+        // this process ID
+        _ProcessSystemFreePid(Process->Id);
+    }
+
+    // the structure and the strings printed by the lock-free walkers of the
+    // process list are released only after they are done
+    RcuCall(&Process->RcuHead, _ProcessFree);
+}
+
+static
+void
+(__cdecl _ProcessFree)(
+    IN      PRCU_HEAD               Head
+    )
+{
+    PPROCESS Process = CONTAINING_RECORD(Head, PROCESS, RcuHead);
+
+    ASSERT(NULL != Process);
+
     if (NULL != Process->FullCommandLine)
     {
         ExFreePoolWithTag(Process->FullCommandLine, HEAP_PROCESS_TAG);
@@ -748,17 +781,5 @@ _ProcessDestroy(
         Process->HeaderInfo = NULL;
     }
 
-    // Because the system process will never be destroyed it is ok to free
-    // these memory addresses unconditionally
-    MmuDestroyAddressSpaceForProcess(Process);
-
-    if (Process->Id != 0)
-    {
-        // This should be done only after MmuDestroyVirtualSpaceForProcess, that
-        // function is also responsible for destroying all cached translations for
-        // this process ID
-        _ProcessSystemFreePid(Process->Id);
-    }
-
     ExFreePoolWithTag(Process, HEAP_PROCESS_TAG);
 }
@@ -0,0 +1,126 @@
+#include "HAL9000.h"
+#include "queued_lock.h"
+#include "cpumu.h"
+
+// Number of pause instructions a waiter executes between two reads of the
+// lock for each CPU which is served before it
+#define QUEUED_LOCK_PAUSES_PER_WAITER       16
+
+_No_competing_thread_
+void
+QueuedLockInit(
+    OUT         PQUEUED_LOCK    Lock
+    )
+{
+    ASSERT(NULL != Lock);
+
+    memzero(Lock, sizeof(QUEUED_LOCK));
+
+    LOCK_STATS_INIT(&Lock->StatsInstance);
+}
+
+ACQUIRES_EXCL_AND_NON_REENTRANT_LOCK(*Lock)
+REQUIRES_NOT_HELD_LOCK(*Lock)
+void
+QueuedLockAcquire(
+    INOUT       PQUEUED_LOCK    Lock,
+    OUT         INTR_STATE*     IntrState
+    )
+{
+    DWORD ticket;
+    DWORD waitersAhead;
+    DWORD i;
+    LOCK_STATS_DECLARE_WAIT(wait);
+
+    ASSERT(NULL != Lock);
+    ASSERT(NULL != IntrState);
+
+    *IntrState = CpuIntrDisable();
+
+    ASSERT_INFO(CpuGetCurrent() != Lock->Holder, "Lock is not reentrant!\n");
+
+    LOCK_STATS_WAIT_BEGIN(wait, FALSE);
+
+    ticket = _InterlockedExchangeAdd((volatile long*) &Lock->NextTicket, 1);
+
+    // the difference is correct even after the counters wrap around
+    while (0 != (waitersAhead = ticket - Lock->NowServing))
+    {
+        LOCK_STATS_WAIT_CONTENDED(wait);
+
+        for (i = 0; i < waitersAhead * QUEUED_LOCK_PAUSES_PER_WAITER; ++i)
+        {
+            _mm_pause();
+        }
+    }
+
+    Lock->Holder = CpuGetCurrent();
+
+    LOCK_STATS_ACQUIRED(&Lock->StatsInstance, wait);
+}
+
+_When_(return, _Acquires_exclusive_lock_(*Lock))
+BOOLEAN
+QueuedLockTryAcquire(
+    INOUT       PQUEUED_LOCK    Lock,
+    OUT         INTR_STATE*     IntrState
+    )
+{
+    DWORD nowServing;
+    INTR_STATE oldState;
+
+    ASSERT(NULL != Lock);
+    ASSERT(NULL != IntrState);
+
+    oldState = CpuIntrDisable();
+
+    // the lock is free and nobody waits for it only if the next ticket to be
+    // handed out is the one being served
+    nowServing = Lock->NowServing;
+    if (nowServing != (DWORD) _InterlockedCompareExchange((volatile long*) &Lock->NextTicket,
+                                                          nowServing + 1,
+                                                          nowServing))
+    {
+        CpuIntrSetState(oldState);
+        return FALSE;
+    }
+
+    Lock->Holder = CpuGetCurrent();
+    *IntrState = oldState;
+
+    LOCK_STATS_ACQUIRED_NO_WAIT(&Lock->StatsInstance);
+
+    return TRUE;
+}
+
+RELEASES_EXCL_AND_NON_REENTRANT_LOCK(*Lock)
+REQUIRES_EXCL_LOCK(*Lock)
+void
+QueuedLockRelease(
+    INOUT       PQUEUED_LOCK    Lock,
+    IN          INTR_STATE      OldIntrState
+    )
+{
+    ASSERT(NULL != Lock);
+    ASSERT_INFO(QueuedLockIsOwner(Lock), "Lock is held by 0x%X\n", Lock->Holder);
+
+    LOCK_STATS_RELEASED(&Lock->StatsInstance);
+
+    Lock->Holder = NULL;
+
+    // only the holder modifies NowServing, the interlocked operation is used
+    // for its full barrier semantics
+    _InterlockedIncrement((volatile long*) &Lock->NowServing);
+
+    CpuIntrSetState(OldIntrState);
+}
+
+BOOLEAN
+QueuedLockIsOwner(
+    IN          PQUEUED_LOCK    Lock
+    )
+{
+    ASSERT(NULL != Lock);
+
+    return CpuGetCurrent() == Lock->Holder;
+}
@@ -0,0 +1,256 @@
+#include "HAL9000.h"
+#include "rcu.h"
+#include "cpumu.h"
+#include "smp.h"
+#include "thread_internal.h"
+
+// A callback queued in epoch E may run once the global epoch reaches E + 2:
+// the epoch advances from E to E + 1 only after all the readers which started
+// before E + 1 was reached ended
+#define RCU_GRACE_PERIOD_EPOCHS         2
+
+typedef struct _RCU_DATA
+{
+    volatile QWORD          GlobalEpoch;
+
+    // Number of callbacks queued on all the CPUs, the epoch is advanced only
+    // if someone is waiting for it
+    volatile DWORD          PendingCallbacks;
+    volatile DWORD          SynchronizeWaiters;
+} RCU_DATA, *PRCU_DATA;
+
+static RCU_DATA m_rcuData;
+
+static
+void
+_RcuTryAdvanceEpoch(
+    void
+    );
+
+_No_competing_thread_
+void
+RcuSystemPreinit(
+    void
+    )
+{
+    memzero(&m_rcuData, sizeof(RCU_DATA));
+}
+
+_No_competing_thread_
+void
+RcuCpuInit(
+    OUT     PRCU_CPU_DATA           CpuData
+    )
+{
+    ASSERT(NULL != CpuData);
+
+    memzero(CpuData, sizeof(RCU_CPU_DATA));
+
+    InitializeListHead(&CpuData->Callbacks);
+}
+
+INTR_STATE
+RcuReadLock(
+    void
+    )
+{
+    INTR_STATE oldState;
+    PRCU_CPU_DATA pRcu;
+
+    oldState = CpuIntrDisable();
+
+    pRcu = &GetCurrentPcpu()->RcuData;
+
+    pRcu->Nesting++;
+    if (1 == pRcu->Nesting)
+    {
+        pRcu->Epoch = m_rcuData.GlobalEpoch;
+
+        // the exchange is a full barrier: the writers advancing the epoch see
+        // us active before we read any list entry
+        _InterlockedExchange8((volatile char*) &pRcu->Active, TRUE);
+    }
+
+    return oldState;
+}
+
+void
+RcuReadUnlock(
+    IN      INTR_STATE              OldIntrState
+    )
+{
+    PRCU_CPU_DATA pRcu;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pRcu = &GetCurrentPcpu()->RcuData;
+
+    ASSERT(pRcu->Nesting > 0);
+
+    pRcu->Nesting--;
+    if (0 == pRcu->Nesting)
+    {
+        _InterlockedExchange8((volatile char*) &pRcu->Active, FALSE);
+    }
+
+    CpuIntrSetState(OldIntrState);
+}
+
+void
+RcuCall(
+    INOUT   PRCU_HEAD               Head,
+    IN      PFUNC_RcuCallback       Callback
+    )
+{
+    INTR_STATE oldState;
+
+    ASSERT(NULL != Head);
+    ASSERT(NULL != Callback);
+
+    Head->Callback = Callback;
+
+    oldState = CpuIntrDisable();
+
+    // the element was already unlinked, the fence makes the unlink visible
+    // before the epoch is read => readers which observe a later epoch cannot
+    // reach the element
+    _mm_mfence();
+    Head->Epoch = m_rcuData.GlobalEpoch;
+    InsertTailList(&GetCurrentPcpu()->RcuData.Callbacks, &Head->ListEntry);
+    _InterlockedIncrement((volatile long*) &m_rcuData.PendingCallbacks);
+
+    CpuIntrSetState(oldState);
+}
+
+void
+RcuSynchronize(
+    void
+    )
+{
+    QWORD targetEpoch;
+
+    ASSERT(INTR_ON == CpuIntrGetState());
+
+    targetEpoch = m_rcuData.GlobalEpoch + RCU_GRACE_PERIOD_EPOCHS;
+
+    _InterlockedIncrement((volatile long*) &m_rcuData.SynchronizeWaiters);
+    while (m_rcuData.GlobalEpoch < targetEpoch)
+    {
+        _RcuTryAdvanceEpoch();
+        ThreadYield();
+    }
+    _InterlockedDecrement((volatile long*) &m_rcuData.SynchronizeWaiters);
+}
+
+void
+RcuQuiescentState(
+    void
+    )
+{
+    PRCU_CPU_DATA pRcu;
+    PLIST_ENTRY pEntry;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    if (0 == m_rcuData.PendingCallbacks && 0 == m_rcuData.SynchronizeWaiters)
+    {
+        return;
+    }
+
+    _RcuTryAdvanceEpoch();
+
+    pRcu = &GetCurrentPcpu()->RcuData;
+    ASSERT(0 == pRcu->Nesting);
+
+    for (pEntry = pRcu->Callbacks.Flink;
+         pEntry != &pRcu->Callbacks;
+         pEntry = pRcu->Callbacks.Flink)
+    {
+        PRCU_HEAD pHead = CONTAINING_RECORD(pEntry, RCU_HEAD, ListEntry);
+
+        // the callbacks are ordered by epoch
+        if (pHead->Epoch + RCU_GRACE_PERIOD_EPOCHS > m_rcuData.GlobalEpoch)
+        {
+            break;
+        }
+
+        RemoveEntryList(pEntry);
+        _InterlockedDecrement((volatile long*) &m_rcuData.PendingCallbacks);
+
+        pHead->Callback(pHead);
+    }
+}
+
+void
+RcuInsertTailList(
+    INOUT   PLIST_ENTRY             ListHead,
+    INOUT   PLIST_ENTRY             Entry
+    )
+{
+    PLIST_ENTRY pLastEntry;
+
+    ASSERT(NULL != ListHead);
+    ASSERT(NULL != Entry);
+
+    pLastEntry = ListHead->Blink;
+
+    Entry->Flink = ListHead;
+    Entry->Blink = pLastEntry;
+
+    // the entry must be completely initialized before it becomes reachable,
+    // x86 does not reorder stores => a compiler barrier is enough
+    _WriteBarrier();
+
+    pLastEntry->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+void
+RcuRemoveEntryList(
+    INOUT   PLIST_ENTRY             Entry
+    )
+{
+    PLIST_ENTRY pPrevEntry;
+    PLIST_ENTRY pNextEntry;
+
+    ASSERT(NULL != Entry);
+
+    pPrevEntry = Entry->Blink;
+    pNextEntry = Entry->Flink;
+
+    pPrevEntry->Flink = pNextEntry;
+    pNextEntry->Blink = pPrevEntry;
+}
+
+static
+void
+_RcuTryAdvanceEpoch(
+    void
+    )
+{
+    PLIST_ENTRY pCpuListHead;
+    PLIST_ENTRY pCurEntry;
+    QWORD currentEpoch;
+
+    currentEpoch = m_rcuData.GlobalEpoch;
+
+    pCpuListHead = NULL;
+    SmpGetCpuList(&pCpuListHead);
+
+    // the epoch cannot advance while a CPU is still inside a read-side
+    // section started in a previous epoch
+    for (pCurEntry = pCpuListHead->Flink;
+         pCurEntry != pCpuListHead;
+         pCurEntry = pCurEntry->Flink)
+    {
+        PPCPU pCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+
+        if (pCpu->RcuData.Active && pCpu->RcuData.Epoch != currentEpoch)
+        {
+            return;
+        }
+    }
+
+    // if someone else advanced it in the meantime we have nothing to do
+    _InterlockedCompareExchange64((volatile __int64*) &m_rcuData.GlobalEpoch, currentEpoch + 1, currentEpoch);
+}
@@ -9,6 +9,9 @@
 #include "io.h"
 #include "ex_event.h"
 #include "hw_fpu.h"
+#include "ex_system.h"
+#include "tsc_clock.h"
+#include "thread_internal.h"
 
 extern void ApAsmStub();
 
@@ -38,6 +41,7 @@ typedef struct _SMP_DATA
     BYTE                    ApicTimerVector;
     BYTE                    IpcIpiVector;
     BYTE                    AssertIpiVector;
+    BYTE                    RescheduleIpiVector;
 } SMP_DATA, *PSMP_DATA;
 
 static SMP_DATA m_smpData;
@@ -157,6 +161,7 @@ _SmpSetupInitialApStack(
 static FUNC_InterruptFunction       _SmpApicTimerIsr;
 static FUNC_InterruptFunction       _SmpAssertIpiIsr;
 static FUNC_InterruptFunction       _SmpIpcIpiIsr;
+static FUNC_InterruptFunction       _SmpRescheduleIpiIsr;
 
 _No_competing_thread_
 void
@@ -344,6 +349,10 @@ SmpWakeupAps(
         ExEventWaitForSignal(&m_smpData.ApStartupEvent);
 
         LOGL("Aps have waken UP\n");
+
+        // the APs compared their TSCs with the value read by the BSP before
+        // they were started and with each other, the BSP must not be behind them
+        TscClockCheckCpu();
     }
     else
     {
@@ -585,6 +594,26 @@ SmpGetCpuList(
     *CpuList = &m_smpData.CpuList;
 }
 
+void
+SmpSendRescheduleIpi(
+    IN      CPU_AFFINITY            Cpus
+    )
+{
+    BYTE vector;
+
+    vector = m_smpData.RescheduleIpiVector;
+
+    // the vector is 0 until the SMP interrupt routines are installed, there
+    // is no other CPU to notify until then
+    if (0 == Cpus || 0 == vector)
+    {
+        return;
+    }
+
+    // a single logical destination message reaches all the CPUs in the group
+    LapicSystemSendIpi(Cpus, ApicDeliveryModeFixed, ApicDestinationShorthandNone, ApicDestinationModeLogical, &vector);
+}
+
 DWORD
 SmpGetNumberOfActiveCpus(
     void
@@ -665,6 +694,13 @@ _SmpInstallInterruptRoutines(
         return status;
     }
 
+    status = _SmpInstallInterruptRoutine(_SmpRescheduleIpiIsr, IrqlIpiLevel, &m_smpData.RescheduleIpiVector );
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("_SmpInstallInterruptRoutine", status);
+        return status;
+    }
+
     LOG_FUNC_END;
 
     return status;
@@ -785,9 +821,18 @@ BOOLEAN
 {
     ASSERT( NULL != Device );
 
-    LOGPL("What are we doing here??\n");
+    if (LapicSystemHandleTimerInterrupt())
+    {
+        // the LAPIC timer of each CPU gives the scheduler tick
+        ExSystemTimerTick();
+    }
+    else
+    {
+        // the interrupt was requested only for the nearest timer deadline
+        ExTimerTick();
+    }
 
-    return FALSE;
+    return TRUE;
 }
 
 static
@@ -804,6 +849,33 @@ BOOLEAN
     return FALSE;
 }
 
+static
+BOOLEAN
+(__cdecl _SmpRescheduleIpiIsr)(
+    IN        PDEVICE_OBJECT           Device
+    )
+{
+    ASSERT( NULL != Device );
+
+    // another CPU armed a timer on our wheel which is due earlier than the
+    // LAPIC deadline we programmed, this does not concern the running thread
+    if (ExTimerReprogramDeadline())
+    {
+        // the IPIs sent meanwhile for a thread made ready are merged with
+        // this one, the ready queues tell if there was such an IPI
+        ThreadRequestPreemptIfNeeded();
+    }
+    else
+    {
+        // a thread which should run instead of the current one was made ready
+        // by another CPU (an idle CPU is also taken out of HLT by the
+        // interrupt)
+        ThreadRequestPreemptOnInterrupt();
+    }
+
+    return TRUE;
+}
+
 static
 BOOLEAN
 (__cdecl _SmpIpcIpiIsr)(
@@ -7,11 +7,18 @@
 #include "mmu.h"
 #include "process_internal.h"
 #include "dmp_cpu.h"
+#include "futex.h"
 
 extern void SyscallEntry();
 
 #define SYSCALL_IF_VERSION_KM       SYSCALL_IMPLEMENTED_IF_VERSION
 
+// The shared syscall_no.h and syscall_func.h are not part of this tree: until
+// SyscallIdFutexWait and SyscallIdFutexWake and their user-mode stubs are
+// added there, the futex calls take the first IDs after the shared ones
+#define SYSCALL_ID_FUTEX_WAIT       ((SYSCALL_ID) (SyscallIdReserved))
+#define SYSCALL_ID_FUTEX_WAKE       ((SYSCALL_ID) (SyscallIdReserved + 1))
+
 void
 SyscallHandler(
     INOUT   COMPLETE_PROCESSOR_STATE    *CompleteProcessorState
@@ -67,6 +74,16 @@ SyscallHandler(
         case SyscallIdIdentifyVersion:
             status = SyscallValidateInterface((SYSCALL_IF_VERSION)*pSyscallParameters);
             break;
+        case SYSCALL_ID_FUTEX_WAIT:
+            status = FutexWait((PVOID)pSyscallParameters[0],
+                               (DWORD)pSyscallParameters[1],
+                               pSyscallParameters[2]);
+            break;
+        case SYSCALL_ID_FUTEX_WAKE:
+            status = FutexWake((PVOID)pSyscallParameters[0],
+                               (DWORD)pSyscallParameters[1],
+                               NULL);
+            break;
         // STUDENT TODO: implement the rest of the syscalls
         default:
             LOG_ERROR("Unimplemented syscall called from User-space!\n");
@@ -90,7 +107,7 @@ SyscallPreinitSystem(
     void
     )
 {
-
+    FutexSystemPreinit();
 }
 
 STATUS
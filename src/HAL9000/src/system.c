@@ -21,10 +21,20 @@
 #include "ex_system.h"
 #include "process_internal.h"
 #include "boot_module.h"
+#include "syscall.h"
+#include "rcu.h"
+#include "dpc.h"
+#include "ex_work_queue.h"
 
 #define NO_OF_TSS_STACKS             7
 STATIC_ASSERT(NO_OF_TSS_STACKS <= NO_OF_IST);
 
+#define SYSTEM_MAX_COMMAND_LINE_LEN  256
+#define SYSTEM_MAX_OPTION_LEN        32
+
+// Passing this option on the multiboot command line selects the MLFQ scheduler
+#define SYSTEM_OPTION_MLFQ           "mlfq"
+
 typedef struct _SYSTEM_DATA
 {
     BYTE        NumberOfTssStacks;
@@ -34,6 +44,12 @@ static SYSTEM_DATA m_systemData;
 
 QWORD gVirtualToPhysicalOffset;
 
+static
+STATUS
+_SystemParseCommandLine(
+    IN      PHYSICAL_ADDRESS        CommandLine
+    );
+
 void
 SystemPreinit(
     void
@@ -46,6 +62,7 @@ SystemPreinit(
     BootModulesPreinit();
     DumpPreinit();
     ThreadSystemPreinit();
+    RcuSystemPreinit();
     printSystemPreinit(NULL);
     LogSystemPreinit();
     OsInfoPreinit();
@@ -57,6 +74,7 @@ SystemPreinit(
     CorePreinit();
     NetworkStackPreinit();
     ProcessSystemPreinit();
+    SyscallPreinitSystem();
 }
 
 STATUS
@@ -146,6 +164,17 @@ SystemInit(
 
     LOGL("MmuInitSystem succeeded\n");
 
+    if (IsBooleanFlagOn(Parameters->MultibootInformation->Flags, MULTIBOOT_FLAG_COMMAND_LINE_PRESENT)
+        && Parameters->MultibootInformation->CommandLine != 0)
+    {
+        status = _SystemParseCommandLine((PHYSICAL_ADDRESS)(QWORD)Parameters->MultibootInformation->CommandLine);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_SystemParseCommandLine", status);
+            return status;
+        }
+    }
+
     if (IsBooleanFlagOn(Parameters->MultibootInformation->Flags, MULTIBOOT_FLAG_BOOT_MODULES_PRESENT))
     {
         status = BootModulesInit((PHYSICAL_ADDRESS)(QWORD)Parameters->MultibootInformation->ModuleAddress,
@@ -255,6 +284,31 @@ SystemInit(
 
     LOGL("ThreadSystemInitIdleForCurrentCPU succeeded\n");
 
+    status = DpcCpuStartThread();
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("DpcCpuStartThread", status);
+        return status;
+    }
+
+    LOGL("DpcCpuStartThread succeeded\n");
+
+    status = ExWorkQueueSystemInit();
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ExWorkQueueSystemInit", status);
+        return status;
+    }
+
+    status = ExWorkQueueCpuStart();
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ExWorkQueueCpuStart", status);
+        return status;
+    }
+
+    LOGL("ExWorkQueueSystemInit succeeded\n");
+
     status = AcpiInterfaceLateInit();
     if (!SUCCEEDED(status))
     {
@@ -325,6 +379,68 @@ SystemUninit(
 
     LOGL("%s terminating!\n", OsInfoGetName());
 
+    ThreadCacheTrim();
+
     // disable interrupts
     CpuIntrDisable();
-}
\ No newline at end of file
+}
+
+static
+STATUS
+_SystemParseCommandLine(
+    IN      PHYSICAL_ADDRESS        CommandLine
+    )
+{
+    char* pMappedCommandLine;
+    DWORD commandLineLen;
+    DWORD i;
+
+    ASSERT(CommandLine != NULL);
+
+    pMappedCommandLine = MmuMapSystemMemory(CommandLine, SYSTEM_MAX_COMMAND_LINE_LEN);
+    if (pMappedCommandLine == NULL)
+    {
+        LOG_FUNC_ERROR_ALLOC("MmuMapSystemMemory", SYSTEM_MAX_COMMAND_LINE_LEN);
+        return STATUS_MEMORY_CANNOT_BE_MAPPED;
+    }
+
+    commandLineLen = strlen_s(pMappedCommandLine, SYSTEM_MAX_COMMAND_LINE_LEN);
+    if (commandLineLen == INVALID_STRING_SIZE)
+    {
+        LOG_WARNING("Command line is longer than %u characters, will ignore it\n", SYSTEM_MAX_COMMAND_LINE_LEN);
+        commandLineLen = 0;
+    }
+
+    LOGL("Command line: [%s]\n", commandLineLen != 0 ? pMappedCommandLine : "");
+
+    // the options are separated by spaces
+    i = 0;
+    while (i < commandLineLen)
+    {
+        char option[SYSTEM_MAX_OPTION_LEN];
+        DWORD optionLen;
+
+        optionLen = 0;
+        while (i < commandLineLen && pMappedCommandLine[i] != ' ')
+        {
+            if (optionLen < SYSTEM_MAX_OPTION_LEN - 1)
+            {
+                option[optionLen] = pMappedCommandLine[i];
+                optionLen = optionLen + 1;
+            }
+            i = i + 1;
+        }
+        option[optionLen] = '\0';
+        i = i + 1;
+
+        if (stricmp(option, SYSTEM_OPTION_MLFQ) == 0)
+        {
+            LOGL("Will use the MLFQ scheduler\n");
+            ThreadSystemSetSchedulingPolicy(ThreadSchedulingPolicyMlfq);
+        }
+    }
+
+    MmuUnmapSystemMemory(pMappedCommandLine, SYSTEM_MAX_COMMAND_LINE_LEN);
+
+    return STATUS_SUCCESS;
+}
@@ -5,6 +5,9 @@
 #include "test_file_io.h"
 #include "test_dma.h"
 #include "test_thread.h"
+#include "test_futex.h"
+#include "test_synch.h"
+#include "test_dpc.h"
 #include "smp.h"
 
 #define TEST_HEAP_ALLOCATION_SIZE           0x100
@@ -18,6 +21,9 @@ TestRunAllFunctional(
     TestPmmReserveAndReleaseFunctions();
     TestVmmAllocAndFreeFunctions();
     TestFileRead();
+    TestFutexFunctions();
+    TestSynchFunctions();
+    TestDpcFunctions();
     TestAllThreadFunctionalities(SmpGetNumberOfActiveCpus() * 2 );
 }
 
@@ -0,0 +1,249 @@
+#include "test_common.h"
+#include "test_dpc.h"
+#include "thread_internal.h"
+#include "cpumu.h"
+#include "smp.h"
+#include "iomu.h"
+
+#define TST_DPC_RUN_MAX_WAIT_US             (1 * SEC_IN_US)
+
+typedef struct _TST_DPC_CTX
+{
+    volatile DWORD          TimesRun;
+
+    // APIC ID of the CPU on which the routine ran last
+    volatile APIC_ID        ApicId;
+} TST_DPC_CTX, *PTST_DPC_CTX;
+
+static FUNC_DpcRoutine      _TstDpcRoutine;
+
+static
+STATUS
+_TstDpcQueueAndRun(
+    void
+    );
+
+static
+STATUS
+_TstDpcRunOnTargetCpu(
+    void
+    );
+
+static
+STATUS
+_TstDpcQueueTwice(
+    void
+    );
+
+static
+STATUS
+_TstDpcWaitForRun(
+    IN          PTST_DPC_CTX        Context,
+    IN          DWORD               ExpectedTimesRun
+    );
+
+void
+TestDpcFunctions(
+    void
+    )
+{
+    STATUS status;
+
+    LOGL("Will call _TstDpcQueueAndRun\n");
+    status = _TstDpcQueueAndRun();
+    LOGL("_TstDpcQueueAndRun finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstDpcRunOnTargetCpu\n");
+    status = _TstDpcRunOnTargetCpu();
+    LOGL("_TstDpcRunOnTargetCpu finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstDpcQueueTwice\n");
+    status = _TstDpcQueueTwice();
+    LOGL("_TstDpcQueueTwice finished with status: 0x%x\n", status);
+}
+
+static
+STATUS
+_TstDpcQueueAndRun(
+    void
+    )
+{
+    DPC dpc;
+    TST_DPC_CTX ctx;
+    STATUS status;
+
+    memzero(&ctx, sizeof(TST_DPC_CTX));
+    DpcInit(&dpc, _TstDpcRoutine, &ctx);
+
+    if (!DpcQueue(&dpc))
+    {
+        LOG_ERROR("DpcQueue returned FALSE for a DPC which was not queued\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    status = _TstDpcWaitForRun(&ctx, 1);
+    if (!SUCCEEDED(status))
+    {
+        return status;
+    }
+
+    // the routine started => the DPC may be queued again
+    if (!DpcQueue(&dpc))
+    {
+        LOG_ERROR("DpcQueue returned FALSE for a DPC whose routine already ran\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return _TstDpcWaitForRun(&ctx, 2);
+}
+
+static
+STATUS
+_TstDpcRunOnTargetCpu(
+    void
+    )
+{
+    DPC dpc;
+    TST_DPC_CTX ctx;
+    STATUS status;
+    DWORD i;
+    DWORD cpusTested;
+
+    status = STATUS_SUCCESS;
+    cpusTested = 0;
+
+    // the DPC is queued on the CPU which calls DpcQueue => we move from one
+    // CPU to the other and check the routine follows us
+    for (i = 0; i < BITS_FOR_STRUCTURE(CPU_AFFINITY) && SUCCEEDED(status); ++i)
+    {
+        if (!SUCCEEDED(ThreadSetAffinity(NULL, (CPU_AFFINITY) (1 << i))))
+        {
+            // the CPU is not active
+            continue;
+        }
+
+        memzero(&ctx, sizeof(TST_DPC_CTX));
+        DpcInit(&dpc, _TstDpcRoutine, &ctx);
+
+        DpcQueue(&dpc);
+
+        status = _TstDpcWaitForRun(&ctx, 1);
+        if (SUCCEEDED(status) && ctx.ApicId != CpuGetApicId())
+        {
+            LOG_ERROR("DPC queued on CPU 0x%02x ran on CPU 0x%02x\n", CpuGetApicId(), ctx.ApicId);
+            status = STATUS_UNSUCCESSFUL;
+        }
+
+        cpusTested++;
+    }
+
+    ThreadSetAffinity(NULL, CPU_AFFINITY_ALL);
+
+    if (SUCCEEDED(status) && cpusTested != SmpGetNumberOfActiveCpus())
+    {
+        LOG_ERROR("Tested %u CPUs out of %u\n", cpusTested, SmpGetNumberOfActiveCpus());
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    return status;
+}
+
+static
+STATUS
+_TstDpcQueueTwice(
+    void
+    )
+{
+    DPC dpc;
+    TST_DPC_CTX ctx;
+    INTR_STATE oldState;
+    BOOLEAN bFirstQueued;
+    BOOLEAN bSecondQueued;
+    STATUS status;
+
+    memzero(&ctx, sizeof(TST_DPC_CTX));
+    DpcInit(&dpc, _TstDpcRoutine, &ctx);
+
+    // nothing can run the DPC between the two calls
+    oldState = CpuIntrDisable();
+    bFirstQueued = DpcQueue(&dpc);
+    bSecondQueued = DpcQueue(&dpc);
+    CpuIntrSetState(oldState);
+
+    if (!bFirstQueued || bSecondQueued)
+    {
+        LOG_ERROR("DpcQueue returned %u and %u instead of TRUE and FALSE\n", bFirstQueued, bSecondQueued);
+
+        // the DPC lives on our stack, it must run before we return
+        if (bFirstQueued || bSecondQueued)
+        {
+            _TstDpcWaitForRun(&ctx, 1);
+        }
+
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    status = _TstDpcWaitForRun(&ctx, 1);
+    if (!SUCCEEDED(status))
+    {
+        return status;
+    }
+
+    // a second run would have followed the first one right away
+    ThreadYield();
+
+    if (1 != ctx.TimesRun)
+    {
+        LOG_ERROR("DPC queued twice ran %u times instead of once\n", ctx.TimesRun);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// The count is given by the caller: the DPC thread of our CPU has a higher
+// priority than us, the routine has most likely already run when DpcQueue
+// returns
+static
+STATUS
+_TstDpcWaitForRun(
+    IN          PTST_DPC_CTX        Context,
+    IN          DWORD               ExpectedTimesRun
+    )
+{
+    QWORD deadline;
+
+    ASSERT(NULL != Context);
+
+    deadline = IomuGetSystemTimeUs() + TST_DPC_RUN_MAX_WAIT_US;
+
+    while (!(Context->TimesRun >= ExpectedTimesRun || IomuGetSystemTimeUs() >= deadline))
+    {
+        ThreadYield();
+    }
+
+    if (Context->TimesRun < ExpectedTimesRun)
+    {
+        LOG_ERROR("DPC routine ran %u times instead of %u in %U us\n",
+                  Context->TimesRun, ExpectedTimesRun, TST_DPC_RUN_MAX_WAIT_US);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+void
+(__cdecl _TstDpcRoutine)(
+    IN_OPT  PVOID                   Context
+    )
+{
+    PTST_DPC_CTX pCtx;
+
+    ASSERT(NULL != Context);
+
+    pCtx = (PTST_DPC_CTX) Context;
+
+    pCtx->ApicId = CpuGetApicId();
+    _InterlockedIncrement((volatile long*) &pCtx->TimesRun);
+}
@@ -0,0 +1,178 @@
+#include "test_common.h"
+#include "test_futex.h"
+#include "thread_internal.h"
+#include "iomu.h"
+
+#define TST_FUTEX_TIMEOUT_US                (50 * MS_IN_US)
+#define TST_FUTEX_WAKE_MAX_WAIT_US          (1 * SEC_IN_US)
+
+// lives in the kernel image => it is a valid futex address for the system
+// process
+static volatile DWORD m_tstFutexValue;
+
+static FUNC_ThreadStart     _TstFutexWaiter;
+
+static
+STATUS
+_TstFutexWaitAndWake(
+    void
+    );
+
+static
+STATUS
+_TstFutexValueMismatch(
+    void
+    );
+
+static
+STATUS
+_TstFutexTimeout(
+    void
+    );
+
+void
+TestFutexFunctions(
+    void
+    )
+{
+    STATUS status;
+
+    LOGL("Will call _TstFutexWaitAndWake\n");
+    status = _TstFutexWaitAndWake();
+    LOGL("_TstFutexWaitAndWake finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstFutexValueMismatch\n");
+    status = _TstFutexValueMismatch();
+    LOGL("_TstFutexValueMismatch finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstFutexTimeout\n");
+    status = _TstFutexTimeout();
+    LOGL("_TstFutexTimeout finished with status: 0x%x\n", status);
+}
+
+static
+STATUS
+_TstFutexWaitAndWake(
+    void
+    )
+{
+    STATUS status;
+    STATUS exitStatus;
+    PTHREAD pThread;
+    DWORD threadsWoken;
+    QWORD deadline;
+
+    m_tstFutexValue = 0;
+
+    status = ThreadCreate("FutexWaiter",
+                          ThreadPriorityDefault,
+                          _TstFutexWaiter,
+                          NULL,
+                          &pThread);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadCreate", status);
+        return status;
+    }
+
+    // the waiter may not be in the wait queue yet, we wake until it is found
+    threadsWoken = 0;
+    deadline = IomuGetSystemTimeUs() + TST_FUTEX_WAKE_MAX_WAIT_US;
+    while (0 == threadsWoken && IomuGetSystemTimeUs() < deadline)
+    {
+        status = FutexWake((PVOID) &m_tstFutexValue, 1, &threadsWoken);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("FutexWake", status);
+            break;
+        }
+
+        ThreadYield();
+    }
+
+    if (SUCCEEDED(status) && 1 != threadsWoken)
+    {
+        LOG_ERROR("FutexWake did not find the waiting thread\n");
+
+        // the waiter must not remain blocked forever
+        m_tstFutexValue = 1;
+        FutexWake((PVOID) &m_tstFutexValue, 1, NULL);
+
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    ThreadWaitForTermination(pThread, &exitStatus);
+    ThreadCloseHandle(pThread);
+
+    if (SUCCEEDED(status) && STATUS_SUCCESS != exitStatus)
+    {
+        LOG_ERROR("FutexWait returned 0x%x instead of STATUS_SUCCESS\n", exitStatus);
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    return status;
+}
+
+static
+STATUS
+_TstFutexValueMismatch(
+    void
+    )
+{
+    STATUS status;
+
+    m_tstFutexValue = 1;
+
+    // the value differs => FutexWait must return without blocking, even with
+    // an infinite timeout
+    status = FutexWait((PVOID) &m_tstFutexValue, 0, FUTEX_WAIT_INFINITE);
+    if (STATUS_UNSUCCESSFUL != status)
+    {
+        LOG_ERROR("FutexWait returned 0x%x instead of STATUS_UNSUCCESSFUL\n", status);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_TstFutexTimeout(
+    void
+    )
+{
+    STATUS status;
+    QWORD startTime;
+    QWORD elapsedTime;
+
+    m_tstFutexValue = 0;
+
+    startTime = IomuGetSystemTimeUs();
+    status = FutexWait((PVOID) &m_tstFutexValue, 0, TST_FUTEX_TIMEOUT_US);
+    elapsedTime = IomuGetSystemTimeUs() - startTime;
+
+    if (STATUS_JOB_INTERRUPTED != status)
+    {
+        LOG_ERROR("FutexWait returned 0x%x instead of STATUS_JOB_INTERRUPTED\n", status);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (elapsedTime < TST_FUTEX_TIMEOUT_US)
+    {
+        LOG_ERROR("FutexWait returned after %U us, the timeout was %U us\n", elapsedTime, TST_FUTEX_TIMEOUT_US);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+(__cdecl _TstFutexWaiter)(
+    IN_OPT      PVOID       Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    return FutexWait((PVOID) &m_tstFutexValue, 0, FUTEX_WAIT_INFINITE);
+}
@@ -1,5 +1,8 @@
 #include "test_common.h"
 #include "test_pmm.h"
+#include "smp.h"
+#include "cpumu.h"
+#include "thread_internal.h"
 
 static const DWORD TST_PMM_ALLOCATION_FRAMES[] =
 {
@@ -10,6 +13,37 @@ static const DWORD TST_PMM_ALLOCATION_FRAMES[] =
 };
 static const DWORD TST_PMM_NO_OF_SIZES = ARRAYSIZE(TST_PMM_ALLOCATION_FRAMES);
 
+static const DWORD TST_PMM_ALIGNMENT_FRAMES[] =
+{
+    2,
+    3,
+    5,
+    16,
+    17,
+    100
+};
+
+#define TST_PMM_SPLIT_BLOCK_FRAMES          32
+
+// Reservations start with this many frames and halve it each time the memory
+// left is too fragmented
+#define TST_PMM_EXHAUST_CHUNK_FRAMES        1024
+#define TST_PMM_EXHAUST_MAX_BLOCKS          (16 * KB_SIZE)
+
+// Only the memory at the top of this size is exhausted: the other CPUs keep
+// running and allocating while the test runs
+#define TST_PMM_EXHAUST_REGION_SIZE         (32 * MB_SIZE)
+
+// Released one by one on another CPU after the region is exhausted, they stay
+// in the cache of that CPU
+#define TST_PMM_REMOTE_CACHED_FRAMES        (PMM_FRAME_CACHE_BATCH / 2)
+
+typedef struct _TST_PMM_BLOCK
+{
+    PHYSICAL_ADDRESS        Address;
+    DWORD                   NoOfFrames;
+} TST_PMM_BLOCK, *PTST_PMM_BLOCK;
+
 static
 STATUS
 _TstPmmReservationAndRelease(
@@ -17,6 +51,71 @@ _TstPmmReservationAndRelease(
     IN_OPT      PHYSICAL_ADDRESS    MinimumAddress
     );
 
+static
+STATUS
+_TstPmmAlignment(
+    void
+    );
+
+static
+STATUS
+_TstPmmSplitAndCoalesce(
+    void
+    );
+
+static
+STATUS
+_TstPmmExhaustAndRelease(
+    void
+    );
+
+static
+STATUS
+_TstPmmFrameCacheReuse(
+    void
+    );
+
+static
+STATUS
+_TstPmmFrameCacheOverflow(
+    void
+    );
+
+static
+STATUS
+_TstPmmFrameCacheRemoteRecovery(
+    void
+    );
+
+static
+STATUS
+_TstPmmZeroedFrame(
+    void
+    );
+
+static
+PHYSICAL_ADDRESS
+_TstPmmGetExhaustRegionStart(
+    void
+    );
+
+static
+BOOLEAN
+_TstPmmExhaustMemory(
+    IN                      PHYSICAL_ADDRESS    MinimumAddress,
+    OUT_WRITES(MaxBlocks)   PTST_PMM_BLOCK      Blocks,
+    IN                      DWORD               MaxBlocks,
+    OUT                     DWORD*              NoOfBlocks,
+    OUT                     QWORD*              NoOfFrames
+    );
+
+static
+void
+_TstPmmReleaseBlocks(
+    IN_READS(NoOfBlocks)    PTST_PMM_BLOCK      Blocks,
+    IN                      DWORD               NoOfBlocks
+    );
+
 void
 TestPmmReserveAndReleaseFunctions(
     void
@@ -43,6 +142,34 @@ TestPmmReserveAndReleaseFunctions(
             LOGL("_TstPmmReservationAndRelease finished with status: 0x%x\n", status);
         }
     }
+
+    LOGL("Will call _TstPmmAlignment\n");
+    status = _TstPmmAlignment();
+    LOGL("_TstPmmAlignment finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstPmmSplitAndCoalesce\n");
+    status = _TstPmmSplitAndCoalesce();
+    LOGL("_TstPmmSplitAndCoalesce finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstPmmExhaustAndRelease\n");
+    status = _TstPmmExhaustAndRelease();
+    LOGL("_TstPmmExhaustAndRelease finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstPmmFrameCacheReuse\n");
+    status = _TstPmmFrameCacheReuse();
+    LOGL("_TstPmmFrameCacheReuse finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstPmmFrameCacheOverflow\n");
+    status = _TstPmmFrameCacheOverflow();
+    LOGL("_TstPmmFrameCacheOverflow finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstPmmFrameCacheRemoteRecovery\n");
+    status = _TstPmmFrameCacheRemoteRecovery();
+    LOGL("_TstPmmFrameCacheRemoteRecovery finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstPmmZeroedFrame\n");
+    status = _TstPmmZeroedFrame();
+    LOGL("_TstPmmZeroedFrame finished with status: 0x%x\n", status);
 }
 
 static
@@ -108,4 +235,574 @@ _TstPmmReservationAndRelease(
     PmmReleaseMemory(pa, NoOfFrames);
 
     return STATUS_SUCCESS;
-}
\ No newline at end of file
+}
+
+static
+STATUS
+_TstPmmAlignment(
+    void
+    )
+{
+    DWORD i;
+    DWORD order;
+    QWORD alignment;
+    PHYSICAL_ADDRESS pa;
+
+    for (i = 0; i < ARRAYSIZE(TST_PMM_ALIGNMENT_FRAMES); ++i)
+    {
+        // the blocks are aligned to their size, the power of two greater than
+        // or equal to the number of frames
+        _BitScanReverse(&order, TST_PMM_ALIGNMENT_FRAMES[i]);
+        if ((1UL << order) != TST_PMM_ALIGNMENT_FRAMES[i])
+        {
+            order++;
+        }
+        alignment = ((QWORD) 1 << order) * PAGE_SIZE;
+
+        pa = PmmReserveMemory(TST_PMM_ALIGNMENT_FRAMES[i]);
+        if (NULL == pa)
+        {
+            LOG_ERROR("PmmReserveMemory failed for %u frames\n", TST_PMM_ALIGNMENT_FRAMES[i]);
+            return STATUS_PHYSICAL_MEMORY_NOT_AVAILABLE;
+        }
+
+        PmmReleaseMemory(pa, TST_PMM_ALIGNMENT_FRAMES[i]);
+
+        if (!IsAddressAligned(pa, alignment))
+        {
+            LOG_ERROR("Physical address 0x%X reserved for %u frames is not aligned to 0x%X\n",
+                      pa, TST_PMM_ALIGNMENT_FRAMES[i], alignment);
+            return STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_TstPmmSplitAndCoalesce(
+    void
+    )
+{
+    PHYSICAL_ADDRESS blockPa;
+    PHYSICAL_ADDRESS pa;
+    PHYSICAL_ADDRESS paFirst;
+    PHYSICAL_ADDRESS paSecond;
+    STATUS status;
+
+    blockPa = PmmReserveMemory(TST_PMM_SPLIT_BLOCK_FRAMES);
+    if (NULL == blockPa)
+    {
+        LOG_ERROR("PmmReserveMemory failed for %u frames\n", TST_PMM_SPLIT_BLOCK_FRAMES);
+        return STATUS_PHYSICAL_MEMORY_NOT_AVAILABLE;
+    }
+
+    // the whole block is free now, the frames asked for inside it must be
+    // split out of it
+    PmmReleaseMemory(blockPa, TST_PMM_SPLIT_BLOCK_FRAMES);
+
+    status = STATUS_SUCCESS;
+    paFirst = NULL;
+    paSecond = NULL;
+
+    __try
+    {
+        pa = PmmReserveMemoryEx(1, PtrOffset(blockPa, 5 * PAGE_SIZE));
+        if (PtrOffset(blockPa, 5 * PAGE_SIZE) != pa)
+        {
+            LOG_ERROR("Frame 5 of the free block at 0x%X was not reserved, got 0x%X\n", blockPa, pa);
+            status = STATUS_UNSUCCESSFUL;
+            __leave;
+        }
+        paFirst = pa;
+
+        pa = PmmReserveMemoryEx(3, PtrOffset(blockPa, 1 * PAGE_SIZE));
+        if (PtrOffset(blockPa, 1 * PAGE_SIZE) != pa)
+        {
+            LOG_ERROR("Frames 1-3 of the free block at 0x%X were not reserved, got 0x%X\n", blockPa, pa);
+            status = STATUS_UNSUCCESSFUL;
+            __leave;
+        }
+        paSecond = pa;
+
+        // the frame is taken => another one above it is given
+        pa = PmmReserveMemoryEx(1, paFirst);
+        if (NULL != pa)
+        {
+            PmmReleaseMemory(pa, 1);
+        }
+
+        if (pa <= paFirst)
+        {
+            LOG_ERROR("Reserving the frame at 0x%X again returned 0x%X\n", paFirst, pa);
+            status = STATUS_UNSUCCESSFUL;
+            __leave;
+        }
+    }
+    __finally
+    {
+        if (NULL != paFirst)
+        {
+            PmmReleaseMemory(paFirst, 1);
+        }
+
+        if (NULL != paSecond)
+        {
+            PmmReleaseMemory(paSecond, 3);
+        }
+    }
+
+    if (!SUCCEEDED(status))
+    {
+        return status;
+    }
+
+    // all the pieces were given back => the whole block is free again
+    pa = PmmReserveMemoryEx(TST_PMM_SPLIT_BLOCK_FRAMES, blockPa);
+    if (blockPa != pa)
+    {
+        LOG_ERROR("The block at 0x%X was not reserved as a whole after its pieces were released, got 0x%X\n",
+                  blockPa, pa);
+
+        if (NULL != pa)
+        {
+            PmmReleaseMemory(pa, TST_PMM_SPLIT_BLOCK_FRAMES);
+        }
+
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    PmmReleaseMemory(pa, TST_PMM_SPLIT_BLOCK_FRAMES);
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_TstPmmExhaustAndRelease(
+    void
+    )
+{
+    PTST_PMM_BLOCK pBlocks;
+    DWORD noOfBlocks;
+    QWORD framesFirst;
+    QWORD framesSecond;
+    QWORD tolerance;
+    PHYSICAL_ADDRESS minPa;
+    BOOLEAN bExhausted;
+
+    minPa = _TstPmmGetExhaustRegionStart();
+
+    LOG_TEST_LOG("Will exhaust the memory above 0x%X\n", minPa);
+
+    pBlocks = ExAllocatePoolWithTag(PoolAllocateZeroMemory,
+                                    TST_PMM_EXHAUST_MAX_BLOCKS * sizeof(TST_PMM_BLOCK),
+                                    HEAP_TEST_TAG,
+                                    0);
+    if (NULL == pBlocks)
+    {
+        LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", TST_PMM_EXHAUST_MAX_BLOCKS * sizeof(TST_PMM_BLOCK));
+        return STATUS_HEAP_INSUFFICIENT_RESOURCES;
+    }
+
+    bExhausted = _TstPmmExhaustMemory(minPa, pBlocks, TST_PMM_EXHAUST_MAX_BLOCKS, &noOfBlocks, &framesFirst);
+    _TstPmmReleaseBlocks(pBlocks, noOfBlocks);
+
+    if (!bExhausted)
+    {
+        LOG_TEST_LOG("Memory is too fragmented to be exhausted in %u blocks\n", TST_PMM_EXHAUST_MAX_BLOCKS);
+        ExFreePoolWithTag(pBlocks, HEAP_TEST_TAG);
+        return STATUS_SUCCESS;
+    }
+
+    // everything released must be found again
+    _TstPmmExhaustMemory(minPa, pBlocks, TST_PMM_EXHAUST_MAX_BLOCKS, &noOfBlocks, &framesSecond);
+    _TstPmmReleaseBlocks(pBlocks, noOfBlocks);
+
+    ExFreePoolWithTag(pBlocks, HEAP_TEST_TAG);
+
+    LOG_TEST_LOG("Reserved %U frames the first time and %U frames the second time\n", framesFirst, framesSecond);
+
+    // the other CPUs may have taken frames in their caches meanwhile
+    tolerance = (QWORD) SmpGetNumberOfActiveCpus() * PMM_FRAME_CACHE_CAPACITY;
+    if (framesSecond + tolerance < framesFirst)
+    {
+        LOG_ERROR("Only %U frames out of %U could be reserved again after they were released\n",
+                  framesSecond, framesFirst);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_TstPmmFrameCacheReuse(
+    void
+    )
+{
+    PHYSICAL_ADDRESS pa;
+    PHYSICAL_ADDRESS paAgain;
+    INTR_STATE oldState;
+
+    // nothing else may use the cache of our CPU in between
+    oldState = CpuIntrDisable();
+
+    pa = PmmReserveMemory(1);
+    if (NULL != pa)
+    {
+        PmmReleaseMemory(pa, 1);
+    }
+
+    paAgain = PmmReserveMemory(1);
+    if (NULL != paAgain)
+    {
+        PmmReleaseMemory(paAgain, 1);
+    }
+
+    CpuIntrSetState(oldState);
+
+    if (NULL == pa || NULL == paAgain)
+    {
+        LOG_ERROR("PmmReserveMemory failed for a single frame\n");
+        return STATUS_PHYSICAL_MEMORY_NOT_AVAILABLE;
+    }
+
+    if (pa != paAgain)
+    {
+        LOG_ERROR("The frame 0x%X released to the cache was not reused, got 0x%X\n", pa, paAgain);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_TstPmmFrameCacheOverflow(
+    void
+    )
+{
+    PHYSICAL_ADDRESS frames[PMM_FRAME_CACHE_CAPACITY + 1];
+    PPMM_FRAME_CACHE pCache;
+    INTR_STATE oldState;
+    DWORD noOfFrames;
+    DWORD noOfOverflows;
+    DWORD i;
+    STATUS status;
+
+    status = STATUS_SUCCESS;
+    noOfOverflows = 0;
+
+    // nothing else may use the cache of our CPU in between
+    oldState = CpuIntrDisable();
+    pCache = &GetCurrentPcpu()->FrameCache;
+
+    for (noOfFrames = 0; noOfFrames < ARRAYSIZE(frames); ++noOfFrames)
+    {
+        frames[noOfFrames] = PmmReserveMemory(1);
+        if (NULL == frames[noOfFrames])
+        {
+            LOG_ERROR("PmmReserveMemory failed for a single frame\n");
+            status = STATUS_PHYSICAL_MEMORY_NOT_AVAILABLE;
+            break;
+        }
+    }
+
+    // more frames are released than the cache holds => it overflows at least
+    // once and keeps the frames it did not give back
+    for (i = 0; i < noOfFrames; ++i)
+    {
+        DWORD framesBefore = pCache->NumberOfFrames;
+
+        PmmReleaseMemory(frames[i], 1);
+
+        if (PMM_FRAME_CACHE_CAPACITY != framesBefore)
+        {
+            continue;
+        }
+
+        noOfOverflows++;
+        if (PMM_FRAME_CACHE_CAPACITY - PMM_FRAME_CACHE_BATCH + 1 != pCache->NumberOfFrames && SUCCEEDED(status))
+        {
+            LOG_ERROR("The full cache holds %u frames after a release instead of %u\n",
+                      pCache->NumberOfFrames, PMM_FRAME_CACHE_CAPACITY - PMM_FRAME_CACHE_BATCH + 1);
+            status = STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    CpuIntrSetState(oldState);
+
+    if (SUCCEEDED(status) && 0 == noOfOverflows)
+    {
+        LOG_ERROR("The cache did not overflow after %u frames were released\n", noOfFrames);
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    return status;
+}
+
+static
+STATUS
+_TstPmmFrameCacheRemoteRecovery(
+    void
+    )
+{
+    PTST_PMM_BLOCK pBlocks;
+    PHYSICAL_ADDRESS recovered[TST_PMM_REMOTE_CACHED_FRAMES];
+    PHYSICAL_ADDRESS cachedPa;
+    PHYSICAL_ADDRESS minPa;
+    PPMM_FRAME_CACHE pCache;
+    CPU_AFFINITY firstCpu;
+    INTR_STATE oldState;
+    DWORD noOfBlocks;
+    DWORD noOfCached;
+    DWORD noOfRecovered;
+    DWORD i;
+    QWORD noOfFrames;
+    STATUS status;
+
+    if (SmpGetNumberOfActiveCpus() < 2)
+    {
+        LOG_TEST_LOG("A single CPU is active, there is no other cache to recover frames from\n");
+        return STATUS_SUCCESS;
+    }
+
+    pBlocks = ExAllocatePoolWithTag(PoolAllocateZeroMemory,
+                                    TST_PMM_EXHAUST_MAX_BLOCKS * sizeof(TST_PMM_BLOCK),
+                                    HEAP_TEST_TAG,
+                                    0);
+    if (NULL == pBlocks)
+    {
+        LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", TST_PMM_EXHAUST_MAX_BLOCKS * sizeof(TST_PMM_BLOCK));
+        return STATUS_HEAP_INSUFFICIENT_RESOURCES;
+    }
+
+    minPa = _TstPmmGetExhaustRegionStart();
+
+    oldState = CpuIntrDisable();
+    firstCpu = (CPU_AFFINITY) GetCurrentPcpu()->LogicalApicId;
+    CpuIntrSetState(oldState);
+
+    // the frames are cached by another CPU and reserved back on ours
+    status = ThreadSetAffinity(NULL, CPU_AFFINITY_ALL & ~firstCpu);
+    ASSERT(SUCCEEDED(status));
+
+    noOfBlocks = 0;
+    noOfCached = 0;
+    noOfRecovered = 0;
+    cachedPa = NULL;
+
+    __try
+    {
+        if (!_TstPmmExhaustMemory(minPa, pBlocks, TST_PMM_EXHAUST_MAX_BLOCKS, &noOfBlocks, &noOfFrames))
+        {
+            LOG_TEST_LOG("Memory is too fragmented to be exhausted in %u blocks\n", TST_PMM_EXHAUST_MAX_BLOCKS);
+            __leave;
+        }
+
+        // the first frames of the first block go to the cache of this CPU
+        cachedPa = pBlocks[0].Address;
+
+        oldState = CpuIntrDisable();
+        pCache = &GetCurrentPcpu()->FrameCache;
+        while (noOfCached < TST_PMM_REMOTE_CACHED_FRAMES
+               && 0 != pBlocks[0].NoOfFrames
+               && pCache->NumberOfFrames < PMM_FRAME_CACHE_CAPACITY)
+        {
+            PmmReleaseMemory(pBlocks[0].Address, 1);
+
+            pBlocks[0].Address = PtrOffset(pBlocks[0].Address, PAGE_SIZE);
+            pBlocks[0].NoOfFrames--;
+            noOfCached++;
+        }
+        CpuIntrSetState(oldState);
+
+        status = ThreadSetAffinity(NULL, firstCpu);
+        ASSERT(SUCCEEDED(status));
+
+        // nothing is free above the cached frames, the buddy allocator can only
+        // give them once the other CPU empties its cache
+        for (noOfRecovered = 0; noOfRecovered < noOfCached; ++noOfRecovered)
+        {
+            recovered[noOfRecovered] = PmmReserveMemoryEx(1, cachedPa);
+            if (NULL == recovered[noOfRecovered])
+            {
+                break;
+            }
+        }
+    }
+    __finally
+    {
+        for (i = 0; i < noOfRecovered; ++i)
+        {
+            PmmReleaseMemory(recovered[i], 1);
+        }
+
+        _TstPmmReleaseBlocks(pBlocks, noOfBlocks);
+        ExFreePoolWithTag(pBlocks, HEAP_TEST_TAG);
+
+        ThreadSetAffinity(NULL, CPU_AFFINITY_ALL);
+    }
+
+    LOG_TEST_LOG("Recovered %u frames out of the %u cached by another CPU\n", noOfRecovered, noOfCached);
+
+    // the other CPU may have reused some of the frames meanwhile, but not all
+    if (0 != noOfCached && 0 == noOfRecovered)
+    {
+        LOG_ERROR("None of the %u frames cached by another CPU was recovered above 0x%X\n", noOfCached, cachedPa);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_TstPmmZeroedFrame(
+    void
+    )
+{
+    PHYSICAL_ADDRESS pa;
+    PBYTE pData;
+    BOOLEAN bZeroed;
+    DWORD i;
+    STATUS status;
+
+    pa = PmmReserveZeroedMemory(&bZeroed);
+    if (NULL == pa)
+    {
+        LOG_ERROR("PmmReserveZeroedMemory failed\n");
+        return STATUS_PHYSICAL_MEMORY_NOT_AVAILABLE;
+    }
+
+    status = STATUS_SUCCESS;
+    pData = NULL;
+
+    __try
+    {
+        if (!bZeroed)
+        {
+            LOG_TEST_LOG("The pool of zeroed frames was not refilled yet\n");
+            __leave;
+        }
+
+        pData = MmuMapSystemMemory(pa, PAGE_SIZE);
+        if (NULL == pData)
+        {
+            LOG_FUNC_ERROR_ALLOC("MmuMapSystemMemory", PAGE_SIZE);
+            status = STATUS_UNSUCCESSFUL;
+            __leave;
+        }
+
+        for (i = 0; i < PAGE_SIZE; ++i)
+        {
+            if (0 != pData[i])
+            {
+                LOG_ERROR("Byte 0x%x of the zeroed frame 0x%X is 0x%x\n", i, pa, pData[i]);
+                status = STATUS_UNSUCCESSFUL;
+                __leave;
+            }
+        }
+    }
+    __finally
+    {
+        if (NULL != pData)
+        {
+            MmuUnmapSystemMemory(pData, PAGE_SIZE);
+        }
+
+        PmmReleaseMemory(pa, 1);
+    }
+
+    return status;
+}
+
+// The memory at the top is exhausted, the rest is left to the other CPUs
+static
+PHYSICAL_ADDRESS
+_TstPmmGetExhaustRegionStart(
+    void
+    )
+{
+    QWORD highestAddress;
+
+    highestAddress = (QWORD) PmmGetHighestPhysicalMemoryAddressAvailable();
+
+    return (PHYSICAL_ADDRESS) AlignAddressLower(highestAddress > 2 * TST_PMM_EXHAUST_REGION_SIZE
+                                                ? highestAddress - TST_PMM_EXHAUST_REGION_SIZE
+                                                : highestAddress / 2,
+                                                PAGE_SIZE);
+}
+
+// Reserves all the memory above MinimumAddress, returns FALSE if the blocks ran
+// out before the memory did
+static
+BOOLEAN
+_TstPmmExhaustMemory(
+    IN                      PHYSICAL_ADDRESS    MinimumAddress,
+    OUT_WRITES(MaxBlocks)   PTST_PMM_BLOCK      Blocks,
+    IN                      DWORD               MaxBlocks,
+    OUT                     DWORD*              NoOfBlocks,
+    OUT                     QWORD*              NoOfFrames
+    )
+{
+    DWORD chunkFrames;
+    DWORD noOfBlocks;
+    QWORD noOfFrames;
+
+    ASSERT(NULL != Blocks);
+    ASSERT(NULL != NoOfBlocks);
+    ASSERT(NULL != NoOfFrames);
+
+    noOfBlocks = 0;
+    noOfFrames = 0;
+
+    for (chunkFrames = TST_PMM_EXHAUST_CHUNK_FRAMES; chunkFrames > 0; )
+    {
+        PHYSICAL_ADDRESS pa;
+
+        if (noOfBlocks == MaxBlocks)
+        {
+            break;
+        }
+
+        pa = PmmReserveMemoryEx(chunkFrames, MinimumAddress);
+        if (NULL == pa)
+        {
+            chunkFrames = chunkFrames / 2;
+            continue;
+        }
+
+        Blocks[noOfBlocks].Address = pa;
+        Blocks[noOfBlocks].NoOfFrames = chunkFrames;
+        noOfBlocks++;
+        noOfFrames += chunkFrames;
+    }
+
+    *NoOfBlocks = noOfBlocks;
+    *NoOfFrames = noOfFrames;
+
+    return (0 == chunkFrames);
+}
+
+static
+void
+_TstPmmReleaseBlocks(
+    IN_READS(NoOfBlocks)    PTST_PMM_BLOCK      Blocks,
+    IN                      DWORD               NoOfBlocks
+    )
+{
+    DWORD i;
+
+    ASSERT(NULL != Blocks);
+
+    for (i = 0; i < NoOfBlocks; ++i)
+    {
+        if (0 != Blocks[i].NoOfFrames)
+        {
+            PmmReleaseMemory(Blocks[i].Address, Blocks[i].NoOfFrames);
+        }
+    }
+}
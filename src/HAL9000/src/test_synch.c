@@ -0,0 +1,806 @@
+#include "test_common.h"
+#include "test_synch.h"
+#include "thread_internal.h"
+#include "ex_event.h"
+#include "cpumu.h"
+#include "smp.h"
+#include "iomu.h"
+
+#define TST_SYNCH_MAX_THREADS               16
+
+#define TST_MUTEX_CONTENDED_ITERATIONS      1000
+
+// Time for which a thread keeps the mutex wanted by the other one: well below
+// the adaptive spin for the short hold, well above it for the long one
+#define TST_MUTEX_SHORT_HOLD_US             5
+#define TST_MUTEX_LONG_HOLD_US              (5 * MS_IN_US)
+
+// Time a waiter is given to (wrongly) acquire a lock still held
+#define TST_MUTEX_STILL_HELD_WAIT_US        (50 * MS_IN_US)
+
+#define TST_RWLOCK_MIXED_ITERATIONS         500
+
+// Maximum time the readers wait for each other inside the lock
+#define TST_RWLOCK_MAX_WAIT_US              (1 * SEC_IN_US)
+
+typedef struct _TST_MUTEX_CTX
+{
+    MUTEX                   Mutex;
+
+    // Number of threads inside the critical section, must never exceed 1
+    volatile DWORD          ThreadsInside;
+
+    // Incremented without atomic instructions inside the critical section
+    volatile DWORD          Counter;
+
+    volatile BOOLEAN        ExclusionViolated;
+
+    // Used by the threads which take the mutex only once
+    EX_EVENT                MutexHeldEvt;
+    QWORD                   HoldTimeUs;
+    CPU_AFFINITY            Affinity;
+    volatile BOOLEAN        Acquired;
+    volatile BOOLEAN        Releasing;
+} TST_MUTEX_CTX, *PTST_MUTEX_CTX;
+
+typedef struct _TST_RWLOCK_CTX
+{
+    EX_RWLOCK               RwLock;
+
+    DWORD                   NumberOfThreads;
+    volatile DWORD          ThreadIndex;
+
+    volatile DWORD          ReadersInside;
+    volatile DWORD          WritersInside;
+
+    // Incremented without atomic instructions by the writers
+    volatile DWORD          Counter;
+
+    volatile BOOLEAN        ExclusionViolated;
+
+    // Used by the writer preference test
+    volatile BOOLEAN        WriterDone;
+    volatile BOOLEAN        ReaderAcquired;
+} TST_RWLOCK_CTX, *PTST_RWLOCK_CTX;
+
+static FUNC_ThreadStart     _TstMutexContendedWorker;
+static FUNC_ThreadStart     _TstMutexHolder;
+static FUNC_ThreadStart     _TstMutexWaiter;
+static FUNC_ThreadStart     _TstRwLockSharedHolder;
+static FUNC_ThreadStart     _TstRwLockMixedWorker;
+static FUNC_ThreadStart     _TstRwLockWriter;
+static FUNC_ThreadStart     _TstRwLockLateReader;
+
+static
+STATUS
+_TstMutexContended(
+    IN          MUTEX_FLAGS         Flags
+    );
+
+static
+STATUS
+_TstMutexRecursive(
+    void
+    );
+
+static
+STATUS
+_TstMutexSpinThenBlock(
+    IN          QWORD               HoldTimeUs
+    );
+
+static
+STATUS
+_TstRwLockConcurrentReaders(
+    void
+    );
+
+static
+STATUS
+_TstRwLockExclusion(
+    void
+    );
+
+static
+STATUS
+_TstRwLockWriterPreference(
+    void
+    );
+
+static
+STATUS
+_TstSynchRunThreads(
+    IN_Z        char*               Name,
+    IN          PFUNC_ThreadStart   Function,
+    IN_OPT      PVOID               Context,
+    IN          DWORD               NumberOfThreads
+    );
+
+static
+DWORD
+_TstSynchGetNumberOfThreads(
+    void
+    );
+
+void
+TestSynchFunctions(
+    void
+    )
+{
+    STATUS status;
+
+    LOGL("Will call _TstMutexContended\n");
+    status = _TstMutexContended(0);
+    LOGL("_TstMutexContended finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstMutexContended for an adaptive mutex\n");
+    status = _TstMutexContended(MUTEX_FLAG_ADAPTIVE_SPIN);
+    LOGL("_TstMutexContended finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstMutexContended for an adaptive barging mutex\n");
+    status = _TstMutexContended(MUTEX_FLAG_ADAPTIVE_SPIN | MUTEX_FLAG_BARGING);
+    LOGL("_TstMutexContended finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstMutexRecursive\n");
+    status = _TstMutexRecursive();
+    LOGL("_TstMutexRecursive finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstMutexSpinThenBlock for a short hold\n");
+    status = _TstMutexSpinThenBlock(TST_MUTEX_SHORT_HOLD_US);
+    LOGL("_TstMutexSpinThenBlock finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstMutexSpinThenBlock for a long hold\n");
+    status = _TstMutexSpinThenBlock(TST_MUTEX_LONG_HOLD_US);
+    LOGL("_TstMutexSpinThenBlock finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstRwLockConcurrentReaders\n");
+    status = _TstRwLockConcurrentReaders();
+    LOGL("_TstRwLockConcurrentReaders finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstRwLockExclusion\n");
+    status = _TstRwLockExclusion();
+    LOGL("_TstRwLockExclusion finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstRwLockWriterPreference\n");
+    status = _TstRwLockWriterPreference();
+    LOGL("_TstRwLockWriterPreference finished with status: 0x%x\n", status);
+}
+
+static
+STATUS
+_TstMutexContended(
+    IN          MUTEX_FLAGS         Flags
+    )
+{
+    TST_MUTEX_CTX ctx;
+    DWORD noOfThreads;
+    STATUS status;
+
+    memzero(&ctx, sizeof(TST_MUTEX_CTX));
+    MutexInitEx(&ctx.Mutex, FALSE, Flags);
+
+    // the threads are spread over all the CPUs by the scheduler
+    noOfThreads = _TstSynchGetNumberOfThreads();
+
+    status = _TstSynchRunThreads("MutexWorker", _TstMutexContendedWorker, &ctx, noOfThreads);
+    if (!SUCCEEDED(status))
+    {
+        return status;
+    }
+
+    if (ctx.ExclusionViolated)
+    {
+        LOG_ERROR("Two threads were inside the critical section at once\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (ctx.Counter != noOfThreads * TST_MUTEX_CONTENDED_ITERATIONS)
+    {
+        LOG_ERROR("Counter is %u instead of %u\n", ctx.Counter, noOfThreads * TST_MUTEX_CONTENDED_ITERATIONS);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (NULL != ctx.Mutex.Holder)
+    {
+        LOG_ERROR("Mutex is still held by thread 0x%X\n", ctx.Mutex.Holder);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_TstMutexRecursive(
+    void
+    )
+{
+    TST_MUTEX_CTX ctx;
+    PTHREAD pThread;
+    STATUS status;
+    STATUS exitStatus;
+    QWORD deadline;
+    DWORD i;
+
+    memzero(&ctx, sizeof(TST_MUTEX_CTX));
+    MutexInit(&ctx.Mutex, TRUE);
+
+    for (i = 0; i < 3; ++i)
+    {
+        MutexAcquire(&ctx.Mutex);
+    }
+
+    if (GetCurrentThread() != ctx.Mutex.Holder || 3 != ctx.Mutex.CurrentRecursivityDepth)
+    {
+        LOG_ERROR("Holder is 0x%X with depth %u after 3 acquisitions\n",
+                  ctx.Mutex.Holder, ctx.Mutex.CurrentRecursivityDepth);
+
+        for (i = 0; i < 3; ++i)
+        {
+            MutexRelease(&ctx.Mutex);
+        }
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    status = ThreadCreate("MutexWaiter",
+                          ThreadPriorityDefault,
+                          _TstMutexWaiter,
+                          &ctx,
+                          &pThread);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadCreate", status);
+
+        for (i = 0; i < 3; ++i)
+        {
+            MutexRelease(&ctx.Mutex);
+        }
+        return status;
+    }
+
+    // the mutex is still held once, the waiter must not get it
+    MutexRelease(&ctx.Mutex);
+    MutexRelease(&ctx.Mutex);
+
+    deadline = IomuGetSystemTimeUs() + TST_MUTEX_STILL_HELD_WAIT_US;
+    while (!ctx.Acquired && IomuGetSystemTimeUs() < deadline)
+    {
+        ThreadYield();
+    }
+
+    if (ctx.Acquired)
+    {
+        LOG_ERROR("The mutex was acquired by another thread while held recursively\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    ctx.Releasing = TRUE;
+    MutexRelease(&ctx.Mutex);
+
+    ThreadWaitForTermination(pThread, &exitStatus);
+    ThreadCloseHandle(pThread);
+
+    if (SUCCEEDED(status) && !SUCCEEDED(exitStatus))
+    {
+        LOG_ERROR("Waiter thread failed with status 0x%x\n", exitStatus);
+        status = exitStatus;
+    }
+
+    return status;
+}
+
+static
+STATUS
+_TstMutexSpinThenBlock(
+    IN          QWORD               HoldTimeUs
+    )
+{
+    TST_MUTEX_CTX ctx;
+    PTHREAD pThread;
+    STATUS status;
+    STATUS exitStatus;
+    INTR_STATE oldState;
+    CPU_AFFINITY ourCpu;
+
+    memzero(&ctx, sizeof(TST_MUTEX_CTX));
+    MutexInitEx(&ctx.Mutex, FALSE, MUTEX_FLAG_ADAPTIVE_SPIN);
+
+    status = ExEventInit(&ctx.MutexHeldEvt, ExEventTypeNotification, FALSE);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ExEventInit", status);
+        return status;
+    }
+
+    oldState = CpuIntrDisable();
+    ourCpu = (CPU_AFFINITY) GetCurrentPcpu()->LogicalApicId;
+    CpuIntrSetState(oldState);
+
+    status = ThreadSetAffinity(NULL, ourCpu);
+    ASSERT(SUCCEEDED(status));
+
+    // we spin only while the holder runs on another CPU, with a single CPU
+    // the waiter blocks right away
+    ctx.Affinity = (SmpGetNumberOfActiveCpus() > 1) ? CPU_AFFINITY_ALL & ~ourCpu : CPU_AFFINITY_ALL;
+    ctx.HoldTimeUs = HoldTimeUs;
+
+    status = ThreadCreate("MutexHolder",
+                          ThreadPriorityDefault,
+                          _TstMutexHolder,
+                          &ctx,
+                          &pThread);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadCreate", status);
+        ThreadSetAffinity(NULL, CPU_AFFINITY_ALL);
+        return status;
+    }
+
+    ExEventWaitForSignal(&ctx.MutexHeldEvt);
+
+    // the holder is busy for HoldTimeUs: a short hold ends while we spin, a
+    // long one outlasts the spin and we block until the release
+    MutexAcquire(&ctx.Mutex);
+    if (!ctx.Releasing)
+    {
+        LOG_ERROR("The mutex was acquired before the holder released it\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+    MutexRelease(&ctx.Mutex);
+
+    ThreadWaitForTermination(pThread, &exitStatus);
+    ThreadCloseHandle(pThread);
+
+    ThreadSetAffinity(NULL, CPU_AFFINITY_ALL);
+
+    if (SUCCEEDED(status) && !SUCCEEDED(exitStatus))
+    {
+        LOG_ERROR("Holder thread failed with status 0x%x\n", exitStatus);
+        status = exitStatus;
+    }
+
+    return status;
+}
+
+static
+STATUS
+_TstRwLockConcurrentReaders(
+    void
+    )
+{
+    TST_RWLOCK_CTX ctx;
+
+    memzero(&ctx, sizeof(TST_RWLOCK_CTX));
+    ExRwLockInit(&ctx.RwLock);
+
+    // each reader waits inside the lock for all the others to enter
+    ctx.NumberOfThreads = _TstSynchGetNumberOfThreads();
+
+    return _TstSynchRunThreads("RwLockReader", _TstRwLockSharedHolder, &ctx, ctx.NumberOfThreads);
+}
+
+static
+STATUS
+_TstRwLockExclusion(
+    void
+    )
+{
+    TST_RWLOCK_CTX ctx;
+    STATUS status;
+    DWORD noOfWriters;
+
+    memzero(&ctx, sizeof(TST_RWLOCK_CTX));
+    ExRwLockInit(&ctx.RwLock);
+
+    // the threads with an even index write, the others read
+    ctx.NumberOfThreads = _TstSynchGetNumberOfThreads();
+    noOfWriters = (ctx.NumberOfThreads + 1) / 2;
+
+    status = _TstSynchRunThreads("RwLockWorker", _TstRwLockMixedWorker, &ctx, ctx.NumberOfThreads);
+    if (!SUCCEEDED(status))
+    {
+        return status;
+    }
+
+    if (ctx.ExclusionViolated)
+    {
+        LOG_ERROR("A writer shared the lock with another thread\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (ctx.Counter != noOfWriters * TST_RWLOCK_MIXED_ITERATIONS)
+    {
+        LOG_ERROR("Counter is %u instead of %u\n", ctx.Counter, noOfWriters * TST_RWLOCK_MIXED_ITERATIONS);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_TstRwLockWriterPreference(
+    void
+    )
+{
+    TST_RWLOCK_CTX ctx;
+    PTHREAD pWriter;
+    PTHREAD pReader;
+    STATUS status;
+    STATUS exitStatus;
+    QWORD deadline;
+
+    memzero(&ctx, sizeof(TST_RWLOCK_CTX));
+    ExRwLockInit(&ctx.RwLock);
+
+    pWriter = NULL;
+    pReader = NULL;
+
+    ExRwLockAcquireShared(&ctx.RwLock);
+
+    status = ThreadCreate("RwLockWriter",
+                          ThreadPriorityDefault,
+                          _TstRwLockWriter,
+                          &ctx,
+                          &pWriter);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadCreate", status);
+        ExRwLockReleaseShared(&ctx.RwLock);
+        return status;
+    }
+
+    __try
+    {
+        // the counter is read without the spinlock of the rwlock, it is
+        // enough to know the writer is blocked
+        deadline = IomuGetSystemTimeUs() + TST_RWLOCK_MAX_WAIT_US;
+        while (0 == ctx.RwLock.NumberOfWaitingWriters && IomuGetSystemTimeUs() < deadline)
+        {
+            ThreadYield();
+        }
+
+        if (0 == ctx.RwLock.NumberOfWaitingWriters)
+        {
+            LOG_ERROR("The writer did not wait for the lock held shared\n");
+            status = STATUS_UNSUCCESSFUL;
+            __leave;
+        }
+
+        // a reader coming after the writer must wait for it even if the lock
+        // is held shared, else a stream of readers would starve the writer
+        status = ThreadCreate("RwLockLateReader",
+                              ThreadPriorityDefault,
+                              _TstRwLockLateReader,
+                              &ctx,
+                              &pReader);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("ThreadCreate", status);
+            __leave;
+        }
+
+        deadline = IomuGetSystemTimeUs() + TST_MUTEX_STILL_HELD_WAIT_US;
+        while (!ctx.ReaderAcquired && IomuGetSystemTimeUs() < deadline)
+        {
+            ThreadYield();
+        }
+
+        if (ctx.ReaderAcquired)
+        {
+            LOG_ERROR("A reader acquired the lock before a waiting writer\n");
+            status = STATUS_UNSUCCESSFUL;
+        }
+    }
+    __finally
+    {
+        ExRwLockReleaseShared(&ctx.RwLock);
+
+        ThreadWaitForTermination(pWriter, &exitStatus);
+        ThreadCloseHandle(pWriter);
+
+        if (NULL != pReader)
+        {
+            ThreadWaitForTermination(pReader, &exitStatus);
+            ThreadCloseHandle(pReader);
+
+            if (SUCCEEDED(status) && !SUCCEEDED(exitStatus))
+            {
+                LOG_ERROR("Late reader failed with status 0x%x\n", exitStatus);
+                status = exitStatus;
+            }
+        }
+    }
+
+    return status;
+}
+
+static
+STATUS
+_TstSynchRunThreads(
+    IN_Z        char*               Name,
+    IN          PFUNC_ThreadStart   Function,
+    IN_OPT      PVOID               Context,
+    IN          DWORD               NumberOfThreads
+    )
+{
+    PTHREAD threads[TST_SYNCH_MAX_THREADS];
+    STATUS status;
+    STATUS exitStatus;
+    DWORD noOfThreadsCreated;
+    DWORD i;
+
+    ASSERT(NULL != Name);
+    ASSERT(NULL != Function);
+    ASSERT(NumberOfThreads <= TST_SYNCH_MAX_THREADS);
+
+    status = STATUS_SUCCESS;
+
+    for (noOfThreadsCreated = 0; noOfThreadsCreated < NumberOfThreads; ++noOfThreadsCreated)
+    {
+        status = ThreadCreate(Name,
+                              ThreadPriorityDefault,
+                              Function,
+                              Context,
+                              &threads[noOfThreadsCreated]);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("ThreadCreate", status);
+            break;
+        }
+    }
+
+    // the threads created must finish even if the others could not be created
+    for (i = 0; i < noOfThreadsCreated; ++i)
+    {
+        ThreadWaitForTermination(threads[i], &exitStatus);
+        ThreadCloseHandle(threads[i]);
+
+        if (SUCCEEDED(status) && !SUCCEEDED(exitStatus))
+        {
+            LOG_ERROR("Thread %u failed with status 0x%x\n", i, exitStatus);
+            status = exitStatus;
+        }
+    }
+
+    return status;
+}
+
+static
+DWORD
+_TstSynchGetNumberOfThreads(
+    void
+    )
+{
+    return min(max(SmpGetNumberOfActiveCpus() * 2, 2), TST_SYNCH_MAX_THREADS);
+}
+
+static
+STATUS
+(__cdecl _TstMutexContendedWorker)(
+    IN_OPT      PVOID       Context
+    )
+{
+    PTST_MUTEX_CTX pCtx;
+    DWORD i;
+
+    ASSERT(NULL != Context);
+
+    pCtx = (PTST_MUTEX_CTX) Context;
+
+    for (i = 0; i < TST_MUTEX_CONTENDED_ITERATIONS; ++i)
+    {
+        MutexAcquire(&pCtx->Mutex);
+
+        if (1 != _InterlockedIncrement((volatile long*) &pCtx->ThreadsInside))
+        {
+            pCtx->ExclusionViolated = TRUE;
+        }
+
+        pCtx->Counter = pCtx->Counter + 1;
+
+        _InterlockedDecrement((volatile long*) &pCtx->ThreadsInside);
+
+        MutexRelease(&pCtx->Mutex);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+(__cdecl _TstMutexHolder)(
+    IN_OPT      PVOID       Context
+    )
+{
+    PTST_MUTEX_CTX pCtx;
+    QWORD releaseTime;
+    STATUS status;
+
+    ASSERT(NULL != Context);
+
+    pCtx = (PTST_MUTEX_CTX) Context;
+
+    status = ThreadSetAffinity(NULL, pCtx->Affinity);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadSetAffinity", status);
+    }
+
+    MutexAcquire(&pCtx->Mutex);
+    ExEventSignal(&pCtx->MutexHeldEvt);
+
+    // we keep running with the mutex held, this is what makes the waiter spin
+    releaseTime = IomuGetSystemTimeUs() + pCtx->HoldTimeUs;
+    while (IomuGetSystemTimeUs() < releaseTime)
+    {
+        _mm_pause();
+    }
+
+    pCtx->Releasing = TRUE;
+    MutexRelease(&pCtx->Mutex);
+
+    return status;
+}
+
+static
+STATUS
+(__cdecl _TstMutexWaiter)(
+    IN_OPT      PVOID       Context
+    )
+{
+    PTST_MUTEX_CTX pCtx;
+    STATUS status;
+
+    ASSERT(NULL != Context);
+
+    pCtx = (PTST_MUTEX_CTX) Context;
+    status = STATUS_SUCCESS;
+
+    MutexAcquire(&pCtx->Mutex);
+
+    pCtx->Acquired = TRUE;
+    if (!pCtx->Releasing)
+    {
+        LOG_ERROR("The mutex was acquired before its last recursive release\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    MutexRelease(&pCtx->Mutex);
+
+    return status;
+}
+
+static
+STATUS
+(__cdecl _TstRwLockSharedHolder)(
+    IN_OPT      PVOID       Context
+    )
+{
+    PTST_RWLOCK_CTX pCtx;
+    QWORD deadline;
+    STATUS status;
+
+    ASSERT(NULL != Context);
+
+    pCtx = (PTST_RWLOCK_CTX) Context;
+    status = STATUS_SUCCESS;
+
+    ExRwLockAcquireShared(&pCtx->RwLock);
+    _InterlockedIncrement((volatile long*) &pCtx->ReadersInside);
+
+    // the last reader can enter only if the others did not exclude it
+    deadline = IomuGetSystemTimeUs() + TST_RWLOCK_MAX_WAIT_US;
+    while (pCtx->ReadersInside < pCtx->NumberOfThreads && IomuGetSystemTimeUs() < deadline)
+    {
+        ThreadYield();
+    }
+
+    if (pCtx->ReadersInside < pCtx->NumberOfThreads)
+    {
+        LOG_ERROR("Only %u readers out of %u hold the lock at once\n", pCtx->ReadersInside, pCtx->NumberOfThreads);
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    ExRwLockReleaseShared(&pCtx->RwLock);
+
+    return status;
+}
+
+static
+STATUS
+(__cdecl _TstRwLockMixedWorker)(
+    IN_OPT      PVOID       Context
+    )
+{
+    PTST_RWLOCK_CTX pCtx;
+    BOOLEAN bWriter;
+    DWORD i;
+
+    ASSERT(NULL != Context);
+
+    pCtx = (PTST_RWLOCK_CTX) Context;
+    bWriter = (0 == (_InterlockedIncrement((volatile long*) &pCtx->ThreadIndex) - 1) % 2);
+
+    for (i = 0; i < TST_RWLOCK_MIXED_ITERATIONS; ++i)
+    {
+        if (bWriter)
+        {
+            ExRwLockAcquireExclusive(&pCtx->RwLock);
+
+            if (1 != _InterlockedIncrement((volatile long*) &pCtx->WritersInside)
+                || 0 != pCtx->ReadersInside)
+            {
+                pCtx->ExclusionViolated = TRUE;
+            }
+
+            pCtx->Counter = pCtx->Counter + 1;
+
+            _InterlockedDecrement((volatile long*) &pCtx->WritersInside);
+
+            ExRwLockReleaseExclusive(&pCtx->RwLock);
+        }
+        else
+        {
+            ExRwLockAcquireShared(&pCtx->RwLock);
+
+            _InterlockedIncrement((volatile long*) &pCtx->ReadersInside);
+            if (0 != pCtx->WritersInside)
+            {
+                pCtx->ExclusionViolated = TRUE;
+            }
+            _InterlockedDecrement((volatile long*) &pCtx->ReadersInside);
+
+            ExRwLockReleaseShared(&pCtx->RwLock);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+(__cdecl _TstRwLockWriter)(
+    IN_OPT      PVOID       Context
+    )
+{
+    PTST_RWLOCK_CTX pCtx;
+
+    ASSERT(NULL != Context);
+
+    pCtx = (PTST_RWLOCK_CTX) Context;
+
+    ExRwLockAcquireExclusive(&pCtx->RwLock);
+    pCtx->WriterDone = TRUE;
+    ExRwLockReleaseExclusive(&pCtx->RwLock);
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+(__cdecl _TstRwLockLateReader)(
+    IN_OPT      PVOID       Context
+    )
+{
+    PTST_RWLOCK_CTX pCtx;
+    STATUS status;
+
+    ASSERT(NULL != Context);
+
+    pCtx = (PTST_RWLOCK_CTX) Context;
+    status = STATUS_SUCCESS;
+
+    ExRwLockAcquireShared(&pCtx->RwLock);
+
+    pCtx->ReaderAcquired = TRUE;
+    if (!pCtx->WriterDone)
+    {
+        LOG_ERROR("The reader arrived after the writer but got the lock first\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    ExRwLockReleaseShared(&pCtx->RwLock);
+
+    return status;
+}
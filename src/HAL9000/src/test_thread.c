@@ -92,6 +92,18 @@ const THREAD_TEST THREADS_TEST[] =
         _ThreadTestPassContext, (PVOID)TEST_TIMER_RELATIVE_ZERO, NULL, NULL,
         ThreadPriorityDefault, FALSE, TRUE, FALSE},
 
+    // Tests to see if a relative once timer of 500 us, shorter than a scheduler tick, wakes up the thread on time,
+    // i.e. without waiting for the next scheduler tick when the LAPIC timer supports deadlines
+    {   "TestThreadTimerWakeupLatency", TestThreadTimerWakeupLatency,
+        _ThreadTestPassContext, (PVOID)TEST_TIMER_RELATIVE_SHORT, NULL, NULL,
+        ThreadPriorityDefault, FALSE, TRUE, FALSE},
+
+    // Binds a 50ms relative once timer to the wheel of one CPU, then starts it again and waits for it from another
+    // CPU. The CPU owning the wheel must be told to arm its LAPIC timer for the new deadline.
+    {   "TestThreadTimerRemoteWheel", TestThreadTimerRemoteWheel,
+        NULL, NULL, NULL, NULL,
+        ThreadPriorityDefault, FALSE, TRUE, FALSE},
+
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     //                                           PRIORITY SCHEDULER TESTS                                             //
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -3,6 +3,14 @@
 #include "test_timer.h"
 #include "ex_timer.h"
 #include "iomu.h"
+#include "cpumu.h"
+#include "thread_internal.h"
+#include "lapic_system.h"
+#include "tsc_clock.h"
+
+// With LAPIC deadlines the waiter is woken up by the interrupt programmed for
+// the timer, it may only be late by the time needed to schedule it
+#define TIMER_TEST_DEADLINE_MAX_LATENCY_WHEEL_TICKS     3
 
 #pragma warning(push)
 
@@ -62,6 +70,12 @@ typedef struct _TIMER_TEST_MULTIPLE_CTX
 
 #pragma warning(pop)
 
+static
+STATUS
+_TestThreadCheckWakeupLatency(
+    IN          PEX_TIMER       Timer
+    );
+
 static
 void
 _TestThreadSleepWaitTimer(
@@ -164,6 +178,97 @@ STATUS
     return STATUS_SUCCESS;
 }
 
+STATUS
+(__cdecl TestThreadTimerWakeupLatency)(
+    IN_OPT      PVOID       Context
+    )
+{
+    PTIMER_TEST_CTX pCtx;
+    EX_TIMER timer;
+    STATUS status;
+
+    pCtx = (PTIMER_TEST_CTX) Context;
+
+    ASSERT(pCtx != NULL);
+    ASSERT(pCtx->TimerType == ExTimerTypeRelativeOnce);
+
+    status = ExTimerInit(&timer, ExTimerTypeRelativeOnce, pCtx->UsToSleep);
+    ASSERT(SUCCEEDED(status));
+
+    ExTimerStart(&timer);
+    ExTimerWait(&timer);
+
+    status = _TestThreadCheckWakeupLatency(&timer);
+
+    ExTimerUninit(&timer);
+
+    if (SUCCEEDED(status))
+    {
+        LOG_TEST_PASS;
+    }
+
+    return status;
+}
+
+STATUS
+(__cdecl TestThreadTimerRemoteWheel)(
+    IN_OPT      PVOID       Context
+    )
+{
+    EX_TIMER timer;
+    STATUS status;
+    INTR_STATE oldState;
+    CPU_AFFINITY firstCpu;
+    PEX_TIMER_WHEEL pFirstWheel;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    oldState = CpuIntrDisable();
+    firstCpu = (CPU_AFFINITY) GetCurrentPcpu()->LogicalApicId;
+    pFirstWheel = &GetCurrentPcpu()->TimerWheel;
+    CpuIntrSetState(oldState);
+
+    status = ThreadSetAffinity(NULL, CPU_AFFINITY_ALL & ~firstCpu);
+    if (!SUCCEEDED(status))
+    {
+        LOG_TEST_LOG("There is a single CPU, the timer cannot be armed remotely\n");
+        LOG_TEST_PASS;
+        return STATUS_SUCCESS;
+    }
+
+    // the relative timeout starts now that we run on another CPU, moving
+    // here did not eat into it
+    status = ExTimerInit(&timer, ExTimerTypeRelativeOnce, TIMER_TEST_SLEEP_TIME_IN_US);
+    ASSERT(SUCCEEDED(status));
+
+    // the timer is bound to the wheel of the CPU which first starts it, we
+    // bind it to the wheel of the first CPU before starting it from here
+    timer.Wheel = pFirstWheel;
+
+    __try
+    {
+        // the first CPU is now likely idle with its scheduler tick stopped,
+        // only the IPI sent by ExTimerStart makes it arm its LAPIC timer
+        ExTimerStart(&timer);
+        ExTimerWait(&timer);
+
+        status = _TestThreadCheckWakeupLatency(&timer);
+    }
+    __finally
+    {
+        ExTimerUninit(&timer);
+
+        ThreadSetAffinity(NULL, CPU_AFFINITY_ALL);
+    }
+
+    if (SUCCEEDED(status))
+    {
+        LOG_TEST_PASS;
+    }
+
+    return status;
+}
+
 void
 (__cdecl TestThreadTimerPrepare)(
     OUT_OPT_PTR     PVOID*              Context,
@@ -295,3 +400,46 @@ void
 
     }
 }
+
+static
+STATUS
+_TestThreadCheckWakeupLatency(
+    IN          PEX_TIMER       Timer
+    )
+{
+    QWORD wakeupTimeUs;
+    QWORD maxLatencyUs;
+    INTR_STATE oldState;
+    BOOLEAN bHardwareDeadlines;
+
+    ASSERT(Timer != NULL);
+
+    wakeupTimeUs = IomuGetSystemTimeUs();
+
+    if (wakeupTimeUs < Timer->TriggerTimeUs)
+    {
+        LOG_ERROR("Thread woke up at %U us system time, before the timer trigger time %U us\n",
+                  wakeupTimeUs, Timer->TriggerTimeUs);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    oldState = CpuIntrDisable();
+    bHardwareDeadlines = LapicSystemHasTimerDeadlines();
+    CpuIntrSetState(oldState);
+
+    // without LAPIC deadlines the timers are only noticed on scheduler ticks
+    maxLatencyUs = (TscClockIsReliable() && bHardwareDeadlines)
+        ? TIMER_TEST_DEADLINE_MAX_LATENCY_WHEEL_TICKS * EX_TIMER_WHEEL_TICK_US
+        : IomuGetTimerInterrupTimeUs() + EX_TIMER_WHEEL_TICK_US;
+
+    LOG_TEST_LOG("Thread woke up %U us after the timer trigger time\n", wakeupTimeUs - Timer->TriggerTimeUs);
+
+    if (wakeupTimeUs - Timer->TriggerTimeUs > maxLatencyUs)
+    {
+        LOG_ERROR("Thread woke up %U us after the timer trigger time, more than %U us\n",
+                  wakeupTimeUs - Timer->TriggerTimeUs, maxLatencyUs);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
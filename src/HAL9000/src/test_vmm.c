@@ -1,9 +1,21 @@
 #include "test_common.h"
 #include "test_vmm.h"
+#include "pmm.h"
+#include "cpumu.h"
+#include "thread_internal.h"
 
 #define TST_VMM_MAGIC_VALUE_TO_WRITE                0xAC
 #define TST_VMM_VA_TO_REQUEST                       (PtrOffset(gVirtualToPhysicalOffset,32 * TB_SIZE))
 
+// Filled with TST_VMM_DIRTY_VALUE and released to the cache of our CPU right
+// before the eager commit which should get them back
+#define TST_VMM_DIRTY_FRAMES                        16
+#define TST_VMM_DIRTY_VALUE                         0xCD
+
+// Committed after an eager commit of the whole memory failed, which left no
+// free frame if the pages it had mapped were not released
+#define TST_VMM_COMMIT_AFTER_FAILURE_SIZE           (1 * MB_SIZE)
+
 static const DWORD TST_VMM_ALLOCATION_SIZES[] =
 {
     PAGE_SIZE,
@@ -21,6 +33,18 @@ _TstVmmAllocationAndDeallocation(
     IN          BOOLEAN     SpecifyBase
     );
 
+static
+STATUS
+_TstVmmCommitClearsDirtyFrames(
+    void
+    );
+
+static
+STATUS
+_TstVmmFailedCommitReleasesFrames(
+    void
+    );
+
 void
 TestVmmAllocAndFreeFunctions(
     void
@@ -39,6 +63,14 @@ TestVmmAllocAndFreeFunctions(
             LOGL("_TstVmmAllocationAndDeallocation finished with status: 0x%x\n", status );
         }
     }
+
+    LOGL("Will call _TstVmmCommitClearsDirtyFrames\n");
+    status = _TstVmmCommitClearsDirtyFrames();
+    LOGL("_TstVmmCommitClearsDirtyFrames finished with status: 0x%x\n", status);
+
+    LOGL("Will call _TstVmmFailedCommitReleasesFrames\n");
+    status = _TstVmmFailedCommitReleasesFrames();
+    LOGL("_TstVmmFailedCommitReleasesFrames finished with status: 0x%x\n", status);
 }
 
 static
@@ -130,4 +162,177 @@ _TstVmmAllocationAndDeallocation(
                   );
 
     return status;
+}
+
+static
+STATUS
+_TstVmmCommitClearsDirtyFrames(
+    void
+    )
+{
+    PHYSICAL_ADDRESS* pZeroedFrames;
+    PHYSICAL_ADDRESS dirtyFrames[TST_VMM_DIRTY_FRAMES];
+    PBYTE pBaseAddress;
+    CPU_AFFINITY ourCpu;
+    INTR_STATE oldState;
+    DWORD noOfZeroedFrames;
+    DWORD noOfDirtyFrames;
+    DWORD i;
+    STATUS status;
+
+    pZeroedFrames = ExAllocatePoolWithTag(PoolAllocateZeroMemory,
+                                          PMM_ZEROED_POOL_MAX_FRAMES * sizeof(PHYSICAL_ADDRESS),
+                                          HEAP_TEST_TAG,
+                                          0);
+    if (NULL == pZeroedFrames)
+    {
+        LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", PMM_ZEROED_POOL_MAX_FRAMES * sizeof(PHYSICAL_ADDRESS));
+        return STATUS_HEAP_INSUFFICIENT_RESOURCES;
+    }
+
+    oldState = CpuIntrDisable();
+    ourCpu = (CPU_AFFINITY) GetCurrentPcpu()->LogicalApicId;
+    CpuIntrSetState(oldState);
+
+    // the dirty frames are released to the cache of our CPU and the commit
+    // must take them from it
+    status = ThreadSetAffinity(NULL, ourCpu);
+    ASSERT(SUCCEEDED(status));
+
+    // the pool of zeroed frames is emptied so that the commit falls back to
+    // the frames which are not zero, the zero worker may refill it meanwhile
+    for (noOfZeroedFrames = 0; noOfZeroedFrames < PMM_ZEROED_POOL_MAX_FRAMES; ++noOfZeroedFrames)
+    {
+        BOOLEAN bZeroed;
+        PHYSICAL_ADDRESS pa;
+
+        pa = PmmReserveZeroedMemory(&bZeroed);
+        if (NULL != pa && !bZeroed)
+        {
+            PmmReleaseMemory(pa, 1);
+        }
+
+        if (NULL == pa || !bZeroed)
+        {
+            break;
+        }
+
+        pZeroedFrames[noOfZeroedFrames] = pa;
+    }
+
+    status = STATUS_SUCCESS;
+
+    for (noOfDirtyFrames = 0; noOfDirtyFrames < TST_VMM_DIRTY_FRAMES; ++noOfDirtyFrames)
+    {
+        PVOID pData;
+
+        dirtyFrames[noOfDirtyFrames] = PmmReserveMemory(1);
+        if (NULL == dirtyFrames[noOfDirtyFrames])
+        {
+            break;
+        }
+
+        pData = MmuMapSystemMemory(dirtyFrames[noOfDirtyFrames], PAGE_SIZE);
+        if (NULL == pData)
+        {
+            PmmReleaseMemory(dirtyFrames[noOfDirtyFrames], 1);
+            break;
+        }
+
+        memset(pData, TST_VMM_DIRTY_VALUE, PAGE_SIZE);
+        MmuUnmapSystemMemory(pData, PAGE_SIZE);
+    }
+
+    for (i = 0; i < noOfDirtyFrames; ++i)
+    {
+        PmmReleaseMemory(dirtyFrames[i], 1);
+    }
+
+    pBaseAddress = VmmAllocRegion(NULL,
+                                  TST_VMM_DIRTY_FRAMES * PAGE_SIZE,
+                                  VMM_ALLOC_TYPE_RESERVE | VMM_ALLOC_TYPE_COMMIT | VMM_ALLOC_TYPE_NOT_LAZY,
+                                  PAGE_RIGHTS_READWRITE
+                                  );
+    if (NULL == pBaseAddress)
+    {
+        LOG_ERROR("VmmAllocRegion failed eager commit: %u bytes of memory\n", TST_VMM_DIRTY_FRAMES * PAGE_SIZE);
+        status = STATUS_MEMORY_CANNOT_BE_COMMITED;
+    }
+    else
+    {
+        for (i = 0; i < TST_VMM_DIRTY_FRAMES * PAGE_SIZE; ++i)
+        {
+            if (0 != pBaseAddress[i])
+            {
+                LOG_ERROR("Byte 0x%x of the committed region at 0x%X is 0x%x\n", i, pBaseAddress, pBaseAddress[i]);
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+        }
+
+        VmmFreeRegion(pBaseAddress,
+                      0,
+                      VMM_FREE_TYPE_RELEASE
+                      );
+    }
+
+    // the frames taken from the pool were not touched, they are still zero
+    for (i = 0; i < noOfZeroedFrames; ++i)
+    {
+        PmmReleaseZeroedMemory(pZeroedFrames[i], 1);
+    }
+
+    ThreadSetAffinity(NULL, CPU_AFFINITY_ALL);
+
+    ExFreePoolWithTag(pZeroedFrames, HEAP_TEST_TAG);
+
+    return status;
+}
+
+static
+STATUS
+_TstVmmFailedCommitReleasesFrames(
+    void
+    )
+{
+    PBYTE pBaseAddress;
+    QWORD size;
+
+    // the memory is exhausted only while the commit maps the pages, it
+    // fails once no frame is left and must release the ones it took
+    size = AlignAddressUpper(PmmGetTotalSystemMemory(), PAGE_SIZE);
+
+    pBaseAddress = VmmAllocRegion(NULL,
+                                  size,
+                                  VMM_ALLOC_TYPE_RESERVE | VMM_ALLOC_TYPE_COMMIT | VMM_ALLOC_TYPE_NOT_LAZY,
+                                  PAGE_RIGHTS_READWRITE
+                                  );
+    if (NULL != pBaseAddress)
+    {
+        LOG_ERROR("VmmAllocRegion eagerly committed 0x%X bytes, the whole memory\n", size);
+        VmmFreeRegion(pBaseAddress,
+                      0,
+                      VMM_FREE_TYPE_RELEASE
+                      );
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    pBaseAddress = VmmAllocRegion(NULL,
+                                  TST_VMM_COMMIT_AFTER_FAILURE_SIZE,
+                                  VMM_ALLOC_TYPE_RESERVE | VMM_ALLOC_TYPE_COMMIT | VMM_ALLOC_TYPE_NOT_LAZY,
+                                  PAGE_RIGHTS_READWRITE
+                                  );
+    if (NULL == pBaseAddress)
+    {
+        LOG_ERROR("VmmAllocRegion failed eager commit: %u bytes of memory after a failed commit, its frames were not released\n",
+                  TST_VMM_COMMIT_AFTER_FAILURE_SIZE);
+        return STATUS_MEMORY_CANNOT_BE_COMMITED;
+    }
+
+    VmmFreeRegion(pBaseAddress,
+                  0,
+                  VMM_FREE_TYPE_RELEASE
+                  );
+
+    return STATUS_SUCCESS;
 }
\ No newline at end of file
@@ -9,11 +9,33 @@
 #include "isr.h"
 #include "gdtmu.h"
 #include "pe_exports.h"
+#include "smp.h"
+#include "lapic_system.h"
+#include "iomu.h"
 
 #define TID_INCREMENT               4
 
 #define THREAD_TIME_SLICE           1
 
+// While there is nothing to run the scheduler tick is stopped. If the LAPIC
+// timer is in the periodic mode it cannot wake the CPU for the timers armed on
+// its wheel, an idle CPU then still wakes up after at most this many ticks
+#define THREAD_IDLE_MAX_SLEEP_TICKS 4
+
+// Maximum number of destroyed threads each CPU keeps for reuse
+#define THREAD_CACHE_SIZE_PER_CPU   8
+
+// XSAVE/XRSTOR require a 64 byte aligned area
+#define THREAD_XSAVE_AREA_ALIGNMENT 64
+
+// Offsets in the legacy region of the XSAVE area and the values the control
+// registers have after FNINIT/power-up (all exceptions masked)
+#define XSAVE_LEGACY_FCW_OFFSET     0x0
+#define XSAVE_LEGACY_MXCSR_OFFSET   0x18
+
+#define THREAD_FPU_DEFAULT_FCW      0x037F
+#define THREAD_FPU_DEFAULT_MXCSR    0x1F80
+
 extern void ThreadStart();
 
 typedef
@@ -32,14 +54,58 @@ typedef struct _THREAD_SYSTEM_DATA
     _Guarded_by_(AllThreadsLock)
     LIST_ENTRY          AllThreadsList;
 
-    LOCK                ReadyThreadsLock;
-
-    _Guarded_by_(ReadyThreadsLock)
-    LIST_ENTRY          ReadyThreadsList;
+    // Selected at boot, does not change afterwards
+    THREAD_SCHEDULING_POLICY    SchedulingPolicy;
 } THREAD_SYSTEM_DATA, *PTHREAD_SYSTEM_DATA;
 
 static THREAD_SYSTEM_DATA m_threadSystemData;
 
+STATIC_ASSERT(ThreadPriorityReserved <= THREAD_PRIORITY_LEVELS);
+STATIC_ASSERT(THREAD_PRIORITY_LEVELS <= sizeof(DWORD) * BITS_PER_BYTE);
+
+__forceinline
+static
+THREAD_PRIORITY
+_ThreadGetEffectivePriority(
+    IN      PTHREAD             Thread
+    )
+{
+    // under MLFQ each level lowers the priority by one
+    if (ThreadSchedulingPolicyMlfq == m_threadSystemData.SchedulingPolicy)
+    {
+        return (Thread->Priority > Thread->MlfqLevel) ? Thread->Priority - Thread->MlfqLevel : ThreadPriorityLowest;
+    }
+
+    return Thread->Priority;
+}
+
+__forceinline
+static
+DWORD
+_ThreadGetTimeSlice(
+    IN      PTHREAD             Thread
+    )
+{
+    // under MLFQ the time slice doubles with each level
+    if (ThreadSchedulingPolicyMlfq == m_threadSystemData.SchedulingPolicy)
+    {
+        return THREAD_TIME_SLICE << Thread->MlfqLevel;
+    }
+
+    return THREAD_TIME_SLICE;
+}
+
+__forceinline
+static
+BOOLEAN
+_ThreadCanRunOnCpu(
+    IN      PTHREAD             Thread,
+    IN      PPCPU               Cpu
+    )
+{
+    return IsBooleanFlagOn(Thread->Affinity, Cpu->LogicalApicId);
+}
+
 __forceinline
 static
 TID
@@ -80,22 +146,19 @@ _ThreadSetupMainThreadUserStack(
     );
 
 
-REQUIRES_EXCL_LOCK(m_threadSystemData.ReadyThreadsLock)
-RELEASES_EXCL_AND_NON_REENTRANT_LOCK(m_threadSystemData.ReadyThreadsLock)
+// All the functions below must be called with the ready list lock of the
+// current CPU held (GetCurrentPcpu()->ThreadData.ReadyThreadsLock)
 static
 void
 _ThreadSchedule(
-    void
+    IN      THREAD_SWITCH_REASON    Reason
     );
 
-REQUIRES_EXCL_LOCK(m_threadSystemData.ReadyThreadsLock)
-RELEASES_EXCL_AND_NON_REENTRANT_LOCK(m_threadSystemData.ReadyThreadsLock)
 void
 ThreadCleanupPostSchedule(
     void
     );
 
-REQUIRES_EXCL_LOCK(m_threadSystemData.ReadyThreadsLock)
 static
 _Ret_notnull_
 PTHREAD
@@ -103,12 +166,119 @@ _ThreadGetReadyThread(
     void
     );
 
+static
+PTHREAD
+_ThreadStealReadyThread(
+    INOUT   PPCPU                   ThiefCpu
+    );
+
+static
+void
+_ThreadReadyQueueInit(
+    OUT     PTHREAD_READY_QUEUE     Queue
+    );
+
+static
+_Ret_notnull_
+PPCPU
+_ThreadSelectCpuForReadyThread(
+    IN      PTHREAD                 Thread
+    );
+
+static
+CPU_AFFINITY
+_ThreadSelectCpusToReschedule(
+    IN      PPCPU                   Cpu,
+    IN      PTHREAD                 Thread
+    );
+
+static
+CPU_AFFINITY
+_ThreadGetActiveCpusAffinity(
+    void
+    );
+
+static
+void
+_ThreadReadyQueueInsert(
+    INOUT   PTHREAD_READY_QUEUE     Queue,
+    INOUT   PTHREAD                 Thread,
+    IN      BOOLEAN                 AtHead
+    );
+
+static
+void
+_ThreadReadyQueueRemove(
+    INOUT   PTHREAD_READY_QUEUE     Queue,
+    INOUT   PTHREAD                 Thread
+    );
+
+static
+PTHREAD
+_ThreadReadyQueuePeekHighest(
+    IN      PTHREAD_READY_QUEUE     Queue
+    );
+
+static
+PTHREAD
+_ThreadReadyQueuePeekHighestForCpu(
+    IN      PTHREAD_READY_QUEUE     Queue,
+    IN      PPCPU                   Cpu
+    );
+
+static
+THREAD_PRIORITY
+_ThreadReadyQueueGetHighestPriority(
+    IN      PTHREAD_READY_QUEUE     Queue
+    );
+
+// The functions below must be called with the ready list lock of Cpu held
+static
+void
+_ThreadCpuReadyInsert(
+    INOUT   PPCPU                   Cpu,
+    INOUT   PTHREAD                 Thread,
+    IN      BOOLEAN                 AtHead
+    );
+
+static
+void
+_ThreadCpuReadyRemove(
+    INOUT   PPCPU                   Cpu,
+    INOUT   PTHREAD                 Thread
+    );
+
+static
+PTHREAD
+_ThreadCpuReadyRemoveHighest(
+    INOUT   PPCPU                   Cpu
+    );
+
+static
+THREAD_PRIORITY
+_ThreadCpuGetHighestReadyPriority(
+    IN      PPCPU                   Cpu
+    );
+
 static
 void
 _ThreadForcedExit(
     void
     );
 
+static
+BOOLEAN
+_ThreadShouldYieldAfterUnblock(
+    IN      INTR_STATE              OldState
+    );
+
+static
+void
+_ThreadSetAffinityForOtherThread(
+    INOUT   PTHREAD                 Thread,
+    IN      CPU_AFFINITY            Affinity
+    );
+
 static
 void
 _ThreadReference(
@@ -123,6 +293,14 @@ _ThreadDereference(
 
 static FUNC_FreeFunction            _ThreadDestroy;
 
+static FUNC_RcuCallback             _ThreadFree;
+
+static
+void
+_ThreadFreeStructure(
+    INOUT   PTHREAD                 Thread
+    );
+
 static
 void
 _ThreadKernelFunction(
@@ -132,6 +310,87 @@ _ThreadKernelFunction(
 
 static FUNC_ThreadStart     _IdleThread;
 
+static
+void
+_ThreadMlfqUpdateLevel(
+    INOUT   PTHREAD                 Thread,
+    IN      BOOLEAN                 UsedWholeSlice
+    );
+
+static
+PTHREAD
+_ThreadCacheGet(
+    void
+    );
+
+static
+BOOLEAN
+_ThreadCachePut(
+    INOUT   PTHREAD                 Thread
+    );
+
+static
+void
+_ThreadStopTickForIdle(
+    INOUT   PPCPU                   Cpu
+    );
+
+static
+void
+_ThreadRestartTick(
+    INOUT   PPCPU                   Cpu
+    );
+
+static
+void
+_ThreadWakeIdleCpuToSteal(
+    INOUT   PPCPU                   Cpu
+    );
+
+static
+void
+_ThreadAccountTicklessIdle(
+    INOUT   PPCPU                   Cpu
+    );
+
+static
+void
+_ThreadFpuInitArea(
+    OUT     PVOID                   XsaveArea
+    );
+
+static
+void
+_ThreadLatencyAdd(
+    INOUT   PTHREAD_LATENCY_HISTOGRAM   Histogram,
+    IN      QWORD                       StartTsc,
+    IN      QWORD                       EndTsc
+    );
+
+static
+void
+_ThreadAccountSchedulingLatency(
+    INOUT   PPCPU                   Cpu,
+    INOUT   PTHREAD                 Thread
+    );
+
+static
+void
+_ThreadTraceSwitch(
+    INOUT   PPCPU                   Cpu,
+    IN      PTHREAD                 PreviousThread,
+    IN      PTHREAD                 NextThread,
+    IN      THREAD_SWITCH_REASON    Reason
+    );
+
+static
+void
+_ThreadFpuSwitch(
+    INOUT   PPCPU                   Cpu,
+    IN      PTHREAD                 CurrentThread,
+    IN      PTHREAD                 NextThread
+    );
+
 void
 _No_competing_thread_
 ThreadSystemPreinit(
@@ -143,8 +402,26 @@ ThreadSystemPreinit(
     InitializeListHead(&m_threadSystemData.AllThreadsList);
     LockInit(&m_threadSystemData.AllThreadsLock);
 
-    InitializeListHead(&m_threadSystemData.ReadyThreadsList);
-    LockInit(&m_threadSystemData.ReadyThreadsLock);
+    m_threadSystemData.SchedulingPolicy = ThreadSchedulingPolicyRoundRobin;
+}
+
+void
+_No_competing_thread_
+ThreadSystemSetSchedulingPolicy(
+    IN      THREAD_SCHEDULING_POLICY    Policy
+    )
+{
+    ASSERT(Policy < ThreadSchedulingPolicyReserved);
+
+    m_threadSystemData.SchedulingPolicy = Policy;
+}
+
+THREAD_SCHEDULING_POLICY
+ThreadSystemGetSchedulingPolicy(
+    void
+    )
+{
+    return m_threadSystemData.SchedulingPolicy;
 }
 
 STATUS
@@ -167,6 +444,17 @@ ThreadSystemInitMainForCurrentCPU(
 
     ASSERT( NULL != pCpu );
 
+    _ThreadReadyQueueInit(&pCpu->ThreadData.ReadyThreads);
+    _ThreadReadyQueueInit(&pCpu->ThreadData.PinnedReadyThreads);
+    HotLockInit(&pCpu->ThreadData.ReadyThreadsLock);
+    HotLockSetName(&pCpu->ThreadData.ReadyThreadsLock, "ReadyThreadsLock");
+    pCpu->ThreadData.NumberOfReadyThreads = 0;
+    pCpu->ThreadData.NumberOfStealableThreads = 0;
+
+    LockInit(&pCpu->ThreadData.ThreadCacheLock);
+    InitializeListHead(&pCpu->ThreadData.ThreadCache);
+    pCpu->ThreadData.ThreadCacheSize = 0;
+
     snprintf( mainThreadName, MAX_PATH, "%s-%02x", "main", pCpu->ApicId );
 
     status = _ThreadInit(mainThreadName, ThreadPriorityDefault, &pThread, FALSE);
@@ -183,6 +471,13 @@ ThreadSystemInitMainForCurrentCPU(
     pThread->State = ThreadStateRunning;
     SetCurrentThread(pThread);
 
+    // the FPU is enabled (CR0.TS is clear) and its registers belong to the
+    // code which was running until now, i.e. to the main thread
+    pCpu->ThreadData.FpuOwner = pThread;
+    pThread->FpuCpu = pCpu;
+
+    pCpu->ThreadData.RunningThreadPriority = _ThreadGetEffectivePriority(pThread);
+
     // In case of the main thread of the BSP the process will be NULL so we need to handle that case
     // When the system process will be initialized it will insert into its thread list the current thread (which will
     // be the main thread of the BSP)
@@ -243,6 +538,9 @@ ThreadSystemInitIdleForCurrentCPU(
     ThreadCloseHandle(idleThread);
     idleThread = NULL;
 
+    // start the periodic scheduler tick for this CPU
+    LapicSystemSetTimer(IomuGetTimerInterrupTimeUs());
+
     LOGPL("About to enable interrupts\n");
 
     // lets enable some interrupts :)
@@ -337,6 +635,10 @@ ThreadCreateEx(
     // the reference must be done outside _ThreadInit
     _ThreadReference(pThread);
 
+    // inherit the affinity of the creator, ThreadUnblock will place the
+    // thread on one of the allowed CPUs
+    pThread->Affinity = GetCurrentThread()->Affinity;
+
     if (!Process->PagingData->Data.KernelSpace)
     {
         // Create user-mode stack
@@ -430,7 +732,15 @@ ThreadTick(
     ASSERT( NULL != pCpu);
 
     LOG_TRACE_THREAD("Thread tick\n");
-    if (pCpu->ThreadData.IdleThread == pThread)
+    if (pCpu->ThreadData.TickStopped)
+    {
+        // The one-shot idle deadline expired: stop the timer (it is
+        // programmed in periodic mode), the idle thread will re-arm it if
+        // there is still nothing to run
+        LapicSystemSetTimer(0);
+        _ThreadAccountTicklessIdle(pCpu);
+    }
+    else if (pCpu->ThreadData.IdleThread == pThread)
     {
         pCpu->ThreadData.IdleTicks++;
     }
@@ -440,10 +750,15 @@ ThreadTick(
     }
     pThread->TickCountCompleted++;
 
-    if (++pCpu->ThreadData.RunningThreadTicks >= THREAD_TIME_SLICE)
+    if (0 != pCpu->ThreadData.NumberOfStealableThreads)
+    {
+        _ThreadWakeIdleCpuToSteal(pCpu);
+    }
+
+    if (++pCpu->ThreadData.RunningThreadTicks >= _ThreadGetTimeSlice(pThread))
     {
         LOG_TRACE_THREAD("Will yield on return\n");
-        pCpu->ThreadData.YieldOnInterruptReturn = TRUE;
+        ThreadRequestYieldOnInterrupt();
     }
 }
 
@@ -457,6 +772,8 @@ ThreadYield(
     PTHREAD pThread = GetCurrentThread();
     PPCPU pCpu;
     BOOLEAN bForcedYield;
+    BOOLEAN bPreempted;
+    THREAD_SWITCH_REASON reason;
 
     ASSERT( NULL != pThread);
 
@@ -466,8 +783,11 @@ ThreadYield(
 
     ASSERT( NULL != pCpu );
 
+    // an expired slice prevails over a preemption requested meanwhile
     bForcedYield = pCpu->ThreadData.YieldOnInterruptReturn;
+    bPreempted = !bForcedYield && pCpu->ThreadData.PreemptOnInterruptReturn;
     pCpu->ThreadData.YieldOnInterruptReturn = FALSE;
+    pCpu->ThreadData.PreemptOnInterruptReturn = FALSE;
 
     if (THREAD_FLAG_FORCE_TERMINATE_PENDING == _InterlockedAnd(&pThread->Flags, MAX_DWORD))
     {
@@ -475,18 +795,48 @@ ThreadYield(
         NOT_REACHED;
     }
 
-    LockAcquire(&m_threadSystemData.ReadyThreadsLock, &dummyState);
+    if (pThread != pCpu->ThreadData.IdleThread && !_ThreadCanRunOnCpu(pThread, pCpu))
+    {
+        // the affinity was changed by another thread while we were running,
+        // we get off this CPU the same way ThreadSetAffinity does
+        pThread->MigrationPending = TRUE;
+
+        ThreadTakeBlockLock();
+        ThreadBlock();
+
+        CpuIntrSetState(oldState);
+        return;
+    }
+
+    HotLockAcquire(&pCpu->ThreadData.ReadyThreadsLock, &dummyState);
     if (pThread != pCpu->ThreadData.IdleThread)
     {
-        InsertTailList(&m_threadSystemData.ReadyThreadsList, &pThread->ReadyList);
+        // a preempted thread did not give up its slice, it neither moves
+        // between the MLFQ levels nor waits behind its peers
+        if (!bPreempted)
+        {
+            _ThreadMlfqUpdateLevel(pThread, bForcedYield);
+        }
+        _ThreadCpuReadyInsert(pCpu, pThread, bPreempted);
+    }
+
+    if (bForcedYield)
+    {
+        reason = ThreadSwitchReasonPreempt;
     }
-    if (!bForcedYield)
+    else if (bPreempted)
+    {
+        reason = ThreadSwitchReasonWakeup;
+    }
+    else
     {
         pThread->TickCountEarly++;
+        reason = ThreadSwitchReasonYield;
     }
+
     pThread->State = ThreadStateReady;
-    _ThreadSchedule();
-    ASSERT( !LockIsOwner(&m_threadSystemData.ReadyThreadsLock));
+    _ThreadSchedule(reason);
+    ASSERT( !HotLockIsOwner(&GetCurrentPcpu()->ThreadData.ReadyThreadsLock));
     LOG_TRACE_THREAD("Returned from _ThreadSchedule\n");
 
     CpuIntrSetState(oldState);
@@ -499,12 +849,16 @@ ThreadBlock(
 {
     INTR_STATE oldState;
     PTHREAD pCurrentThread;
+    PPCPU pCpu;
 
     pCurrentThread = GetCurrentThread();
 
     ASSERT( INTR_OFF == CpuIntrGetState());
     ASSERT(LockIsOwner(&pCurrentThread->BlockLock));
 
+    pCpu = GetCurrentPcpu();
+    ASSERT( NULL != pCpu );
+
     if (THREAD_FLAG_FORCE_TERMINATE_PENDING == _InterlockedAnd(&pCurrentThread->Flags, MAX_DWORD))
     {
         _ThreadForcedExit();
@@ -512,10 +866,14 @@ ThreadBlock(
     }
 
     pCurrentThread->TickCountEarly++;
+    if (pCurrentThread != pCpu->ThreadData.IdleThread)
+    {
+        _ThreadMlfqUpdateLevel(pCurrentThread, FALSE);
+    }
     pCurrentThread->State = ThreadStateBlocked;
-    LockAcquire(&m_threadSystemData.ReadyThreadsLock, &oldState);
-    _ThreadSchedule();
-    ASSERT( !LockIsOwner(&m_threadSystemData.ReadyThreadsLock));
+    HotLockAcquire(&pCpu->ThreadData.ReadyThreadsLock, &oldState);
+    _ThreadSchedule(ThreadSwitchReasonBlock);
+    ASSERT( !HotLockIsOwner(&GetCurrentPcpu()->ThreadData.ReadyThreadsLock));
 }
 
 void
@@ -525,6 +883,8 @@ ThreadUnblock(
 {
     INTR_STATE oldState;
     INTR_STATE dummyState;
+    PPCPU pCpu;
+    BOOLEAN bYield;
 
     ASSERT(NULL != Thread);
 
@@ -532,11 +892,102 @@ ThreadUnblock(
 
     ASSERT(ThreadStateBlocked == Thread->State);
 
-    LockAcquire(&m_threadSystemData.ReadyThreadsLock, &dummyState);
-    InsertTailList(&m_threadSystemData.ReadyThreadsList, &Thread->ReadyList);
+    Thread->UnblockTsc = __rdtsc();
+
+    // interrupts are disabled while holding the block lock => we cannot be
+    // moved to another CPU while choosing the target CPU
+    pCpu = _ThreadSelectCpuForReadyThread(Thread);
+
+    HotLockAcquire(&pCpu->ThreadData.ReadyThreadsLock, &dummyState);
+    _ThreadCpuReadyInsert(pCpu, Thread, FALSE);
     Thread->State = ThreadStateReady;
-    LockRelease(&m_threadSystemData.ReadyThreadsLock, dummyState );
+    HotLockRelease(&pCpu->ThreadData.ReadyThreadsLock, dummyState );
+
+    SmpSendRescheduleIpi(_ThreadSelectCpusToReschedule(pCpu, Thread));
+
+    bYield = _ThreadShouldYieldAfterUnblock(oldState);
+
     LockRelease(&Thread->BlockLock, oldState);
+
+    if (bYield)
+    {
+        ThreadYield();
+    }
+}
+
+void
+ThreadUnblockList(
+    INOUT   PLIST_ENTRY         ThreadList
+    )
+{
+    INTR_STATE oldState;
+    INTR_STATE dummyState;
+    PLIST_ENTRY pEntry;
+    PLIST_ENTRY pNextEntry;
+    CPU_AFFINITY cpusToReschedule;
+    BOOLEAN bYield;
+
+    ASSERT(NULL != ThreadList);
+
+    oldState = CpuIntrDisable();
+
+    cpusToReschedule = 0;
+
+    // the block locks must be taken before any ready queue lock (same order
+    // as in ThreadBlock), once we hold all of them none of the threads is still
+    // in the process of blocking
+    for (pEntry = ThreadList->Flink; pEntry != ThreadList; pEntry = pEntry->Flink)
+    {
+        PTHREAD pThread = CONTAINING_RECORD(pEntry, THREAD, ReadyList);
+
+        LockAcquire(&pThread->BlockLock, &dummyState);
+
+        ASSERT(ThreadStateBlocked == pThread->State);
+
+        pThread->UnblockTsc = __rdtsc();
+    }
+
+    // each pass moves all the threads which go to the same CPU with a single
+    // ready queue lock acquisition
+    while (!IsListEmpty(ThreadList))
+    {
+        PPCPU pCpu;
+
+        pCpu = _ThreadSelectCpuForReadyThread(CONTAINING_RECORD(ThreadList->Flink, THREAD, ReadyList));
+
+        HotLockAcquire(&pCpu->ThreadData.ReadyThreadsLock, &dummyState);
+        for (pEntry = ThreadList->Flink; pEntry != ThreadList; pEntry = pNextEntry)
+        {
+            PTHREAD pThread = CONTAINING_RECORD(pEntry, THREAD, ReadyList);
+
+            pNextEntry = pEntry->Flink;
+
+            if (_ThreadSelectCpuForReadyThread(pThread) != pCpu)
+            {
+                continue;
+            }
+
+            RemoveEntryList(pEntry);
+            _ThreadCpuReadyInsert(pCpu, pThread, FALSE);
+            pThread->State = ThreadStateReady;
+
+            cpusToReschedule |= _ThreadSelectCpusToReschedule(pCpu, pThread);
+
+            LockRelease(&pThread->BlockLock, INTR_OFF);
+        }
+        HotLockRelease(&pCpu->ThreadData.ReadyThreadsLock, INTR_OFF);
+    }
+
+    SmpSendRescheduleIpi(cpusToReschedule);
+
+    bYield = _ThreadShouldYieldAfterUnblock(oldState);
+
+    CpuIntrSetState(oldState);
+
+    if (bYield)
+    {
+        ThreadYield();
+    }
 }
 
 void
@@ -564,21 +1015,79 @@ ThreadExit(
 
     ProcessNotifyThreadTermination(pThread);
 
-    LockAcquire(&m_threadSystemData.ReadyThreadsLock, &oldState);
-    _ThreadSchedule();
+    HotLockAcquire(&GetCurrentPcpu()->ThreadData.ReadyThreadsLock, &oldState);
+    _ThreadSchedule(ThreadSwitchReasonExit);
     NOT_REACHED;
 }
 
-BOOLEAN
-ThreadYieldOnInterrupt(
+void
+ThreadRequestYieldOnInterrupt(
     void
     )
 {
-    return GetCurrentPcpu()->ThreadData.YieldOnInterruptReturn;
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    GetCurrentPcpu()->ThreadData.YieldOnInterruptReturn = TRUE;
 }
 
 void
-ThreadTakeBlockLock(
+ThreadRequestPreemptOnInterrupt(
+    void
+    )
+{
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    GetCurrentPcpu()->ThreadData.PreemptOnInterruptReturn = TRUE;
+}
+
+void
+ThreadRequestPreemptIfNeeded(
+    void
+    )
+{
+    INTR_STATE dummyState;
+    PPCPU pCpu;
+    THREAD_PRIORITY highestReady;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pCpu = GetCurrentPcpu();
+
+    if (NULL == pCpu->ThreadData.IdleThread)
+    {
+        // the CPU cannot schedule yet
+        return;
+    }
+
+    // an idle CPU also looks for threads to steal when it yields
+    if (pCpu->ThreadData.CurrentThread == pCpu->ThreadData.IdleThread)
+    {
+        ThreadRequestPreemptOnInterrupt();
+        return;
+    }
+
+    HotLockAcquire(&pCpu->ThreadData.ReadyThreadsLock, &dummyState);
+    highestReady = _ThreadCpuGetHighestReadyPriority(pCpu);
+    HotLockRelease(&pCpu->ThreadData.ReadyThreadsLock, dummyState);
+
+    if (highestReady != ThreadPriorityReserved && highestReady > pCpu->ThreadData.RunningThreadPriority)
+    {
+        ThreadRequestPreemptOnInterrupt();
+    }
+}
+
+BOOLEAN
+ThreadYieldOnInterrupt(
+    void
+    )
+{
+    PPCPU pCpu = GetCurrentPcpu();
+
+    return pCpu->ThreadData.YieldOnInterruptReturn || pCpu->ThreadData.PreemptOnInterruptReturn;
+}
+
+void
+ThreadTakeBlockLock(
     void
     )
 {
@@ -616,10 +1125,24 @@ ThreadTerminate(
     INOUT   PTHREAD             Thread
     )
 {
+    INTR_STATE oldState;
+
     ASSERT( NULL != Thread );
 
     // it's not a problem if the thread already finished
+    // the flag is set with the block lock held: a thread which checked it
+    // with its block lock held does not see it change before blocking
+    LockAcquire(&Thread->BlockLock, &oldState);
     _InterlockedOr(&Thread->Flags, THREAD_FLAG_FORCE_TERMINATE_PENDING );
+    LockRelease(&Thread->BlockLock, oldState);
+}
+
+BOOLEAN
+ThreadIsTerminatePending(
+    void
+    )
+{
+    return IsBooleanFlagOn(GetCurrentThread()->Flags, THREAD_FLAG_FORCE_TERMINATE_PENDING);
 }
 
 const
@@ -653,14 +1176,259 @@ ThreadGetPriority(
     return (NULL != pThread) ? pThread->Priority : 0;
 }
 
+void
+ThreadCacheTrim(
+    void
+    )
+{
+    INTR_STATE oldState;
+    PLIST_ENTRY pCpuListHead;
+    PLIST_ENTRY pCurEntry;
+    LIST_ENTRY trimmedThreads;
+    DWORD noOfThreads;
+
+    InitializeListHead(&trimmedThreads);
+    noOfThreads = 0;
+
+    pCpuListHead = NULL;
+    SmpGetCpuList(&pCpuListHead);
+
+    for (pCurEntry = pCpuListHead->Flink;
+         pCurEntry != pCpuListHead;
+         pCurEntry = pCurEntry->Flink)
+    {
+        PPCPU pCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+
+        if (NULL == pCpu->ThreadData.IdleThread)
+        {
+            // the threading data of the CPU is not yet initialized
+            continue;
+        }
+
+        LockAcquire(&pCpu->ThreadData.ThreadCacheLock, &oldState);
+        while (!IsListEmpty(&pCpu->ThreadData.ThreadCache))
+        {
+            InsertTailList(&trimmedThreads, RemoveHeadList(&pCpu->ThreadData.ThreadCache));
+            noOfThreads++;
+        }
+        pCpu->ThreadData.ThreadCacheSize = 0;
+        LockRelease(&pCpu->ThreadData.ThreadCacheLock, oldState);
+    }
+
+    // the stacks are unmapped without holding any lock
+    while (!IsListEmpty(&trimmedThreads))
+    {
+        _ThreadFreeStructure(CONTAINING_RECORD(RemoveHeadList(&trimmedThreads), THREAD, AllList));
+    }
+
+    LOG_TRACE_THREAD("Freed %u cached threads\n", noOfThreads);
+}
+
 void
 ThreadSetPriority(
     IN      THREAD_PRIORITY     NewPriority
     )
 {
+    INTR_STATE oldState;
+    INTR_STATE dummyState;
+    PPCPU pCpu;
+    THREAD_PRIORITY highestReady;
+
     ASSERT(ThreadPriorityLowest <= NewPriority && NewPriority <= ThreadPriorityMaximum);
 
     GetCurrentThread()->Priority = NewPriority;
+
+    oldState = CpuIntrDisable();
+    pCpu = GetCurrentPcpu();
+
+    pCpu->ThreadData.RunningThreadPriority = _ThreadGetEffectivePriority(GetCurrentThread());
+
+    HotLockAcquire(&pCpu->ThreadData.ReadyThreadsLock, &dummyState);
+    highestReady = _ThreadCpuGetHighestReadyPriority(pCpu);
+    HotLockRelease(&pCpu->ThreadData.ReadyThreadsLock, dummyState);
+
+    CpuIntrSetState(oldState);
+
+    if (highestReady != ThreadPriorityReserved && highestReady > _ThreadGetEffectivePriority(GetCurrentThread()))
+    {
+        ThreadYield();
+    }
+}
+
+STATUS
+ThreadSetAffinity(
+    IN_OPT  PTHREAD             Thread,
+    IN      CPU_AFFINITY        Affinity
+    )
+{
+    PTHREAD pThread;
+    INTR_STATE oldState;
+
+    if (0 == (Affinity & _ThreadGetActiveCpusAffinity()))
+    {
+        return STATUS_INVALID_PARAMETER2;
+    }
+
+    pThread = GetCurrentThread();
+
+    if (NULL != Thread && pThread != Thread)
+    {
+        _ThreadSetAffinityForOtherThread(Thread, Affinity);
+        return STATUS_SUCCESS;
+    }
+
+    oldState = CpuIntrDisable();
+
+    pThread->Affinity = Affinity;
+    if (!_ThreadCanRunOnCpu(pThread, GetCurrentPcpu()))
+    {
+        // We cannot place ourselves in the ready queue of another CPU while
+        // we are still running here => we block and the thread which replaces
+        // us on this CPU will unblock us on an allowed CPU (see
+        // ThreadCleanupPostSchedule)
+        pThread->MigrationPending = TRUE;
+
+        ThreadTakeBlockLock();
+        ThreadBlock();
+
+        ASSERT(_ThreadCanRunOnCpu(pThread, GetCurrentPcpu()));
+    }
+
+    CpuIntrSetState(oldState);
+
+    return STATUS_SUCCESS;
+}
+
+CPU_AFFINITY
+ThreadGetAffinity(
+    IN_OPT  PTHREAD             Thread
+    )
+{
+    PTHREAD pThread = (NULL != Thread) ? Thread : GetCurrentThread();
+
+    return (NULL != pThread) ? pThread->Affinity : 0;
+}
+
+QWORD
+ThreadLatencyGetPercentileUs(
+    IN      PTHREAD_LATENCY_HISTOGRAM   Histogram,
+    IN      DWORD                       Percentile
+    )
+{
+    QWORD samplesNeeded;
+    QWORD samplesSeen;
+    QWORD upperBound;
+    DWORD i;
+
+    ASSERT(NULL != Histogram);
+    ASSERT(1 <= Percentile && Percentile <= 100);
+
+    if (0 == Histogram->Samples)
+    {
+        return 0;
+    }
+
+    // the histogram is updated without synchronization with the readers, the
+    // values may be slightly inconsistent but they are good enough for stats
+    samplesNeeded = (Histogram->Samples * Percentile + 99) / 100;
+    samplesSeen = 0;
+    upperBound = Histogram->MaxTicks;
+
+    for (i = 0; i < THREAD_LATENCY_BUCKETS - 1; ++i)
+    {
+        samplesSeen += Histogram->Buckets[i];
+        if (samplesSeen >= samplesNeeded)
+        {
+            upperBound = min((2ULL << i) - 1, Histogram->MaxTicks);
+            break;
+        }
+    }
+
+    return IomuTickCountToUs(upperBound);
+}
+
+DWORD
+ThreadGetSwitchTrace(
+    IN                      PPCPU                       Cpu,
+    OUT_WRITES(MaxEntries)  PTHREAD_SWITCH_TRACE_ENTRY  Entries,
+    IN                      DWORD                       MaxEntries
+    )
+{
+    QWORD startCount;
+    QWORD endCount;
+    QWORD firstValid;
+    DWORD noOfEntries;
+    DWORD noOfOverwritten;
+
+    ASSERT(NULL != Cpu);
+    ASSERT(NULL != Entries);
+
+    MaxEntries = min(MaxEntries, THREAD_SWITCH_TRACE_ENTRIES);
+
+    endCount = Cpu->ThreadData.SwitchTraceCount;
+    startCount = endCount > MaxEntries ? endCount - MaxEntries : 0;
+    noOfEntries = (DWORD) (endCount - startCount);
+
+    for (QWORD i = startCount; i < endCount; ++i)
+    {
+        Entries[i - startCount] = Cpu->ThreadData.SwitchTrace[i % THREAD_SWITCH_TRACE_ENTRIES];
+    }
+
+    // the CPU may have recorded new switches while we were copying, the slot
+    // it writes before incrementing the count holds the entry with index
+    // count - THREAD_SWITCH_TRACE_ENTRIES => only the entries newer than that
+    // are surely intact
+    firstValid = Cpu->ThreadData.SwitchTraceCount + 1;
+    firstValid = firstValid > THREAD_SWITCH_TRACE_ENTRIES ? firstValid - THREAD_SWITCH_TRACE_ENTRIES : 0;
+
+    if (firstValid > startCount)
+    {
+        if (firstValid >= endCount)
+        {
+            return 0;
+        }
+
+        noOfOverwritten = (DWORD) (firstValid - startCount);
+        noOfEntries = noOfEntries - noOfOverwritten;
+
+        memmove(Entries, &Entries[noOfOverwritten], noOfEntries * sizeof(THREAD_SWITCH_TRACE_ENTRY));
+    }
+
+    return noOfEntries;
+}
+
+BOOLEAN
+ThreadHandleDeviceNotAvailable(
+    void
+    )
+{
+    PPCPU pCpu;
+    PTHREAD pThread;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pCpu = GetCurrentPcpu();
+    pThread = GetCurrentThread();
+
+    if (NULL == pCpu || NULL == pThread || !IsBooleanFlagOn(__readcr0(), CR0_TS))
+    {
+        // #NM was not caused by the lazy FPU switching
+        return FALSE;
+    }
+
+    __writecr0(__readcr0() & ~CR0_TS);
+
+    if (pCpu->ThreadData.FpuOwner != pThread || pThread->FpuCpu != pCpu)
+    {
+        // the last state saved by _ThreadFpuSwitch, the previous owner of this
+        // CPU's FPU (if any) already has its state in memory
+        _xrstor64(pThread->XsaveArea, CpuMuGetActiveFpuFeatures());
+
+        pCpu->ThreadData.FpuOwner = pThread;
+        pThread->FpuCpu = pCpu;
+    }
+
+    return TRUE;
 }
 
 STATUS
@@ -679,13 +1447,15 @@ ThreadExecuteForEachThreadEntry(
 
     status = STATUS_SUCCESS;
 
-    LockAcquire(&m_threadSystemData.AllThreadsLock, &oldState);
+    // the writers still serialize on AllThreadsLock, the readers do not need
+    // it: the threads removed from the list are freed after a grace period
+    oldState = RcuReadLock();
     status = ForEachElementExecute(&m_threadSystemData.AllThreadsList,
                                    Function,
                                    Context,
                                    FALSE
                                    );
-    LockRelease(&m_threadSystemData.AllThreadsLock, oldState );
+    RcuReadUnlock(oldState);
 
     return status;
 }
@@ -724,6 +1494,7 @@ _ThreadInit(
     PTHREAD pThread;
     DWORD nameLen;
     PVOID pStack;
+    PVOID pXsaveArea;
     INTR_STATE oldIntrState;
 
     LOG_FUNC_START;
@@ -737,15 +1508,39 @@ _ThreadInit(
     pThread = NULL;
     nameLen = strlen(Name);
     pStack = NULL;
+    pXsaveArea = NULL;
 
     __try
     {
-        pThread = ExAllocatePoolWithTag(PoolAllocateZeroMemory, sizeof(THREAD), HEAP_THREAD_TAG, 0);
+        if (AllocateKernelStack)
+        {
+            // a recycled thread already has a mapped and guarded kernel stack
+            pThread = _ThreadCacheGet();
+            if (NULL != pThread)
+            {
+                pStack = pThread->InitialStackBase;
+                pXsaveArea = pThread->XsaveArea;
+
+                memzero(pThread, sizeof(THREAD));
+
+                pThread->XsaveArea = pXsaveArea;
+                pThread->Stack = pStack;
+                pThread->InitialStackBase = pStack;
+                pThread->StackSize = STACK_DEFAULT_SIZE;
+                pThread->OwnsKernelStack = TRUE;
+            }
+        }
+
         if (NULL == pThread)
         {
-            LOG_FUNC_ERROR_ALLOC("HeapAllocatePoolWithTag", sizeof(THREAD));
-            status = STATUS_HEAP_INSUFFICIENT_RESOURCES;
-            __leave;
+            // the heap frees the cached threads before failing
+            pThread = ExAllocatePoolWithTag(PoolAllocateZeroMemory, sizeof(THREAD), HEAP_THREAD_TAG, 0);
+            if (NULL == pThread)
+            {
+                LOG_FUNC_ERROR_ALLOC("HeapAllocatePoolWithTag", sizeof(THREAD));
+                status = STATUS_HEAP_INSUFFICIENT_RESOURCES;
+                __leave;
+            }
         }
 
         RfcPreInit(&pThread->RefCnt);
@@ -759,6 +1554,21 @@ _ThreadInit(
 
         pThread->Self = pThread;
 
+        if (NULL == pThread->XsaveArea)
+        {
+            pThread->XsaveArea = ExAllocatePoolWithTag(PoolAllocateZeroMemory,
+                                                       CpuMuGetXsaveAreaSize(),
+                                                       HEAP_THREAD_TAG,
+                                                       THREAD_XSAVE_AREA_ALIGNMENT);
+            if (NULL == pThread->XsaveArea)
+            {
+                LOG_FUNC_ERROR_ALLOC("HeapAllocatePoolWithTag", CpuMuGetXsaveAreaSize());
+                status = STATUS_HEAP_INSUFFICIENT_RESOURCES;
+                __leave;
+            }
+        }
+        _ThreadFpuInitArea(pThread->XsaveArea);
+
         status = ExEventInit(&pThread->TerminationEvt, ExEventTypeNotification, FALSE);
         if (!SUCCEEDED(status))
         {
@@ -766,7 +1576,7 @@ _ThreadInit(
             __leave;
         }
 
-        if (AllocateKernelStack)
+        if (AllocateKernelStack && !pThread->OwnsKernelStack)
         {
             pStack = MmuAllocStack(STACK_DEFAULT_SIZE, TRUE, FALSE, NULL);
             if (NULL == pStack)
@@ -778,6 +1588,7 @@ _ThreadInit(
             pThread->Stack = pStack;
             pThread->InitialStackBase = pStack;
             pThread->StackSize = STACK_DEFAULT_SIZE;
+            pThread->OwnsKernelStack = TRUE;
         }
 
         pThread->Name = ExAllocatePoolWithTag(PoolAllocateZeroMemory, sizeof(char)*(nameLen + 1), HEAP_THREAD_TAG, 0);
@@ -793,11 +1604,12 @@ _ThreadInit(
         pThread->Id = _ThreadSystemGetNextTid();
         pThread->State = ThreadStateBlocked;
         pThread->Priority = Priority;
+        pThread->Affinity = CPU_AFFINITY_ALL;
 
         LockInit(&pThread->BlockLock);
 
         LockAcquire(&m_threadSystemData.AllThreadsLock, &oldIntrState);
-        InsertTailList(&m_threadSystemData.AllThreadsList, &pThread->AllList);
+        RcuInsertTailList(&m_threadSystemData.AllThreadsList, &pThread->AllList);
         LockRelease(&m_threadSystemData.AllThreadsLock, oldIntrState);
     }
     __finally
@@ -955,12 +1767,10 @@ _ThreadSetupMainThreadUserStack(
     return STATUS_SUCCESS;
 }
 
-REQUIRES_EXCL_LOCK(m_threadSystemData.ReadyThreadsLock)
-RELEASES_EXCL_AND_NON_REENTRANT_LOCK(m_threadSystemData.ReadyThreadsLock)
 static
 void
 _ThreadSchedule(
-    void
+    IN      THREAD_SWITCH_REASON    Reason
     )
 {
     PTHREAD pCurrentThread;
@@ -968,12 +1778,12 @@ _ThreadSchedule(
     PCPU* pCpu;
 
     ASSERT(INTR_OFF == CpuIntrGetState());
-    ASSERT(LockIsOwner(&m_threadSystemData.ReadyThreadsLock));
 
     pCurrentThread = GetCurrentThread();
     ASSERT( NULL != pCurrentThread );
 
     pCpu = GetCurrentPcpu();
+    ASSERT(HotLockIsOwner(&pCpu->ThreadData.ReadyThreadsLock));
 
     // save previous thread
     pCpu->ThreadData.PreviousThread = pCurrentThread;
@@ -982,6 +1792,8 @@ _ThreadSchedule(
     pNextThread = _ThreadGetReadyThread();
     ASSERT( NULL != pNextThread );
 
+    _ThreadAccountSchedulingLatency(pCpu, pNextThread);
+
     // if current differs from next
     // => schedule next
     if (pNextThread != pCurrentThread)
@@ -1000,11 +1812,31 @@ _ThreadSchedule(
         // appearing to cause inconsistencies
         pCurrentThread->UninterruptedTicks = 0;
 
+        pNextThread->LastCpu = pCpu;
+        pCpu->ThreadData.RunningThreadPriority = _ThreadGetEffectivePriority(pNextThread);
+
+        _ThreadTraceSwitch(pCpu, pCurrentThread, pNextThread, Reason);
+
+        if (pCpu->ThreadData.TickStopped && pNextThread != pCpu->ThreadData.IdleThread)
+        {
+            // real work arrived, we need the time slices again
+            _ThreadRestartTick(pCpu);
+        }
+
         SetCurrentThread(pNextThread);
+
+        // must be done after the current thread was changed: if the #NM
+        // handler runs from here on it will load the state of the next thread
+        _ThreadFpuSwitch(pCpu, pCurrentThread, pNextThread);
+
         ThreadSwitch( &pCurrentThread->Stack, pNextThread->Stack);
 
         ASSERT(INTR_OFF == CpuIntrGetState());
-        ASSERT(LockIsOwner(&m_threadSystemData.ReadyThreadsLock));
+
+        // the thread may have been stolen by another CPU while it was in the
+        // ready list => it may resume execution on a different processor
+        pCpu = GetCurrentPcpu();
+        ASSERT(HotLockIsOwner(&pCpu->ThreadData.ReadyThreadsLock));
 
         LOG_TRACE_THREAD("After ThreadSwitch\n");
         LOG_TRACE_THREAD("Current: %s\n", pCurrentThread->Name);
@@ -1027,8 +1859,6 @@ _ThreadSchedule(
     ThreadCleanupPostSchedule();
 }
 
-REQUIRES_EXCL_LOCK(m_threadSystemData.ReadyThreadsLock)
-RELEASES_EXCL_AND_NON_REENTRANT_LOCK(m_threadSystemData.ReadyThreadsLock)
 void
 ThreadCleanupPostSchedule(
     void
@@ -1041,7 +1871,8 @@ ThreadCleanupPostSchedule(
     GetCurrentPcpu()->ThreadData.RunningThreadTicks = 0;
     prevThread = GetCurrentPcpu()->ThreadData.PreviousThread;
 
-    LockRelease(&m_threadSystemData.ReadyThreadsLock, INTR_OFF);
+    _Analysis_assume_lock_held_(GetCurrentPcpu()->ThreadData.ReadyThreadsLock);
+    HotLockRelease(&GetCurrentPcpu()->ThreadData.ReadyThreadsLock, INTR_OFF);
 
     if (NULL != prevThread)
     {
@@ -1058,6 +1889,15 @@ ThreadCleanupPostSchedule(
 
             _Analysis_assume_lock_held_(prevThread->BlockLock);
             LockRelease(&prevThread->BlockLock, INTR_OFF);
+
+            if (prevThread->MigrationPending)
+            {
+                // the thread blocked itself in ThreadSetAffinity only to get
+                // off this CPU, now that its stack is no longer in use it can
+                // be placed on a CPU allowed by its new affinity
+                prevThread->MigrationPending = FALSE;
+                ThreadUnblock(prevThread);
+            }
         }
         else if (prevThread->State == ThreadStateDying)
         {
@@ -1068,6 +1908,9 @@ ThreadCleanupPostSchedule(
             GetCurrentPcpu()->ThreadData.PreviousThread = NULL;
         }
     }
+
+    // a CPU which switches threads is outside any RCU read-side section
+    RcuQuiescentState();
 }
 
 static
@@ -1093,13 +1936,16 @@ STATUS
         ThreadTakeBlockLock();
         ThreadBlock();
 
+        // We were scheduled because there was no other thread to run, there
+        // is no need for the periodic tick until we have something to do
+        _ThreadStopTickForIdle(GetCurrentPcpu());
+
         __sti_and_hlt();
     }
 
     NOT_REACHED;
 }
 
-REQUIRES_EXCL_LOCK(m_threadSystemData.ReadyThreadsLock)
 static
 _Ret_notnull_
 PTHREAD
@@ -1108,26 +1954,31 @@ _ThreadGetReadyThread(
     )
 {
     PTHREAD pNextThread;
-    PLIST_ENTRY pEntry;
     BOOLEAN bIdleScheduled;
+    PPCPU pCpu;
 
     ASSERT( INTR_OFF == CpuIntrGetState());
-    ASSERT( LockIsOwner(&m_threadSystemData.ReadyThreadsLock));
+
+    pCpu = GetCurrentPcpu();
+    ASSERT( HotLockIsOwner(&pCpu->ThreadData.ReadyThreadsLock));
 
     pNextThread = NULL;
+    bIdleScheduled = FALSE;
 
-    pEntry = RemoveHeadList(&m_threadSystemData.ReadyThreadsList);
-    if (pEntry == &m_threadSystemData.ReadyThreadsList)
+    pNextThread = _ThreadCpuReadyRemoveHighest(pCpu);
+    if (NULL == pNextThread)
     {
-        pNextThread = GetCurrentPcpu()->ThreadData.IdleThread;
-        bIdleScheduled = TRUE;
+        // nothing to run locally, see if any other CPU has work for us
+        pNextThread = _ThreadStealReadyThread(pCpu);
+        if (NULL == pNextThread)
+        {
+            pNextThread = pCpu->ThreadData.IdleThread;
+            bIdleScheduled = TRUE;
+        }
     }
     else
     {
-        pNextThread = CONTAINING_RECORD( pEntry, THREAD, ReadyList );
-
         ASSERT( pNextThread->State == ThreadStateReady );
-        bIdleScheduled = FALSE;
     }
 
     // maybe we shouldn't update idle time each time a thread is scheduled
@@ -1139,23 +1990,873 @@ _ThreadGetReadyThread(
 }
 
 static
-void
-_ThreadForcedExit(
-    void
+PTHREAD
+_ThreadStealReadyThread(
+    INOUT   PPCPU                   ThiefCpu
     )
 {
-    PTHREAD pCurrentThread = GetCurrentThread();
+    PLIST_ENTRY pCpuListHead;
+    PLIST_ENTRY pCurEntry;
+    PTHREAD pThread;
 
-    _InterlockedOr( &pCurrentThread->Flags, THREAD_FLAG_FORCE_TERMINATED );
+    ASSERT( INTR_OFF == CpuIntrGetState());
+    ASSERT( NULL != ThiefCpu );
+    ASSERT( HotLockIsOwner(&ThiefCpu->ThreadData.ReadyThreadsLock));
 
-    ThreadExit(STATUS_JOB_INTERRUPTED);
-    NOT_REACHED;
+    pCpuListHead = NULL;
+    pThread = NULL;
+
+    SmpGetCpuList(&pCpuListHead);
+
+    // Start with the CPU following the thief so that all the idle CPUs will
+    // not try to steal from the same victim
+    for (pCurEntry = ThiefCpu->ListEntry.Flink;
+         pCurEntry != &ThiefCpu->ListEntry && NULL == pThread;
+         pCurEntry = pCurEntry->Flink)
+    {
+        PPCPU pVictimCpu;
+        INTR_STATE dummyState;
+
+        if (pCurEntry == pCpuListHead)
+        {
+            continue;
+        }
+
+        pVictimCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+
+        // The CPU may not have initialized its threading data yet. Also there
+        // is no use in taking the lock if the CPU has nothing to give us.
+        if (NULL == pVictimCpu->ThreadData.IdleThread
+            || 0 == pVictimCpu->ThreadData.NumberOfStealableThreads)
+        {
+            continue;
+        }
+
+        // We already hold our own ready list lock: if we were to wait for the
+        // victim's lock we could deadlock with a CPU trying to steal from us
+        if (!HotLockTryAcquire(&pVictimCpu->ThreadData.ReadyThreadsLock, &dummyState))
+        {
+            continue;
+        }
+
+        // the stealable queue holds the threads which may run on more than
+        // one CPU, not necessarily on ours
+        pThread = _ThreadReadyQueuePeekHighestForCpu(&pVictimCpu->ThreadData.ReadyThreads, ThiefCpu);
+
+        if (NULL != pThread)
+        {
+            ASSERT(pThread->State == ThreadStateReady);
+
+            _ThreadCpuReadyRemove(pVictimCpu, pThread);
+        }
+
+        HotLockRelease(&pVictimCpu->ThreadData.ReadyThreadsLock, dummyState);
+    }
+
+    return pThread;
 }
 
 static
 void
-_ThreadReference(
-    INOUT   PTHREAD                 Thread
+_ThreadReadyQueueInit(
+    OUT     PTHREAD_READY_QUEUE     Queue
+    )
+{
+    DWORD i;
+
+    ASSERT(NULL != Queue);
+
+    Queue->NonEmptyLevels = 0;
+    for (i = 0; i < THREAD_PRIORITY_LEVELS; ++i)
+    {
+        InitializeListHead(&Queue->Lists[i]);
+    }
+}
+
+// A thread inserted at the head of its priority list runs before the threads
+// of the same priority which were already waiting
+static
+void
+_ThreadReadyQueueInsert(
+    INOUT   PTHREAD_READY_QUEUE     Queue,
+    INOUT   PTHREAD                 Thread,
+    IN      BOOLEAN                 AtHead
+    )
+{
+    THREAD_PRIORITY priority;
+
+    ASSERT(NULL != Queue);
+    ASSERT(NULL != Thread);
+
+    priority = _ThreadGetEffectivePriority(Thread);
+    ASSERT(priority < THREAD_PRIORITY_LEVELS);
+
+    if (AtHead)
+    {
+        InsertHeadList(&Queue->Lists[priority], &Thread->ReadyList);
+    }
+    else
+    {
+        InsertTailList(&Queue->Lists[priority], &Thread->ReadyList);
+    }
+    Queue->NonEmptyLevels |= (1UL << priority);
+
+    // the effective priority may change while the thread waits, it is
+    // removed from the list it was inserted in
+    Thread->ReadyQueue = Queue;
+    Thread->ReadyPriority = priority;
+
+    Thread->EnqueueTsc = __rdtsc();
+}
+
+static
+void
+_ThreadReadyQueueRemove(
+    INOUT   PTHREAD_READY_QUEUE     Queue,
+    INOUT   PTHREAD                 Thread
+    )
+{
+    ASSERT(NULL != Queue);
+    ASSERT(NULL != Thread);
+    ASSERT(Thread->ReadyQueue == Queue);
+
+    RemoveEntryList(&Thread->ReadyList);
+    if (IsListEmpty(&Queue->Lists[Thread->ReadyPriority]))
+    {
+        Queue->NonEmptyLevels &= ~(1UL << Thread->ReadyPriority);
+    }
+
+    Thread->ReadyQueue = NULL;
+}
+
+static
+PTHREAD
+_ThreadReadyQueuePeekHighest(
+    IN      PTHREAD_READY_QUEUE     Queue
+    )
+{
+    DWORD level;
+
+    ASSERT(NULL != Queue);
+
+    if (!_BitScanReverse(&level, Queue->NonEmptyLevels))
+    {
+        return NULL;
+    }
+
+    ASSERT(!IsListEmpty(&Queue->Lists[level]));
+
+    return CONTAINING_RECORD(Queue->Lists[level].Flink, THREAD, ReadyList);
+}
+
+// Returns the first thread of the highest priority which may run on Cpu, the
+// threads whose affinity does not allow it are skipped
+static
+PTHREAD
+_ThreadReadyQueuePeekHighestForCpu(
+    IN      PTHREAD_READY_QUEUE     Queue,
+    IN      PPCPU                   Cpu
+    )
+{
+    DWORD levels;
+    DWORD level;
+
+    ASSERT(NULL != Queue);
+    ASSERT(NULL != Cpu);
+
+    for (levels = Queue->NonEmptyLevels;
+         _BitScanReverse(&level, levels);
+         levels &= ~(1UL << level))
+    {
+        PLIST_ENTRY pEntry;
+
+        for (pEntry = Queue->Lists[level].Flink;
+             pEntry != &Queue->Lists[level];
+             pEntry = pEntry->Flink)
+        {
+            PTHREAD pThread = CONTAINING_RECORD(pEntry, THREAD, ReadyList);
+
+            if (_ThreadCanRunOnCpu(pThread, Cpu))
+            {
+                return pThread;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static
+void
+_ThreadCpuReadyInsert(
+    INOUT   PPCPU                   Cpu,
+    INOUT   PTHREAD                 Thread,
+    IN      BOOLEAN                 AtHead
+    )
+{
+    BOOLEAN bStealable;
+
+    ASSERT(NULL != Cpu);
+    ASSERT(NULL != Thread);
+    ASSERT(HotLockIsOwner(&Cpu->ThreadData.ReadyThreadsLock));
+    ASSERT(_ThreadCanRunOnCpu(Thread, Cpu));
+
+    // only a thread bound to a single CPU cannot be stolen
+    bStealable = (0 != (Thread->Affinity & (Thread->Affinity - 1)));
+
+    _ThreadReadyQueueInsert(bStealable ? &Cpu->ThreadData.ReadyThreads : &Cpu->ThreadData.PinnedReadyThreads,
+                            Thread,
+                            AtHead);
+    Thread->ReadyCpu = Cpu;
+
+    Cpu->ThreadData.NumberOfReadyThreads++;
+    if (bStealable)
+    {
+        Cpu->ThreadData.NumberOfStealableThreads++;
+    }
+}
+
+static
+void
+_ThreadCpuReadyRemove(
+    INOUT   PPCPU                   Cpu,
+    INOUT   PTHREAD                 Thread
+    )
+{
+    ASSERT(NULL != Cpu);
+    ASSERT(NULL != Thread);
+    ASSERT(HotLockIsOwner(&Cpu->ThreadData.ReadyThreadsLock));
+    ASSERT(Thread->ReadyCpu == Cpu);
+
+    if (Thread->ReadyQueue == &Cpu->ThreadData.ReadyThreads)
+    {
+        ASSERT(Cpu->ThreadData.NumberOfStealableThreads > 0);
+        Cpu->ThreadData.NumberOfStealableThreads--;
+    }
+
+    _ThreadReadyQueueRemove(Thread->ReadyQueue, Thread);
+    Thread->ReadyCpu = NULL;
+
+    ASSERT(Cpu->ThreadData.NumberOfReadyThreads > 0);
+    Cpu->ThreadData.NumberOfReadyThreads--;
+}
+
+static
+PTHREAD
+_ThreadCpuReadyRemoveHighest(
+    INOUT   PPCPU                   Cpu
+    )
+{
+    PTHREAD pStealable;
+    PTHREAD pPinned;
+    PTHREAD pThread;
+
+    ASSERT(NULL != Cpu);
+
+    pStealable = _ThreadReadyQueuePeekHighest(&Cpu->ThreadData.ReadyThreads);
+    pPinned = _ThreadReadyQueuePeekHighest(&Cpu->ThreadData.PinnedReadyThreads);
+
+    // the higher priority wins, on equal priorities the thread which waited
+    // longer goes first so that the round-robin order is kept across the
+    // two queues
+    if (NULL == pPinned)
+    {
+        pThread = pStealable;
+    }
+    else if (NULL == pStealable)
+    {
+        pThread = pPinned;
+    }
+    else if (pPinned->ReadyPriority != pStealable->ReadyPriority)
+    {
+        pThread = (pPinned->ReadyPriority > pStealable->ReadyPriority) ? pPinned : pStealable;
+    }
+    else
+    {
+        pThread = (pPinned->EnqueueTsc <= pStealable->EnqueueTsc) ? pPinned : pStealable;
+    }
+
+    if (NULL != pThread)
+    {
+        _ThreadCpuReadyRemove(Cpu, pThread);
+    }
+
+    return pThread;
+}
+
+static
+THREAD_PRIORITY
+_ThreadCpuGetHighestReadyPriority(
+    IN      PPCPU                   Cpu
+    )
+{
+    THREAD_PRIORITY stealable;
+    THREAD_PRIORITY pinned;
+
+    ASSERT(NULL != Cpu);
+
+    stealable = _ThreadReadyQueueGetHighestPriority(&Cpu->ThreadData.ReadyThreads);
+    pinned = _ThreadReadyQueueGetHighestPriority(&Cpu->ThreadData.PinnedReadyThreads);
+
+    if (ThreadPriorityReserved == stealable)
+    {
+        return pinned;
+    }
+
+    if (ThreadPriorityReserved == pinned)
+    {
+        return stealable;
+    }
+
+    return max(stealable, pinned);
+}
+
+static
+void
+_ThreadMlfqUpdateLevel(
+    INOUT   PTHREAD                 Thread,
+    IN      BOOLEAN                 UsedWholeSlice
+    )
+{
+    ASSERT(NULL != Thread);
+
+    if (ThreadSchedulingPolicyMlfq != m_threadSystemData.SchedulingPolicy)
+    {
+        return;
+    }
+
+    // These are the same events which increment TickCountCompleted (the slice
+    // expired on a clock tick) and TickCountEarly (blocked or yielded before)
+    if (UsedWholeSlice)
+    {
+        if (Thread->MlfqLevel < THREAD_MLFQ_LEVELS - 1)
+        {
+            Thread->MlfqLevel++;
+        }
+    }
+    else if (Thread->MlfqLevel > 0)
+    {
+        Thread->MlfqLevel--;
+    }
+}
+
+static
+PTHREAD
+_ThreadCacheGet(
+    void
+    )
+{
+    INTR_STATE oldState;
+    INTR_STATE dummyState;
+    PPCPU pCpu;
+    PTHREAD pThread;
+
+    pThread = NULL;
+
+    oldState = CpuIntrDisable();
+    pCpu = GetCurrentPcpu();
+
+    LockAcquire(&pCpu->ThreadData.ThreadCacheLock, &dummyState);
+    if (!IsListEmpty(&pCpu->ThreadData.ThreadCache))
+    {
+        pThread = CONTAINING_RECORD(RemoveHeadList(&pCpu->ThreadData.ThreadCache), THREAD, AllList);
+        pCpu->ThreadData.ThreadCacheSize--;
+    }
+    LockRelease(&pCpu->ThreadData.ThreadCacheLock, dummyState);
+
+    CpuIntrSetState(oldState);
+
+    return pThread;
+}
+
+static
+BOOLEAN
+_ThreadCachePut(
+    INOUT   PTHREAD                 Thread
+    )
+{
+    INTR_STATE oldState;
+    INTR_STATE dummyState;
+    PPCPU pCpu;
+    BOOLEAN bCached;
+
+    ASSERT(NULL != Thread);
+
+    // only stacks of the default size can be handed to new threads
+    if (!Thread->OwnsKernelStack || STACK_DEFAULT_SIZE != Thread->StackSize)
+    {
+        return FALSE;
+    }
+
+    bCached = FALSE;
+
+    oldState = CpuIntrDisable();
+    pCpu = GetCurrentPcpu();
+
+    LockAcquire(&pCpu->ThreadData.ThreadCacheLock, &dummyState);
+    if (pCpu->ThreadData.ThreadCacheSize < THREAD_CACHE_SIZE_PER_CPU)
+    {
+        // the thread was removed from the all threads list => we can reuse
+        // its AllList entry
+        InsertHeadList(&pCpu->ThreadData.ThreadCache, &Thread->AllList);
+        pCpu->ThreadData.ThreadCacheSize++;
+        bCached = TRUE;
+    }
+    LockRelease(&pCpu->ThreadData.ThreadCacheLock, dummyState);
+
+    CpuIntrSetState(oldState);
+
+    return bCached;
+}
+
+static
+void
+_ThreadStopTickForIdle(
+    INOUT   PPCPU                   Cpu
+    )
+{
+    ASSERT(INTR_OFF == CpuIntrGetState());
+    ASSERT(NULL != Cpu);
+    ASSERT(GetCurrentThread() == Cpu->ThreadData.IdleThread);
+
+    if (!Cpu->ThreadData.TickStopped)
+    {
+        Cpu->ThreadData.TickStopped = TRUE;
+        Cpu->ThreadData.TicklessIdleAccountedUs = IomuGetSystemTimeUs();
+    }
+
+    if (LapicSystemHasTimerDeadlines())
+    {
+        // the wheel programs its next deadline in the LAPIC and the threads
+        // made ready for this CPU come with a reschedule IPI (the busy CPUs
+        // also send one when they have threads we could steal), nothing else
+        // needs to wake us up
+        LapicSystemSetTimer(0);
+        return;
+    }
+
+    // one-shot: ThreadTick stops the timer when it expires, the CPU wakes up
+    // in time for the next timer armed on its wheel
+    LapicSystemSetTimer(IomuGetTimerInterrupTimeUs() * ExTimerGetIdleTicks(THREAD_IDLE_MAX_SLEEP_TICKS));
+}
+
+static
+void
+_ThreadRestartTick(
+    INOUT   PPCPU                   Cpu
+    )
+{
+    ASSERT(INTR_OFF == CpuIntrGetState());
+    ASSERT(NULL != Cpu);
+    ASSERT(Cpu->ThreadData.TickStopped);
+
+    _ThreadAccountTicklessIdle(Cpu);
+
+    Cpu->ThreadData.TickStopped = FALSE;
+    LapicSystemSetTimer(IomuGetTimerInterrupTimeUs());
+}
+
+// The idle CPUs with a stopped tick look for threads to steal only when they
+// are woken up, Cpu keeps waking one while some of its ready threads wait
+static
+void
+_ThreadWakeIdleCpuToSteal(
+    INOUT   PPCPU                   Cpu
+    )
+{
+    PLIST_ENTRY pCpuListHead;
+    PLIST_ENTRY pCurEntry;
+    INTR_STATE dummyState;
+    CPU_AFFINITY cpuToWake;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+    ASSERT(NULL != Cpu);
+
+    pCpuListHead = NULL;
+    cpuToWake = 0;
+
+    SmpGetCpuList(&pCpuListHead);
+
+    HotLockAcquire(&Cpu->ThreadData.ReadyThreadsLock, &dummyState);
+    for (pCurEntry = pCpuListHead->Flink;
+         pCurEntry != pCpuListHead && 0 == cpuToWake;
+         pCurEntry = pCurEntry->Flink)
+    {
+        PPCPU pIdleCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+
+        // the state of the other CPU is read without synchronization, at
+        // worst it is woken up for nothing or on the next tick
+        if (pIdleCpu != Cpu
+            && NULL != pIdleCpu->ThreadData.IdleThread
+            && pIdleCpu->ThreadData.TickStopped
+            && NULL != _ThreadReadyQueuePeekHighestForCpu(&Cpu->ThreadData.ReadyThreads, pIdleCpu))
+        {
+            cpuToWake = pIdleCpu->LogicalApicId;
+        }
+    }
+    HotLockRelease(&Cpu->ThreadData.ReadyThreadsLock, dummyState);
+
+    SmpSendRescheduleIpi(cpuToWake);
+}
+
+static
+void
+_ThreadAccountTicklessIdle(
+    INOUT   PPCPU                   Cpu
+    )
+{
+    QWORD elapsedTicks;
+    DWORD tickUs;
+
+    ASSERT(NULL != Cpu);
+    ASSERT(Cpu->ThreadData.TickStopped);
+
+    tickUs = IomuGetTimerInterrupTimeUs();
+
+    // the ticks which would have been received while the tick was stopped
+    // were all idle ticks, keep the remainder for the next accounting
+    elapsedTicks = (IomuGetSystemTimeUs() - Cpu->ThreadData.TicklessIdleAccountedUs) / tickUs;
+
+    Cpu->ThreadData.IdleTicks += elapsedTicks;
+    Cpu->ThreadData.TicklessIdleAccountedUs += elapsedTicks * tickUs;
+}
+
+static
+void
+_ThreadLatencyAdd(
+    INOUT   PTHREAD_LATENCY_HISTOGRAM   Histogram,
+    IN      QWORD                       StartTsc,
+    IN      QWORD                       EndTsc
+    )
+{
+    QWORD ticks;
+    DWORD bucket;
+
+    ASSERT(NULL != Histogram);
+
+    // the start may have been taken on another CPU, if the TSCs are not
+    // perfectly synchronized the difference may be negative
+    ticks = EndTsc > StartTsc ? EndTsc - StartTsc : 0;
+
+    bucket = 0;
+    if (0 != ticks)
+    {
+        _BitScanReverse64(&bucket, ticks);
+    }
+
+    Histogram->Buckets[min(bucket, THREAD_LATENCY_BUCKETS - 1)]++;
+    Histogram->Samples++;
+    Histogram->MaxTicks = max(Histogram->MaxTicks, ticks);
+}
+
+static
+void
+_ThreadAccountSchedulingLatency(
+    INOUT   PPCPU                   Cpu,
+    INOUT   PTHREAD                 Thread
+    )
+{
+    QWORD now;
+
+    ASSERT(NULL != Cpu);
+    ASSERT(NULL != Thread);
+    ASSERT(HotLockIsOwner(&Cpu->ThreadData.ReadyThreadsLock));
+
+    if (0 == Thread->EnqueueTsc)
+    {
+        // the idle thread is never placed in a ready queue
+        return;
+    }
+
+    now = __rdtsc();
+
+    _ThreadLatencyAdd(&Thread->RunQueueLatency, Thread->EnqueueTsc, now);
+    _ThreadLatencyAdd(&Cpu->ThreadData.RunQueueLatency, Thread->EnqueueTsc, now);
+    Thread->EnqueueTsc = 0;
+
+    if (0 != Thread->UnblockTsc)
+    {
+        _ThreadLatencyAdd(&Thread->WakeupLatency, Thread->UnblockTsc, now);
+        _ThreadLatencyAdd(&Cpu->ThreadData.WakeupLatency, Thread->UnblockTsc, now);
+        Thread->UnblockTsc = 0;
+    }
+}
+
+static
+void
+_ThreadTraceSwitch(
+    INOUT   PPCPU                   Cpu,
+    IN      PTHREAD                 PreviousThread,
+    IN      PTHREAD                 NextThread,
+    IN      THREAD_SWITCH_REASON    Reason
+    )
+{
+    PTHREAD_SWITCH_TRACE_ENTRY pEntry;
+    QWORD count;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+    ASSERT(NULL != Cpu);
+    ASSERT(NULL != PreviousThread);
+    ASSERT(NULL != NextThread);
+    ASSERT(Reason < ThreadSwitchReasonReserved);
+
+    // only this CPU writes its ring and it cannot be interrupted => no lock
+    count = Cpu->ThreadData.SwitchTraceCount;
+    pEntry = &Cpu->ThreadData.SwitchTrace[count % THREAD_SWITCH_TRACE_ENTRIES];
+
+    pEntry->Tsc = __rdtsc();
+    pEntry->PreviousTid = PreviousThread->Id;
+    pEntry->NextTid = NextThread->Id;
+    pEntry->Reason = (BYTE) Reason;
+    pEntry->ReadyThreads = Cpu->ThreadData.NumberOfReadyThreads;
+
+    // volatile write => it is not reordered before the writes to the entry
+    Cpu->ThreadData.SwitchTraceCount = count + 1;
+}
+
+static
+void
+_ThreadFpuInitArea(
+    OUT     PVOID                   XsaveArea
+    )
+{
+    ASSERT(NULL != XsaveArea);
+
+    // a zero XSAVE header marks all the components as being in their initial
+    // state, however XRSTOR always loads MXCSR from memory
+    memzero(XsaveArea, CpuMuGetXsaveAreaSize());
+
+    *((WORD*)PtrOffset(XsaveArea, XSAVE_LEGACY_FCW_OFFSET)) = THREAD_FPU_DEFAULT_FCW;
+    *((DWORD*)PtrOffset(XsaveArea, XSAVE_LEGACY_MXCSR_OFFSET)) = THREAD_FPU_DEFAULT_MXCSR;
+}
+
+static
+void
+_ThreadFpuSwitch(
+    INOUT   PPCPU                   Cpu,
+    IN      PTHREAD                 CurrentThread,
+    IN      PTHREAD                 NextThread
+    )
+{
+    QWORD cr0;
+    BOOLEAN bNextStateLoaded;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+    ASSERT(NULL != Cpu);
+    ASSERT(NULL != CurrentThread);
+    ASSERT(NULL != NextThread);
+
+    cr0 = __readcr0();
+
+    // CR0.TS is cleared only when the FPU is given to a thread, if it is still
+    // set the current thread did not use the FPU since it was scheduled and
+    // there is nothing to save
+    if (!IsBooleanFlagOn(cr0, CR0_TS)
+        && Cpu->ThreadData.FpuOwner == CurrentThread
+        && ThreadStateDying != CurrentThread->State)
+    {
+        // the thread may resume on another CPU => the state must be in memory
+        // before it can be taken from the ready list, XSAVEOPT skips the
+        // components which were not modified since they were restored
+        if (CpuMuIsXsaveoptSupported())
+        {
+            _xsaveopt64(CurrentThread->XsaveArea, CpuMuGetActiveFpuFeatures());
+        }
+        else
+        {
+            _xsave64(CurrentThread->XsaveArea, CpuMuGetActiveFpuFeatures());
+        }
+    }
+
+    // the registers still hold the state of the next thread if no other thread
+    // used the FPU of this CPU since then and it did not use another CPU's
+    bNextStateLoaded = Cpu->ThreadData.FpuOwner == NextThread && NextThread->FpuCpu == Cpu;
+
+    // CR0 is written only if the FPU changes state: switching between threads
+    // which do not use it costs nothing more than reading CR0
+    if (bNextStateLoaded == IsBooleanFlagOn(cr0, CR0_TS))
+    {
+        __writecr0(bNextStateLoaded ? (cr0 & ~CR0_TS) : (cr0 | CR0_TS));
+    }
+}
+
+static
+_Ret_notnull_
+PPCPU
+_ThreadSelectCpuForReadyThread(
+    IN      PTHREAD                 Thread
+    )
+{
+    PPCPU pCurrentCpu;
+    PLIST_ENTRY pCpuListHead;
+    PLIST_ENTRY pCurEntry;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+    ASSERT(NULL != Thread);
+
+    pCurrentCpu = GetCurrentPcpu();
+    ASSERT(NULL != pCurrentCpu);
+
+    // soft preference: the CPU where the thread last ran
+    if (NULL != Thread->LastCpu && _ThreadCanRunOnCpu(Thread, Thread->LastCpu))
+    {
+        return Thread->LastCpu;
+    }
+
+    if (_ThreadCanRunOnCpu(Thread, pCurrentCpu))
+    {
+        return pCurrentCpu;
+    }
+
+    pCpuListHead = NULL;
+    SmpGetCpuList(&pCpuListHead);
+
+    for (pCurEntry = pCpuListHead->Flink;
+         pCurEntry != pCpuListHead;
+         pCurEntry = pCurEntry->Flink)
+    {
+        PPCPU pCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+
+        // the ready queue of a CPU can be used only after it started scheduling
+        if (NULL != pCpu->ThreadData.IdleThread && _ThreadCanRunOnCpu(Thread, pCpu))
+        {
+            return pCpu;
+        }
+    }
+
+    // ThreadSetAffinity does not accept masks without any active CPU
+    NOT_REACHED;
+
+    return pCurrentCpu;
+}
+
+static
+CPU_AFFINITY
+_ThreadSelectCpusToReschedule(
+    IN      PPCPU                   Cpu,
+    IN      PTHREAD                 Thread
+    )
+{
+    PPCPU pCurrentCpu;
+    PLIST_ENTRY pCpuListHead;
+    PLIST_ENTRY pCurEntry;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+    ASSERT(NULL != Cpu);
+    ASSERT(NULL != Thread);
+
+    pCurrentCpu = GetCurrentPcpu();
+
+    // the running thread and its priority are read without synchronization:
+    // in the worst case a CPU is interrupted for nothing or the thread waits
+    // for the next scheduling decision of Cpu, as it did before
+    if (Cpu->ThreadData.CurrentThread == Cpu->ThreadData.IdleThread
+        || _ThreadGetEffectivePriority(Thread) > Cpu->ThreadData.RunningThreadPriority)
+    {
+        if (Cpu != pCurrentCpu)
+        {
+            return Cpu->LogicalApicId;
+        }
+
+        if (NULL == Cpu->ThreadData.IdleThread)
+        {
+            // the CPU cannot schedule yet
+            return 0;
+        }
+
+        // no IPI is needed to preempt ourselves: the running thread yields on
+        // the next interrupt return or, if it is the one unblocking, as soon
+        // as it releases its locks (see _ThreadShouldYieldAfterUnblock)
+        ThreadRequestPreemptOnInterrupt();
+        return 0;
+    }
+
+    // the thread will wait in the ready queue of Cpu, an idle CPU which is
+    // allowed to run it may steal it right away instead of when its idle
+    // sleep expires
+    pCpuListHead = NULL;
+    SmpGetCpuList(&pCpuListHead);
+
+    for (pCurEntry = pCpuListHead->Flink;
+         pCurEntry != pCpuListHead;
+         pCurEntry = pCurEntry->Flink)
+    {
+        PPCPU pCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+
+        if (pCpu != pCurrentCpu
+            && pCpu != Cpu
+            && NULL != pCpu->ThreadData.IdleThread
+            && pCpu->ThreadData.CurrentThread == pCpu->ThreadData.IdleThread
+            && _ThreadCanRunOnCpu(Thread, pCpu))
+        {
+            return pCpu->LogicalApicId;
+        }
+    }
+
+    return 0;
+}
+
+static
+CPU_AFFINITY
+_ThreadGetActiveCpusAffinity(
+    void
+    )
+{
+    PLIST_ENTRY pCpuListHead;
+    PLIST_ENTRY pCurEntry;
+    CPU_AFFINITY affinity;
+
+    pCpuListHead = NULL;
+    affinity = 0;
+
+    SmpGetCpuList(&pCpuListHead);
+
+    for (pCurEntry = pCpuListHead->Flink;
+         pCurEntry != pCpuListHead;
+         pCurEntry = pCurEntry->Flink)
+    {
+        PPCPU pCpu = CONTAINING_RECORD(pCurEntry, PCPU, ListEntry);
+
+        if (NULL != pCpu->ThreadData.IdleThread)
+        {
+            affinity = affinity | (CPU_AFFINITY) pCpu->LogicalApicId;
+        }
+    }
+
+    return affinity;
+}
+
+static
+THREAD_PRIORITY
+_ThreadReadyQueueGetHighestPriority(
+    IN      PTHREAD_READY_QUEUE     Queue
+    )
+{
+    DWORD level;
+
+    ASSERT(NULL != Queue);
+
+    return _BitScanReverse(&level, Queue->NonEmptyLevels) ? (THREAD_PRIORITY) level : ThreadPriorityReserved;
+}
+
+static
+void
+_ThreadForcedExit(
+    void
+    )
+{
+    PTHREAD pCurrentThread = GetCurrentThread();
+
+    _InterlockedOr( &pCurrentThread->Flags, THREAD_FLAG_FORCE_TERMINATED );
+
+    ThreadExit(STATUS_JOB_INTERRUPTED);
+    NOT_REACHED;
+}
+
+static
+void
+_ThreadReference(
+    INOUT   PTHREAD                 Thread
     )
 {
     ASSERT( NULL != Thread );
@@ -1188,7 +2889,7 @@ _ThreadDestroy(
     ASSERT(NULL == Context);
 
     LockAcquire(&m_threadSystemData.AllThreadsLock, &oldState);
-    RemoveEntryList(&pThread->AllList);
+    RcuRemoveEntryList(&pThread->AllList);
     LockRelease(&m_threadSystemData.AllThreadsLock, oldState);
 
     // This must be done before removing the thread from the process list, else
@@ -1203,21 +2904,59 @@ _ThreadDestroy(
 
     ProcessRemoveThreadFromList(pThread);
 
+    // lock-free walkers of the thread list may still be looking at the
+    // structure, the rest is released after they are done
+    RcuCall(&pThread->RcuHead, _ThreadFree);
+}
+
+static
+void
+(__cdecl _ThreadFree)(
+    IN      PRCU_HEAD               Head
+    )
+{
+    PTHREAD pThread = CONTAINING_RECORD(Head, THREAD, RcuHead);
+
+    ASSERT(NULL != pThread);
+
     if (NULL != pThread->Name)
     {
         ExFreePoolWithTag(pThread->Name, HEAP_THREAD_TAG);
         pThread->Name = NULL;
     }
 
-    if (NULL != pThread->Stack)
+    if (_ThreadCachePut(pThread))
+    {
+        // the structure and its kernel stack will be reused by _ThreadInit
+        return;
+    }
+
+    _ThreadFreeStructure(pThread);
+}
+
+static
+void
+_ThreadFreeStructure(
+    INOUT   PTHREAD                 Thread
+    )
+{
+    ASSERT(NULL != Thread);
+
+    if (NULL != Thread->Stack)
     {
         // This is the kernel mode stack
         // It does not 'belong' to any process => pass NULL
-        MmuFreeStack(pThread->Stack, NULL);
-        pThread->Stack = NULL;
+        MmuFreeStack(Thread->Stack, NULL);
+        Thread->Stack = NULL;
     }
 
-    ExFreePoolWithTag(pThread, HEAP_THREAD_TAG);
+    if (NULL != Thread->XsaveArea)
+    {
+        ExFreePoolWithTag(Thread->XsaveArea, HEAP_THREAD_TAG);
+        Thread->XsaveArea = NULL;
+    }
+
+    ExFreePoolWithTag(Thread, HEAP_THREAD_TAG);
 }
 
 static
@@ -1238,4 +2977,89 @@ _ThreadKernelFunction(
 
     ThreadExit(exitStatus);
     NOT_REACHED;
-}
\ No newline at end of file
+}
+
+static
+BOOLEAN
+_ThreadShouldYieldAfterUnblock(
+    IN      INTR_STATE              OldState
+    )
+{
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    // with interrupts disabled by the caller or inside an interrupt the
+    // request is served when the interrupts are enabled again
+    return INTR_ON == OldState
+        && ThreadYieldOnInterrupt()
+        && !DpcIsInterruptContext();
+}
+
+static
+void
+_ThreadSetAffinityForOtherThread(
+    INOUT   PTHREAD                 Thread,
+    IN      CPU_AFFINITY            Affinity
+    )
+{
+    INTR_STATE oldState;
+    INTR_STATE dummyState;
+    PPCPU pReadyCpu;
+    PPCPU pRunningCpu;
+    CPU_AFFINITY cpusToReschedule;
+
+    ASSERT(NULL != Thread);
+    ASSERT(GetCurrentThread() != Thread);
+
+    cpusToReschedule = 0;
+
+    // the block lock keeps the thread from being unblocked meanwhile, an
+    // unblocked thread would be placed according to the old affinity
+    LockAcquire(&Thread->BlockLock, &oldState);
+
+    Thread->Affinity = Affinity;
+
+    // the thread may be taken out of the ready queue by its CPU at any time,
+    // where it waits is checked again with the queue lock held
+    pReadyCpu = Thread->ReadyCpu;
+    if (NULL != pReadyCpu)
+    {
+        BOOLEAN bRemoved;
+
+        bRemoved = FALSE;
+
+        HotLockAcquire(&pReadyCpu->ThreadData.ReadyThreadsLock, &dummyState);
+        if (Thread->ReadyCpu == pReadyCpu)
+        {
+            // even if the CPU is still allowed the thread may have to move
+            // between the stealable and the pinned queue
+            _ThreadCpuReadyRemove(pReadyCpu, Thread);
+            bRemoved = TRUE;
+        }
+        HotLockRelease(&pReadyCpu->ThreadData.ReadyThreadsLock, dummyState);
+
+        if (bRemoved)
+        {
+            PPCPU pCpu = _ThreadSelectCpuForReadyThread(Thread);
+
+            HotLockAcquire(&pCpu->ThreadData.ReadyThreadsLock, &dummyState);
+            _ThreadCpuReadyInsert(pCpu, Thread, FALSE);
+            HotLockRelease(&pCpu->ThreadData.ReadyThreadsLock, dummyState);
+
+            cpusToReschedule = _ThreadSelectCpusToReschedule(pCpu, Thread);
+        }
+    }
+
+    // a running thread checks its affinity when it yields the CPU, the CPU
+    // it runs on is asked to reschedule
+    pRunningCpu = Thread->LastCpu;
+    if (ThreadStateRunning == Thread->State
+        && NULL != pRunningCpu
+        && !_ThreadCanRunOnCpu(Thread, pRunningCpu))
+    {
+        cpusToReschedule |= pRunningCpu->LogicalApicId;
+    }
+
+    SmpSendRescheduleIpi(cpusToReschedule);
+
+    LockRelease(&Thread->BlockLock, oldState);
+}
@@ -0,0 +1,170 @@
+#include "HAL9000.h"
+#include "tsc_clock.h"
+#include "synch.h"
+#include "cpumu.h"
+
+// The conversion is done as (ticks * Multiplier) >> TSC_CLOCK_SHIFT with a
+// 128 bit intermediate result => no division on the read path
+#define TSC_CLOCK_SHIFT                     32
+
+// Shift of InverseMultiplier, smaller than TSC_CLOCK_SHIFT so the TSC
+// frequency may be larger than 4 GHz
+#define TSC_CLOCK_INVERSE_SHIFT             24
+
+// Number of times each CPU compares its TSC with the last TSC value read
+#define TSC_CLOCK_WARP_CHECK_ITERATIONS     1000
+
+typedef struct _TSC_CLOCK_DATA
+{
+    // Written only by TscClockInit, before Reliable is first set
+    QWORD                   Frequency;
+    QWORD                   BaseTsc;
+    QWORD                   Multiplier;
+    QWORD                   InverseMultiplier;
+
+    volatile BOOLEAN        Reliable;
+
+    LOCK                    WarpCheckLock;
+
+    // Last TSC value read by a CPU while checking its TSC, the next CPU must
+    // not read a smaller value
+    _Guarded_by_(WarpCheckLock)
+    QWORD                   LastTsc;
+} TSC_CLOCK_DATA, *PTSC_CLOCK_DATA;
+
+static TSC_CLOCK_DATA m_tscClockData;
+
+static
+__forceinline
+QWORD
+_TscClockReadTsc(
+    void
+    )
+{
+    // RDTSC is not serializing, without the fence it may be executed before
+    // the preceding loads
+    _mm_lfence();
+    return __rdtsc();
+}
+
+_No_competing_thread_
+void
+TscClockInit(
+    IN      QWORD                   TscFrequency,
+    IN      BOOLEAN                 Invariant
+    )
+{
+    ASSERT(0 != TscFrequency);
+
+    memzero(&m_tscClockData, sizeof(TSC_CLOCK_DATA));
+
+    LockInit(&m_tscClockData.WarpCheckLock);
+
+    m_tscClockData.Frequency = TscFrequency;
+    m_tscClockData.Multiplier = (SEC_IN_NS << TSC_CLOCK_SHIFT) / TscFrequency;
+    m_tscClockData.InverseMultiplier = (TscFrequency << TSC_CLOCK_INVERSE_SHIFT) / SEC_IN_NS;
+    m_tscClockData.BaseTsc = _TscClockReadTsc();
+
+    // the APs started after this point must not read smaller values
+    m_tscClockData.LastTsc = m_tscClockData.BaseTsc;
+
+    if (!Invariant)
+    {
+        LOG_WARNING("The TSC is not invariant, it will not be used as a clocksource\n");
+        return;
+    }
+
+    _WriteBarrier();
+    m_tscClockData.Reliable = TRUE;
+
+    LOGL("TSC clocksource started, frequency %U Hz\n", TscFrequency);
+}
+
+void
+TscClockCheckCpu(
+    void
+    )
+{
+    INTR_STATE oldState;
+    QWORD maxWarp;
+
+    if (!m_tscClockData.Reliable)
+    {
+        return;
+    }
+
+    maxWarp = 0;
+
+    // the other CPUs which start at the same time run the same loop, the
+    // lock orders the reads => a later read must see a larger value
+    for (DWORD i = 0; i < TSC_CLOCK_WARP_CHECK_ITERATIONS; ++i)
+    {
+        QWORD currentTsc;
+
+        LockAcquire(&m_tscClockData.WarpCheckLock, &oldState);
+
+        currentTsc = _TscClockReadTsc();
+        if (currentTsc < m_tscClockData.LastTsc)
+        {
+            maxWarp = max(maxWarp, m_tscClockData.LastTsc - currentTsc);
+        }
+        else
+        {
+            m_tscClockData.LastTsc = currentTsc;
+        }
+
+        LockRelease(&m_tscClockData.WarpCheckLock, oldState);
+    }
+
+    if (0 != maxWarp)
+    {
+        // the CPUs are started early in the boot, before the system time is
+        // used to measure anything
+        m_tscClockData.Reliable = FALSE;
+
+        LOG_WARNING("TSC of CPU 0x%02x is behind by %U ticks, the TSC will not be used as a clocksource\n",
+                    GetCurrentPcpu()->ApicId, maxWarp);
+    }
+}
+
+BOOLEAN
+TscClockIsReliable(
+    void
+    )
+{
+    return m_tscClockData.Reliable;
+}
+
+QWORD
+TscClockGetTimeNs(
+    void
+    )
+{
+    return TscClockTicksToNs(_TscClockReadTsc() - m_tscClockData.BaseTsc);
+}
+
+QWORD
+TscClockTicksToNs(
+    IN      QWORD                   TscTicks
+    )
+{
+    QWORD low;
+    QWORD high;
+
+    low = _umul128(TscTicks, m_tscClockData.Multiplier, &high);
+
+    return __shiftright128(low, high, TSC_CLOCK_SHIFT);
+}
+
+QWORD
+TscClockNsToTicks(
+    IN      QWORD                   Nanoseconds
+    )
+{
+    QWORD low;
+    QWORD high;
+
+    low = _umul128(Nanoseconds, m_tscClockData.InverseMultiplier, &high);
+
+    return __shiftright128(low, high, TSC_CLOCK_INVERSE_SHIFT);
+}
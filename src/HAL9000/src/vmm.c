@@ -582,6 +582,70 @@ VmmAllocRegionEx(
 
                 _VmmMapDescribedRegion(pBaseAddress, Mdl, Rights, PagingData);
             }
+            else if (FileObject == NULL)
+            {
+                // Anonymous memory does not need continuous frames, each page is mapped to a frame
+                // from the zeroed pool and only the frames the pool could not provide are zeroed here
+                ASSERT(alignedSize / PAGE_SIZE <= MAX_DWORD);
+                DWORD noOfFrames = (DWORD)(alignedSize / PAGE_SIZE);
+                DWORD i;
+
+                for (i = 0; i < noOfFrames; ++i)
+                {
+                    PVOID pPage = PtrOffset(pBaseAddress, (QWORD) i * PAGE_SIZE);
+                    BOOLEAN bZeroed;
+
+                    pa = PmmReserveZeroedMemory(&bZeroed);
+                    if (NULL == pa)
+                    {
+                        break;
+                    }
+
+                    if (!bZeroed)
+                    {
+                        PVOID pKernelAlias;
+
+                        // the frame is cleared through a mapping of our own before it is visible in the
+                        // region, whose pages may be read-only or belong to another address space
+                        pKernelAlias = MmuMapSystemMemory(pa, PAGE_SIZE);
+                        if (NULL == pKernelAlias)
+                        {
+                            LOG_FUNC_ERROR_ALLOC("MmuMapSystemMemory", PAGE_SIZE);
+                            PmmReleaseMemory(pa, 1);
+                            pa = NULL;
+                            break;
+                        }
+
+                        memzero(pKernelAlias, PAGE_SIZE);
+                        MmuUnmapSystemMemory(pKernelAlias, PAGE_SIZE);
+                    }
+
+                    MmuMapMemoryInternal(pa,
+                                         PAGE_SIZE,
+                                         Rights,
+                                         pPage,
+                                         TRUE,
+                                         Uncacheable,
+                                         PagingData
+                    );
+                }
+
+                if (i != noOfFrames)
+                {
+                    LOG_ERROR("Failed to commit page %u out of %u!\n", i, noOfFrames);
+                    status = STATUS_MEMORY_CANNOT_BE_COMMITED;
+
+                    // the pages mapped so far are released here, the region is freed on the way out
+                    if (0 != i)
+                    {
+                        MmuUnmapMemoryEx(pBaseAddress, (QWORD) i * PAGE_SIZE, TRUE, PagingData);
+                    }
+                    __leave;
+                }
+
+                // the frames are released page by page when the region is freed
+                pa = NULL;
+            }
             else
             {
                 // This area is not described by an MDL, we need to reserve it now
@@ -795,11 +859,12 @@ VmmSolvePageFault(
         {
             PHYSICAL_ADDRESS pa;
             PVOID alignedAddress;
+            BOOLEAN bZeroed;
 
             // solve #PF
 
-            // 1. Reserve one frame of physical memory
-            pa = PmmReserveMemory(1);
+            // 1. Reserve one frame of physical memory, preferably one already zeroed
+            pa = PmmReserveZeroedMemory(&bZeroed);
             ASSERT(NULL != pa);
 
             alignedAddress = (PVOID)AlignAddressLower(FaultingAddress, PAGE_SIZE);
@@ -834,9 +899,9 @@ VmmSolvePageFault(
                 ASSERT(bytesReadFromFile <= PAGE_SIZE);
             }
 
-            // 4. Zero the rest of the memory (in case the remaining file size was smaller than a page
-            /// TODO: check if this is really necessary (we have a ZERO worker thread already!)
-            if (bytesReadFromFile != PAGE_SIZE)
+            // 4. Zero the rest of the memory (in case the remaining file size was smaller than a page),
+            // the frames taken from the zeroed pool are already clean
+            if (bytesReadFromFile != PAGE_SIZE && !bZeroed)
             {
                 /// TODO: Check if we really need to remove the WP (I'd rather not do this)
                 /// According to the Intel manual the WP flag has nothing to do with accessing UM pages